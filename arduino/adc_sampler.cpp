@@ -0,0 +1,180 @@
+/* adc_sampler.cpp
+ * Timer-paced analog sampling using the nRF52 SAADC, a TIMER and PPI, with EasyDMA double-buffering.
+ *
+ * The timer's compare 0 clears the counter and triggers a scan through PPI channel ADC_SAMPLER_PPI_CHANNEL_BASE,
+ * the SAADC storing one sample per input (lowest AIN first) through EasyDMA. Once a buffer holds scans_per_buffer
+ * scans the SAADC signals END, which restarts it through PPI channel ADC_SAMPLER_PPI_CHANNEL_BASE + 1 on the buffer
+ * pointer set at the previous STARTED. The interrupt only swaps that pointer and counts, so it never costs a scan.
+ *
+ * Buffer n is written over as buffer n + 2 starts, so loop() has one buffer's worth of time to read each one.
+ */
+
+#include "adc_sampler.h"
+
+#include "hf_clock.h"
+
+using namespace ble_uart_pin_ctrl;
+
+/* Instance serviced by the SAADC interrupt */
+static AdcSampler *adc_sampler_instance = nullptr;
+
+extern "C" void ADC_SAMPLER_IRQHandler(void) {
+    if (adc_sampler_instance) {
+        adc_sampler_instance->on_interrupt();
+    }
+}
+
+/* EasyDMA pointers are 32-bit bus addresses */
+static std::uint32_t dma_address(const void *buffer) {
+    return static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(buffer));
+}
+
+AdcSampler::AdcSampler() : _running{false},
+                           _inputs{0},
+                           _period_ticks{0},
+                           _scans_per_buffer{0},
+                           _started{0},
+                           _filled{0},
+                           _taken{0},
+                           _buffers{},
+                           _wake_task{nullptr} {}
+
+bool AdcSampler::start(std::uint8_t inputs, std::uint32_t period_ticks, std::size_t scans_per_buffer) {
+    stop();
+
+    const unsigned int count = __builtin_popcount(inputs);
+    if (!count || !scans_per_buffer || scans_per_buffer * count > BUFFER_CAPACITY) {
+        return false;
+    }
+    if (period_ticks < count * MIN_TICKS_PER_INPUT) {
+        period_ticks = count * MIN_TICKS_PER_INPUT;
+    }
+
+    _inputs = inputs;
+    _period_ticks = period_ticks;
+    _scans_per_buffer = scans_per_buffer;
+    _started = 0;
+    _filled = 0;
+    _taken = 0;
+
+    /* Keep the crystal running so the sample rate is as accurate as the pulse timer's */
+    hf_clock::request();
+
+    /* One single-ended channel per input at 0-3.6 V (gain 1/6 of the internal 0.6 V reference), the rest unused */
+    unsigned int ch = 0;
+    for (unsigned int input = 0; input < NUM_INPUTS; ++input) {
+        if (!(inputs & (1U << input))) {
+            continue;
+        }
+        NRF_SAADC->CH[ch].PSELP = SAADC_CH_PSELP_PSELP_AnalogInput0 + input;
+        NRF_SAADC->CH[ch].PSELN = SAADC_CH_PSELN_PSELN_NC;
+        NRF_SAADC->CH[ch].CONFIG = (SAADC_CH_CONFIG_RESP_Bypass << SAADC_CH_CONFIG_RESP_Pos)
+                                 | (SAADC_CH_CONFIG_RESN_Bypass << SAADC_CH_CONFIG_RESN_Pos)
+                                 | (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos)
+                                 | (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos)
+                                 | (SAADC_CH_CONFIG_TACQ_3us << SAADC_CH_CONFIG_TACQ_Pos)
+                                 | (SAADC_CH_CONFIG_MODE_SE << SAADC_CH_CONFIG_MODE_Pos)
+                                 | (SAADC_CH_CONFIG_BURST_Disabled << SAADC_CH_CONFIG_BURST_Pos);
+        ++ch;
+    }
+    for (; ch < NUM_INPUTS; ++ch) {
+        NRF_SAADC->CH[ch].PSELP = SAADC_CH_PSELP_PSELP_NC;
+    }
+    NRF_SAADC->RESOLUTION = SAADC_RESOLUTION_VAL_12bit;
+    NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Bypass;
+    NRF_SAADC->SAMPLERATE = SAADC_SAMPLERATE_MODE_Task << SAADC_SAMPLERATE_MODE_Pos;
+
+    /* Buffer 0 first, the STARTED interrupt queues buffer 1 */
+    NRF_SAADC->RESULT.PTR = dma_address(_buffers[0]);
+    NRF_SAADC->RESULT.MAXCNT = scans_per_buffer * count;
+    NRF_SAADC->INTENCLR = 0xFFFFFFFF;
+    NRF_SAADC->EVENTS_STARTED = 0;
+    NRF_SAADC->EVENTS_END = 0;
+    NRF_SAADC->EVENTS_STOPPED = 0;
+    NRF_SAADC->INTENSET = SAADC_INTENSET_STARTED_Msk | SAADC_INTENSET_END_Msk;
+
+    /* Timer counting at TIMER_HZ, compare 0 ending every scan period */
+    ADC_SAMPLER_TIMER->TASKS_STOP = 1;
+    ADC_SAMPLER_TIMER->MODE = TIMER_MODE_MODE_Timer;
+    ADC_SAMPLER_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    ADC_SAMPLER_TIMER->PRESCALER = 0; // 16 MHz
+    ADC_SAMPLER_TIMER->CC[0] = period_ticks;
+    ADC_SAMPLER_TIMER->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk;
+    ADC_SAMPLER_TIMER->INTENCLR = 0xFFFFFFFF;
+    ADC_SAMPLER_TIMER->TASKS_CLEAR = 1;
+
+    /* Compare 0 scans, a full buffer restarts the SAADC on the next one */
+    sd_ppi_channel_assign(ADC_SAMPLER_PPI_CHANNEL_BASE, &ADC_SAMPLER_TIMER->EVENTS_COMPARE[0],
+                          &NRF_SAADC->TASKS_SAMPLE);
+    sd_ppi_channel_assign(ADC_SAMPLER_PPI_CHANNEL_BASE + 1, &NRF_SAADC->EVENTS_END, &NRF_SAADC->TASKS_START);
+    sd_ppi_channel_enable_set(3UL << ADC_SAMPLER_PPI_CHANNEL_BASE);
+
+    adc_sampler_instance = this;
+    NVIC_SetPriority(ADC_SAMPLER_IRQn, ADC_SAMPLER_IRQ_PRIORITY);
+    NVIC_ClearPendingIRQ(ADC_SAMPLER_IRQn);
+    NVIC_EnableIRQ(ADC_SAMPLER_IRQn);
+
+    NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+    NRF_SAADC->TASKS_START = 1;
+    ADC_SAMPLER_TIMER->TASKS_START = 1;
+    _running = true;
+    return true;
+}
+
+void AdcSampler::stop() {
+    if (!_running) {
+        return;
+    }
+
+    ADC_SAMPLER_TIMER->TASKS_STOP = 1;
+    sd_ppi_channel_enable_clr(3UL << ADC_SAMPLER_PPI_CHANNEL_BASE);
+    NVIC_DisableIRQ(ADC_SAMPLER_IRQn);
+
+    /* Stopping takes a conversion at most, the SAADC must be stopped before it's disabled */
+    NRF_SAADC->TASKS_STOP = 1;
+    for (unsigned int wait = 0; wait < 1000 && !NRF_SAADC->EVENTS_STOPPED; ++wait) {
+    }
+    NRF_SAADC->EVENTS_STOPPED = 0;
+    NRF_SAADC->INTENCLR = 0xFFFFFFFF;
+    NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+
+    hf_clock::release();
+
+    adc_sampler_instance = nullptr;
+    _running = false;
+}
+
+bool AdcSampler::take(std::uint32_t &number, const std::int16_t *&samples) {
+    const std::uint32_t filled = _filled;
+    if (!_running || filled == _taken) {
+        return false;
+    }
+
+    /* The newest buffer is the only one not being written over */
+    number = filled - 1;
+    samples = _buffers[number % 2];
+    _taken = filled;
+    return true;
+}
+
+void AdcSampler::on_interrupt() {
+    /* END comes first: a full buffer ends just before the SAADC starts on the next one */
+    if (NRF_SAADC->EVENTS_END) {
+        NRF_SAADC->EVENTS_END = 0;
+        _filled = _filled + 1;
+
+        if (_wake_task) {
+            BaseType_t woken = pdFALSE;
+            vTaskNotifyGiveFromISR(_wake_task, &woken);
+            portYIELD_FROM_ISR(woken);
+        }
+    }
+
+    /* The pointer was latched by the start, queue the other buffer for the start after it */
+    if (NRF_SAADC->EVENTS_STARTED) {
+        NRF_SAADC->EVENTS_STARTED = 0;
+        const std::uint32_t started = _started + 1;
+        NRF_SAADC->RESULT.PTR = dma_address(_buffers[started % 2]);
+        _started = started;
+    }
+}
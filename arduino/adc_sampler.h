@@ -0,0 +1,87 @@
+/* adc_sampler.h
+ * Timer-paced analog sampling using the nRF52 SAADC, a TIMER and PPI, with EasyDMA double-buffering.
+ * Functionality:
+ *      - A TIMER compare triggers every scan through PPI (one sample of each selected input), so the sample rate
+ *        doesn't depend on loop() or the BLE stack
+ *      - EasyDMA fills one buffer while loop() reads the other, the SAADC restarts on the next buffer through PPI
+ *      - Buffers that loop() didn't take in time are dropped, their scan numbers show the gap
+ *      - Optionally wake a FreeRTOS task whenever a buffer is filled
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <bluefruit.h>
+
+/* Peripherals used for sampling, must not be used by anything else in the sketch (analogRead() included) */
+#define ADC_SAMPLER_TIMER           NRF_TIMER3
+#define ADC_SAMPLER_IRQn            SAADC_IRQn
+#define ADC_SAMPLER_IRQHandler      SAADC_IRQHandler
+#define ADC_SAMPLER_IRQ_PRIORITY    3   // highest application priority that may not call SoftDevice APIs
+#define ADC_SAMPLER_PPI_CHANNEL_BASE 12 // after the pulse timer's (see PULSE_PPI_CHANNEL_BASE)
+
+namespace ble_uart_pin_ctrl {
+
+class AdcSampler {
+public:
+    /** Number of analog inputs (AIN0-AIN7), all of them can be sampled in one scan */
+    static constexpr unsigned int NUM_INPUTS = 8;
+
+    /** Rate of the timer pacing scans */
+    static constexpr std::uint32_t TIMER_HZ = 16000000;
+
+    /** Shortest scan period per input, the SAADC's acquisition time (3 us) plus conversion time (2 us) */
+    static constexpr std::uint32_t MIN_TICKS_PER_INPUT = 5 * TIMER_HZ / 1000000;
+
+    /** Samples per buffer, scans_per_buffer * inputs must not exceed it */
+    static constexpr std::size_t BUFFER_CAPACITY = 166;
+
+    /** Largest sample value (12-bit resolution) */
+    static constexpr std::int16_t MAX_SAMPLE = 4095;
+
+private:
+    bool _running;                                  /*!< True while the timer paces scans */
+    std::uint8_t _inputs;                           /*!< Sampled inputs, bit n is AIN n */
+    std::uint32_t _period_ticks;                    /*!< Time between scans, in TIMER_HZ ticks */
+    std::size_t _scans_per_buffer;                  /*!< Scans in each buffer */
+    volatile std::uint32_t _started;                /*!< Buffers the SAADC started since start() */
+    volatile std::uint32_t _filled;                 /*!< Buffers the SAADC filled since start() */
+    std::uint32_t _taken;                           /*!< Buffers handed out by take() (or skipped) */
+    std::int16_t _buffers[2][BUFFER_CAPACITY];      /*!< Buffer n of the stream is _buffers[n % 2] */
+    TaskHandle_t _wake_task;                        /*!< Task notified by the interrupt (nullptr if none) */
+
+public:
+    AdcSampler();
+
+    /* Scan the inputs (bit n = AIN n) every period_ticks of TIMER_HZ, scans_per_buffer scans per buffer */
+    /* Note: any current stream is stopped first. Returns false (and samples nothing) if no input is selected or the
+     * buffer can't hold scans_per_buffer scans, period_ticks is raised to what the SAADC can convert. */
+    bool start(std::uint8_t inputs, std::uint32_t period_ticks, std::size_t scans_per_buffer);
+    void stop();
+
+    bool running() const { return _running; }
+    std::uint8_t inputs() const { return _inputs; }
+    unsigned int input_count() const { return __builtin_popcount(_inputs); }
+    std::uint32_t period_ticks() const { return _period_ticks; }
+    std::size_t scans_per_buffer() const { return _scans_per_buffer; }
+
+    /* Notify a task (with xTaskNotifyGive) every time a buffer is filled, nullptr to stop */
+    void set_wake_task(TaskHandle_t task) { _wake_task = task; }
+
+    // true if a filled buffer is waiting for take()
+    bool ready() const { return _running && _filled != _taken; }
+
+    /* Get the newest filled buffer (number counts buffers from 0 at start()), returns false if there is none */
+    /* Note: older filled buffers are skipped, and the buffer is only good until intact() says otherwise */
+    bool take(std::uint32_t &number, const std::int16_t *&samples);
+
+    /* True if buffer number hasn't been written over yet, check it once done reading the buffer */
+    bool intact(std::uint32_t number) const { return _filled - number < 2; }
+
+    /* SAADC interrupt, points the SAADC at the next buffer and counts filled ones */
+    void on_interrupt();
+};
+
+}  // namespace ble_uart_pin_ctrl
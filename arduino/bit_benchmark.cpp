@@ -0,0 +1,110 @@
+/* bit_benchmark.cpp
+ * Startup microbenchmark of set bit iteration.
+ *
+ * Each variant walks the same masks ITERATIONS times, highest bit first like the pulse scheduler, adding up the bit
+ * positions so the compiler can't drop the work. The DWT cycle counter times each variant, so results are in CPU
+ * cycles (64 MHz on the nRF52840) and include the loop overhead a handler would have.
+ */
+
+#include "bit_benchmark.h"
+
+#if PIN_CTRL_BIT_BENCHMARK
+
+#include <cstdint>
+#include <cstdio>
+
+#include <bluefruit.h>
+
+#include "bit_ops.h"
+
+using namespace ble_uart_pin_ctrl;
+
+static constexpr unsigned int ITERATIONS = 1000;
+
+/* Masks of 1, 4, 16 and 32 pins */
+static const std::uint32_t MASKS[] = {0x00000100, 0x80402010, 0x5555AAAA, 0xFFFFFFFF};
+
+static volatile std::uint32_t sink;
+
+/* Test every bit, what the handlers used to do */
+static std::uint32_t scan_all_bits(std::uint32_t mask) {
+    std::uint32_t sum = 0;
+    for (int n = 31; n >= 0; --n) {
+        if (mask & (1UL << n)) {
+            sum += n;
+        }
+    }
+    return sum;
+}
+
+/* Find then clear the highest bit, each with a 32 bit scan, what PinCtrl::get/clear_highest_bit() used to do */
+static int scan_highest_bit(std::uint32_t mask) {
+    for (int i = 31; i >= 0; --i) {
+        if (mask & (1UL << i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static std::uint32_t scan_pop_highest(std::uint32_t mask) {
+    std::uint32_t sum = 0;
+    while (mask) {
+        sum += scan_highest_bit(mask);
+        mask &= ~(1UL << scan_highest_bit(mask));
+    }
+    return sum;
+}
+
+static std::uint32_t clz_pop_highest(std::uint32_t mask) {
+    std::uint32_t sum = 0;
+    while (mask) {
+        sum += bit_ops::pop_highest(mask);
+    }
+    return sum;
+}
+
+static std::uint32_t ctz_set_bits(std::uint32_t mask) {
+    std::uint32_t sum = 0;
+    for (unsigned int n : bit_ops::set_bits(mask)) {
+        sum += n;
+    }
+    return sum;
+}
+
+/* Cycles per call of variant on mask, averaged over ITERATIONS calls */
+static std::uint32_t time_variant(std::uint32_t (*variant)(std::uint32_t), std::uint32_t mask) {
+    volatile std::uint32_t input = mask; // read each time, so nothing is computed at build time
+    std::uint32_t sum = 0;
+    const std::uint32_t start = DWT->CYCCNT;
+    for (unsigned int i = 0; i < ITERATIONS; ++i) {
+        sum += variant(input);
+    }
+    const std::uint32_t cycles = DWT->CYCCNT - start;
+    sink = sum;
+    return cycles / ITERATIONS;
+}
+
+void ble_uart_pin_ctrl::run_bit_benchmark() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    Serial.println("Set bit iteration, CPU cycles per mask:");
+    Serial.println("pins  scan  scan highest  clz highest  ctz set bits");
+    for (const std::uint32_t mask : MASKS) {
+        char line[64];
+        snprintf(line, sizeof(line), "%4d %5lu %13lu %12lu %13lu", __builtin_popcount(mask),
+                 static_cast<unsigned long>(time_variant(scan_all_bits, mask)),
+                 static_cast<unsigned long>(time_variant(scan_pop_highest, mask)),
+                 static_cast<unsigned long>(time_variant(clz_pop_highest, mask)),
+                 static_cast<unsigned long>(time_variant(ctz_set_bits, mask)));
+        Serial.println(line);
+    }
+}
+
+#else
+
+void ble_uart_pin_ctrl::run_bit_benchmark() {}
+
+#endif
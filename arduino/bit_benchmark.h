@@ -0,0 +1,20 @@
+/* bit_benchmark.h
+ * Startup microbenchmark of set bit iteration, the per-pin loop every pin command and pulse train runs.
+ * Functionality:
+ *      - Time testing all 32 bits against visiting only the set bits (bit_ops.h), for masks of 1 to 32 pins
+ *      - Print CPU cycles per mask over Serial
+ */
+
+#pragma once
+
+/* Set to 1 here, or with -DPIN_CTRL_BIT_BENCHMARK=1, to run it from setup(). 0 leaves it out */
+#ifndef PIN_CTRL_BIT_BENCHMARK
+#   define PIN_CTRL_BIT_BENCHMARK 0
+#endif
+
+namespace ble_uart_pin_ctrl {
+
+/* Run the benchmark and print its results, takes a few ms (does nothing unless PIN_CTRL_BIT_BENCHMARK is set) */
+void run_bit_benchmark();
+
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,91 @@
+/* bit_ops.h
+ * Visit the set bits of a 32-bit mask without testing every bit.
+ * Functionality:
+ *      - Find the lowest/highest set bit in one instruction (RBIT+CLZ / CLZ on the Cortex-M4)
+ *      - Pop set bits off a mask, lowest or highest first (also 64-bit masks spanning both GPIO ports)
+ *      - Range-for over the set bits of a mask, lowest first
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace ble_uart_pin_ctrl {
+namespace bit_ops {
+
+static_assert(sizeof(unsigned int) == sizeof(std::uint32_t), "bit_ops needs 32-bit __builtin_clz/ctz");
+static_assert(sizeof(unsigned long long) == sizeof(std::uint64_t), "bit_ops needs 64-bit __builtin_clzll");
+
+/* Position of the lowest set bit (-1 if no bits are set) */
+inline int lowest(std::uint32_t mask) {
+    return mask ? __builtin_ctz(mask) : -1;
+}
+
+/* Position of the highest set bit (-1 if no bits are set) */
+inline int highest(std::uint32_t mask) {
+    return mask ? 31 - __builtin_clz(mask) : -1;
+}
+
+/* Clear the lowest set bit of a non-zero mask, returns its position */
+inline unsigned int pop_lowest(std::uint32_t &mask) {
+    const unsigned int n = __builtin_ctz(mask);
+    mask &= mask - 1;
+    return n;
+}
+
+/* Clear the highest set bit of a non-zero mask, returns its position */
+inline unsigned int pop_highest(std::uint32_t &mask) {
+    const unsigned int n = 31 - __builtin_clz(mask);
+    mask &= ~(1UL << n);
+    return n;
+}
+
+/* Clear the highest set bit of a non-zero 64-bit mask, returns its position */
+inline unsigned int pop_highest(std::uint64_t &mask) {
+    const unsigned int n = 63 - __builtin_clzll(mask);
+    mask &= ~(1ULL << n);
+    return n;
+}
+
+/** Set bits of a mask as a range, for (unsigned int n : set_bits(mask)) visits each set bit n, lowest first */
+class SetBits {
+    std::uint32_t _mask;
+
+public:
+    class Iterator {
+        std::uint32_t _remaining; /*!< Bits not visited yet, the current one is the lowest */
+
+    public:
+        explicit Iterator(std::uint32_t remaining) : _remaining{remaining} {}
+
+        unsigned int operator*() const {
+            return __builtin_ctz(_remaining);
+        }
+
+        Iterator &operator++() {
+            _remaining &= _remaining - 1;
+            return *this;
+        }
+
+        bool operator!=(const Iterator &other) const {
+            return _remaining != other._remaining;
+        }
+    };
+
+    explicit SetBits(std::uint32_t mask) : _mask{mask} {}
+
+    Iterator begin() const {
+        return Iterator{_mask};
+    }
+
+    Iterator end() const {
+        return Iterator{0};
+    }
+};
+
+inline SetBits set_bits(std::uint32_t mask) {
+    return SetBits{mask};
+}
+
+}  // namespace bit_ops
+}  // namespace ble_uart_pin_ctrl
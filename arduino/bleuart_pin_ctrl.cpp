@@ -2,258 +2,2127 @@
  * A simple pin control class that utilizes BLE UART to control pins on this device.
  * Functionality:
  *      - Control GPIO (set, clear, toggle)
+ *      - Schedule many overlapping pulses, each with its own duration and start offset
+ *      - Optionally time pulse edges in hardware (TIMER/PPI/GPIOTE) for microsecond accuracy
  *      - Control PWM (0-255)
- *      - Get status
+ *      - Batch many commands into a single BLE write
+ *      - Frame messages with a sync byte, length and CRC, dropping bad ones and resynchronizing
+ *      - Get GPIO status and device state in a single notification
+ *      - Report debounced input changes as batched notifications, at a limited rate
+ *      - Negotiate connection interval, latency, PHY and data length at runtime
+ *      - Echo timestamped replies for latency and throughput benchmarks
+ *      - Keep always-on performance counters, readable over BLE
+ *      - Record every command in a binary log ring, read over BLE or printed while idle
+ *      - Store keyframe patterns and play them back with local timing
+ *      - Save pin configuration and patterns to flash, and restore them at boot
+ *      - Set per-pin PWM duties, frequency and resolution on a PWM peripheral in one command
+ *      - Ramp PWM duties linearly or exponentially, played by the PWM peripheral
+ *      - Queue commands to run at a device timestamp, for actuation free of BLE delivery jitter
+ *      - Report RX FIFO credits so a central can stream write-without-response frames without overrunning it
+ *      - Negotiate a protocol version, version 2 adds compact commands with varint fields and pin lists
+ *      - Optionally run in a FreeRTOS task of its own that sleeps until data, an input change or the next deadline
+ *      - Take frames in from the BLE UART RX callback into a ring, so RX bursts never wait on commands (the RX
+ *        callback and service() push under a mutex, service() pops without taking it)
+ *      - Sync pin levels against a shadow state, sending only the pins changed since the last acknowledged state
+ *      - Stream timer-paced ADC samples of up to 8 inputs, 12-bit packed into notifications sized to the MTU
+ *      - Switch pins off once they stay on longer than their limit, and drive every output off when the link drops
  */
 
 #include "bleuart_pin_ctrl.h"
 
-using namespace ble_uart_pin_ctrl;
-
-/* Enable debugging log statements */
-#define DEBUG
+#include "config_file.h"
+#include "debug_log.h"
 
-#ifdef DEBUG
-#   define DBG_LOG(...) Serial.print(__VA_ARGS__)
-#   define DBG_LOG_LINE(...) Serial.println(__VA_ARGS__)
-#else
-#   define DBG_LOG(...) 
-#   define DBG_LOG_LINE(...)
-#endif // DEBUG
+using namespace ble_uart_pin_ctrl;
 
 PinCtrl::PinCtrl(BLEUart *uart) : _uart{uart},
-                                  _pins_to_pulse{0},
-                                  _pulse_dur_ms{0},
-                                  _pulse_start_ms{0} {}
+                                  _parser{},
+                                  _rx_frames{},
+                                  _rx_lock{nullptr},
+                                  _rx_pending{false},
+                                  _bad_commands{0},
+                                  _frame_received_us{0},
+                                  _frame_consumed{0},
+                                  _counters{},
+#if PIN_CTRL_LOG_RING_CAPACITY
+                                  _log{},
+                                  _log_dropped{0},
+#endif
+                                  _schedule_queue{},
+                                  _scheduled{},
+                                  _scheduled_length{},
+                                  _scheduled_free{(1UL << SCHEDULE_QUEUE_CAPACITY) - 1},
+                                  _scheduled_arrivals{0},
+                                  _pulse_queue{},
+                                  _pulsing{},
+                                  _pulse_busy_until_us{},
+                                  _pulse_timer{},
+                                  _pwm_duty{},
+                                  _pwm_group{},
+                                  _configured_inputs{},
+                                  _configured_outputs{},
+                                  _patterns{},
+                                  _players{},
+                                  _inputs{},
+                                  _input_port{0},
+                                  _input_interval_ms{0},
+                                  _input_sent_ms{0},
+                                  _input_event_count{0},
+                                  _input_events{},
+                                  _conn_params_wanted{},
+                                  _conn_params_pending{false},
+                                  _conn_params_requested_ms{0},
+                                  _rx_bytes_before_reset{0},
+                                  _credits_enabled{false},
+                                  _credits_interval_ms{0},
+                                  _credits_sent_ms{0},
+                                  _credits_reported{0},
+                                  _protocol_version{PROTOCOL_VERSION_1},
+                                  _synced{false},
+                                  _sync_state{0},
+                                  _sync_full_state{0},
+                                  _sync_pins{},
+                                  _sync_levels{},
+                                  _adc{},
+                                  _limited{},
+                                  _max_on_us{},
+                                  _auto_off_queued{},
+                                  _auto_off_us{},
+                                  _auto_off_queued_us{},
+                                  _auto_offs{0},
+                                  _failsafe{true},
+                                  _link_lost{false},
+                                  _failsafes{0},
+                                  _task{nullptr} {
+    /* Build the reverse pin map used when commands address hardware ports */
+    memset(_hw_to_arduino, -1, sizeof(_hw_to_arduino));
+    for (unsigned int pin = 0; pin < PINS_COUNT; ++pin) {
+        const std::uint32_t hw_pin = gpio_ports::arduino_to_hw_pin(pin);
+        if (hw_pin < sizeof(_hw_to_arduino)) {
+            _hw_to_arduino[hw_pin] = static_cast<std::int8_t>(pin);
+        }
+    }
+}
 
 void PinCtrl::service() {
+    const std::uint32_t start_us = micros();
+    ++_counters.service_calls;
+
+    /* A FIFO that keeps filling up means loop() can't keep up with the central */
+    const int available = _uart->available();
+    if (available > _counters.rx_fifo_high_water) {
+        _counters.rx_fifo_high_water = available;
+    }
+
+    /* Finish driving the outputs off before anything else runs, if the link dropped */
+    if (_link_lost) {
+        apply_failsafe();
+    }
+
     /* Always service pin pulsing if it's ongoing */
     service_gpio_pulse();
+
+    /* Run queued commands, their deadline matters more than anything below */
+    service_schedule();
+
+    /* Play back stored patterns */
+    service_patterns();
+
+    /* Report input changes, if anything is subscribed */
+    service_inputs();
+
+    /* Send ADC samples, if a stream is running */
+    service_adc();
+
+    /* Report negotiated connection parameters, if any were requested */
+    service_conn_params();
   
-    /* Do nothing if there's no data */
-    if (_uart->available() <= 0) {
-        return;
+    /* Run every complete frame, bad bytes and frames are dropped by the parser */
+    bool idle = true;
+    RxFrame frame;
+    while (next_frame(frame)) {
+        idle = false;
+        _frame_received_us = frame.received_us;
+        _frame_consumed = frame.consumed;
+
+        /* A frame carries exactly one command (which may be a batch) */
+        if (execute(frame.payload, frame.length) != frame.length) {
+            ++_bad_commands;
+            ERR_LOG_LINE("!!! Unknown command or bad command length, dropping frame");
+        }
     }
 
-    /* First byte is command, peek that */
-    const Command command = static_cast<Command>(_uart->peek());
-    
-    /* Perform command-specific processing (break if all data bytes aren't recieved yet) */
-    switch (command) {
-        case Command::GPIO_CONFIGURE: {
-            handle_gpio_configure();
-        } break;
+    /* Hand back the FIFO space freed by this pass */
+    service_credits(false);
 
-        case Command::GPIO_WRITE: {
-            handle_gpio_write();
-        } break;
+    /* Deferred logging only gets the time nothing else needs */
+    if (idle && _pulse_queue.empty() && _schedule_queue.empty()) {
+        print_log_record();
+    }
 
-        case Command::GPIO_PULSE: {
-            handle_gpio_pulse();
-        } break;
+    const std::uint32_t service_us = micros() - start_us;
+    if (service_us > _counters.max_service_us) {
+        _counters.max_service_us = service_us;
+    }
+}
 
-        case Command::GPIO_QUERY: {
-            handle_gpio_query();
-            // TODO CMK (11/14/20): implement
-        } break;
+void PinCtrl::reset_counters() {
+    _counters = Counters{};
+    _counters.since_ms = millis();
+    _bad_commands = 0;
 
-        case Command::PWM_SET: {
-            handle_pwm_set();
-        } break;
+    /* The parser's counters belong to whoever runs receive() */
+    if (_rx_lock) {
+        xSemaphoreTake(_rx_lock, portMAX_DELAY);
+    }
+    _rx_bytes_before_reset += _parser.bytes_received();
+    _parser.reset_counters();
+    if (_rx_lock) {
+        xSemaphoreGive(_rx_lock);
+    }
+}
 
-        case Command::QUERY_STATE: {
-            handle_query_state();
-            // TODO CMK (11/14/20): implement
-        } break;
+void PinCtrl::receive() {
+    bool received = false;
+
+    /* One producer at a time: the RX callback, or service() taking in what the ring turned away */
+    for (;;) {
+        _rx_pending = true;
+        if (_rx_lock && xSemaphoreTake(_rx_lock, 0) != pdTRUE) {
+            break; // the holder sees _rx_pending once it's done, and goes round again
+        }
+        _rx_pending = false;
+
+        /* Check for room first, a frame the parser completed must go into the ring */
+        while (_rx_frames.size() < _rx_frames.capacity() && _parser.poll(_uart, millis())) {
+            RxFrame frame;
+            frame.received_us = micros();
+            frame.consumed = _rx_bytes_before_reset + _parser.bytes_received();
+            frame.length = static_cast<std::uint8_t>(_parser.payload_length());
+            memcpy(frame.payload, _parser.payload(), frame.length);
+            _rx_frames.push(frame);
+            _parser.release();
+            received = true;
+        }
+
+        if (_rx_lock) {
+            xSemaphoreGive(_rx_lock);
+        }
+        if (!_rx_pending) {
+            break;
+        }
+    }
+
+    if (received) {
+        wake();
     }
 }
 
-void PinCtrl::handle_gpio_configure() {
-    const unsigned int number_of_bytes = static_cast<unsigned int>(_uart->available());
+bool PinCtrl::next_frame(RxFrame &frame) {
+    if (_rx_frames.pop(frame)) {
+        return true;
+    }
+
+    receive();
+    return _rx_frames.pop(frame);
+}
 
-    if (number_of_bytes < sizeof(GpioConfigure)) {
-        return; // missing bytes
+bool PinCtrl::load_config() {
+    if (!ConfigFile::begin()) {
+        ERR_LOG_LINE("!!! Internal file system unusable, starting from defaults");
+        return false;
     }
 
-    /* Parse byte buffer into the struct */
-    auto params = parse_bytes<GpioConfigure>();
-    // fix endianness for multi-byte pieces of data
-    params.gpio_port = byte_swap32(params.gpio_port);
-    params.gpio_bitset = byte_swap32(params.gpio_bitset);
-    
-    DBG_LOG("GPIO_CONFIGURE: ");
-    DBG_LOG(params.gpio_bitset, HEX);
-    DBG_LOG(" ");
-    DBG_LOG_LINE(static_cast<int>(params.gpio_direction));
+    ConfigFile file;
+    if (!file.start_read()) {
+        DBG_LOG_LINE("No saved settings, starting from defaults");
+        return false;
+    }
 
-    /* Go through each bit and configure appropriate pins */
-    for (int pin = 0; pin < 32; ++pin) {
-        if (is_set(params.gpio_bitset, pin)) {
-            if (params.gpio_direction == GpioDirection::DIR_INPUT) {
-                pinMode(pin, INPUT);
-            } else {
-                pinMode(pin, OUTPUT);
-                digitalWrite(pin, LOW);
+    /* Patterns are read straight into the store, and thrown away again if the file turns out to be bad */
+    SavedHeader header{};
+    gpio_ports::PortMasks inputs{}, outputs{}, high{};
+    bool ok = file.read(&header, sizeof(header)) && header.magic == SAVED_MAGIC && header.version == SAVED_VERSION
+              && header.ports == gpio_ports::NUM_PORTS && header.patterns <= PATTERN_SLOTS
+              && file.read(&inputs, sizeof(inputs)) && file.read(&outputs, sizeof(outputs))
+              && file.read(&high, sizeof(high));
+    for (std::size_t i = 0; ok && i < header.patterns; ++i) {
+        std::uint8_t slot = 0, count = 0;
+        ok = file.read(&slot, sizeof(slot)) && file.read(&count, sizeof(count))
+             && slot < PATTERN_SLOTS && count <= MAX_PATTERN_KEYFRAMES
+             && file.read(_patterns[slot].keyframes, count * sizeof(Keyframe));
+        if (ok) {
+            _patterns[slot].keyframe_count = count;
+        }
+    }
+    ok = file.finish_read() && ok;
+
+    if (!ok) {
+        for (auto &pattern : _patterns) {
+            pattern.keyframe_count = 0;
+        }
+        ERR_LOG_LINE("!!! Saved settings are corrupt, starting from defaults");
+        return false;
+    }
+
+    /* Outputs come up at their saved levels: the latch is set before the driver is enabled */
+    gpio_ports::make_input(inputs);
+    gpio_ports::clear(outputs);
+    gpio_ports::set(high);
+    gpio_ports::make_output(outputs);
+    _configured_inputs = inputs;
+    _configured_outputs = outputs;
+
+    DBG_LOG("Restored saved settings, bytes: ");
+    DBG_LOG_LINE(file.size());
+    return true;
+}
+
+void PinCtrl::set_hw_pulse_timing(bool enable) {
+    if (enable) {
+        _pulse_timer.begin();
+    } else {
+        _pulse_timer.end();
+    }
+}
+
+bool PinCtrl::start_task() {
+    if (_task) {
+        return true;
+    }
+
+    /* From here on the RX callback and the task may both take frames in */
+    _rx_lock = xSemaphoreCreateMutex();
+    if (!_rx_lock) {
+        ERR_LOG_LINE("!!! Couldn't create the pin control RX lock");
+        return false;
+    }
+
+    if (xTaskCreate(task_main, "pin_ctrl", TASK_STACK_WORDS, this, TASK_PRIORITY, &_task) != pdPASS) {
+        _task = nullptr;
+        vSemaphoreDelete(_rx_lock);
+        _rx_lock = nullptr;
+        ERR_LOG_LINE("!!! Couldn't create the pin control task");
+        return false;
+    }
+    _inputs.set_wake_task(_task);
+    _adc.set_wake_task(_task);
+    return true;
+}
+
+void PinCtrl::link_lost() {
+    if (!_failsafe) {
+        return;
+    }
+
+    /* One OUTCLR store per port is safe from any context, whatever service() is in the middle of */
+    gpio_ports::clear(_configured_outputs);
+    _link_lost = true;
+    wake();
+}
+
+void PinCtrl::apply_failsafe() {
+    _link_lost = false;
+    ++_failsafes;
+
+    /* Nothing queued may turn a pin back on */
+    for (auto &player : _players) {
+        player.playing = false;
+    }
+    _schedule_queue.clear();
+    _scheduled_free = (1UL << SCHEDULE_QUEUE_CAPACITY) - 1;
+    _pulse_queue.clear();
+    _pulsing = gpio_ports::PortMasks{};
+    _auto_off_queued = gpio_ports::PortMasks{};
+
+    /* Restarting the pulse timer cuts its pulses short */
+    if (_pulse_timer.enabled()) {
+        _pulse_timer.end();
+        _pulse_timer.begin();
+    }
+
+    /* Pins leaving PWM fall back to their output latch, so PWM goes first */
+    for (unsigned int pin = 0; pin < NUM_HW_PINS; ++pin) {
+        if (_pwm_duty[pin] || _pwm_group.channel_of(pin) >= 0) {
+            stop_pwm(pin);
+        }
+    }
+    gpio_ports::clear(_configured_outputs);
+
+    /* The central's shadow no longer matches the pins */
+    _synced = false;
+
+    DBG_LOG_LINE("Link lost, outputs driven off");
+}
+
+void PinCtrl::wake() {
+    if (_task) {
+        xTaskNotifyGive(_task);
+    }
+}
+
+void PinCtrl::task_main(void *pin_ctrl) {
+    PinCtrl &self = *static_cast<PinCtrl *>(pin_ctrl);
+
+    for (;;) {
+        self.service();
+
+        /* Sleep whole ticks, rounded down so the deadline isn't missed, and wait out the rest of it awake */
+        /* Note: a wake() that comes while service() runs isn't lost, it makes the next take return right away */
+        const std::uint32_t idle_us = self.idle_time_us();
+        if (idle_us == WAIT_FOREVER) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            const TickType_t ticks = static_cast<std::uint64_t>(idle_us) * configTICK_RATE_HZ / 1000000UL;
+            if (ticks) {
+                ulTaskNotifyTake(pdTRUE, ticks);
             }
         }
     }
 }
 
-void PinCtrl::handle_gpio_write() {
-    const unsigned int number_of_bytes = static_cast<unsigned int>(_uart->available());
+std::uint32_t PinCtrl::idle_time_us() {
+    const std::uint32_t now_us = micros();
+    const std::uint32_t now_ms = millis();
+    std::uint32_t idle_us = WAIT_FOREVER;
 
-    if (number_of_bytes < sizeof(GpioWrite)) {
-        return; // missing bytes
+    /* Frames or ADC samples are waiting */
+    if (!_rx_frames.empty() || _adc.ready()) {
+        return 0;
     }
 
-    /* Parse byte buffer into the struct */
-    auto params = parse_bytes<GpioWrite>();
-    // fix endianness for multi-byte pieces of data
-    params.gpio_port = byte_swap32(params.gpio_port);
-    params.gpio_bitset = byte_swap32(params.gpio_bitset);
-    
-    DBG_LOG("GPIO_WRITE: ");
-    DBG_LOG_LINE(params.gpio_bitset, HEX);
+    /* Earliest of every deadline service() has, a passed one making it 0 */
+    std::uint32_t deadlines[3 + PATTERN_SLOTS];
+    std::size_t deadline_count = 0;
+    if (!_pulse_queue.empty()) {
+        deadlines[deadline_count++] = _pulse_queue.top_deadline();
+    }
+    if (!_schedule_queue.empty()) {
+        deadlines[deadline_count++] = _schedule_queue.top_deadline();
+    }
+    for (std::size_t slot = 0; slot < PATTERN_SLOTS; ++slot) {
+        if (_players[slot].playing) {
+            deadlines[deadline_count++] = _players[slot].next_us;
+        }
+    }
+    if (_inputs.settling()) {
+        deadlines[deadline_count++] = now_us + _inputs.debounce_us();
+    }
+    for (std::size_t i = 0; i < deadline_count; ++i) {
+        if (!deadline_before(now_us, deadlines[i])) {
+            return 0;
+        }
+        if (deadlines[i] - now_us < idle_us) {
+            idle_us = deadlines[i] - now_us;
+        }
+    }
 
-    /* Go through each bit and set appropriate pins */
-    for (int pin = 0; pin < 32; ++pin) {
-        if (is_set(params.gpio_bitset, pin)) {
-            digitalWrite(pin, params.output == GpioOutput::OUT_HIGH); // true if high, false if low
+    /* Notifications held back by their interval */
+    std::uint32_t waits_ms[2];
+    std::size_t wait_count = 0;
+    if (_input_event_count) {
+        waits_ms[wait_count++] = _input_interval_ms - (now_ms - _input_sent_ms);
+    }
+    if (_credits_enabled && _rx_bytes_before_reset + _parser.bytes_received() != _credits_reported) {
+        waits_ms[wait_count++] = _credits_interval_ms - (now_ms - _credits_sent_ms);
+    }
+    for (std::size_t i = 0; i < wait_count; ++i) {
+        if (static_cast<std::int32_t>(waits_ms[i]) <= 0) {
+            return 0;
+        }
+        if (waits_ms[i] < idle_us / 1000UL) {
+            idle_us = waits_ms[i] * 1000UL;
         }
     }
+
+    /* Connection parameters change without an event reaching us, so check on them now and then */
+    if (_conn_params_pending && CONN_PARAMS_POLL_US < idle_us) {
+        idle_us = CONN_PARAMS_POLL_US;
+    }
+
+#if PIN_CTRL_LOG_RING_CAPACITY && PIN_CTRL_LOG_LEVEL == PIN_CTRL_LOG_DEFERRED
+    /* The deferred log prints a record per idle pass, until it's empty */
+    if (!_log.empty()) {
+        return 0;
+    }
+#endif
+
+    return idle_us;
 }
 
-void PinCtrl::handle_gpio_pulse() {
-    const unsigned int number_of_bytes = static_cast<unsigned int>(_uart->available());
+/** Dispatch table: each command's size and handler, indexed by command id */
+/* Note: ids left out are unknown commands (size 0), including the notifications only this device sends */
+struct PinCtrl::CommandTable {
+    static constexpr CommandEntry ENTRIES[COMMAND_TABLE_SIZE] = {
+        {},     // 0x00: unused
+        {Command::GPIO_CONFIGURE, sizeof(GpioConfigure),
+         &PinCtrl::run_fixed<GpioConfigure, &PinCtrl::handle_gpio_configure>},
+        {Command::GPIO_WRITE, sizeof(GpioWrite), &PinCtrl::run_fixed<GpioWrite, &PinCtrl::handle_gpio_write>},
+        {Command::GPIO_PULSE, sizeof(GpioPulse), &PinCtrl::run_fixed<GpioPulse, &PinCtrl::handle_gpio_pulse>},
+        {Command::GPIO_QUERY, sizeof(GpioQuery), &PinCtrl::run_fixed<GpioQuery, &PinCtrl::handle_gpio_query>},
+        {Command::PWM_SET, sizeof(PwmSet), &PinCtrl::run_fixed<PwmSet, &PinCtrl::handle_pwm_set>},
+        {Command::QUERY_STATE, sizeof(QueryState), &PinCtrl::run_fixed<QueryState, &PinCtrl::handle_query_state>},
+        {Command::BATCH, sizeof(BatchHeader), &PinCtrl::handle_batch},
+        {Command::GPIO_PULSE_SCHEDULE, sizeof(GpioPulseSchedule),
+         &PinCtrl::run_fixed<GpioPulseSchedule, &PinCtrl::handle_gpio_pulse_schedule>},
+        {Command::INPUT_SUBSCRIBE, sizeof(InputSubscribe),
+         &PinCtrl::run_fixed<InputSubscribe, &PinCtrl::handle_input_subscribe>},
+        {},     // 0x0A: INPUT_EVENTS (this -> Central only)
+        {Command::CONN_PARAMS, sizeof(ConnParams), &PinCtrl::run_fixed<ConnParams, &PinCtrl::handle_conn_params>},
+        {Command::ECHO, sizeof(Echo), &PinCtrl::handle_echo},
+        {Command::STATS, sizeof(Stats), &PinCtrl::run_fixed<Stats, &PinCtrl::handle_stats>},
+        {Command::LOG_READ, sizeof(LogRead), &PinCtrl::run_fixed<LogRead, &PinCtrl::handle_log_read>},
+        {Command::PATTERN_UPLOAD, sizeof(PatternUpload), &PinCtrl::handle_pattern_upload},
+        {Command::PATTERN_PLAY, sizeof(PatternPlay), &PinCtrl::run_fixed<PatternPlay, &PinCtrl::handle_pattern_play>},
+        {Command::PATTERN_STOP, sizeof(PatternStop), &PinCtrl::run_fixed<PatternStop, &PinCtrl::handle_pattern_stop>},
+        {Command::COMMIT, sizeof(Commit), &PinCtrl::run_fixed<Commit, &PinCtrl::handle_commit>},
+        {Command::PWM_SET_MULTI, sizeof(PwmSetMulti), &PinCtrl::handle_pwm_set_multi},
+        {Command::PWM_RAMP, sizeof(PwmRamp), &PinCtrl::run_fixed<PwmRamp, &PinCtrl::handle_pwm_ramp>},
+        {Command::SCHEDULE, sizeof(Schedule), &PinCtrl::handle_schedule},
+        {Command::FLOW_CONTROL, sizeof(FlowControl), &PinCtrl::run_fixed<FlowControl, &PinCtrl::handle_flow_control>},
+        {},     // 0x17: CREDITS (this -> Central only)
+        {Command::PROTOCOL_VERSION, sizeof(ProtocolVersion),
+         &PinCtrl::run_fixed<ProtocolVersion, &PinCtrl::handle_protocol_version>},
+        {Command::COMPACT_GPIO_CONFIGURE, COMPACT_MIN_SIZE, &PinCtrl::handle_compact},
+        {Command::COMPACT_GPIO_WRITE, COMPACT_MIN_SIZE, &PinCtrl::handle_compact},
+        {Command::COMPACT_GPIO_PULSE, COMPACT_MIN_SIZE, &PinCtrl::handle_compact},
+        {Command::COMPACT_GPIO_PULSE_SCHEDULE, COMPACT_MIN_SIZE, &PinCtrl::handle_compact},
+        {Command::COMPACT_PWM_SET, COMPACT_MIN_SIZE, &PinCtrl::handle_compact},
+        {Command::STATE_SYNC, sizeof(StateSync), &PinCtrl::handle_state_sync},
+        {Command::ADC_STREAM, sizeof(AdcStream), &PinCtrl::run_fixed<AdcStream, &PinCtrl::handle_adc_stream>},
+        {},     // 0x20: ADC_SAMPLES (this -> Central only)
+        {Command::SAFETY, sizeof(Safety), &PinCtrl::run_fixed<Safety, &PinCtrl::handle_safety>},
+    };
 
-    if (number_of_bytes < sizeof(GpioPulse)) {
-        return; // missing bytes
+    // true if every entry from index i on is unknown or sits at its command's id
+    static constexpr bool indexed_by_id(std::size_t i) {
+        return i == COMMAND_TABLE_SIZE
+            || ((!ENTRIES[i].size || static_cast<std::size_t>(ENTRIES[i].command) == i) && indexed_by_id(i + 1));
     }
+};
 
-    /* Parse byte buffer into the struct */
-    auto params = parse_bytes<GpioPulse>();
-    // fix endianness for multi-byte pieces of data
-    params.gpio_port = byte_swap32(params.gpio_port);
-    params.gpio_bitset = byte_swap32(params.gpio_bitset);
-    params.duration_ms = byte_swap32(params.duration_ms);
-    
-    DBG_LOG("GPIO_PULSE: ");
+constexpr PinCtrl::CommandEntry PinCtrl::CommandTable::ENTRIES[COMMAND_TABLE_SIZE];
+
+std::size_t PinCtrl::execute(std::uint8_t *data, std::size_t length) {
+    static_assert(CommandTable::indexed_by_id(0), "Dispatch table entries must sit at their command's id");
+
+    if (!length || data[0] >= COMMAND_TABLE_SIZE) {
+        return 0;
+    }
+
+    /* First byte is command, the rest of the frame must hold its data */
+    const std::size_t id = data[0];
+    const CommandEntry &entry = CommandTable::ENTRIES[id];
+    if (!entry.size || length < entry.size) {
+        return 0; // unknown command or missing bytes
+    }
+
+    ++_counters.commands[id];
+    LogRecord record;
+    start_log_record(data, length, record);
+
+    /* One indexed call, each handler returns how much of data its command used */
+    const std::size_t used = (this->*entry.handler)(data, length);
+    log_command(record, used);
+    return used;
+}
+
+template <typename T, void (PinCtrl::*HANDLER)(const T &)>
+std::size_t PinCtrl::run_fixed(std::uint8_t *data, std::size_t) {
+    (this->*HANDLER)(decode<T>(data));
+    return sizeof(T);
+}
+
+std::size_t PinCtrl::frame_size(Command command) {
+    const std::size_t id = static_cast<std::size_t>(command);
+    return id < COMMAND_TABLE_SIZE ? CommandTable::ENTRIES[id].size : 0;
+}
+
+void PinCtrl::handle_gpio_configure(const GpioConfigure &params) {
+    DBG_LOG("GPIO_CONFIGURE: ");
     DBG_LOG(params.gpio_bitset, HEX);
     DBG_LOG(" ");
-    DBG_LOG_LINE(params.duration_ms);
+    DBG_LOG_LINE(static_cast<int>(params.gpio_direction));
 
-    /* Store data for use by pin pulsing routine */
-    _pins_to_pulse = params.gpio_bitset;
-    _pulse_dur_ms = params.duration_ms;
+    configure_pins(resolve_pins(params.gpio_port, params.gpio_bitset), params.gpio_direction);
+}
 
-    if (!_pins_to_pulse) { // nothing to do
-        return;
+void PinCtrl::configure_pins(const gpio_ports::PortMasks &pins, GpioDirection direction) {
+    /* Configure every pin of each port at once */
+    if (direction == GpioDirection::DIR_INPUT) {
+        gpio_ports::make_input(pins);
+    } else {
+        gpio_ports::make_output_low(pins);
     }
-    
-    /* Start the first pulse (set the pin high and record the start time) */
-    int pin = PinCtrl::get_highest_bit(_pins_to_pulse);
-    if (pin < 0) { // note - should never happen
-        Serial.println("!!! Pulse starting with no pin set");
-        return; 
+
+    /* Remember the configuration for COMMIT */
+    auto &now_set = direction == GpioDirection::DIR_INPUT ? _configured_inputs : _configured_outputs;
+    auto &now_unset = direction == GpioDirection::DIR_INPUT ? _configured_outputs : _configured_inputs;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        now_set.bits[port] |= pins.bits[port];
+        now_unset.bits[port] &= ~pins.bits[port];
+    }
+}
+
+void PinCtrl::handle_gpio_write(const GpioWrite &params) {
+    DBG_LOG("GPIO_WRITE: ");
+    DBG_LOG_LINE(params.gpio_bitset, HEX);
+
+    write_pins(resolve_pins(params.gpio_port, params.gpio_bitset), params.output);
+}
+
+void PinCtrl::write_pins(const gpio_ports::PortMasks &pins, GpioOutput output) {
+    /* Set every pin of each port in the same cycle, ports one store after the other */
+    if (output == GpioOutput::OUT_HIGH) {
+        gpio_ports::set(pins);
+        limit_on_time(pins);
+    } else {
+        gpio_ports::clear(pins);
     }
+}
 
-    DBG_LOG("Pulsing pin ");
-    DBG_LOG(pin);
-    DBG_LOG(" for ");
-    DBG_LOG_LINE(_pulse_dur_ms);
+void PinCtrl::handle_gpio_pulse(const GpioPulse &params) {
+    DBG_LOG("GPIO_PULSE: ");
+    DBG_LOG(params.gpio_bitset, HEX);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.duration_ms);
 
-    digitalWrite(pin, HIGH);
-    _pulse_start_ms = millis();
+    /* Legacy pulses run one pin after another */
+    schedule_pulses(params.gpio_port, params.gpio_bitset, PulseMode::SEQUENTIAL, pulse_ms_to_us(params.duration_ms),
+                    0);
 }
 
-void PinCtrl::handle_gpio_query() {
-    Serial.println("GPIO QUERY: TODO");
+void PinCtrl::handle_gpio_pulse_schedule(const GpioPulseSchedule &params) {
+    DBG_LOG("GPIO_PULSE_SCHEDULE: ");
+    DBG_LOG(params.gpio_bitset, HEX);
+    DBG_LOG(" ");
+    DBG_LOG(static_cast<int>(params.mode));
+    DBG_LOG(" ");
+    DBG_LOG(params.duration_us);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.start_offset_us);
+
+    schedule_pulses(params.gpio_port, params.gpio_bitset, params.mode, params.duration_us, params.start_offset_us);
 }
 
-void PinCtrl::handle_pwm_set() {
-    const unsigned int number_of_bytes = static_cast<unsigned int>(_uart->available());
+void PinCtrl::handle_gpio_query(const GpioQuery &params) {
+    DBG_LOG("GPIO_QUERY: ");
+    DBG_LOG_LINE(params.gpio_bitset, HEX);
+
+    std::uint8_t payload[sizeof(GpioQueryReply) + gpio_ports::PINS_PER_PORT];
+    auto &reply = *reinterpret_cast<GpioQueryReply *>(payload);
+    reply = GpioQueryReply{Command::GPIO_QUERY, params.gpio_port, params.gpio_bitset, 0, 0, 0, 0};
+
+    /* Snapshot each port once so every pin of the reply is from the same moment */
+    std::uint32_t input[gpio_ports::NUM_PORTS];
+    std::uint32_t output[gpio_ports::NUM_PORTS];
+    std::uint32_t direction[gpio_ports::NUM_PORTS];
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        input[port] = gpio_ports::read_input(port);
+        output[port] = gpio_ports::read_output(port);
+        direction[port] = gpio_ports::read_direction(port);
+    }
+
+    /* Report in the query's own pin numbering, lowest pin first */
+    std::size_t length = sizeof(GpioQueryReply);
+    for (unsigned int n : bit_ops::set_bits(params.gpio_bitset)) {
+        const int hw_pin = wire_to_hw_pin(params.gpio_port, n);
+        std::uint8_t duty = 0;
+        if (hw_pin >= 0) {
+            const unsigned int port = hw_pin / gpio_ports::PINS_PER_PORT;
+            const std::uint32_t hw_bit = 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
+            const std::uint32_t bit = 1UL << n;
 
-    if (number_of_bytes < sizeof(PwmSet)) {
-        return; // missing bytes
+            reply.input |= (input[port] & hw_bit) ? bit : 0;
+            reply.output |= (output[port] & hw_bit) ? bit : 0;
+            reply.direction |= (direction[port] & hw_bit) ? bit : 0;
+            reply.pulsing |= (_pulsing.bits[port] & hw_bit) ? bit : 0;
+            duty = _pwm_duty[hw_pin];
+        }
+        payload[length++] = duty;
     }
 
-    /* Parse byte buffer into the struct */
-    auto params = parse_bytes<PwmSet>();
-    // fix endianness for multi-byte pieces of data
-    params.gpio_port = byte_swap32(params.gpio_port);
-    params.gpio_bitset = byte_swap32(params.gpio_bitset);
+    wire_format::to_network(reply);
+    send_reply(payload, length);
+}
 
+void PinCtrl::handle_pwm_set(const PwmSet &params) {
     DBG_LOG("PWM_SET: ");
     DBG_LOG(params.gpio_bitset, HEX);
     DBG_LOG(" ");
     DBG_LOG_LINE(static_cast<int>(params.intensity));
 
-    /* Go through each bit and set PWM on appropriate pins */
-    for (int pin = 0; pin < 32; ++pin) {
-        if (is_set(params.gpio_bitset, pin)) {
-            analogWrite(pin, params.intensity);
+    set_pwm(resolve_arduino_pins(params.gpio_port, params.gpio_bitset), params.intensity);
+}
+
+void PinCtrl::set_pwm(std::uint32_t arduino_pins, std::uint8_t intensity) {
+    /* Go through each bit and set PWM on appropriate pins (PWM is per-pin, there's no port register for it) */
+    gpio_ports::PortMasks on{};
+    for (unsigned int pin : bit_ops::set_bits(arduino_pins)) {
+        const std::uint32_t hw_pin = gpio_ports::arduino_to_hw_pin(pin);
+        _pwm_group.release(hw_pin);
+        analogWrite(pin, intensity);
+        _pwm_duty[hw_pin] = intensity;
+        if (intensity) {
+            on.bits[hw_pin / gpio_ports::PINS_PER_PORT] |= 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
         }
     }
+    limit_on_time(on);
 }
 
-void PinCtrl::handle_query_state() {
-    Serial.println("QUERY STATE: TODO");
+void PinCtrl::stop_pwm(unsigned int hw_pin) {
+    _pwm_group.release(hw_pin);
+    if (_hw_to_arduino[hw_pin] >= 0) {
+        for (unsigned int module = 0; module < HWPWM_MODULE_NUM; ++module) {
+            HwPWMx[module]->removePin(_hw_to_arduino[hw_pin]);
+        }
+    }
+    _pwm_duty[hw_pin] = 0;
 }
 
-void PinCtrl::service_gpio_pulse() {
-    /* Do nothing if no pulsing is ongoing */
-    if (!_pins_to_pulse) {
+void PinCtrl::limit_on_time(const gpio_ports::PortMasks &on) {
+    gpio_ports::PortMasks limited{};
+    bool any = false;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        limited.bits[port] = on.bits[port] & _limited.bits[port];
+        any = any || limited.bits[port];
+    }
+    if (!any) {
         return;
     }
 
-    /* Do nothing if pulse time hasn't elapsed yet */
-    if (millis() - _pulse_start_ms < _pulse_dur_ms) {
-        return;
+    /* A later deadline waits for the live entry to come up, an earlier one (the limit was lowered) replaces it */
+    const std::uint32_t now_us = micros();
+    gpio_ports::PortMasks cut{};
+    bool cutting = false;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        for (unsigned int n : bit_ops::set_bits(limited.bits[port])) {
+            const unsigned int pin = port * gpio_ports::PINS_PER_PORT + n;
+            const std::uint32_t bit = 1UL << n;
+            const std::uint32_t off_us = now_us + _max_on_us[pin];
+            _auto_off_us[pin] = off_us;
+            if ((_auto_off_queued.bits[port] & bit) && !deadline_before(off_us, _auto_off_queued_us[pin])) {
+                continue;
+            }
+
+            if (!_pulse_queue.push(off_us, PulseEdge{static_cast<std::uint8_t>(pin), false, false, true})) {
+                cut.bits[port] |= bit;
+                cutting = true;
+                continue;
+            }
+            _auto_off_queued.bits[port] |= bit;
+            _auto_off_queued_us[pin] = off_us;
+        }
     }
 
-    /* Set the pin low */
-    int pin = PinCtrl::get_highest_bit(_pins_to_pulse);
-    if (pin < 0) { // note - should never happen
-        Serial.println("!!! Pulse active with no pin set");
-        return;
+    /* A pin nothing would switch off isn't left on */
+    if (cutting) {
+        ERR_LOG_LINE("!!! Pulse queue full, switching limited pins off now");
+        switch_off(cut);
+    }
+}
+
+unsigned int PinCtrl::switch_off(const gpio_ports::PortMasks &pins) {
+    unsigned int were_on = 0;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        const std::uint32_t high = pins.bits[port] ? gpio_ports::read_output(port) : 0;
+        for (unsigned int n : bit_ops::set_bits(pins.bits[port])) {
+            const unsigned int pin = port * gpio_ports::PINS_PER_PORT + n;
+            const bool pwm = _pwm_duty[pin] || _pwm_group.channel_of(pin) >= 0;
+            if (pwm) {
+                stop_pwm(pin);
+            }
+            if (pwm || (high & (1UL << n))) {
+                ++were_on;
+            }
+
+            /* A synced pin that was on no longer matches the central's shadow */
+            if ((_sync_pins.bits[port] & (1UL << n)) && _sync_levels[pin]) {
+                _synced = false;
+            }
+        }
+    }
+    gpio_ports::clear(pins);
+    return were_on;
+}
+
+std::size_t PinCtrl::handle_pwm_set_multi(std::uint8_t *data, std::size_t length) {
+    const auto &params = decode<PwmSetMulti>(data);
+
+    DBG_LOG("PWM_SET_MULTI: ");
+    DBG_LOG(params.frequency_hz);
+    DBG_LOG(" ");
+    DBG_LOG(params.top);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<int>(params.count));
+
+    const std::size_t command_end = sizeof(PwmSetMulti) + params.count * sizeof(PwmChannelDuty);
+    if (command_end > length) {
+        return 0; // missing bytes
+    }
+
+    /* The whole command is still consumed when it's refused, so the rest of a batch runs */
+    if (params.count > MAX_PWM_MULTI_CHANNELS) {
+        ERR_LOG_LINE("!!! Too many PWM channels, dropping command");
+        return command_end;
+    }
+
+    /* Nothing changes unless the group can take the pins */
+    if (!_pwm_group.begin()) {
+        ERR_LOG_LINE("!!! PWM peripheral is in use by analogWrite(), dropping command");
+        return command_end;
+    }
+
+    std::uint8_t hw_pins[MAX_PWM_MULTI_CHANNELS];
+    std::uint16_t duties[MAX_PWM_MULTI_CHANNELS];
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < params.count; ++i) {
+        const auto &entry = decode<PwmChannelDuty>(data + sizeof(PwmSetMulti) + i * sizeof(PwmChannelDuty));
+        const int hw_pin = wire_to_hw_pin(params.gpio_port, entry.pin);
+        if (hw_pin < 0) {
+            continue;
+        }
+
+        /* A pin can only have one PWM driving it, take it away from analogWrite() */
+        if (_hw_to_arduino[hw_pin] >= 0) {
+            for (unsigned int module = 0; module < HWPWM_MODULE_NUM; ++module) {
+                HwPWMx[module]->removePin(_hw_to_arduino[hw_pin]);
+            }
+        }
+        hw_pins[count] = static_cast<std::uint8_t>(hw_pin);
+        duties[count++] = entry.duty;
     }
-    
-    digitalWrite(pin, LOW);
-    PinCtrl::clear_highest_bit(_pins_to_pulse);
 
-    /* If there's nothing left to do, stop */
-    if (!_pins_to_pulse) {
-        DBG_LOG("Done with pulsing");
-        _pulse_start_ms = 0;
+    int old_pins[PwmGroup::NUM_CHANNELS];
+    for (unsigned int ch = 0; ch < PwmGroup::NUM_CHANNELS; ++ch) {
+        old_pins[ch] = _pwm_group.pin(ch);
+    }
+
+    /* Claimed and at most NUM_CHANNELS pins, so set() can't fail */
+    _pwm_group.set_timing(params.frequency_hz, params.top);
+    _pwm_group.set(hw_pins, duties, count);
+
+    /* Pins that left the group read as stopped, duties are reported scaled to 0-255 like PWM_SET's */
+    for (int old_pin : old_pins) {
+        if (old_pin >= 0) {
+            _pwm_duty[old_pin] = 0;
+        }
+    }
+    gpio_ports::PortMasks on{};
+    for (std::size_t i = 0; i < count; ++i) {
+        const std::uint32_t duty = duties[i] < _pwm_group.top() ? duties[i] : _pwm_group.top();
+        _pwm_duty[hw_pins[i]] = static_cast<std::uint8_t>(duty * 255 / _pwm_group.top());
+        if (duty) {
+            on.bits[hw_pins[i] / gpio_ports::PINS_PER_PORT] |= 1UL << (hw_pins[i] % gpio_ports::PINS_PER_PORT);
+        }
+    }
+    limit_on_time(on);
+    return command_end;
+}
+
+void PinCtrl::handle_pwm_ramp(const PwmRamp &params) {
+    DBG_LOG("PWM_RAMP: ");
+    DBG_LOG(params.gpio_bitset, HEX);
+    DBG_LOG(" ");
+    DBG_LOG(params.start_duty);
+    DBG_LOG(" ");
+    DBG_LOG(params.end_duty);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.duration_us);
+
+    std::uint8_t channels = 0;
+    for (unsigned int n : bit_ops::set_bits(params.gpio_bitset)) {
+        const int hw_pin = wire_to_hw_pin(params.gpio_port, n);
+        const int ch = hw_pin >= 0 ? _pwm_group.channel_of(hw_pin) : -1;
+        if (ch >= 0) {
+            channels |= 1U << ch;
+        }
+    }
+
+    if (!_pwm_group.ramp(channels, params.start_duty, params.end_duty, params.duration_us, params.curve)) {
+        ERR_LOG_LINE("!!! No PWM group pins to ramp, dropping command");
         return;
     }
 
-    /* Start next pulse */
-    pin = PinCtrl::get_highest_bit(_pins_to_pulse);
-    if (pin < 0) { // note - should never happen
-        Serial.println("!!! Next pulse starting with no pin set");
+    /* Ramping pins report where they end up, and are on for the ramp unless it goes from 0 to 0 */
+    gpio_ports::PortMasks on{};
+    for (unsigned int ch : bit_ops::set_bits(channels)) {
+        const unsigned int hw_pin = _pwm_group.pin(ch);
+        _pwm_duty[hw_pin] = static_cast<std::uint8_t>(
+            static_cast<std::uint32_t>(_pwm_group.duty(ch)) * 255 / _pwm_group.top());
+        if (params.start_duty || params.end_duty) {
+            on.bits[hw_pin / gpio_ports::PINS_PER_PORT] |= 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
+        }
+    }
+    limit_on_time(on);
+}
+
+void PinCtrl::handle_query_state(const QueryState &) {
+    DBG_LOG_LINE("QUERY_STATE");
+
+    std::uint8_t payload[sizeof(QueryStateReply) + NUM_HW_PINS * sizeof(PwmDuty)];
+    auto &reply = *reinterpret_cast<QueryStateReply *>(payload);
+    reply = QueryStateReply{};
+    reply.command = Command::QUERY_STATE;
+    reply.uptime_ms = millis();
+
+    /* Ports the chip doesn't have read as all zeros */
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS && port < QUERY_STATE_PORTS; ++port) {
+        reply.input[port] = gpio_ports::read_input(port);
+        reply.output[port] = gpio_ports::read_output(port);
+        reply.direction[port] = gpio_ports::read_direction(port);
+        reply.pulsing[port] = _pulsing.bits[port];
+    }
+    reply.queued_pulse_edges = static_cast<std::uint16_t>(_pulse_queue.size());
+    reply.hw_pulses_active = static_cast<std::uint8_t>(_pulse_timer.active());
+
+    /* Only pins with PWM running are listed, most sketches drive just a few */
+    std::size_t length = sizeof(QueryStateReply);
+    for (unsigned int hw_pin = 0; hw_pin < NUM_HW_PINS; ++hw_pin) {
+        if (_pwm_duty[hw_pin]) {
+            const PwmDuty entry{static_cast<std::uint8_t>(hw_pin), _pwm_duty[hw_pin]};
+            memcpy(payload + length, &entry, sizeof(entry));
+            length += sizeof(entry);
+            ++reply.pwm_count;
+        }
+    }
+
+    wire_format::to_network(reply);
+    send_reply(payload, length);
+}
+
+void PinCtrl::handle_input_subscribe(const InputSubscribe &params) {
+    DBG_LOG("INPUT_SUBSCRIBE: ");
+    DBG_LOG(params.gpio_bitset, HEX);
+    DBG_LOG(" ");
+    DBG_LOG(params.debounce_ms);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.min_interval_ms);
+
+    /* Changes of the old subscription still waiting are numbered for it, send them first */
+    if (_input_event_count) {
+        _input_interval_ms = 0;
+        service_inputs();
+    }
+
+    const std::uint32_t arduino_pins = _inputs.monitor(resolve_arduino_pins(params.gpio_port, params.gpio_bitset),
+                                                       params.debounce_ms * 1000UL);
+    _input_port = params.gpio_port;
+    _input_interval_ms = params.min_interval_ms;
+
+    /* Tell the central which pins it got, in its own numbering */
+    InputSubscribeReply reply{Command::INPUT_SUBSCRIBE, params.gpio_port, 0};
+    for (unsigned int n : bit_ops::set_bits(params.gpio_bitset)) {
+        const int hw_pin = wire_to_hw_pin(params.gpio_port, n);
+        if (hw_pin >= 0 && _hw_to_arduino[hw_pin] >= 0
+                && is_set(arduino_pins, _hw_to_arduino[hw_pin])) {
+            reply.gpio_bitset |= 1UL << n;
+        }
+    }
+
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+void PinCtrl::handle_conn_params(const ConnParams &params) {
+    DBG_LOG("CONN_PARAMS: ");
+    DBG_LOG(params.interval);
+    DBG_LOG(" ");
+    DBG_LOG(params.slave_latency);
+    DBG_LOG(" ");
+    DBG_LOG(params.supervision_timeout);
+    DBG_LOG(" ");
+    DBG_LOG(static_cast<int>(params.phy));
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.data_length);
+
+    /* Every request gets its own reply, finish an earlier one with whatever it got so far */
+    if (_conn_params_pending) {
+        _conn_params_requested_ms = millis() - CONN_PARAMS_TIMEOUT_MS;
+        service_conn_params();
+    }
+
+    _conn_params_wanted = params;
+    _conn_params_requested_ms = millis();
+    _conn_params_pending = true;
+
+    BLEConnection *const connection = Bluefruit.Connection(Bluefruit.connHandle());
+    if (!connection) {
+        service_conn_params(); // reported as all zeros
         return;
     }
 
-    DBG_LOG("Pulsing pin ");
-    DBG_LOG(pin);
-    DBG_LOG(" for ");
-    DBG_LOG_LINE(_pulse_dur_ms);
+    bool refused = false;
+
+    /* Each parameter is its own link layer procedure, the central may accept some and not others */
+    if (params.interval || params.slave_latency || params.supervision_timeout) {
+        const ConnParamsReply current = read_conn_params();
+        const std::uint16_t interval = params.interval ? params.interval : current.interval;
+        const std::uint16_t slave_latency = params.interval || params.slave_latency
+                                          ? params.slave_latency : current.slave_latency;
+        const std::uint16_t supervision_timeout = params.supervision_timeout
+                                                ? params.supervision_timeout : current.supervision_timeout;
+
+        /* The supervision timeout must outlast the longest gap between two events this device listens to */
+        if (static_cast<std::uint32_t>(supervision_timeout) * 4 <= (1UL + slave_latency) * interval
+                || !connection->requestConnectionParameter(interval, slave_latency, supervision_timeout)) {
+            ERR_LOG_LINE("!!! Couldn't request connection interval, latency or supervision timeout");
+            refused = true;
+        }
+    }
+
+    if (params.phy != ConnPhy::PHY_KEEP
+            && !connection->requestPHY(params.phy == ConnPhy::PHY_2M ? BLE_GAP_PHY_2MBPS : BLE_GAP_PHY_1MBPS)) {
+        ERR_LOG_LINE("!!! Couldn't request PHY");
+        refused = true;
+    }
+
+    if (params.data_length) {
+        ble_gap_data_length_params_t data_length = {};
+        data_length.max_tx_octets = params.data_length;
+        data_length.max_rx_octets = params.data_length;
+        data_length.max_tx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        data_length.max_rx_time_us = BLE_GAP_DATA_LENGTH_AUTO;
+        if (!connection->requestDataLengthUpdate(&data_length)) {
+            ERR_LOG_LINE("!!! Couldn't request data length");
+            refused = true;
+        }
+    }
 
-    digitalWrite(pin, HIGH);
-    _pulse_start_ms = millis();
+    /* Nothing to wait for if a request never went out, and a plain read is answered right away */
+    if (refused) {
+        _conn_params_requested_ms = millis() - CONN_PARAMS_TIMEOUT_MS;
+    }
+    service_conn_params();
 }
 
-/** Helper to parse data from the UART buffer */
-template <typename T> 
-T PinCtrl::parse_bytes() {
-    /* Read into a byte buffer */
-    std::uint8_t read_buffer[sizeof(T)] = {};
-    _uart->read(read_buffer, sizeof(read_buffer));
-    
-    /* Transform that byte buffer into the appropriate struct */
-    T parameters = {};
-    memcpy(&parameters, read_buffer, sizeof(parameters));
-    
-    return parameters;
+std::size_t PinCtrl::handle_echo(std::uint8_t *data, std::size_t length) {
+    const std::uint32_t dispatched_us = micros();
+    const auto &params = decode<Echo>(data);
+
+    const std::size_t echo_end = sizeof(Echo) + params.filler_length;
+    if (echo_end > length) {
+        return 0; // missing bytes
+    }
+
+    /* No logging here, it would show up in the timings */
+    if (params.flags & ECHO_SILENT) {
+        return echo_end;
+    }
+
+    /* The filler sent back is capped so the reply still fits in a frame */
+    std::uint8_t payload[MAX_FRAME_PAYLOAD];
+    std::size_t filler_length = (params.flags & ECHO_RETURN_FILLER) ? params.filler_length : 0;
+    if (filler_length > MAX_FRAME_PAYLOAD - sizeof(EchoReply)) {
+        filler_length = MAX_FRAME_PAYLOAD - sizeof(EchoReply);
+    }
+
+    auto &reply = *reinterpret_cast<EchoReply *>(payload);
+    reply = EchoReply{Command::ECHO, params.sequence, _frame_received_us, dispatched_us,
+                      static_cast<std::uint8_t>(filler_length)};
+    wire_format::to_network(reply);
+    memcpy(payload + sizeof(EchoReply), data + sizeof(Echo), filler_length);
+
+    send_reply(payload, sizeof(EchoReply) + filler_length);
+    return echo_end;
+}
+
+void PinCtrl::handle_stats(const Stats &params) {
+    DBG_LOG("STATS: ");
+    DBG_LOG_LINE(static_cast<int>(params.reset));
+
+    std::uint8_t payload[sizeof(StatsReply) + STATS_COMMAND_TYPES * sizeof(StatsCommandCount)];
+    auto &reply = *reinterpret_cast<StatsReply *>(payload);
+    const FrameErrors &errors = _parser.errors();
+    reply = StatsReply{Command::STATS,
+                       millis() - _counters.since_ms,
+                       _counters.service_calls,
+                       _counters.max_service_us,
+                       _counters.max_pulse_late_us,
+                       static_cast<std::uint16_t>(_counters.rx_fifo_high_water),
+                       _parser.bytes_received(),
+                       errors.dropped_bytes,
+                       errors.bad_length,
+                       errors.bad_crc,
+                       errors.timeouts,
+                       _bad_commands,
+                       0};
+
+    /* Only command types that were run are listed */
+    std::size_t length = sizeof(StatsReply);
+    for (std::size_t id = 0; id < STATS_COMMAND_TYPES; ++id) {
+        if (_counters.commands[id]) {
+            StatsCommandCount entry{static_cast<Command>(id), _counters.commands[id]};
+            wire_format::to_network(entry);
+            memcpy(payload + length, &entry, sizeof(entry));
+            length += sizeof(entry);
+            ++reply.command_types;
+        }
+    }
+
+    wire_format::to_network(reply);
+    send_reply(payload, length);
+
+    if (params.reset) {
+        reset_counters();
+    }
+}
+
+void PinCtrl::handle_log_read(const LogRead &params) {
+    DBG_LOG("LOG_READ: ");
+    DBG_LOG_LINE(static_cast<int>(params.max_records));
+
+    std::uint8_t payload[sizeof(LogReadReply) + MAX_LOG_READ_RECORDS * sizeof(LogRecord)];
+    auto &reply = *reinterpret_cast<LogReadReply *>(payload);
+    reply = LogReadReply{Command::LOG_READ, 0, 0, 0};
+
+#if PIN_CTRL_LOG_RING_CAPACITY
+    const std::size_t max_records = params.max_records && params.max_records < MAX_LOG_READ_RECORDS
+                                  ? params.max_records : MAX_LOG_READ_RECORDS;
+    LogRecord record;
+    while (reply.count < max_records && _log.pop(record)) {
+        wire_format::to_network(record);
+        memcpy(payload + sizeof(LogReadReply) + reply.count * sizeof(LogRecord), &record, sizeof(record));
+        ++reply.count;
+    }
+
+    reply.dropped = static_cast<std::uint16_t>(_log_dropped > 0xFFFF ? 0xFFFF : _log_dropped);
+    reply.remaining = static_cast<std::uint16_t>(_log.size());
+    _log_dropped = 0;
+#else
+    (void) params;
+#endif
+
+    const std::size_t length = sizeof(LogReadReply) + reply.count * sizeof(LogRecord);
+    wire_format::to_network(reply);
+    send_reply(payload, length);
+}
+
+std::size_t PinCtrl::handle_pattern_upload(std::uint8_t *data, std::size_t length) {
+    const auto &params = decode<PatternUpload>(data);
+
+    DBG_LOG("PATTERN_UPLOAD: ");
+    DBG_LOG(static_cast<int>(params.slot));
+    DBG_LOG(" ");
+    DBG_LOG(static_cast<int>(params.first_keyframe));
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<int>(params.count));
+
+    const std::size_t upload_end = sizeof(PatternUpload) + params.count * sizeof(Keyframe);
+    if (upload_end > length) {
+        return 0; // missing bytes
+    }
+
+    /* The whole upload is still consumed when it's refused, so the rest of a batch runs */
+    if (params.slot >= PATTERN_SLOTS) {
+        ERR_LOG_LINE("!!! No such pattern slot, dropping upload");
+        return upload_end;
+    }
+
+    Pattern &pattern = _patterns[params.slot];
+    _players[params.slot].playing = false;
+    if (!params.first_keyframe) {
+        pattern.keyframe_count = 0;
+    }
+
+    if (params.first_keyframe != pattern.keyframe_count
+            || params.first_keyframe + params.count > MAX_PATTERN_KEYFRAMES) {
+        ERR_LOG_LINE("!!! Pattern upload out of order or too long, dropping it");
+        return upload_end;
+    }
+
+    for (std::size_t i = 0; i < params.count; ++i) {
+        pattern.keyframes[pattern.keyframe_count++] =
+            decode<Keyframe>(data + sizeof(PatternUpload) + i * sizeof(Keyframe));
+    }
+    return upload_end;
+}
+
+void PinCtrl::handle_pattern_play(const PatternPlay &params) {
+    DBG_LOG("PATTERN_PLAY: ");
+    DBG_LOG(static_cast<int>(params.slot));
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.repeat);
+
+    if (params.slot >= PATTERN_SLOTS || !_patterns[params.slot].keyframe_count) {
+        ERR_LOG_LINE("!!! No pattern in slot, not playing");
+        return;
+    }
+
+    /* A pattern that takes no time would never let service() return */
+    const Pattern &pattern = _patterns[params.slot];
+    bool takes_time = false;
+    for (std::size_t i = 0; i < pattern.keyframe_count; ++i) {
+        takes_time |= pattern.keyframes[i].duration_us != 0;
+    }
+    if (!takes_time) {
+        ERR_LOG_LINE("!!! Pattern has no duration, not playing");
+        return;
+    }
+
+    PatternPlayer &player = _players[params.slot];
+    player.playing = true;
+    player.keyframe = 0;
+    player.forever = !params.repeat;
+    player.repeats_left = params.repeat ? params.repeat - 1 : 0;
+    player.next_us = micros();
+
+    /* The first keyframe goes out right away */
+    service_patterns();
+}
+
+void PinCtrl::handle_pattern_stop(const PatternStop &params) {
+    DBG_LOG("PATTERN_STOP: ");
+    DBG_LOG_LINE(static_cast<int>(params.slot));
+
+    for (std::size_t slot = 0; slot < PATTERN_SLOTS; ++slot) {
+        if (params.slot == PATTERN_ALL_SLOTS || params.slot == slot) {
+            _players[slot].playing = false;
+        }
+    }
+}
+
+void PinCtrl::service_patterns() {
+    const std::uint32_t now_us = micros();
+
+    for (std::size_t slot = 0; slot < PATTERN_SLOTS; ++slot) {
+        PatternPlayer &player = _players[slot];
+        const Pattern &pattern = _patterns[slot];
+
+        /* Each keyframe is timed from the previous deadline, not from when it was applied, so nothing drifts */
+        std::size_t applied = 0;
+        while (player.playing && !deadline_before(now_us, player.next_us)) {
+            const Keyframe &keyframe = pattern.keyframes[player.keyframe];
+            apply_keyframe(keyframe);
+            player.next_us += keyframe.duration_us;
+
+            /* More than a whole pass behind (loop() was stalled), pick the timing up from now */
+            if (++applied > pattern.keyframe_count) {
+                player.next_us = now_us + keyframe.duration_us;
+            }
+
+            if (++player.keyframe < pattern.keyframe_count) {
+                continue;
+            }
+
+            player.keyframe = 0;
+            if (player.forever) {
+                continue;
+            }
+            if (!player.repeats_left) {
+                player.playing = false;
+            } else {
+                --player.repeats_left;
+            }
+        }
+    }
+}
+
+void PinCtrl::apply_keyframe(const Keyframe &keyframe) {
+    if (keyframe.mode == KeyframeMode::PWM) {
+        handle_pwm_set(PwmSet{Command::PWM_SET, keyframe.gpio_port, keyframe.gpio_bitset, keyframe.level});
+    } else {
+        handle_gpio_write(GpioWrite{Command::GPIO_WRITE, keyframe.gpio_port, keyframe.gpio_bitset,
+                                    keyframe.level ? GpioOutput::OUT_HIGH : GpioOutput::OUT_LOW});
+    }
+}
+
+void PinCtrl::handle_commit(const Commit &params) {
+    DBG_LOG("COMMIT: ");
+    DBG_LOG_LINE(static_cast<int>(params.flags));
+
+    CommitReply reply{Command::COMMIT, 0, 0};
+    if (params.flags & COMMIT_ERASE) {
+        reply.saved = ConfigFile::erase();
+    } else {
+        const std::size_t size = save_config();
+        reply.saved = size != 0;
+        reply.size = size;
+    }
+    if (!reply.saved) {
+        ERR_LOG_LINE("!!! Couldn't write the saved settings");
+    }
+
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+std::size_t PinCtrl::save_config() {
+    /* File layout (host byte order, CRC-8 of everything at the end):
+     *      SavedHeader
+     *      configured inputs, configured outputs, high outputs (PortMasks)
+     *      per stored pattern: <slot 1-byte> <keyframe count 1-byte> <Keyframe entries> */
+    SavedHeader header{SAVED_MAGIC, SAVED_VERSION, gpio_ports::NUM_PORTS, 0};
+    for (const auto &pattern : _patterns) {
+        header.patterns += pattern.keyframe_count != 0;
+    }
+
+    gpio_ports::PortMasks high{};
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        high.bits[port] = gpio_ports::read_output(port) & _configured_outputs.bits[port];
+    }
+
+    ConfigFile file;
+    bool ok = file.start_write() && file.write(&header, sizeof(header))
+              && file.write(&_configured_inputs, sizeof(_configured_inputs))
+              && file.write(&_configured_outputs, sizeof(_configured_outputs)) && file.write(&high, sizeof(high));
+    for (std::uint8_t slot = 0; ok && slot < PATTERN_SLOTS; ++slot) {
+        const Pattern &pattern = _patterns[slot];
+        if (pattern.keyframe_count) {
+            ok = file.write(&slot, sizeof(slot)) && file.write(&pattern.keyframe_count, sizeof(pattern.keyframe_count))
+                 && file.write(pattern.keyframes, pattern.keyframe_count * sizeof(Keyframe));
+        }
+    }
+    ok = file.finish_write() && ok;
+
+    return ok ? file.size() + 1 : 0; // + 1 for the CRC
+}
+
+void PinCtrl::start_log_record(const std::uint8_t *data, std::size_t length, LogRecord &record) const {
+#if PIN_CTRL_LOG_RING_CAPACITY
+    record = LogRecord{};
+    record.time_us = micros();
+    record.command = static_cast<Command>(data[0]);
+    memcpy(record.args, data + 1, length - 1 < sizeof(record.args) ? length - 1 : sizeof(record.args));
+#else
+    (void) data;
+    (void) length;
+    (void) record;
+#endif
+}
+
+void PinCtrl::log_command(LogRecord &record, std::size_t used) {
+#if PIN_CTRL_LOG_RING_CAPACITY
+    /* A batch follows its sub-commands, each record only counts its own command's bytes */
+    record.length = static_cast<std::uint8_t>(used > 0xFF ? 0xFF : used);
+    if (!_log.push(record)) {
+        ++_log_dropped;
+    }
+#else
+    (void) record;
+    (void) used;
+#endif
+}
+
+void PinCtrl::print_log_record() {
+#if PIN_CTRL_LOG_RING_CAPACITY && PIN_CTRL_LOG_LEVEL == PIN_CTRL_LOG_DEFERRED
+    LogRecord record;
+    if (!_log.pop(record)) {
+        return;
+    }
+
+    Serial.print(record.time_us);
+    Serial.print(" cmd 0x");
+    Serial.print(static_cast<int>(record.command), HEX);
+    Serial.print(" len ");
+    Serial.print(static_cast<int>(record.length));
+    Serial.print(":");
+    for (std::size_t i = 0; i < sizeof(record.args) && i + 1 < record.length; ++i) {
+        Serial.print(" ");
+        Serial.print(static_cast<int>(record.args[i]), HEX);
+    }
+    Serial.println();
+#endif
+}
+
+void PinCtrl::send_reply(const std::uint8_t *payload, std::size_t length) {
+    if (!write_frame(_uart, payload, length)) {
+        ERR_LOG_LINE("!!! Couldn't send reply, is the central subscribed to notifications?");
+    }
+}
+
+std::size_t PinCtrl::handle_batch(std::uint8_t *data, std::size_t length) {
+    const auto &params = decode<BatchHeader>(data);
+
+    DBG_LOG("BATCH: ");
+    DBG_LOG_LINE(params.batch_length);
+
+    const std::size_t batch_end = sizeof(BatchHeader) + params.batch_length;
+    if (batch_end > length) {
+        return 0; // missing bytes
+    }
+
+    /* Run every sub-command in one pass */
+    std::size_t offset = sizeof(BatchHeader);
+    while (offset < batch_end) {
+        const std::size_t used = static_cast<Command>(data[offset]) == Command::BATCH
+                               ? 0 : execute(data + offset, batch_end - offset);
+
+        if (!used) {
+            ERR_LOG_LINE("!!! Malformed batch, dropping the rest of it");
+            return 0;
+        }
+
+        offset += used;
+    }
+
+    return batch_end;
+}
+
+std::size_t PinCtrl::handle_schedule(std::uint8_t *data, std::size_t length) {
+    const auto &params = decode<Schedule>(data);
+
+    DBG_LOG("SCHEDULE: ");
+    DBG_LOG(params.run_at_us);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<int>(params.length));
+
+    const std::size_t schedule_end = sizeof(Schedule) + params.length;
+    if (schedule_end > length) {
+        return 0; // missing bytes
+    }
+
+    if (!params.length) {
+        _schedule_queue.clear();
+        _scheduled_free = (1UL << SCHEDULE_QUEUE_CAPACITY) - 1;
+        return schedule_end;
+    }
+
+    /* The whole command is still consumed when it's refused, so the rest of a batch runs */
+    const std::uint32_t now_us = micros();
+    if (params.length > MAX_SCHEDULED_LENGTH || !_scheduled_free) {
+        ERR_LOG_LINE("!!! Scheduled command too long or schedule queue full, dropping it");
+        return schedule_end;
+    }
+    if (deadline_before(now_us + MAX_SCHEDULE_HORIZON_US, params.run_at_us)) {
+        ERR_LOG_LINE("!!! Scheduled command too far ahead, dropping it");
+        return schedule_end;
+    }
+
+    /* The command stays in wire byte order until it runs */
+    const unsigned int slot = bit_ops::pop_lowest(_scheduled_free);
+    memcpy(_scheduled[slot], data + sizeof(Schedule), params.length);
+    _scheduled_length[slot] = params.length;
+    _schedule_queue.push(params.run_at_us, ScheduledCommand{static_cast<std::uint8_t>(slot), _scheduled_arrivals++,
+                                                            _frame_received_us});
+    return schedule_end;
+}
+
+void PinCtrl::service_schedule() {
+    if (_schedule_queue.empty()) {
+        return;
+    }
+
+    const std::uint32_t now_us = micros();
+    while (!_schedule_queue.empty() && !deadline_before(now_us, _schedule_queue.top_deadline())) {
+        const ScheduledCommand command = _schedule_queue.top();
+        const unsigned int slot = command.slot;
+        _schedule_queue.pop();
+
+        /* The slot is only freed once the command is done with its bytes, it runs as part of the frame it came in */
+        const std::uint32_t frame_received_us = _frame_received_us;
+        _frame_received_us = command.received_us;
+        if (execute(_scheduled[slot], _scheduled_length[slot]) != _scheduled_length[slot]) {
+            ++_bad_commands;
+            ERR_LOG_LINE("!!! Unknown command or bad command length in schedule, dropping it");
+        }
+        _frame_received_us = frame_received_us;
+        _scheduled_free |= 1UL << slot;
+    }
+}
+
+void PinCtrl::service_gpio_pulse() {
+    /* Do nothing if no pulsing is ongoing */
+    if (_pulse_queue.empty()) {
+        return;
+    }
+
+    /* Collect every edge that is due, later edges on a pin override earlier ones */
+    const std::uint32_t now_us = micros();
+    gpio_ports::PortMasks rising = {};
+    gpio_ports::PortMasks falling = {};
+    gpio_ports::PortMasks cut = {};
+    bool cutting = false;
+
+    while (!_pulse_queue.empty() && !deadline_before(now_us, _pulse_queue.top_deadline())) {
+        const PulseEdge edge = _pulse_queue.top();
+        const std::uint32_t deadline_us = _pulse_queue.top_deadline();
+        _pulse_queue.pop();
+
+        const unsigned int port = edge.pin / gpio_ports::PINS_PER_PORT;
+        const std::uint32_t bit = 1UL << (edge.pin % gpio_ports::PINS_PER_PORT);
+
+        /* Entries replaced by an earlier deadline are stale, a pin turned on again since waits for its new one */
+        if (edge.auto_off) {
+            if (!(_auto_off_queued.bits[port] & bit) || deadline_us != _auto_off_queued_us[edge.pin]) {
+                continue;
+            }
+            if (deadline_before(deadline_us, _auto_off_us[edge.pin])) {
+                _auto_off_queued_us[edge.pin] = _auto_off_us[edge.pin];
+                _pulse_queue.push(_auto_off_us[edge.pin], edge);
+                continue;
+            }
+            _auto_off_queued.bits[port] &= ~bit;
+            cut.bits[port] |= bit;
+            cutting = true;
+            continue;
+        }
+
+        if (!edge.hw_timed && now_us - deadline_us > _counters.max_pulse_late_us) {
+            _counters.max_pulse_late_us = now_us - deadline_us;
+        }
+
+        /* The pulse timer doesn't run off micros(), its pin is only free once its channel lets it go */
+        if (edge.hw_timed && _pulse_timer.owns(edge.pin)) {
+            if (deadline_us == _pulse_busy_until_us[edge.pin]) {
+                _pulse_busy_until_us[edge.pin] = now_us + HW_PULSE_POLL_US;
+                _pulse_queue.push(_pulse_busy_until_us[edge.pin], edge);
+            }
+            continue; // a pulse queued behind it takes the pin over at its rising edge
+        }
+
+        if (edge.rising) {
+            rising.bits[port] |= bit;
+            falling.bits[port] &= ~bit;
+        } else {
+            falling.bits[port] |= bit;
+            rising.bits[port] &= ~bit;
+
+            /* The pin is free once its last queued pulse ends */
+            if (deadline_us == _pulse_busy_until_us[edge.pin]) {
+                _pulsing.bits[port] &= ~bit;
+            }
+        }
+    }
+
+    /* Apply all edges of this pass together, pins that stayed on too long go off and don't rise again */
+    if (cutting) {
+        DBG_LOG_LINE("Switching pins off, on for too long");
+        for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+            rising.bits[port] &= ~cut.bits[port];
+        }
+        _auto_offs += switch_off(cut);
+    }
+    gpio_ports::clear(falling);
+    gpio_ports::set(rising);
+
+    /* Pulses queued behind a hardware pulse that hasn't quite ended yet take the pin over from it */
+    if (_pulse_timer.active()) {
+        for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+            for (unsigned int n : bit_ops::set_bits(rising.bits[port])) {
+                const unsigned int hw_pin = port * gpio_ports::PINS_PER_PORT + n;
+                if (_pulse_timer.owns(hw_pin)) {
+                    _pulse_timer.release_pin(hw_pin);
+                }
+            }
+        }
+    }
+
+    /* Pulses queued before their pin got its limit are cut by an auto-off from their rising edge */
+    limit_on_time(rising);
+
+    if (_pulse_queue.empty()) {
+        DBG_LOG_LINE("Done with pulsing");
+    }
+}
+
+void PinCtrl::service_inputs() {
+    if (!_inputs.pins() && !_input_event_count) {
+        return;
+    }
+
+    /* Anything that doesn't fit waits in the monitor's ring, which counts what it loses */
+    const std::uint32_t now_us = micros();
+    InputMonitor::Event change;
+    while (_input_event_count < MAX_INPUT_EVENTS && _inputs.poll(now_us, change)) {
+        InputEvent event{change.time_us,
+                         static_cast<std::uint8_t>((_input_port & GPIO_PORT_HW) ? change.pin % gpio_ports::PINS_PER_PORT
+                                                                                 : _hw_to_arduino[change.pin]),
+                         static_cast<std::uint8_t>(change.level)};
+        wire_format::to_network(event);
+        memcpy(_input_events + sizeof(InputEvents) + _input_event_count * sizeof(InputEvent), &event, sizeof(event));
+        ++_input_event_count;
+    }
+
+    /* Coalesce everything since the last notification into the next one */
+    const std::uint32_t now_ms = millis();
+    if (!_input_event_count || now_ms - _input_sent_ms < _input_interval_ms) {
+        return;
+    }
+
+    const std::uint32_t lost = _inputs.take_overflows();
+    auto &header = *reinterpret_cast<InputEvents *>(_input_events);
+    header = InputEvents{Command::INPUT_EVENTS, static_cast<std::uint16_t>(lost > 0xFFFF ? 0xFFFF : lost),
+                         static_cast<std::uint8_t>(_input_event_count)};
+    wire_format::to_network(header);
+
+    send_reply(_input_events, sizeof(InputEvents) + _input_event_count * sizeof(InputEvent));
+    _input_event_count = 0;
+    _input_sent_ms = now_ms;
+}
+
+void PinCtrl::handle_adc_stream(const AdcStream &params) {
+    DBG_LOG("ADC_STREAM: ");
+    DBG_LOG(static_cast<int>(params.inputs), HEX);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.rate_hz);
+
+    _adc.stop();
+
+    AdcStreamReply reply{Command::ADC_STREAM, 0, 0, 0};
+    const unsigned int input_count = __builtin_popcount(params.inputs);
+    if (input_count && params.rate_hz) {
+        std::uint32_t period_ticks = ADC_TIMER_HZ / params.rate_hz;
+        if (period_ticks < input_count * AdcSampler::MIN_TICKS_PER_INPUT) {
+            period_ticks = input_count * AdcSampler::MIN_TICKS_PER_INPUT;
+        }
+
+        /* As many scans as fit a single packet (ATT header and framing taken off), but no more than the latency
+         * allows, and at least one even if it has to be split over packets */
+        const std::size_t mtu = read_conn_params().mtu;
+        const std::size_t payload = mtu > 3 + FRAME_OVERHEAD + sizeof(AdcSamples)
+                                  && mtu - 3 - FRAME_OVERHEAD < MAX_FRAME_PAYLOAD
+                                  ? mtu - 3 - FRAME_OVERHEAD : MAX_FRAME_PAYLOAD;
+        std::size_t scans = (payload - sizeof(AdcSamples)) * 2 / 3 / input_count;
+        if (scans > AdcSampler::BUFFER_CAPACITY / input_count) {
+            scans = AdcSampler::BUFFER_CAPACITY / input_count;
+        }
+        const std::uint32_t latency_scans = ADC_TIMER_HZ / 1000 * ADC_STREAM_MAX_LATENCY_MS / period_ticks;
+        if (scans > latency_scans) {
+            scans = latency_scans;
+        }
+        if (!scans) {
+            scans = 1;
+        }
+
+        if (_adc.start(params.inputs, period_ticks, scans)) {
+            reply.inputs = _adc.inputs();
+            reply.period_ticks = _adc.period_ticks();
+            reply.scans_per_notification = static_cast<std::uint8_t>(_adc.scans_per_buffer());
+        } else {
+            ERR_LOG_LINE("!!! Couldn't start the ADC stream");
+        }
+    }
+
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+void PinCtrl::service_adc() {
+    if (!_adc.running()) {
+        return;
+    }
+
+    /* Nobody to send samples to, stop sampling rather than fail every notification */
+    if (!_uart->notifyEnabled()) {
+        _adc.stop();
+        ERR_LOG_LINE("!!! Central stopped listening, ADC stream stopped");
+        return;
+    }
+
+    std::uint32_t number;
+    const std::int16_t *samples;
+    if (!_adc.take(number, samples)) {
+        return;
+    }
+
+    std::uint8_t payload[MAX_FRAME_PAYLOAD];
+    const std::size_t scans = _adc.scans_per_buffer();
+    AdcSamples header{Command::ADC_SAMPLES, static_cast<std::uint32_t>(number * scans),
+                      static_cast<std::uint8_t>(scans)};
+    wire_format::to_network(header);
+    memcpy(payload, &header, sizeof(header));
+    const std::size_t length = sizeof(AdcSamples)
+                             + pack_adc_samples(samples, scans * _adc.input_count(), payload + sizeof(AdcSamples));
+
+    /* Written over while it was packed, its scans are lost like any other dropped buffer */
+    if (!_adc.intact(number)) {
+        return;
+    }
+    send_reply(payload, length);
+}
+
+std::size_t PinCtrl::pack_adc_samples(const std::int16_t *samples, std::size_t count, std::uint8_t *out) {
+    /* Noise around 0 V reads slightly negative in single-ended mode */
+    const auto clamp = [](std::int16_t sample) -> std::uint16_t {
+        return sample < 0 ? 0 : sample > AdcSampler::MAX_SAMPLE ? AdcSampler::MAX_SAMPLE : sample;
+    };
+
+    std::uint8_t *const start = out;
+    for (std::size_t i = 0; i < count; i += 2) {
+        const std::uint16_t first = clamp(samples[i]);
+        *out++ = first >> 4;
+        if (i + 1 == count) {
+            *out++ = (first & 0x0F) << 4;
+            break;
+        }
+        const std::uint16_t second = clamp(samples[i + 1]);
+        *out++ = ((first & 0x0F) << 4) | (second >> 8);
+        *out++ = second & 0xFF;
+    }
+    return out - start;
+}
+
+void PinCtrl::handle_safety(const Safety &params) {
+    DBG_LOG("SAFETY: ");
+    DBG_LOG(params.gpio_bitset, HEX);
+    DBG_LOG(" ");
+    DBG_LOG(params.max_on_us);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<int>(params.link_loss));
+
+    const gpio_ports::PortMasks pins = resolve_pins(params.gpio_port, params.gpio_bitset);
+    const std::uint32_t max_on_us = params.max_on_us < MAX_SAFETY_ON_US ? params.max_on_us : MAX_SAFETY_ON_US;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        for (unsigned int n : bit_ops::set_bits(pins.bits[port])) {
+            _max_on_us[port * gpio_ports::PINS_PER_PORT + n] = max_on_us;
+        }
+        if (max_on_us) {
+            _limited.bits[port] |= pins.bits[port];
+        } else {
+            _limited.bits[port] &= ~pins.bits[port];
+            _auto_off_queued.bits[port] &= ~pins.bits[port]; // their queue entries go stale
+        }
+    }
+
+    /* Pins already on count from now (ones that are off just get switched off again), and hardware-timed pulses
+     * are cut in the pulse timer, where switching the pin off can't reach them. Queued software pulses are cut from
+     * their rising edge. */
+    limit_on_time(pins);
+    if (max_on_us) {
+        for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+            for (unsigned int n : bit_ops::set_bits(pins.bits[port] & _pulsing.bits[port])) {
+                _pulse_timer.limit(port * gpio_ports::PINS_PER_PORT + n, max_on_us);
+            }
+        }
+    }
+
+    if (params.link_loss == LinkLoss::LINK_LOSS_OFF || params.link_loss == LinkLoss::LINK_LOSS_HOLD) {
+        _failsafe = params.link_loss == LinkLoss::LINK_LOSS_OFF;
+    }
+
+    SafetyReply reply{Command::SAFETY, {0, 0}, _failsafe ? LinkLoss::LINK_LOSS_OFF : LinkLoss::LINK_LOSS_HOLD,
+                      _failsafes, _auto_offs};
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS && port < QUERY_STATE_PORTS; ++port) {
+        reply.limited[port] = _limited.bits[port];
+    }
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+void PinCtrl::handle_flow_control(const FlowControl &params) {
+    DBG_LOG("FLOW_CONTROL: ");
+    DBG_LOG(static_cast<int>(params.enable));
+    DBG_LOG(" ");
+    DBG_LOG_LINE(params.interval_ms);
+
+    _credits_enabled = params.enable;
+    _credits_interval_ms = params.interval_ms;
+
+    /* The first report lines the central's byte count up with ours: everything up to this frame is consumed */
+    service_credits(true);
+}
+
+void PinCtrl::service_credits(bool force) {
+    if (!_credits_enabled) {
+        return;
+    }
+
+    /* A forced report counts only up to the frame being run, frames taken in after it haven't been seen yet */
+    const std::uint32_t consumed = force ? _frame_consumed : _rx_bytes_before_reset + _parser.bytes_received();
+    const std::uint32_t now_ms = millis();
+    if (!force && (consumed == _credits_reported
+                   || (now_ms - _credits_sent_ms < _credits_interval_ms
+                       && consumed - _credits_reported < UART_RX_FIFO_DEPTH / 2))) {
+        return;
+    }
+
+    Credits report{Command::CREDITS, consumed, UART_RX_FIFO_DEPTH};
+    wire_format::to_network(report);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&report), sizeof(report));
+    _credits_sent_ms = now_ms;
+    _credits_reported = consumed;
+}
+
+void PinCtrl::handle_protocol_version(const ProtocolVersion &params) {
+    DBG_LOG("PROTOCOL_VERSION: ");
+    DBG_LOG_LINE(static_cast<int>(params.version));
+
+    /* Speak the highest version both sides know, a central asking for 0 gets version 1 */
+    _protocol_version = params.version < PROTOCOL_VERSION_1 ? PROTOCOL_VERSION_1
+                      : params.version > PROTOCOL_VERSION_MAX ? PROTOCOL_VERSION_MAX : params.version;
+
+    ProtocolVersionReply reply{Command::PROTOCOL_VERSION, _protocol_version, PROTOCOL_VERSION_MAX};
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+std::size_t PinCtrl::handle_compact(std::uint8_t *data, std::size_t length) {
+    const Command command = static_cast<Command>(data[0]);
+
+    compact_format::PinSet pins;
+    std::size_t used = 1;
+    const std::size_t pins_length = compact_format::decode_pins(data + used, length - used, pins);
+    if (!pins_length) {
+        return 0; // missing bytes or bad pins
+    }
+    used += pins_length;
+
+    /* Compact commands share the packed structs' pin addressing (see GPIO_PORT_HW and GPIO_PORT_HW_ALL) */
+    const std::uint32_t gpio_port = pins.port == compact_format::PORT_ARDUINO ? 0
+                                  : pins.port == compact_format::PORT_HW_ALL ? GPIO_PORT_HW_ALL
+                                  : GPIO_PORT_HW | (pins.port - compact_format::PORT_HW_P0);
+
+    /* Read the fields that follow the pin set, 32-bit fields being varints */
+    std::uint8_t value = 0;
+    std::uint32_t varints[2] = {0, 0};
+    const bool has_value = command != Command::COMPACT_GPIO_PULSE;
+    const std::size_t varint_count = command == Command::COMPACT_GPIO_PULSE ? 1
+                                   : command == Command::COMPACT_GPIO_PULSE_SCHEDULE ? 2 : 0;
+    if (has_value) {
+        if (used >= length) {
+            return 0; // missing bytes
+        }
+        value = data[used++];
+    }
+    for (std::size_t i = 0; i < varint_count; ++i) {
+        const std::size_t varint_length = compact_format::decode_varint(data + used, length - used, varints[i]);
+        if (!varint_length) {
+            return 0; // missing bytes or overlong varint
+        }
+        used += varint_length;
+    }
+
+    /* The whole command is still consumed when it's refused, so the rest of a batch runs */
+    if (_protocol_version < PROTOCOL_VERSION_2) {
+        ERR_LOG_LINE("!!! Compact command before protocol version 2 was picked, ignoring it");
+        return used;
+    }
+
+    DBG_LOG("COMPACT: ");
+    DBG_LOG(static_cast<int>(command));
+    DBG_LOG(" ");
+    DBG_LOG(static_cast<std::uint32_t>(pins.bitset >> 32), HEX);
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<std::uint32_t>(pins.bitset), HEX);
+
+    /* Do what the packed command's handler does, on a pin set that may span both ports */
+    switch (command) {
+        case Command::COMPACT_GPIO_CONFIGURE: {
+            configure_pins(resolve_pins(gpio_port, pins.bitset), static_cast<GpioDirection>(value));
+        } break;
+
+        case Command::COMPACT_GPIO_WRITE: {
+            write_pins(resolve_pins(gpio_port, pins.bitset), static_cast<GpioOutput>(value));
+        } break;
+
+        case Command::COMPACT_GPIO_PULSE: {
+            schedule_pulses(gpio_port, pins.bitset, PulseMode::SEQUENTIAL, pulse_ms_to_us(varints[0]), 0);
+        } break;
+
+        case Command::COMPACT_GPIO_PULSE_SCHEDULE: {
+            schedule_pulses(gpio_port, pins.bitset, static_cast<PulseMode>(value), varints[0], varints[1]);
+        } break;
+
+        case Command::COMPACT_PWM_SET: {
+            set_pwm(resolve_arduino_pins(gpio_port, pins.bitset), value);
+        } break;
+
+        default: {
+            return 0;
+        }
+    }
+
+    return used;
+}
+
+std::size_t PinCtrl::handle_state_sync(std::uint8_t *data, std::size_t length) {
+    const auto &params = decode<StateSync>(data);
+
+    DBG_LOG("STATE_SYNC: ");
+    DBG_LOG(params.sequence);
+    DBG_LOG(" ");
+    DBG_LOG(params.base);
+    DBG_LOG(" ");
+    DBG_LOG(static_cast<int>(params.flags));
+    DBG_LOG(" ");
+    DBG_LOG_LINE(static_cast<int>(params.count));
+
+    const std::size_t command_end = sizeof(StateSync) + params.count * sizeof(PinLevel);
+    if (command_end > length) {
+        return 0; // missing bytes
+    }
+
+    StateSyncReply reply{Command::STATE_SYNC, params.sequence, _sync_state, StateSyncStatus::APPLIED};
+
+    /* A delta only applies on top of its base, or of a later state reached by deltas from base (they list every pin
+     * changed since it), so base must lie between the last full snapshot and now. The command is still consumed
+     * when it's refused, so the rest of a batch runs. */
+    const bool full = params.flags & STATE_SYNC_FULL;
+    if (!full && (!_synced || state_before(params.base, _sync_full_state) || state_before(_sync_state, params.base)
+                  || !state_before(_sync_state, params.sequence))) {
+        ERR_LOG_LINE("!!! State sync delta against a state this device isn't in, asking for a full snapshot");
+        reply.status = StateSyncStatus::NEED_FULL;
+        wire_format::to_network(reply);
+        send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+        return command_end;
+    }
+
+    /* A full snapshot replaces the synced pins */
+    if (full) {
+        _sync_pins = gpio_ports::PortMasks{};
+    }
+
+    /* Sort the levels into port masks so digital pins change together, PWM is per-pin anyway */
+    gpio_ports::PortMasks high{};
+    gpio_ports::PortMasks low{};
+    gpio_ports::PortMasks digital{};
+    for (std::size_t i = 0; i < params.count; ++i) {
+        const auto &entry = decode<PinLevel>(data + sizeof(StateSync) + i * sizeof(PinLevel));
+        if (entry.pin >= NUM_HW_PINS) {
+            continue;
+        }
+        const unsigned int port = entry.pin / gpio_ports::PINS_PER_PORT;
+        const std::uint32_t bit = 1UL << (entry.pin % gpio_ports::PINS_PER_PORT);
+
+        /* Deltas list pins sent since their base again, the shadow skips the ones already there. Snapshots are
+         * for recovery, so they set every pin. */
+        const bool was_synced = _sync_pins.bits[port] & bit;
+        _sync_pins.bits[port] |= bit;
+        if (!full && was_synced && _sync_levels[entry.pin] == entry.level) {
+            continue;
+        }
+        _sync_levels[entry.pin] = entry.level;
+
+        /* PWM goes through analogWrite(), so it needs an Arduino pin set_pwm() can take */
+        if (entry.level == 0 || entry.level == 255) {
+            stop_pwm(entry.pin);
+            (entry.level ? high : low).bits[port] |= bit;
+            digital.bits[port] |= bit;
+        } else if (_hw_to_arduino[entry.pin] >= 0 && _hw_to_arduino[entry.pin] < 32) {
+            set_pwm(1UL << _hw_to_arduino[entry.pin], entry.level);
+        }
+    }
+
+    /* Latch the levels before enabling the drivers, so pins that weren't outputs yet don't glitch */
+    gpio_ports::set(high);
+    gpio_ports::clear(low);
+    gpio_ports::make_output(digital);
+    limit_on_time(high);
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        _configured_outputs.bits[port] |= digital.bits[port];
+        _configured_inputs.bits[port] &= ~digital.bits[port];
+    }
+
+    _synced = true;
+    _sync_state = params.sequence;
+    if (full) {
+        _sync_full_state = params.sequence;
+    }
+
+    reply.state = _sync_state;
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+    return command_end;
+}
+
+void PinCtrl::service_conn_params() {
+    if (!_conn_params_pending) {
+        return;
+    }
+
+    /* Wait until everything requested is in effect, or the central had its chance to refuse */
+    ConnParamsReply reply = read_conn_params();
+    const ConnParams &wanted = _conn_params_wanted;
+    const bool done = (!wanted.interval || reply.interval == wanted.interval)
+                   && (!wanted.supervision_timeout || reply.supervision_timeout == wanted.supervision_timeout)
+                   && (!(wanted.interval || wanted.slave_latency) || reply.slave_latency == wanted.slave_latency)
+                   && (wanted.phy == ConnPhy::PHY_KEEP || reply.phy == wanted.phy)
+                   && (!wanted.data_length || reply.data_length == wanted.data_length);
+
+    if (!done && reply.interval && millis() - _conn_params_requested_ms < CONN_PARAMS_TIMEOUT_MS) {
+        return;
+    }
+
+    _conn_params_pending = false;
+    wire_format::to_network(reply);
+    send_reply(reinterpret_cast<const std::uint8_t *>(&reply), sizeof(reply));
+}
+
+ConnParamsReply PinCtrl::read_conn_params() {
+    ConnParamsReply params = {};
+    params.command = Command::CONN_PARAMS;
+
+    BLEConnection *const connection = Bluefruit.Connection(Bluefruit.connHandle());
+    if (connection && connection->connected()) {
+        params.interval = connection->getConnectionInterval();
+        params.slave_latency = connection->getSlaveLatency();
+        params.supervision_timeout = connection->getSupervisionTimeout();
+        params.phy = connection->getPHY() == BLE_GAP_PHY_2MBPS ? ConnPhy::PHY_2M : ConnPhy::PHY_1M;
+        params.data_length = connection->getDataLength();
+        params.mtu = connection->getMtu();
+    }
+    return params;
+}
+
+bool PinCtrl::state_before(std::uint16_t a, std::uint16_t b) {
+    return static_cast<std::int16_t>(b - a) > 0;
+}
+
+std::uint32_t PinCtrl::pulse_ms_to_us(std::uint32_t duration_ms) {
+    return duration_ms > MAX_PULSE_HORIZON_US / 1000UL ? MAX_PULSE_HORIZON_US + 1 : duration_ms * 1000UL;
+}
+
+void PinCtrl::schedule_pulses(std::uint32_t gpio_port, std::uint64_t gpio_bitset, PulseMode mode,
+                              std::uint32_t duration_us, std::uint32_t start_offset_us) {
+    if (!gpio_bitset || !duration_us) { // nothing to do
+        return;
+    }
+
+    /* Every pulse of one command is relative to the same time, so simultaneous pulses share their edges */
+    const std::uint32_t now_us = micros();
+    const std::uint32_t now_tick = _pulse_timer.enabled() ? _pulse_timer.now() : 0;
+    std::uint32_t start_us = now_us + start_offset_us;
+
+    /* Highest bit first, matching the order of the original sequential pulses */
+    for (std::uint64_t remaining = gpio_bitset; remaining;) {
+        const int hw_pin = wire_to_hw_pin(gpio_port, bit_ops::pop_highest(remaining));
+        if (hw_pin < 0) {
+            continue;
+        }
+
+        std::uint32_t pin_start_us = start_us;
+        if (!schedule_pulse(hw_pin, now_us, now_tick, pin_start_us, duration_us)) {
+            ERR_LOG_LINE("!!! Pulse queue full or pulse too far out, dropping pulse");
+            continue;
+        }
+
+        DBG_LOG("Pulsing pin ");
+        DBG_LOG(hw_pin);
+        DBG_LOG(" in ");
+        DBG_LOG(pin_start_us - now_us);
+        DBG_LOG(" for ");
+        DBG_LOG_LINE(duration_us);
+
+        if (mode == PulseMode::SEQUENTIAL) {
+            start_us = pin_start_us + duration_us;
+        }
+    }
+
+    /* Start anything that is already due */
+    service_gpio_pulse();
+}
+
+bool PinCtrl::schedule_pulse(unsigned int hw_pin, std::uint32_t now_us, std::uint32_t now_tick,
+                             std::uint32_t &start_us, std::uint32_t duration_us) {
+    const unsigned int port = hw_pin / gpio_ports::PINS_PER_PORT;
+    const std::uint32_t bit = 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
+    const bool busy = _pulsing.bits[port] & bit;
+
+    /* Queue behind any pulse already active or pending on this pin */
+    if (busy && deadline_before(start_us, _pulse_busy_until_us[hw_pin])) {
+        start_us = _pulse_busy_until_us[hw_pin];
+    }
+
+    /* Idle pins can be timed in hardware, the hardware needs a little lead time to arm */
+    const bool hw_timed = _pulse_timer.enabled() && !busy && !_pulse_timer.full();
+    if (hw_timed && start_us - now_us < PulseTimer::START_LEAD_US) {
+        start_us = now_us + PulseTimer::START_LEAD_US;
+    }
+
+    /* Limited pins are cut to their limit, the queued auto-off waits for the pulse to end (it'll be low then) */
+    const bool limited = _limited.bits[port] & bit;
+    if (limited && duration_us > _max_on_us[hw_pin]) {
+        duration_us = _max_on_us[hw_pin];
+    }
+
+    const std::uint32_t end_us = start_us + duration_us;
+    if (_pulse_queue.space() < 2 + AUTO_OFF_RESERVE || end_us - now_us > MAX_PULSE_HORIZON_US) {
+        return false;
+    }
+    if (limited && (_auto_off_queued.bits[port] & bit) && deadline_before(_auto_off_us[hw_pin], end_us)) {
+        _auto_off_us[hw_pin] = end_us;
+    }
+
+    /* The hardware drives both edges, only the falling edge is queued to track when the pin is free again */
+    /* (with the output latch already low, driving it low again at the end changes nothing) */
+    const bool started = hw_timed && _pulse_timer.start(hw_pin, now_tick + (start_us - now_us), duration_us);
+    if (!started) {
+        _pulse_queue.push(start_us, PulseEdge{static_cast<std::uint8_t>(hw_pin), true, false, false});
+    }
+    _pulse_queue.push(end_us, PulseEdge{static_cast<std::uint8_t>(hw_pin), false, started, false});
+    _pulsing.bits[port] |= bit;
+    _pulse_busy_until_us[hw_pin] = end_us;
+    return true;
+}
+
+/** Helper to convert wire pin addressing into hardware port masks */
+gpio_ports::PortMasks PinCtrl::resolve_pins(std::uint32_t gpio_port, std::uint64_t gpio_bitset) {
+    gpio_ports::PortMasks masks = {};
+
+    if (gpio_port == GPIO_PORT_HW_ALL) {
+        /* Bitset holds every port, P0 in the low word */
+        for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+            masks.bits[port] = static_cast<std::uint32_t>(gpio_bitset >> (port * gpio_ports::PINS_PER_PORT));
+        }
+        return masks;
+    }
+
+    if (gpio_port & GPIO_PORT_HW) {
+        /* Bitset is already in hardware pin order */
+        const std::uint32_t port = gpio_port & ~GPIO_PORT_HW;
+        if (port < gpio_ports::NUM_PORTS) {
+            masks.bits[port] = static_cast<std::uint32_t>(gpio_bitset);
+        }
+        return masks;
+    }
+
+    /* Bitset holds Arduino pins, map each one onto its port */
+    for (unsigned int pin : bit_ops::set_bits(static_cast<std::uint32_t>(gpio_bitset))) {
+        if (pin >= PINS_COUNT) {
+            break;
+        }
+        const std::uint32_t hw_pin = gpio_ports::arduino_to_hw_pin(pin);
+        masks.bits[hw_pin / gpio_ports::PINS_PER_PORT] |= 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
+    }
+    return masks;
+}
+
+/** Helper to convert a single bit of wire pin addressing into a hardware pin */
+int PinCtrl::wire_to_hw_pin(std::uint32_t gpio_port, unsigned int n) {
+    if (gpio_port == GPIO_PORT_HW_ALL) {
+        return n < NUM_HW_PINS ? static_cast<int>(n) : -1;
+    }
+
+    if (n >= gpio_ports::PINS_PER_PORT) {
+        return -1;
+    }
+
+    if (gpio_port & GPIO_PORT_HW) {
+        const std::uint32_t port = gpio_port & ~GPIO_PORT_HW;
+        return port < gpio_ports::NUM_PORTS ? static_cast<int>(port * gpio_ports::PINS_PER_PORT + n) : -1;
+    }
+
+    return n < PINS_COUNT ? static_cast<int>(gpio_ports::arduino_to_hw_pin(n)) : -1;
+}
+
+/** Helper to convert wire pin addressing into Arduino pins */
+std::uint32_t PinCtrl::resolve_arduino_pins(std::uint32_t gpio_port, std::uint64_t gpio_bitset) const {
+    if (!(gpio_port & GPIO_PORT_HW)) {
+        return static_cast<std::uint32_t>(gpio_bitset);
+    }
+
+    /* Map the hardware pins of each port the bitset covers */
+    const gpio_ports::PortMasks masks = resolve_pins(gpio_port, gpio_bitset);
+    std::uint32_t arduino_pins = 0;
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        for (unsigned int pin : bit_ops::set_bits(masks.bits[port])) {
+            const int arduino_pin = _hw_to_arduino[port * gpio_ports::PINS_PER_PORT + pin];
+            if (arduino_pin >= 0 && arduino_pin < 32) {
+                arduino_pins |= 1UL << arduino_pin;
+            }
+        }
+    }
+    return arduino_pins;
+}
+
+/** Helper to decode command data in place */
+template <typename T> 
+const T &PinCtrl::decode(std::uint8_t *data) {
+    /* Packed structs have no alignment requirement, so fix endianness of all multi-byte fields right where
+     * the frame parser stored them instead of copying them out */
+    T &frame = *reinterpret_cast<T *>(data);
+    wire_format::to_host(frame);
+
+    return frame;
 }
@@ -2,21 +2,57 @@
  * A simple pin control class that utilizes BLE UART to control pins on this device.
  * Functionality:
  *      - Control GPIO (set, clear, toggle, pulse)
+ *      - Schedule many overlapping pulses, each with its own duration and start offset
+ *      - Optionally time pulse edges in hardware (TIMER/PPI/GPIOTE) for microsecond accuracy
  *      - Control PWM (0-255)
- *      - Get status
+ *      - Batch many commands into a single BLE write
+ *      - Frame messages with a sync byte, length and CRC, dropping bad ones and resynchronizing
+ *      - Get GPIO status and device state in a single notification
+ *      - Report debounced input changes as batched notifications, at a limited rate
+ *      - Negotiate connection interval, latency, PHY and data length at runtime
+ *      - Echo timestamped replies for latency and throughput benchmarks
+ *      - Keep always-on performance counters, readable over BLE
+ *      - Record every command in a binary log ring, read over BLE or printed while idle
+ *      - Store keyframe patterns and play them back with local timing
+ *      - Save pin configuration and patterns to flash, and restore them at boot
+ *      - Set per-pin PWM duties, frequency and resolution on a PWM peripheral in one command
+ *      - Ramp PWM duties linearly or exponentially, played by the PWM peripheral
+ *      - Queue commands to run at a device timestamp, for actuation free of BLE delivery jitter
+ *      - Report RX FIFO credits so a central can stream write-without-response frames without overrunning it
+ *      - Negotiate a protocol version, version 2 adds compact commands with varint fields and pin lists
+ *      - Optionally run in a FreeRTOS task of its own that sleeps until data, an input change or the next deadline
+ *      - Take frames in from the BLE UART RX callback into a ring, so RX bursts never wait on commands (the RX
+ *        callback and service() push under a mutex, service() pops without taking it)
+ *      - Sync pin levels against a shadow state, sending only the pins changed since the last acknowledged state
+ *      - Stream timer-paced ADC samples of up to 8 inputs, 12-bit packed into notifications sized to the MTU
+ *      - Switch pins off once they stay on longer than their limit, and drive every output off when the link drops
  */
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include <bluefruit.h>
 
+#include "adc_sampler.h"
+#include "bit_ops.h"
+#include "deadline_heap.h"
+#include "compact_format.h"
+#include "debug_log.h"
+#include "framing.h"
+#include "gpio_ports.h"
+#include "input_monitor.h"
+#include "pulse_timer.h"
+#include "pwm_group.h"
+#include "spsc_ring.h"
+#include "wire_format.h"
+
 namespace ble_uart_pin_ctrl {
 
 /**
- * Messages shall be 1 command byte followed by data byte(s). 
- * Data bytes will be organized based on structs below.
+ * Messages shall be sent in frames (see framing.h), each frame's payload being 1 command byte followed by data
+ * byte(s). Data bytes will be organized based on structs below.
  */
 
 /** Types of commands */
@@ -25,17 +61,80 @@ enum class Command : std::uint8_t {
     GPIO_CONFIGURE = 0x01,  /*!< Central -> this: configure GPIO pin(s) */
     GPIO_WRITE = 0x02,      /*!< Central -> this: digital write on output GPIO pin(s) */
     GPIO_PULSE = 0x03,      /*!< Central -> this: pulse GPIO pin(s) for so many ms */
-    // TODO CMK (11/14/20): implement or delete
-    GPIO_QUERY = 0x04,      /*!< this -> Central: get GPIO status info */
+    GPIO_QUERY = 0x04,      /*!< Central -> this -> Central: get GPIO status info */
     
     /** PWM commands */
     PWM_SET = 0x05,         /*!< Central -> this: set PWM output on pin(s) */
 
     /** Query commands */
-    // TODO CMK (11/14/20): implement or delete
-    QUERY_STATE = 0x06,     /*!< this -> Central: get info about device state */
+    QUERY_STATE = 0x06,     /*!< Central -> this -> Central: get info about device state */
+
+    /** Framing commands */
+    BATCH = 0x07,           /*!< Central -> this: length-prefixed container of sub-commands */
+
+    /** GPIO commands (continued) */
+    GPIO_PULSE_SCHEDULE = 0x08, /*!< Central -> this: queue pulses on GPIO pin(s) with a start offset, in us */
+
+    /** Input commands */
+    INPUT_SUBSCRIBE = 0x09, /*!< Central -> this -> Central: report level changes of input GPIO pin(s) */
+    INPUT_EVENTS = 0x0A,    /*!< this -> Central: debounced level changes of subscribed pins */
+
+    /** Connection commands */
+    CONN_PARAMS = 0x0B,     /*!< Central -> this -> Central: request connection parameters, get the negotiated ones */
+
+    /** Diagnostic commands */
+    ECHO = 0x0C,            /*!< Central -> this -> Central: timestamped echo, for benchmarks */
+    STATS = 0x0D,           /*!< Central -> this -> Central: get (and optionally reset) performance counters */
+    LOG_READ = 0x0E,        /*!< Central -> this -> Central: take the oldest records from the binary log */
+
+    /** Pattern commands */
+    PATTERN_UPLOAD = 0x0F,  /*!< Central -> this: store keyframes of a pattern */
+    PATTERN_PLAY = 0x10,    /*!< Central -> this: play a stored pattern */
+    PATTERN_STOP = 0x11,    /*!< Central -> this: stop playing pattern(s) */
+
+    /** Settings commands */
+    COMMIT = 0x12,          /*!< Central -> this -> Central: save pin configuration and patterns to flash */
+
+    PWM_SET_MULTI = 0x13,   /*!< Central -> this: set a PWM duty per pin, all changing in the same PWM period */
+    PWM_RAMP = 0x14,        /*!< Central -> this: ramp the duty of PWM group pins */
+
+    SCHEDULE = 0x15,        /*!< Central -> this: run a command at a device time */
+
+    /** Flow control commands */
+    FLOW_CONTROL = 0x16,    /*!< Central -> this: start/stop credit reports */
+    CREDITS = 0x17,         /*!< this -> Central: bytes taken from the RX FIFO so far (not a command) */
+
+    /** Protocol commands */
+    PROTOCOL_VERSION = 0x18, /*!< Central -> this -> Central: pick the protocol version to speak */
+
+    /** Compact (protocol version 2) commands, see COMPACT_COMMANDS */
+    COMPACT_GPIO_CONFIGURE = 0x19,      /*!< Central -> this: GPIO_CONFIGURE */
+    COMPACT_GPIO_WRITE = 0x1A,          /*!< Central -> this: GPIO_WRITE */
+    COMPACT_GPIO_PULSE = 0x1B,          /*!< Central -> this: GPIO_PULSE */
+    COMPACT_GPIO_PULSE_SCHEDULE = 0x1C, /*!< Central -> this: GPIO_PULSE_SCHEDULE */
+    COMPACT_PWM_SET = 0x1D,             /*!< Central -> this: PWM_SET */
+
+    /** State sync commands */
+    STATE_SYNC = 0x1E,      /*!< Central -> this -> Central: set pin levels changed since an acknowledged state */
+
+    /** Sensor commands */
+    ADC_STREAM = 0x1F,      /*!< Central -> this -> Central: start/stop streaming ADC samples */
+    ADC_SAMPLES = 0x20,     /*!< this -> Central: packed samples of the ADC stream (not a command) */
+
+    /** Safety commands */
+    SAFETY = 0x21,          /*!< Central -> this -> Central: limit pin on-times, pick what a link loss does */
 };
 
+/** gpio_port flag selecting nRF52 hardware port addressing */
+/* Note: without this flag the port is ignored and bit n of gpio_bitset is Arduino pin n. With it, the remaining
+ * bits of gpio_port select the hardware port (0 = P0, 1 = P1) and bit n of gpio_bitset is pin n of that port. */
+constexpr std::uint32_t GPIO_PORT_HW = 0x80000000UL;
+
+/** gpio_port value addressing every hardware port at once */
+/* Note: bit n is hardware pin n, P1.n being pin 32 + n, so ports are applied together through their registers.
+ * Only compact pin sets (see compact_format.h) are wide enough for P1, packed commands with it reach P0 alone. */
+constexpr std::uint32_t GPIO_PORT_HW_ALL = GPIO_PORT_HW | 0xFFUL;
+
 /** GPIO direction options */
 enum class GpioDirection : std::uint8_t {
     DIR_INPUT = 0,
@@ -52,7 +151,7 @@ enum class GpioOutput : std::uint8_t {
 /* Note: when GPIO are configured as output, they are set to low as well */
 struct __attribute__((packed)) GpioConfigure {
     Command command;
-    std::uint32_t gpio_port; // unused on Arduino
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
     std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
     GpioDirection gpio_direction;
 };
@@ -60,7 +159,7 @@ struct __attribute__((packed)) GpioConfigure {
 /** GPIO set parameters */
 struct __attribute__((packed)) GpioWrite {
     Command command;
-    std::uint32_t gpio_port; // unused on Arduino
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
     std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
     GpioOutput output;
 };
@@ -68,68 +167,988 @@ struct __attribute__((packed)) GpioWrite {
 /** GPIO toggle parameters */
 struct __attribute__((packed)) GpioToggle {
     Command command;
-    std::uint32_t gpio_port; // unused on Arduino
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
     std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
 };
 
 /** GPIO pulse parameters */
 struct __attribute__((packed)) GpioPulse {
     Command command;
-    std::uint32_t gpio_port; // unused on Arduino
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
     std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
     std::uint32_t duration_ms; // duration of pulse per gpio in ms
 };
 
-/** GPIO query */
+/** GPIO pulse scheduling modes */
+enum class PulseMode : std::uint8_t {
+    SIMULTANEOUS = 0,   // every pin pulses at the same time
+    SEQUENTIAL = 1      // pins pulse one after another, highest bit first
+};
+
+/** GPIO pulse schedule parameters */
+/* Note: a pulse on a pin that is already pulsing (or has pulses queued) starts when the last of those ends */
+struct __attribute__((packed)) GpioPulseSchedule {
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
+    PulseMode mode;
+    std::uint32_t duration_us; // duration of pulse per gpio in us
+    std::uint32_t start_offset_us; // delay from receiving the command to the first pulse in us
+};
+
+/** GPIO query parameters */
 struct __attribute__((packed)) GpioQuery {
-    // TODO
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being queried
+};
+
+/** GPIO query reply (this -> Central) */
+/* Note: followed by one PWM duty byte per pin in gpio_bitset, lowest pin first */
+struct __attribute__((packed)) GpioQueryReply {
+    Command command;
+    std::uint32_t gpio_port; // echoed from the query
+    std::uint32_t gpio_bitset; // echoed from the query
+    std::uint32_t input; // bit n is the input level of GPIO n
+    std::uint32_t output; // bit n is the output latch of GPIO n
+    std::uint32_t direction; // bit n is 1 if GPIO n is an output
+    std::uint32_t pulsing; // bit n is 1 if GPIO n has a pulse active or queued
 };
 
 /** PWM set parameters */
 struct __attribute__((packed)) PwmSet {
     Command command;
-    std::uint32_t gpio_port; // unused on Arduino
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
     std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being configured
     std::uint8_t intensity; // 0-255
 };
 
 /** Query state parameters */
 struct __attribute__((packed)) QueryState {
-    // TODO
+    Command command;
+};
+
+/** Number of ports reported in a query state reply, whether or not the chip has them */
+constexpr unsigned int QUERY_STATE_PORTS = 2;
+
+/** Query state reply (this -> Central), pins are numbered by hardware port (bit n of port p) */
+/* Note: followed by pwm_count PwmDuty entries */
+struct __attribute__((packed)) QueryStateReply {
+    Command command;
+    std::uint32_t uptime_ms;
+    std::uint32_t input[QUERY_STATE_PORTS]; // IN register of each port
+    std::uint32_t output[QUERY_STATE_PORTS]; // OUT register of each port
+    std::uint32_t direction[QUERY_STATE_PORTS]; // DIR register of each port
+    std::uint32_t pulsing[QUERY_STATE_PORTS]; // pins with a pulse active or queued
+    std::uint16_t queued_pulse_edges; // pulse edges waiting in the software queue
+    std::uint8_t hw_pulses_active; // pulses being timed in hardware
+    std::uint8_t pwm_count; // number of PwmDuty entries that follow
+};
+
+/** Duty of a pin with PWM running, in a query state reply */
+struct __attribute__((packed)) PwmDuty {
+    std::uint8_t pin; // hardware pin number (port * 32 + pin)
+    std::uint8_t duty; // 0-255
+};
+
+/** PWM set multi parameters */
+/* Note: followed by count PwmChannelDuty entries (up to MAX_PWM_MULTI_CHANNELS). The listed pins become the whole
+ * PWM group, pins of the group that aren't listed stop (low output), count 0 stops the group. The group runs on its
+ * own PWM peripheral and is separate from PWM_SET, a pin moved from one to the other stops in the first. */
+struct __attribute__((packed)) PwmSetMulti {
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t frequency_hz; // PWM frequency, the closest one the clock gives for top is used (0 = unchanged)
+    std::uint16_t top; // resolution, duties range from 0 to top (3-32767, 0 = unchanged, 255 at boot)
+    std::uint8_t count; // number of PwmChannelDuty entries following this header
+};
+
+/** Duty of one pin in a PWM set multi command */
+struct __attribute__((packed)) PwmChannelDuty {
+    std::uint8_t pin; // bit number n as in gpio_bitset
+    std::uint16_t duty; // 0 to top, anything above top is always on
+};
+
+/** Most pins in a PWM set multi command */
+constexpr std::size_t MAX_PWM_MULTI_CHANNELS = PwmGroup::NUM_CHANNELS;
+
+/** PWM ramp parameters */
+/* Note: only pins of the PWM group (see PwmSetMulti) ramp, other group pins keep their duty. The ramp makes up to
+ * PwmGroup::MAX_RAMP_STEPS steps, at most one per PWM period. A new ramp, or PWM_SET_MULTI, replaces a running one. */
+struct __attribute__((packed)) PwmRamp {
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is ramping
+    std::uint16_t start_duty; // 0 to the group's top, the pins jump here first
+    std::uint16_t end_duty; // held once the ramp is done
+    std::uint32_t duration_us;
+    PwmCurve curve;
+};
+
+/** Input subscribe parameters */
+/* Note: replaces any earlier subscription (an empty bitset unsubscribes), pins should be configured as inputs */
+struct __attribute__((packed)) InputSubscribe {
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW, also used to number the pins of INPUT_EVENTS
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being subscribed to
+    std::uint16_t debounce_ms; // changes this soon after a reported change are bounces
+    std::uint16_t min_interval_ms; // shortest time between two INPUT_EVENTS notifications
+};
+
+/** Input subscribe reply (this -> Central) */
+struct __attribute__((packed)) InputSubscribeReply {
+    Command command;
+    std::uint32_t gpio_port; // echoed from the subscription
+    std::uint32_t gpio_bitset; // pins actually subscribed to, see InputMonitor::MAX_PINS
+};
+
+/** Input events notification (this -> Central) */
+/* Note: followed by count InputEvent entries, oldest first */
+struct __attribute__((packed)) InputEvents {
+    Command command;
+    std::uint16_t lost; // changes dropped since the last notification because they came in too fast
+    std::uint8_t count; // number of InputEvent entries that follow
+};
+
+/** Level change of a subscribed pin, in an input events notification */
+struct __attribute__((packed)) InputEvent {
+    std::uint32_t time_us; // device micros() at the change
+    std::uint8_t pin; // pin number, in the subscription's numbering
+    std::uint8_t level; // 0 = low, 1 = high
+};
+
+/** Connection PHY options */
+enum class ConnPhy : std::uint8_t {
+    PHY_KEEP = 0,   // leave the PHY as it is
+    PHY_1M = 1,
+    PHY_2M = 2
+};
+
+/** Connection parameters request */
+/* Note: 0 leaves a parameter as it is, so a request of all zeros only reads the current parameters. The reply is sent
+ * once every requested parameter is in effect, or after CONN_PARAMS_TIMEOUT_MS if the central didn't accept them. */
+struct __attribute__((packed)) ConnParams {
+    Command command;
+    std::uint16_t interval; // connection interval in 1.25 ms units (6 = 7.5 ms)
+    std::uint16_t slave_latency; // connection events this device may skip, used as is (even 0) if interval is set
+    std::uint16_t supervision_timeout; // in 10 ms units, must exceed 2 * (1 + slave_latency) * interval
+    ConnPhy phy;
+    std::uint16_t data_length; // link layer payload size in bytes (27-251)
+};
+
+/** Connection parameters reply (this -> Central), the parameters in effect */
+struct __attribute__((packed)) ConnParamsReply {
+    Command command;
+    std::uint16_t interval; // in 1.25 ms units (0 if not connected)
+    std::uint16_t slave_latency;
+    std::uint16_t supervision_timeout; // in 10 ms units
+    ConnPhy phy;
+    std::uint16_t data_length; // in bytes
+    std::uint16_t mtu; // ATT MTU in bytes
+};
+
+/** Longest wait for the central to accept requested connection parameters */
+constexpr std::uint32_t CONN_PARAMS_TIMEOUT_MS = 2000;
+
+/** Echo flags */
+constexpr std::uint8_t ECHO_RETURN_FILLER = 0x01;  /*!< Send the filler back in the reply */
+constexpr std::uint8_t ECHO_SILENT = 0x02;         /*!< Don't reply, e.g. to pad a batch with no-op commands */
+
+/** Echo parameters */
+/* Note: followed by filler_length bytes of filler, to benchmark different payload sizes */
+struct __attribute__((packed)) Echo {
+    Command command;
+    std::uint32_t sequence; // returned in the reply, to match replies and spot missing ones
+    std::uint8_t flags; // see ECHO_RETURN_FILLER and ECHO_SILENT
+    std::uint8_t filler_length; // number of filler bytes following this header
+};
+
+/** Echo reply (this -> Central) */
+/* Note: followed by the filler if ECHO_RETURN_FILLER was set */
+struct __attribute__((packed)) EchoReply {
+    Command command;
+    std::uint32_t sequence; // echoed from the command
+    std::uint32_t received_us; // device micros() when the frame holding the command (or its SCHEDULE) was complete
+    std::uint32_t dispatched_us; // device micros() when the command was run
+    std::uint8_t filler_length; // number of filler bytes following this header
+};
+
+/** Stats parameters */
+struct __attribute__((packed)) Stats {
+    Command command;
+    std::uint8_t reset; // 1 to zero every counter once they are read
+};
+
+/** Stats reply (this -> Central), everything counts from the last reset (or boot) */
+/* Note: followed by command_types StatsCommandCount entries, for the command types that were run */
+struct __attribute__((packed)) StatsReply {
+    Command command;
+    std::uint32_t elapsed_ms; // time since the counters were reset
+    std::uint32_t service_calls; // number of PinCtrl::service() calls
+    std::uint32_t max_service_us; // longest PinCtrl::service() call
+    std::uint32_t max_pulse_late_us; // latest a software-timed pulse edge was applied after its deadline
+    std::uint16_t rx_fifo_high_water; // most bytes seen waiting in the BLE UART RX FIFO
+    std::uint32_t bytes_received; // bytes read from the BLE UART
+    std::uint32_t dropped_bytes; // see FrameErrors
+    std::uint32_t bad_length;
+    std::uint32_t bad_crc;
+    std::uint32_t timeouts;
+    std::uint32_t bad_commands; // frames with an unknown command or a payload that doesn't match it
+    std::uint8_t command_types; // number of StatsCommandCount entries that follow
+};
+
+/** Number of commands run of one type, in a stats reply (batched sub-commands count too) */
+struct __attribute__((packed)) StatsCommandCount {
+    Command command;
+    std::uint32_t count;
+};
+
+/** Binary log record, one per command run (see PIN_CTRL_LOG_RING_CAPACITY in debug_log.h) */
+struct __attribute__((packed)) LogRecord {
+    std::uint32_t time_us; // device micros() when the command ran
+    Command command;
+    std::uint8_t length; // bytes of the command and its data (truncated to 255)
+    std::uint8_t args[8]; // first bytes of the command's data as they were received (zero padded)
+};
+
+/** Log read parameters */
+struct __attribute__((packed)) LogRead {
+    Command command;
+    std::uint8_t max_records; // most records to send, 0 for as many as fit in the reply
+};
+
+/** Log read reply (this -> Central), the records are removed from the log */
+/* Note: followed by count LogRecord entries, oldest first */
+struct __attribute__((packed)) LogReadReply {
+    Command command;
+    std::uint16_t dropped; // records lost since the last read because the log was full
+    std::uint16_t remaining; // records still in the log after this reply
+    std::uint8_t count; // number of LogRecord entries that follow
+};
+
+/** Most log records in one reply */
+constexpr std::size_t MAX_LOG_READ_RECORDS = (MAX_FRAME_PAYLOAD - sizeof(LogReadReply)) / sizeof(LogRecord);
+
+/** Number of pattern slots, and most keyframes in a pattern */
+constexpr std::size_t PATTERN_SLOTS = 8;
+constexpr std::size_t MAX_PATTERN_KEYFRAMES = 32;
+
+/** Pattern stop slot that stops every pattern */
+constexpr std::uint8_t PATTERN_ALL_SLOTS = 0xFF;
+
+/** Keyframe output options */
+enum class KeyframeMode : std::uint8_t {
+    DIGITAL = 0,    // digital write, level 0 = low, anything else = high
+    PWM = 1         // PWM output, level is the intensity (0-255)
+};
+
+/** Pattern keyframe: set the pins, then hold for duration_us before the next keyframe */
+struct __attribute__((packed)) Keyframe {
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n is being set
+    KeyframeMode mode;
+    std::uint8_t level;
+    std::uint32_t duration_us;
+};
+
+/** Pattern upload parameters */
+/* Note: followed by count Keyframe entries. An upload starting at keyframe 0 replaces the whole pattern, later ones
+ * append to it, so patterns longer than a frame take several uploads. Uploading stops the slot if it's playing. */
+struct __attribute__((packed)) PatternUpload {
+    Command command;
+    std::uint8_t slot; // 0 to PATTERN_SLOTS - 1
+    std::uint8_t first_keyframe; // index of the first keyframe in this upload, must follow the ones stored
+    std::uint8_t count; // number of Keyframe entries following this header
+};
+
+/** Pattern play parameters */
+/* Note: playing a slot that is already playing restarts it. Pins are left as the last keyframe set them. */
+struct __attribute__((packed)) PatternPlay {
+    Command command;
+    std::uint8_t slot;
+    std::uint16_t repeat; // number of times to play the pattern, 0 = until stopped
+};
+
+/** Pattern stop parameters */
+/* Note: pins are left as they are */
+struct __attribute__((packed)) PatternStop {
+    Command command;
+    std::uint8_t slot; // or PATTERN_ALL_SLOTS
+};
+
+/** Commit flags */
+constexpr std::uint8_t COMMIT_ERASE = 0x01; // remove the saved settings instead, the next boot starts from defaults
+
+/** Commit parameters */
+/* Note: writing flash stalls the device for up to a few hundred ms, pulses and patterns playing meanwhile run late */
+struct __attribute__((packed)) Commit {
+    Command command;
+    std::uint8_t flags;
+};
+
+/** Commit reply (this -> Central), sent once the flash is written */
+struct __attribute__((packed)) CommitReply {
+    Command command;
+    std::uint8_t saved; // 1 if the settings were saved (or erased), 0 if the file system failed
+    std::uint16_t size; // bytes in the saved file (0 if erased)
+};
+
+/** Schedule parameters */
+/* Note: followed by length bytes holding one command (which may be a batch), queued until the device's micros()
+ * reaches run_at_us. Times already passed run on the next service() call, commands due at the same time run in
+ * the order they arrived. Length 0 cancels every queued command instead. Sync clocks with ECHO (see
+ * BleUartPinCtrl.sync_clock on the desktop). */
+struct __attribute__((packed)) Schedule {
+    Command command;
+    std::uint32_t run_at_us; // device micros() to run the command at (at most MAX_SCHEDULE_HORIZON_US ahead)
+    std::uint8_t length; // bytes of the scheduled command (up to MAX_SCHEDULED_LENGTH)
+};
+
+/** Queued command limits */
+constexpr std::size_t SCHEDULE_QUEUE_CAPACITY = 16;
+constexpr std::size_t MAX_SCHEDULED_LENGTH = 128;
+constexpr std::uint32_t MAX_SCHEDULE_HORIZON_US = 60000000;
+static_assert(SCHEDULE_QUEUE_CAPACITY <= 32, "Free schedule slots are tracked in a 32-bit mask");
+
+/** BLE UART RX FIFO size, the sketch must create its BLEUart with it (credits are computed from it) */
+constexpr std::uint16_t UART_RX_FIFO_DEPTH = 1024;
+
+/** Flow control parameters */
+/* Note: a credit report is sent right away, then whenever bytes were taken from the FIFO and interval_ms passed
+ * (or half the FIFO was freed). A central may have fifo_depth - (bytes sent - consumed) bytes in flight. */
+struct __attribute__((packed)) FlowControl {
+    Command command;
+    std::uint8_t enable; // 0 stops the reports
+    std::uint16_t interval_ms; // shortest time between reports
+};
+
+/** Credit report (this -> Central) */
+struct __attribute__((packed)) Credits {
+    Command command;
+    std::uint32_t consumed; // bytes taken from the RX FIFO since boot (wraps), up to the end of a frame
+    std::uint16_t fifo_depth; // see UART_RX_FIFO_DEPTH
+};
+
+/** Protocol versions */
+constexpr std::uint8_t PROTOCOL_VERSION_1 = 1; // packed structs only
+constexpr std::uint8_t PROTOCOL_VERSION_2 = 2; // packed structs and compact commands
+constexpr std::uint8_t PROTOCOL_VERSION_MAX = PROTOCOL_VERSION_2;
+
+/** Protocol version parameters */
+/* Note: the device speaks version 1 after boot. A central that gets no reply is talking to firmware older than
+ * this command and must stay on version 1. */
+struct __attribute__((packed)) ProtocolVersion {
+    Command command;
+    std::uint8_t version; // highest version the central speaks
+};
+
+/** Protocol version reply (this -> Central) */
+struct __attribute__((packed)) ProtocolVersionReply {
+    Command command;
+    std::uint8_t version; // version in use from now on, the lower of the central's and PROTOCOL_VERSION_MAX
+    std::uint8_t max_version; // see PROTOCOL_VERSION_MAX
+};
+
+/** Compact commands */
+/* Note: each is the command byte, a pin set (see compact_format.h) and the fields of its packed counterpart in
+ * order, 32-bit fields being varints:
+ *      COMPACT_GPIO_CONFIGURE:         <pins> <direction>
+ *      COMPACT_GPIO_WRITE:             <pins> <output>
+ *      COMPACT_GPIO_PULSE:             <pins> <varint duration_ms>
+ *      COMPACT_GPIO_PULSE_SCHEDULE:    <pins> <mode> <varint duration_us> <varint start_offset_us>
+ *      COMPACT_PWM_SET:                <pins> <intensity>
+ * so pulsing one pin for 100 ms takes 4 bytes instead of 13. They're refused (but still skipped over, so the
+ * rest of a batch runs) until PROTOCOL_VERSION picked version 2. The packed structs stay the version 1 encoding
+ * and are accepted in either version. */
+constexpr std::size_t COMPACT_MIN_SIZE = 2; // command byte and an empty pin list
+
+/** Batch header */
+/* Note: followed by batch_length bytes of back-to-back sub-commands (nested batches are not allowed) */
+struct __attribute__((packed)) BatchHeader {
+    Command command;
+    std::uint16_t batch_length; // number of sub-command bytes following this header
+};
+
+/** Largest batch body that fits in a frame along with its header */
+constexpr std::size_t MAX_BATCH_LENGTH = MAX_FRAME_PAYLOAD - sizeof(BatchHeader);
+
+/** State sync flags */
+constexpr std::uint8_t STATE_SYNC_FULL = 0x01; // full snapshot: base is ignored, the listed pins become the whole state
+
+/** State sync parameters */
+/* Note: followed by count PinLevel entries. Each frame numbers the state it brings the pins to, and a delta lists
+ * every pin whose level differs from, or was sent since, its base state, the last one the device acknowledged. The
+ * device applies a delta only if it went through base since its last full snapshot, else it replies NEED_FULL.
+ * The state outlives the connection, so a central that reconnects resumes with a delta, unless the link-loss
+ * failsafe (see Safety) or an on-time limit switched pins off behind the central's back. */
+struct __attribute__((packed)) StateSync {
+    Command command;
+    std::uint16_t sequence; // state the frame brings the pins to, one more than the central's previous frame (wraps)
+    std::uint16_t base; // state the listed changes are against (ignored by full snapshots)
+    std::uint8_t flags; // see STATE_SYNC_FULL
+    std::uint8_t count; // number of PinLevel entries that follow
+};
+
+/** Level of a pin in a state sync */
+struct __attribute__((packed)) PinLevel {
+    std::uint8_t pin; // hardware pin number (port * 32 + pin)
+    std::uint8_t level; // 0 = output low, 255 = output high, anything between is a PWM duty
+};
+
+/** Most PinLevel entries in one state sync */
+constexpr std::size_t MAX_STATE_SYNC_PINS = (MAX_FRAME_PAYLOAD - sizeof(StateSync)) / sizeof(PinLevel);
+
+/** State sync outcome */
+enum class StateSyncStatus : std::uint8_t {
+    APPLIED = 0,    // the pins are in the frame's state
+    NEED_FULL = 1   // the device isn't in a state the delta can apply to, send a full snapshot
+};
+
+/** State sync reply (this -> Central) */
+struct __attribute__((packed)) StateSyncReply {
+    Command command;
+    std::uint16_t sequence; // sequence of the frame replied to
+    std::uint16_t state; // state the device is in, sequence if it was applied
+    StateSyncStatus status;
+};
+
+/** ADC stream parameters */
+/* Note: replaces any earlier stream (no inputs stops it). Each scan samples every selected input, lowest AIN first,
+ * and the scans go out in ADC_SAMPLES notifications, each sized to fit a single packet at the connection's MTU and
+ * sent at most ADC_STREAM_MAX_LATENCY_MS after its first scan. Samples read 0-ADC_FULL_SCALE_MV in 0-4095. */
+struct __attribute__((packed)) AdcStream {
+    Command command;
+    std::uint8_t inputs; // if the n-th bit is 1, analog input AIN n is sampled
+    std::uint32_t rate_hz; // scans per second, lowered to what the SAADC can convert (200 kHz shared by the inputs)
+};
+
+/** ADC stream reply (this -> Central) */
+struct __attribute__((packed)) AdcStreamReply {
+    Command command;
+    std::uint8_t inputs; // inputs being streamed (0 if stopped)
+    std::uint32_t period_ticks; // time between scans in ticks of ADC_TIMER_HZ (0 if stopped)
+    std::uint8_t scans_per_notification; // scans in every ADC_SAMPLES notification
+};
+
+/** ADC samples notification (this -> Central) */
+/* Note: followed by scans * (number of inputs) 12-bit samples in scan order, packed big-endian two in 3 bytes (an
+ * odd last sample takes 2 bytes, low nibble 0). Scans dropped because the link fell behind show as a gap in
+ * first_scan. */
+struct __attribute__((packed)) AdcSamples {
+    Command command;
+    std::uint32_t first_scan; // number of the first scan, counting from 0 at the stream's start (wraps)
+    std::uint8_t scans; // number of scans that follow
+};
+
+/** Tick rate of AdcStreamReply::period_ticks */
+constexpr std::uint32_t ADC_TIMER_HZ = AdcSampler::TIMER_HZ;
+
+/** Input voltage of sample 4095 (gain 1/6 of the 0.6 V internal reference) */
+constexpr std::uint32_t ADC_FULL_SCALE_MV = 3600;
+
+/** Longest an ADC_SAMPLES notification waits for its scans */
+constexpr std::uint32_t ADC_STREAM_MAX_LATENCY_MS = 10;
+
+/** Most samples in one ADC_SAMPLES notification */
+constexpr std::size_t MAX_ADC_SAMPLES = (MAX_FRAME_PAYLOAD - sizeof(AdcSamples)) * 2 / 3;
+static_assert(AdcSampler::BUFFER_CAPACITY <= MAX_ADC_SAMPLES, "A buffer of samples must fit in one notification");
+
+/** Link-loss actions */
+enum class LinkLoss : std::uint8_t {
+    LINK_LOSS_KEEP = 0,     // leave the action as it is
+    LINK_LOSS_OFF = 1,      // drive every output off, stop PWM and drop everything queued (the default)
+    LINK_LOSS_HOLD = 2      // leave the pins and queues as they are
+};
+
+/** Longest on-time limit, longer ones are cut to it */
+constexpr std::uint32_t MAX_SAFETY_ON_US = 1UL << 30;
+
+/** Safety parameters */
+/* Note: a limited pin left on (output high or a PWM duty above 0) for max_on_us after whatever last turned it on is
+ * switched off (output low, PWM stopped), and its pulses are cut to max_on_us, queued ones included. A pin that is
+ * on when it gets its limit counts from this command. Limits aren't saved by COMMIT. */
+struct __attribute__((packed)) Safety {
+    Command command;
+    std::uint32_t gpio_port; // see GPIO_PORT_HW
+    std::uint32_t gpio_bitset; // if the n-th bit is 1, GPIO n gets the limit
+    std::uint32_t max_on_us; // longest the pins may stay on, 0 lifts their limit
+    LinkLoss link_loss; // what a dropped link does to the outputs
+};
+
+/** Safety reply (this -> Central), pins are numbered by hardware port (bit n of port p) */
+struct __attribute__((packed)) SafetyReply {
+    Command command;
+    std::uint32_t limited[QUERY_STATE_PORTS]; // pins with an on-time limit
+    LinkLoss link_loss; // action in effect, LINK_LOSS_OFF or LINK_LOSS_HOLD
+    std::uint32_t failsafes; // times a link loss drove the outputs off since boot
+    std::uint32_t auto_offs; // times a pin was switched off for staying on too long since boot
 };
 
+/** Multi-byte (big-endian on the wire) fields of each struct, used to fix endianness in one step */
+namespace wire_format {
+template <> struct Layout<GpioConfigure>
+    : Fields<WIRE_FIELD(GpioConfigure, gpio_port), WIRE_FIELD(GpioConfigure, gpio_bitset)> {};
+template <> struct Layout<GpioWrite>
+    : Fields<WIRE_FIELD(GpioWrite, gpio_port), WIRE_FIELD(GpioWrite, gpio_bitset)> {};
+template <> struct Layout<GpioPulse>
+    : Fields<WIRE_FIELD(GpioPulse, gpio_port), WIRE_FIELD(GpioPulse, gpio_bitset),
+             WIRE_FIELD(GpioPulse, duration_ms)> {};
+template <> struct Layout<GpioPulseSchedule>
+    : Fields<WIRE_FIELD(GpioPulseSchedule, gpio_port), WIRE_FIELD(GpioPulseSchedule, gpio_bitset),
+             WIRE_FIELD(GpioPulseSchedule, duration_us), WIRE_FIELD(GpioPulseSchedule, start_offset_us)> {};
+template <> struct Layout<GpioQuery>
+    : Fields<WIRE_FIELD(GpioQuery, gpio_port), WIRE_FIELD(GpioQuery, gpio_bitset)> {};
+template <> struct Layout<GpioQueryReply>
+    : Fields<WIRE_FIELD(GpioQueryReply, gpio_port), WIRE_FIELD(GpioQueryReply, gpio_bitset),
+             WIRE_FIELD(GpioQueryReply, input), WIRE_FIELD(GpioQueryReply, output),
+             WIRE_FIELD(GpioQueryReply, direction), WIRE_FIELD(GpioQueryReply, pulsing)> {};
+template <> struct Layout<QueryState>
+    : Fields<> {};
+template <> struct Layout<QueryStateReply>
+    : Fields<WIRE_FIELD(QueryStateReply, uptime_ms), WIRE_ARRAY(QueryStateReply, input),
+             WIRE_ARRAY(QueryStateReply, output), WIRE_ARRAY(QueryStateReply, direction),
+             WIRE_ARRAY(QueryStateReply, pulsing), WIRE_FIELD(QueryStateReply, queued_pulse_edges)> {};
+template <> struct Layout<PwmSet>
+    : Fields<WIRE_FIELD(PwmSet, gpio_port), WIRE_FIELD(PwmSet, gpio_bitset)> {};
+template <> struct Layout<PwmSetMulti>
+    : Fields<WIRE_FIELD(PwmSetMulti, gpio_port), WIRE_FIELD(PwmSetMulti, frequency_hz),
+             WIRE_FIELD(PwmSetMulti, top)> {};
+template <> struct Layout<PwmChannelDuty>
+    : Fields<WIRE_FIELD(PwmChannelDuty, duty)> {};
+template <> struct Layout<PwmRamp>
+    : Fields<WIRE_FIELD(PwmRamp, gpio_port), WIRE_FIELD(PwmRamp, gpio_bitset), WIRE_FIELD(PwmRamp, start_duty),
+             WIRE_FIELD(PwmRamp, end_duty), WIRE_FIELD(PwmRamp, duration_us)> {};
+template <> struct Layout<InputSubscribe>
+    : Fields<WIRE_FIELD(InputSubscribe, gpio_port), WIRE_FIELD(InputSubscribe, gpio_bitset),
+             WIRE_FIELD(InputSubscribe, debounce_ms), WIRE_FIELD(InputSubscribe, min_interval_ms)> {};
+template <> struct Layout<InputSubscribeReply>
+    : Fields<WIRE_FIELD(InputSubscribeReply, gpio_port), WIRE_FIELD(InputSubscribeReply, gpio_bitset)> {};
+template <> struct Layout<InputEvents>
+    : Fields<WIRE_FIELD(InputEvents, lost)> {};
+template <> struct Layout<InputEvent>
+    : Fields<WIRE_FIELD(InputEvent, time_us)> {};
+template <> struct Layout<ConnParams>
+    : Fields<WIRE_FIELD(ConnParams, interval), WIRE_FIELD(ConnParams, slave_latency),
+             WIRE_FIELD(ConnParams, supervision_timeout), WIRE_FIELD(ConnParams, data_length)> {};
+template <> struct Layout<ConnParamsReply>
+    : Fields<WIRE_FIELD(ConnParamsReply, interval), WIRE_FIELD(ConnParamsReply, slave_latency),
+             WIRE_FIELD(ConnParamsReply, supervision_timeout), WIRE_FIELD(ConnParamsReply, data_length),
+             WIRE_FIELD(ConnParamsReply, mtu)> {};
+template <> struct Layout<Echo>
+    : Fields<WIRE_FIELD(Echo, sequence)> {};
+template <> struct Layout<EchoReply>
+    : Fields<WIRE_FIELD(EchoReply, sequence), WIRE_FIELD(EchoReply, received_us),
+             WIRE_FIELD(EchoReply, dispatched_us)> {};
+template <> struct Layout<Stats>
+    : Fields<> {};
+template <> struct Layout<StatsReply>
+    : Fields<WIRE_FIELD(StatsReply, elapsed_ms), WIRE_FIELD(StatsReply, service_calls),
+             WIRE_FIELD(StatsReply, max_service_us), WIRE_FIELD(StatsReply, max_pulse_late_us),
+             WIRE_FIELD(StatsReply, rx_fifo_high_water), WIRE_FIELD(StatsReply, bytes_received),
+             WIRE_FIELD(StatsReply, dropped_bytes), WIRE_FIELD(StatsReply, bad_length),
+             WIRE_FIELD(StatsReply, bad_crc), WIRE_FIELD(StatsReply, timeouts),
+             WIRE_FIELD(StatsReply, bad_commands)> {};
+template <> struct Layout<StatsCommandCount>
+    : Fields<WIRE_FIELD(StatsCommandCount, count)> {};
+template <> struct Layout<LogRecord>
+    : Fields<WIRE_FIELD(LogRecord, time_us)> {};
+template <> struct Layout<LogRead>
+    : Fields<> {};
+template <> struct Layout<LogReadReply>
+    : Fields<WIRE_FIELD(LogReadReply, dropped), WIRE_FIELD(LogReadReply, remaining)> {};
+template <> struct Layout<Keyframe>
+    : Fields<WIRE_FIELD(Keyframe, gpio_port), WIRE_FIELD(Keyframe, gpio_bitset),
+             WIRE_FIELD(Keyframe, duration_us)> {};
+template <> struct Layout<PatternUpload>
+    : Fields<> {};
+template <> struct Layout<PatternPlay>
+    : Fields<WIRE_FIELD(PatternPlay, repeat)> {};
+template <> struct Layout<PatternStop>
+    : Fields<> {};
+template <> struct Layout<Commit>
+    : Fields<> {};
+template <> struct Layout<CommitReply>
+    : Fields<WIRE_FIELD(CommitReply, size)> {};
+template <> struct Layout<Schedule>
+    : Fields<WIRE_FIELD(Schedule, run_at_us)> {};
+template <> struct Layout<FlowControl>
+    : Fields<WIRE_FIELD(FlowControl, interval_ms)> {};
+template <> struct Layout<Credits>
+    : Fields<WIRE_FIELD(Credits, consumed), WIRE_FIELD(Credits, fifo_depth)> {};
+template <> struct Layout<ProtocolVersion>
+    : Fields<> {};
+template <> struct Layout<ProtocolVersionReply>
+    : Fields<> {};
+template <> struct Layout<StateSync>
+    : Fields<WIRE_FIELD(StateSync, sequence), WIRE_FIELD(StateSync, base)> {};
+template <> struct Layout<PinLevel>
+    : Fields<> {};
+template <> struct Layout<StateSyncReply>
+    : Fields<WIRE_FIELD(StateSyncReply, sequence), WIRE_FIELD(StateSyncReply, state)> {};
+template <> struct Layout<AdcStream>
+    : Fields<WIRE_FIELD(AdcStream, rate_hz)> {};
+template <> struct Layout<AdcStreamReply>
+    : Fields<WIRE_FIELD(AdcStreamReply, period_ticks)> {};
+template <> struct Layout<AdcSamples>
+    : Fields<WIRE_FIELD(AdcSamples, first_scan)> {};
+template <> struct Layout<Safety>
+    : Fields<WIRE_FIELD(Safety, gpio_port), WIRE_FIELD(Safety, gpio_bitset), WIRE_FIELD(Safety, max_on_us)> {};
+template <> struct Layout<SafetyReply>
+    : Fields<WIRE_ARRAY(SafetyReply, limited), WIRE_FIELD(SafetyReply, failsafes),
+             WIRE_FIELD(SafetyReply, auto_offs)> {};
+template <> struct Layout<BatchHeader>
+    : Fields<WIRE_FIELD(BatchHeader, batch_length)> {};
+}  // namespace wire_format
+
 class PinCtrl {
 private:
+    /** Number of hardware pins across all ports */
+    static constexpr unsigned int NUM_HW_PINS = gpio_ports::NUM_PORTS * gpio_ports::PINS_PER_PORT;
+
+    /** Room kept in the pulse queue for the auto-off deadline of every pin (see limit_on_time()) */
+    static constexpr std::size_t AUTO_OFF_RESERVE = NUM_HW_PINS;
+
+    /** Number of pulse edges that can be queued (each pulse takes two), plus the auto-off reserve */
+    static constexpr std::size_t PULSE_QUEUE_CAPACITY = 128 + AUTO_OFF_RESERVE;
+
+    /** Furthest ahead a pulse may end, keeps queued deadlines comparable across micros() wrap-around */
+    static constexpr std::uint32_t MAX_PULSE_HORIZON_US = 1UL << 30;
+
+    /** How often a hardware pulse's pin is checked on once it should be free (its timer drifts from micros()) */
+    static constexpr std::uint32_t HW_PULSE_POLL_US = 100;
+
+    /** Most input changes sent in one notification, keeps it within a single packet at the largest MTU */
+    static constexpr std::size_t MAX_INPUT_EVENTS = 32;
+
+    /** Service task (see start_task()), above loop() and below the BLE stack's tasks */
+    static constexpr std::uint32_t TASK_STACK_WORDS = 256 * 6;
+    static constexpr UBaseType_t TASK_PRIORITY = TASK_PRIO_NORMAL;
+
+    /** How often a connection parameter request is checked on while the task waits for it */
+    static constexpr std::uint32_t CONN_PARAMS_POLL_US = 10000;
+
+    /** Frames buffered between the BLE UART RX callback and the executor (a power of two) */
+    static constexpr std::size_t RX_RING_CAPACITY = 8;
+
+    /** Command ids below this get a run counter */
+    static constexpr std::size_t STATS_COMMAND_TYPES = 40;
+
+    /** Handler of a command, returns the bytes it used (0 if they're truncated or malformed) */
+    typedef std::size_t (PinCtrl::*CommandHandler)(std::uint8_t *data, std::size_t length);
+
+    /** Dispatch table entry */
+    struct CommandEntry {
+        Command command;        // command of the entry, checked against its table index at compile time
+        std::uint8_t size;      // size of the command's struct (the fixed part for variable-length ones), 0 if unknown
+        CommandHandler handler;
+    };
+
+    /** Dispatch table, indexed by command id (see bleuart_pin_ctrl.cpp) */
+    static constexpr std::size_t COMMAND_TABLE_SIZE = STATS_COMMAND_TYPES;
+    struct CommandTable;
+
+    /** Performance counters, cheap enough to always keep */
+    struct Counters {
+        std::uint32_t since_ms;             // time of the last reset
+        std::uint32_t service_calls;
+        std::uint32_t max_service_us;
+        std::uint32_t max_pulse_late_us;
+        int rx_fifo_high_water;
+        std::uint32_t commands[STATS_COMMAND_TYPES]; // runs per command id
+    };
+
+    /** Stored pattern, keyframes are in host byte order */
+    struct Pattern {
+        std::uint8_t keyframe_count;
+        Keyframe keyframes[MAX_PATTERN_KEYFRAMES];
+    };
+
+    /** Playback state of a pattern slot */
+    struct PatternPlayer {
+        bool playing;
+        std::uint8_t keyframe;      // next keyframe to apply
+        std::uint16_t repeats_left; // plays left after the current one (ignored if forever)
+        bool forever;
+        std::uint32_t next_us;      // time to apply the next keyframe
+    };
+
+    /** Start of the saved settings file (see save_config() for the rest), in host byte order */
+    struct __attribute__((packed)) SavedHeader {
+        std::uint32_t magic;
+        std::uint8_t version;
+        std::uint8_t ports;     // number of GPIO ports, a file from another chip is ignored
+        std::uint8_t patterns;  // number of saved patterns
+    };
+    static constexpr std::uint32_t SAVED_MAGIC = 0x47464350; // "PCFG"
+    static constexpr std::uint8_t SAVED_VERSION = 1;
+
+    /** Frame taken in from the BLE UART, waiting to run */
+    struct RxFrame {
+        std::uint32_t received_us;  // time the frame was complete
+        std::uint32_t consumed;     // bytes taken from the RX FIFO up to the end of the frame (see Credits)
+        std::uint8_t length;        // payload bytes (frames carry 1 to MAX_FRAME_PAYLOAD)
+        std::uint8_t payload[MAX_FRAME_PAYLOAD];
+    };
+
+    /** Queued command in the schedule queue, the bytes are in _scheduled[slot] */
+    struct ScheduledCommand {
+        std::uint8_t slot;
+        std::uint32_t arrival;  // order of arrival, breaks ties between equal times
+        std::uint32_t received_us;  // time the frame carrying it was complete, what an ECHO in it reports
+
+        bool operator<(const ScheduledCommand &other) const { return deadline_before(arrival, other.arrival); }
+    };
+
+    /** Pulse edge waiting in the pulse queue */
+    struct PulseEdge {
+        std::uint8_t pin;   // hardware pin number (port * 32 + pin)
+        bool rising;        // true to drive the pin high, false to drive it low
+        bool hw_timed;      // the pulse timer drives this edge, it's only queued to track when the pin is free
+        bool auto_off;      // not an edge: the time a limited pin must be off by (see limit_on_time())
+
+        // at equal deadlines falling edges go first, so back-to-back pulses on a pin stay high
+        bool operator<(const PulseEdge &other) const { return !rising && other.rising; }
+    };
+
     BLEUart *_uart;                 /*!< Pointer to BLE UART instance */
-    std::uint32_t _pins_to_pulse;   /*!< Bit mask of pins to pulse */
-    std::uint32_t _pulse_dur_ms;    /*!< Current pulse activity delay in ms */
-    std::uint32_t _pulse_start_ms;  /*!< Time the current pulse started in ms */
+    FrameParser _parser;            /*!< Reassembles frames from the BLE UART byte stream */
+    SpscRing<RxFrame, RX_RING_CAPACITY> _rx_frames; /*!< Frames taken in, receive() -> service() */
+    SemaphoreHandle_t _rx_lock;     /*!< Held by whichever context runs receive() (nullptr while polling) */
+    volatile bool _rx_pending;      /*!< Set by a receive() that found _rx_lock taken, the holder goes round again */
+    std::uint32_t _bad_commands;    /*!< Frames with an unknown command or a payload that doesn't match it */
+    std::uint32_t _frame_received_us; /*!< Time the frame being run was complete */
+    std::uint32_t _frame_consumed;  /*!< RX FIFO bytes consumed up to the end of the frame being run */
+    Counters _counters;             /*!< Performance counters */
+#if PIN_CTRL_LOG_RING_CAPACITY
+    SpscRing<LogRecord, PIN_CTRL_LOG_RING_CAPACITY> _log; /*!< Binary log of the commands run */
+    std::uint32_t _log_dropped;     /*!< Records lost since the last read because the log was full */
+#endif
+    std::int8_t _hw_to_arduino[NUM_HW_PINS]; /*!< Arduino pin of each hardware pin (-1 if none) */
+    DeadlineHeap<ScheduledCommand, SCHEDULE_QUEUE_CAPACITY> _schedule_queue; /*!< Queued commands by time in us */
+    std::uint8_t _scheduled[SCHEDULE_QUEUE_CAPACITY][MAX_SCHEDULED_LENGTH]; /*!< Bytes of each queued command */
+    std::uint8_t _scheduled_length[SCHEDULE_QUEUE_CAPACITY]; /*!< Length of each queued command */
+    std::uint32_t _scheduled_free;  /*!< Bit n is set while _scheduled[n] is free */
+    std::uint32_t _scheduled_arrivals; /*!< Commands scheduled so far, numbers the next one */
+    DeadlineHeap<PulseEdge, PULSE_QUEUE_CAPACITY> _pulse_queue; /*!< Pending pulse edges ordered by time in us */
+    gpio_ports::PortMasks _pulsing; /*!< Pins with a pulse active or queued */
+    std::uint32_t _pulse_busy_until_us[NUM_HW_PINS]; /*!< End of the last queued pulse per pin (valid while pulsing) */
+    PulseTimer _pulse_timer;        /*!< Hardware pulse timing, used for pulses on idle pins while enabled */
+    std::uint8_t _pwm_duty[NUM_HW_PINS]; /*!< Last PWM duty set on each hardware pin (0 if none) */
+    PwmGroup _pwm_group;            /*!< PWM peripheral driven by PWM_SET_MULTI */
+    gpio_ports::PortMasks _configured_inputs; /*!< Pins last configured as inputs, saved by COMMIT */
+    gpio_ports::PortMasks _configured_outputs; /*!< Pins last configured as outputs, saved by COMMIT */
+    Pattern _patterns[PATTERN_SLOTS]; /*!< Pattern store */
+    PatternPlayer _players[PATTERN_SLOTS]; /*!< Playback state of each pattern slot */
+    InputMonitor _inputs;           /*!< Change detection on subscribed input pins */
+    std::uint32_t _input_port;      /*!< gpio_port of the input subscription */
+    std::uint32_t _input_interval_ms; /*!< Shortest time between input events notifications */
+    std::uint32_t _input_sent_ms;   /*!< Time the last input events notification was sent */
+    std::size_t _input_event_count; /*!< Number of input changes waiting in _input_events */
+    std::uint8_t _input_events[sizeof(InputEvents) + MAX_INPUT_EVENTS * sizeof(InputEvent)]; /*!< Next notification */
+    ConnParams _conn_params_wanted; /*!< Connection parameters being negotiated (valid while pending) */
+    bool _conn_params_pending;      /*!< True until the negotiated connection parameters are reported */
+    std::uint32_t _conn_params_requested_ms; /*!< Time the connection parameters were requested */
+    std::uint32_t _rx_bytes_before_reset; /*!< Bytes read from the BLE UART before the counters were last reset */
+    bool _credits_enabled;          /*!< True while credit reports are on */
+    std::uint32_t _credits_interval_ms; /*!< Shortest time between credit reports */
+    std::uint32_t _credits_sent_ms; /*!< Time the last credit report was sent */
+    std::uint32_t _credits_reported; /*!< Bytes consumed as of the last credit report */
+    std::uint8_t _protocol_version; /*!< Protocol version picked by the central */
+    bool _synced;                   /*!< True once a full state snapshot was applied */
+    std::uint16_t _sync_state;      /*!< State the synced pins are in (valid while synced) */
+    std::uint16_t _sync_full_state; /*!< State of the last full snapshot, deltas can't be against an older one */
+    gpio_ports::PortMasks _sync_pins; /*!< Pins whose level the state sync sets */
+    std::uint8_t _sync_levels[NUM_HW_PINS]; /*!< Shadow of the level last synced on each pin (valid for _sync_pins) */
+    AdcSampler _adc;                /*!< Timer-paced sampling of the ADC stream's inputs */
+    gpio_ports::PortMasks _limited; /*!< Pins with an on-time limit */
+    std::uint32_t _max_on_us[NUM_HW_PINS]; /*!< On-time limit of each hardware pin (valid for _limited) */
+    gpio_ports::PortMasks _auto_off_queued; /*!< Limited pins with an auto-off deadline in the pulse queue */
+    std::uint32_t _auto_off_us[NUM_HW_PINS]; /*!< Time each pin must be off by (valid for _auto_off_queued) */
+    std::uint32_t _auto_off_queued_us[NUM_HW_PINS]; /*!< Deadline of the pin's live queue entry, others are stale */
+    std::uint32_t _auto_offs;       /*!< Pins switched off for staying on too long since boot */
+    bool _failsafe;                 /*!< True to drive the outputs off when the link drops */
+    volatile bool _link_lost;       /*!< Set by link_lost(), the next service() finishes the failsafe */
+    std::uint32_t _failsafes;       /*!< Link losses that drove the outputs off since boot */
+    TaskHandle_t _task;             /*!< Service task (nullptr while service() is called from loop()) */
+
+    /* Take the next frame from the ring, refilling it from the RX FIFO once it's empty, returns false if none */
+    bool next_frame(RxFrame &frame);
+
+    /* Run the handler for the command at the front of data, returns the bytes used (0 if unknown or truncated) */
+    std::size_t execute(std::uint8_t *data, std::size_t length);
+
+    /* Dispatch table handler of a fixed-size command: decode it and run HANDLER on it */
+    template <typename T, void (PinCtrl::*HANDLER)(const T &)>
+    std::size_t run_fixed(std::uint8_t *data, std::size_t length);
 
     /* Functions to handle commands */
-    void handle_gpio_configure();
-    void handle_gpio_write();
-    void handle_gpio_pulse();
-    void handle_gpio_query();
-    void handle_pwm_set();
-    void handle_query_state();
+    void handle_gpio_configure(const GpioConfigure &params);
+    void handle_gpio_write(const GpioWrite &params);
+    void handle_gpio_pulse(const GpioPulse &params);
+    void handle_gpio_pulse_schedule(const GpioPulseSchedule &params);
+    void handle_gpio_query(const GpioQuery &params);
+    void handle_pwm_set(const PwmSet &params);
+    std::size_t handle_pwm_set_multi(std::uint8_t *data, std::size_t length);
+    void handle_pwm_ramp(const PwmRamp &params);
+    void handle_query_state(const QueryState &params);
+    void handle_input_subscribe(const InputSubscribe &params);
+    void handle_conn_params(const ConnParams &params);
+    std::size_t handle_echo(std::uint8_t *data, std::size_t length);
+    void handle_stats(const Stats &params);
+    void handle_log_read(const LogRead &params);
+    std::size_t handle_pattern_upload(std::uint8_t *data, std::size_t length);
+    void handle_pattern_play(const PatternPlay &params);
+    void handle_pattern_stop(const PatternStop &params);
+    void handle_commit(const Commit &params);
+    void send_reply(const std::uint8_t *payload, std::size_t length);
+    std::size_t handle_batch(std::uint8_t *data, std::size_t length);
+    std::size_t handle_schedule(std::uint8_t *data, std::size_t length);
+    void handle_flow_control(const FlowControl &params);
+    void handle_protocol_version(const ProtocolVersion &params);
+    std::size_t handle_compact(std::uint8_t *data, std::size_t length);
+    std::size_t handle_state_sync(std::uint8_t *data, std::size_t length);
+    void handle_adc_stream(const AdcStream &params);
+    void handle_safety(const Safety &params);
 
     /* Service any ongoing pulse command */
     void service_gpio_pulse();
 
-    /* Copy bytes from the BLE UART byte buffer into the type T */
+    /* Run queued commands that are due */
+    void service_schedule();
+
+    /* Collect input changes and send them once the notification interval has passed */
+    void service_inputs();
+
+    /* Send the newest buffer of ADC samples, if one was filled */
+    void service_adc();
+
+    /* Apply the keyframes of playing patterns that are due */
+    void service_patterns();
+
+    /* Set the pins of a keyframe */
+    void apply_keyframe(const Keyframe &keyframe);
+
+    /* Add a command to the binary log, and print the oldest record (while idle, at PIN_CTRL_LOG_DEFERRED) */
+    /* Note: the record is started before the command runs, as handlers convert its bytes in place, and logged with
+     * the bytes its handler used once it ran */
+    void start_log_record(const std::uint8_t *data, std::size_t length, LogRecord &record) const;
+    void log_command(LogRecord &record, std::size_t used);
+    void print_log_record();
+
+    /* Write the pin configuration and patterns to flash, returns the file size (0 if it failed) */
+    std::size_t save_config();
+
+    /* Send a credit report if bytes were consumed and it's time for one (or always, if forced) */
+    void service_credits(bool force);
+
+    /* Report the connection parameters once a request for them is done */
+    void service_conn_params();
+
+    /* Body of the service task: service(), then sleep until woken or until there's work again */
+    static void task_main(void *pin_ctrl);
+
+    /* Read the connection parameters in effect (all zeros if not connected) */
+    static ConnParamsReply read_conn_params();
+
+    /* Configure, write or PWM every pin of hardware pin masks (the pin commands' handlers, once pins are resolved) */
+    void configure_pins(const gpio_ports::PortMasks &pins, GpioDirection direction);
+    void write_pins(const gpio_ports::PortMasks &pins, GpioOutput output);
+    void set_pwm(std::uint32_t arduino_pins, std::uint8_t intensity);
+
+    /* Take a hardware pin back from whichever PWM drives it, so its output latch drives it again */
+    void stop_pwm(unsigned int hw_pin);
+
+    /* Queue the auto-off deadline of the limited pins among pins just turned on, costs two ANDs if there are none */
+    /* Note: a pin keeps one live entry, which is pushed back when it comes up early. Pins whose deadline doesn't fit
+     * in the queue are switched off right away. */
+    void limit_on_time(const gpio_ports::PortMasks &on);
+
+    /* Switch pins off: stop their PWM and clear their output latch, returns how many of them were on */
+    unsigned int switch_off(const gpio_ports::PortMasks &pins);
+
+    /* Stop everything that could turn a pin on, and switch off every output (after link_lost()) */
+    void apply_failsafe();
+
+    /* Pack 12-bit samples big-endian, two in 3 bytes (clamping them to 0-4095), returns the bytes used */
+    static std::size_t pack_adc_samples(const std::int16_t *samples, std::size_t count, std::uint8_t *out);
+
+    /* True if state sync sequence a comes before b (sequences wrap, so b must be within 32767 after a) */
+    static bool state_before(std::uint16_t a, std::uint16_t b);
+
+    /* Convert a GPIO_PULSE duration to us (overlong durations are clamped so the pulse queue rejects them) */
+    static std::uint32_t pulse_ms_to_us(std::uint32_t duration_ms);
+
+    /* Queue pulses on every pin of a port/bitset pair */
+    void schedule_pulses(std::uint32_t gpio_port, std::uint64_t gpio_bitset, PulseMode mode,
+                         std::uint32_t duration_us, std::uint32_t start_offset_us);
+
+    /* Queue one pulse on a hardware pin, returns false if the queue is full or the pulse ends too far out */
+    /* Note: now_tick is the pulse timer's counter at now_us, only used while hardware pulse timing is enabled */
+    bool schedule_pulse(unsigned int hw_pin, std::uint32_t now_us, std::uint32_t now_tick, std::uint32_t &start_us,
+                        std::uint32_t duration_us);
+
+    /* Convert a port/bitset pair from the wire into a mask of Arduino pins (pins above 31 are dropped) */
+    std::uint32_t resolve_arduino_pins(std::uint32_t gpio_port, std::uint64_t gpio_bitset) const;
+
+    /* View command bytes in place as the type T, converting them to host byte order */
     template <typename T> 
-    T parse_bytes();
+    static const T &decode(std::uint8_t *data);
 
 public:
+    /** idle_time_us() when only new data or an input change can make work */
+    static constexpr std::uint32_t WAIT_FOREVER = UINT32_MAX;
+
     PinCtrl(BLEUart *uart);
     void service();
 
-    /* Misc utils/helpers */
+    /* Call service() from a FreeRTOS task of its own instead of loop() (call after bleuart.begin()) */
+    /* Note: the task sleeps until wake(), an input change or the next deadline, so loop() may suspend itself. Returns
+     * false if the task couldn't be created. */
+    bool start_task();
 
-    // fix endianness (network to host)
-    static std::uint32_t byte_swap32(std::uint32_t input) {
-        return __builtin_bswap32(input);
-    }
+    /* Wake the service task to read new data */
+    void wake();
+
+    /* Move complete frames from the BLE UART into the ring for service() and wake the task (call from the BLEUart
+     * RX callback) */
+    /* Note: only once start_task() succeeded, service() reads the BLE UART itself when it's called from loop().
+     * Frames that don't fit stay in the RX FIFO, service() takes them in once it has made room. */
+    void receive();
+
+    /* Drive the outputs off, unless the link-loss action is LINK_LOSS_HOLD (call from the disconnect callback) */
+    /* Note: latched outputs go low right away, from any context. PWM and anything queued are stopped by the next
+     * service(), which the task is woken for. */
+    void link_lost();
+
+    /* Time until service() next has something to do, in us (0 if it has now) */
+    std::uint32_t idle_time_us();
+
+    /* Mount the internal file system and restore the saved pin configuration and patterns (call in setup()) */
+    /* Returns false if nothing was restored, the device then starts from defaults */
+    bool load_config();
+
+    /* Time pulse edges with the hardware pulse timer (call after Bluefruit.begin()), or go back to polling */
+    /* Note: pulses that find every hardware channel busy, or whose pin is already pulsing, are always polled */
+    void set_hw_pulse_timing(bool enable);
+
+    /* Size of a command's data (the fixed part for batches) including the command byte (0 if unknown) */
+    static std::size_t frame_size(Command command);
+
+    /* Framing error counters, and the number of frames holding a bad command */
+    const FrameErrors &frame_errors() const { return _parser.errors(); }
+    std::uint32_t bad_commands() const { return _bad_commands; }
+
+    /* Zero the performance and error counters */
+    void reset_counters();
+
+    /* Convert a port/bitset pair from the wire into hardware pin masks */
+    /* Note: bits above 31 are only used by GPIO_PORT_HW_ALL */
+    static gpio_ports::PortMasks resolve_pins(std::uint32_t gpio_port, std::uint64_t gpio_bitset);
+
+    /* Convert bit n of a wire bitset into a hardware pin number (-1 if there's no such pin) */
+    static int wire_to_hw_pin(std::uint32_t gpio_port, unsigned int n);
+
+    /* Misc utils/helpers */
 
     // check if bit n is set in the mask
     static bool is_set(std::uint32_t mask, unsigned int n) {
@@ -138,24 +1157,6 @@ public:
         }
         return mask & (1UL << n);
     }
-
-    // return the bit position of the highest set bit (-1 if no bits are set)
-    static int get_highest_bit(std::uint32_t mask) {
-        for (int i = 31; i >= 0; --i) {
-            if (mask & (1UL << i)) {
-                return i;
-            }
-        }
-        return -1;
-    }
-
-    // clears the bit position of the highest set bit
-    static void clear_highest_bit(std::uint32_t &mask) {
-        int n = get_highest_bit(mask);
-        if (n >= 0) {
-            mask &= ~(1UL << n);
-        }
-    }
 };
 
 }  // namespace ble_uart_pin_ctrl
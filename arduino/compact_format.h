@@ -0,0 +1,94 @@
+/* compact_format.h
+ * Compact encoding of pin sets and integers, used by the protocol version 2 commands.
+ * Functionality:
+ *      - Decode unsigned LEB128 varints (7 bits per byte, least significant group first)
+ *      - Decode pin sets: a 1-byte port/count header followed by a pin list (sparse sets) or a short mask
+ *      - Address both hardware ports in one pin set, with pins numbered across them (P1.n is pin 32 + n)
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ble_uart_pin_ctrl {
+namespace compact_format {
+
+/** Pin set header: bits 7-6 select the port, bit 5 the form, bits 4-0 the count */
+constexpr unsigned int HEADER_PORT_SHIFT = 6;
+constexpr std::uint8_t HEADER_FORM_MASK = 0x20;  // set: count mask bytes follow, clear: count pin numbers follow
+constexpr std::uint8_t HEADER_COUNT = 0x1F;
+
+/** Pin set ports */
+constexpr std::uint8_t PORT_ARDUINO = 0;    // pins are Arduino pin numbers
+constexpr std::uint8_t PORT_HW_P0 = 1;      // pins are pins of hardware port P0
+constexpr std::uint8_t PORT_HW_P1 = 2;      // pins are pins of hardware port P1
+constexpr std::uint8_t PORT_HW_ALL = 3;     // pins are hardware pins of every port, P1.n is pin 32 + n
+
+/** Highest pin (and longest mask) of a single port set, and of a PORT_HW_ALL set */
+constexpr unsigned int MAX_PORT_PIN = 31;
+constexpr unsigned int MAX_ALL_PIN = 63;
+constexpr std::size_t MAX_PORT_MASK_LENGTH = 4;
+constexpr std::size_t MAX_ALL_MASK_LENGTH = 8;
+
+/** Longest varint holding 32 bits */
+constexpr std::size_t MAX_VARINT_LENGTH = 5;
+
+/** Decoded pin set, bit n of bitset is pin n of port (only PORT_HW_ALL sets use bits above 31) */
+struct PinSet {
+    std::uint8_t port;
+    std::uint64_t bitset;
+};
+
+/* Decode a varint into value, returns the bytes used (0 if it's truncated or doesn't fit 32 bits) */
+inline std::size_t decode_varint(const std::uint8_t *data, std::size_t length, std::uint32_t &value) {
+    value = 0;
+    for (std::size_t i = 0; i < length && i < MAX_VARINT_LENGTH; ++i) {
+        const std::uint32_t group = data[i] & 0x7F;
+        if (i == MAX_VARINT_LENGTH - 1 && group > 0x0F) {
+            return 0; // more than 32 bits
+        }
+        value |= group << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Decode a pin set, returns the bytes used (0 if it's truncated or names a pin its port doesn't have) */
+/* Note: a list may name pins in any order, a mask is 1-4 bytes (1-8 for PORT_HW_ALL), most significant first */
+inline std::size_t decode_pins(const std::uint8_t *data, std::size_t length, PinSet &pins) {
+    if (!length) {
+        return 0;
+    }
+
+    const std::uint8_t header = data[0];
+    const std::size_t count = header & HEADER_COUNT;
+    if (length < 1 + count) {
+        return 0;
+    }
+
+    pins.port = header >> HEADER_PORT_SHIFT;
+    pins.bitset = 0;
+    const bool all_ports = pins.port == PORT_HW_ALL;
+    if (header & HEADER_FORM_MASK) {
+        if (count < 1 || count > (all_ports ? MAX_ALL_MASK_LENGTH : MAX_PORT_MASK_LENGTH)) {
+            return 0;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            pins.bitset = (pins.bitset << 8) | data[1 + i];
+        }
+    } else {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (data[1 + i] > (all_ports ? MAX_ALL_PIN : MAX_PORT_PIN)) {
+                return 0;
+            }
+            pins.bitset |= 1ULL << data[1 + i];
+        }
+    }
+    return 1 + count;
+}
+
+}  // namespace compact_format
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,87 @@
+/* config_file.cpp
+ * Saved pin controller settings in the nRF52 internal flash (InternalFS, LittleFS).
+ * Functionality:
+ *      - Stream records into a new file, then swap it in for the saved one, so a reset mid-write keeps the old file
+ *      - Stream records back out, checking the file's CRC-8 once the whole file is read
+ *      - Remove the saved file
+ */
+
+#include "config_file.h"
+
+#include "crc8.h"
+
+using namespace ble_uart_pin_ctrl;
+using namespace Adafruit_LittleFS_Namespace;
+
+constexpr const char *ConfigFile::PATH;
+constexpr const char *ConfigFile::TEMP_PATH;
+
+ConfigFile::ConfigFile() : _file{InternalFS}, _crc{0}, _size{0}, _ok{false} {}
+
+bool ConfigFile::begin() {
+    return InternalFS.begin();
+}
+
+bool ConfigFile::erase() {
+    return !InternalFS.exists(PATH) || InternalFS.remove(PATH);
+}
+
+bool ConfigFile::start_write() {
+    /* Opening for write appends, so always start from an empty file */
+    if (InternalFS.exists(TEMP_PATH)) {
+        InternalFS.remove(TEMP_PATH);
+    }
+    _crc = 0;
+    _size = 0;
+    _ok = _file.open(TEMP_PATH, FILE_O_WRITE);
+    return _ok;
+}
+
+bool ConfigFile::write(const void *data, std::size_t length) {
+    if (!_ok) {
+        return false;
+    }
+    const auto bytes = static_cast<const std::uint8_t *>(data);
+    _ok = _file.write(bytes, length) == length;
+    _crc = crc8(bytes, length, _crc);
+    _size += length;
+    return _ok;
+}
+
+bool ConfigFile::finish_write() {
+    if (!_ok) {
+        _file.close();
+        return false;
+    }
+    _ok = _file.write(&_crc, sizeof(_crc)) == sizeof(_crc);
+    _file.close();
+
+    /* The saved file is only touched once the new one is complete */
+    _ok = _ok && erase() && InternalFS.rename(TEMP_PATH, PATH);
+    return _ok;
+}
+
+bool ConfigFile::start_read() {
+    _crc = 0;
+    _size = 0;
+    _ok = _file.open(PATH, FILE_O_READ);
+    return _ok;
+}
+
+bool ConfigFile::read(void *data, std::size_t length) {
+    if (!_ok) {
+        return false;
+    }
+    const auto bytes = static_cast<std::uint8_t *>(data);
+    _ok = _file.read(bytes, length) == static_cast<int>(length);
+    _crc = crc8(bytes, length, _crc);
+    _size += length;
+    return _ok;
+}
+
+bool ConfigFile::finish_read() {
+    std::uint8_t crc = 0;
+    _ok = _ok && _file.read(&crc, sizeof(crc)) == sizeof(crc) && crc == _crc && !_file.available();
+    _file.close();
+    return _ok;
+}
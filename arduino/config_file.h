@@ -0,0 +1,55 @@
+/* config_file.h
+ * Saved pin controller settings in the nRF52 internal flash (InternalFS, LittleFS).
+ * Functionality:
+ *      - Stream records into a new file, then swap it in for the saved one, so a reset mid-write keeps the old file
+ *      - Stream records back out, checking the file's CRC-8 once the whole file is read
+ *      - Remove the saved file
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <Adafruit_LittleFS.h>
+#include <InternalFileSystem.h>
+
+namespace ble_uart_pin_ctrl {
+
+class ConfigFile {
+private:
+    /** Paths of the saved file, and of the one being written */
+    static constexpr const char *PATH = "/pin_ctrl.cfg";
+    static constexpr const char *TEMP_PATH = "/pin_ctrl.tmp";
+
+    Adafruit_LittleFS_Namespace::File _file; /*!< File being read or written */
+    std::uint8_t _crc;                      /*!< CRC-8 of the bytes read or written so far */
+    std::size_t _size;                      /*!< Bytes read or written so far */
+    bool _ok;                               /*!< False once a read or write failed */
+
+public:
+    ConfigFile();
+
+    /* Mount the file system (formatting it if it's unreadable), returns false if it can't be used */
+    static bool begin();
+
+    /* Remove the saved file */
+    static bool erase();
+
+    /* Start writing a new file, add bytes to it, then replace the saved file with it */
+    /* Note: flash writes stall the CPU (page erases take tens of ms), never call these while timing matters */
+    bool start_write();
+    bool write(const void *data, std::size_t length);
+    bool finish_write();
+
+    /* Start reading the saved file, take bytes from it, then close it, returns false if it's missing */
+    /* Note: bytes are handed out before the CRC is checked, only trust them if finish_read() returns true */
+    bool start_read();
+    bool read(void *data, std::size_t length);
+    bool finish_read();
+
+    /* Bytes read or written so far */
+    std::size_t size() const { return _size; }
+};
+
+}  // namespace ble_uart_pin_ctrl
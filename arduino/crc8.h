@@ -0,0 +1,16 @@
+/* crc8.h
+ * CRC-8 used to check frames sent over BLE UART.
+ * Polynomial 0x07, initial value 0x00, no reflection, no final XOR (CRC-8/SMBUS).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ble_uart_pin_ctrl {
+
+/* CRC-8 of length bytes, continuing from crc (pass 0 to start) */
+std::uint8_t crc8(const std::uint8_t *data, std::size_t length, std::uint8_t crc = 0);
+
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,105 @@
+/* deadline_heap.h
+ * A fixed-capacity binary min-heap of items ordered by a 32-bit deadline.
+ * Functionality:
+ *      - Push/pop in O(log n) with no heap allocation
+ *      - Deadline comparisons survive timer wrap-around (deadlines must be < 2^31 ticks apart)
+ *      - Items with equal deadlines are ordered by T's operator<
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ble_uart_pin_ctrl {
+
+// true if deadline a comes before deadline b, accounting for wrap-around
+inline bool deadline_before(std::uint32_t a, std::uint32_t b) {
+    return static_cast<std::int32_t>(a - b) < 0;
+}
+
+template <typename T, std::size_t CAPACITY>
+class DeadlineHeap {
+private:
+    struct Entry {
+        std::uint32_t deadline;
+        T item;
+    };
+
+    Entry _entries[CAPACITY];   /*!< Heap storage, _entries[0] is the earliest deadline */
+    std::size_t _size;          /*!< Number of entries in use */
+
+    static bool earlier(const Entry &a, const Entry &b) {
+        if (a.deadline != b.deadline) {
+            return deadline_before(a.deadline, b.deadline);
+        }
+        return a.item < b.item;
+    }
+
+    static void swap(Entry &a, Entry &b) {
+        const Entry temp = a;
+        a = b;
+        b = temp;
+    }
+
+public:
+    DeadlineHeap() : _size{0} {}
+
+    std::size_t size() const { return _size; }
+    std::size_t capacity() const { return CAPACITY; }
+    std::size_t space() const { return CAPACITY - _size; }
+    bool empty() const { return _size == 0; }
+    void clear() { _size = 0; }
+
+    // deadline of the earliest entry (heap must not be empty)
+    std::uint32_t top_deadline() const { return _entries[0].deadline; }
+
+    // item of the earliest entry (heap must not be empty)
+    const T &top() const { return _entries[0].item; }
+
+    // adds an item, returns false if the heap is full
+    bool push(std::uint32_t deadline, const T &item) {
+        if (_size >= CAPACITY) {
+            return false;
+        }
+
+        /* Sift the new entry up */
+        std::size_t child = _size++;
+        _entries[child] = Entry{deadline, item};
+        while (child > 0) {
+            const std::size_t parent = (child - 1) / 2;
+            if (!earlier(_entries[child], _entries[parent])) {
+                break;
+            }
+            swap(_entries[child], _entries[parent]);
+            child = parent;
+        }
+        return true;
+    }
+
+    // removes the earliest entry (heap must not be empty)
+    void pop() {
+        _entries[0] = _entries[--_size];
+
+        /* Sift the moved entry down */
+        std::size_t parent = 0;
+        for (;;) {
+            const std::size_t left = 2 * parent + 1;
+            const std::size_t right = left + 1;
+            std::size_t smallest = parent;
+            if (left < _size && earlier(_entries[left], _entries[smallest])) {
+                smallest = left;
+            }
+            if (right < _size && earlier(_entries[right], _entries[smallest])) {
+                smallest = right;
+            }
+            if (smallest == parent) {
+                break;
+            }
+            swap(_entries[parent], _entries[smallest]);
+            parent = smallest;
+        }
+    }
+};
+
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,40 @@
+/* debug_log.h
+ * Build-time logging settings for the pin controller.
+ * Functionality:
+ *      - Pick how much is printed over Serial, anything below the chosen level compiles to nothing
+ *      - Size the deferred binary log, which records every command in RAM without blocking
+ */
+
+#pragma once
+
+#include <bluefruit.h>
+
+/** Serial log levels */
+#define PIN_CTRL_LOG_NONE       0   // print nothing
+#define PIN_CTRL_LOG_ERROR      1   // print errors ("!!! ...")
+#define PIN_CTRL_LOG_DEFERRED   2   // print errors, and the binary log while loop() is idle
+#define PIN_CTRL_LOG_DEBUG      3   // print errors and a trace of every command as it runs (about 1 ms per command)
+
+/* Set the level here, or with -DPIN_CTRL_LOG_LEVEL=... */
+#ifndef PIN_CTRL_LOG_LEVEL
+#   define PIN_CTRL_LOG_LEVEL PIN_CTRL_LOG_ERROR
+#endif
+
+/* Records kept by the binary log (a power of two), 0 leaves it out. Read it over BLE with LOG_READ */
+#ifndef PIN_CTRL_LOG_RING_CAPACITY
+#   define PIN_CTRL_LOG_RING_CAPACITY 64
+#endif
+
+#if PIN_CTRL_LOG_LEVEL >= PIN_CTRL_LOG_DEBUG
+#   define DBG_LOG(...) Serial.print(__VA_ARGS__)
+#   define DBG_LOG_LINE(...) Serial.println(__VA_ARGS__)
+#else
+#   define DBG_LOG(...)
+#   define DBG_LOG_LINE(...)
+#endif
+
+#if PIN_CTRL_LOG_LEVEL >= PIN_CTRL_LOG_ERROR
+#   define ERR_LOG_LINE(...) Serial.println(__VA_ARGS__)
+#else
+#   define ERR_LOG_LINE(...)
+#endif
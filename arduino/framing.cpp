@@ -0,0 +1,130 @@
+/* framing.cpp
+ * Frames messages on the BLE UART byte stream.
+ */
+
+#include "framing.h"
+
+#include <cstring>
+
+#include "crc8.h"
+
+using namespace ble_uart_pin_ctrl;
+
+bool ble_uart_pin_ctrl::write_frame(BLEUart *uart, const std::uint8_t *payload, std::size_t length) {
+    if (!length || length > MAX_FRAME_PAYLOAD) {
+        return false;
+    }
+
+    std::uint8_t frame[FRAME_OVERHEAD + MAX_FRAME_PAYLOAD];
+    frame[0] = FRAME_SYNC;
+    frame[1] = static_cast<std::uint8_t>(length);
+    memcpy(frame + 2, payload, length);
+    frame[length + 2] = crc8(frame + 1, length + 1);
+
+    const std::size_t frame_length = length + FRAME_OVERHEAD;
+    return uart->write(frame, frame_length) == frame_length;
+}
+
+FrameParser::FrameParser() : _buffer{},
+                             _count{0},
+                             _frame_length{0},
+                             _last_byte_ms{0},
+                             _errors{},
+                             _bytes_received{0} {}
+
+bool FrameParser::poll(BLEUart *uart, std::uint32_t now_ms) {
+    if (_frame_length) {
+        return true;
+    }
+
+    /* A frame that stopped arriving would otherwise swallow the start of the next one */
+    if (_count && now_ms - _last_byte_ms > FRAME_TIMEOUT_MS) {
+        ++_errors.timeouts;
+        resync();
+    }
+
+    for (;;) {
+        /* Check what's buffered, there may be leftovers from a resync */
+        while (_count > 0) {
+            if (_buffer[0] != FRAME_SYNC) {
+                resync();
+                continue;
+            }
+
+            if (_count < 2) {
+                break; // missing length
+            }
+
+            const std::size_t payload_length = _buffer[1];
+            if (!payload_length) {
+                ++_errors.bad_length;
+                resync();
+                continue;
+            }
+
+            const std::size_t frame_length = payload_length + FRAME_OVERHEAD;
+            if (_count < frame_length) {
+                break; // missing payload or CRC
+            }
+
+            if (crc8(_buffer + 1, payload_length + 1) != _buffer[frame_length - 1]) {
+                ++_errors.bad_crc;
+                resync();
+                continue;
+            }
+
+            _frame_length = frame_length;
+            return true;
+        }
+
+        /* Read only up to the end of the current frame so the next one stays in the FIFO */
+        const int available = uart->available();
+        if (available <= 0) {
+            return false;
+        }
+
+        std::size_t count = needed();
+        if (count > static_cast<std::size_t>(available)) {
+            count = static_cast<std::size_t>(available);
+        }
+        const int received = uart->read(_buffer + _count, count);
+        _count += received;
+        _bytes_received += received;
+        _last_byte_ms = now_ms;
+    }
+}
+
+void FrameParser::release() {
+    if (!_frame_length) {
+        return;
+    }
+
+    /* Keep anything received after the frame */
+    _count -= _frame_length;
+    memmove(_buffer, _buffer + _frame_length, _count);
+    _frame_length = 0;
+}
+
+std::size_t FrameParser::needed() const {
+    if (_count < 2) {
+        return 2 - _count; // sync and length
+    }
+    return _buffer[1] + FRAME_OVERHEAD - _count;
+}
+
+void FrameParser::resync() {
+    std::size_t next = 1;
+    while (next < _count && _buffer[next] != FRAME_SYNC) {
+        ++next;
+    }
+
+    /* Only bytes that never started a frame count as dropped, bad frames have their own counters */
+    if (_buffer[0] != FRAME_SYNC) {
+        _errors.dropped_bytes += next;
+    } else {
+        _errors.dropped_bytes += next - 1;
+    }
+
+    _count -= next;
+    memmove(_buffer, _buffer + next, _count);
+}
@@ -0,0 +1,84 @@
+/* framing.h
+ * Frames messages on the BLE UART byte stream.
+ * Frame format:
+ *      <sync 1-byte> <payload length 1-byte> <payload bytes> <CRC-8 of length and payload 1-byte>
+ * Functionality:
+ *      - Drop bytes until a sync byte, then check the length and CRC of the frame
+ *      - Resynchronize on the next sync byte after a bad or stale frame, so later frames are never lost to it
+ *      - Count every kind of framing error, and the bytes received
+ *      - Send framed replies
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <bluefruit.h>
+
+namespace ble_uart_pin_ctrl {
+
+/** Marks the start of a frame */
+constexpr std::uint8_t FRAME_SYNC = 0xA5;
+
+/** Bytes of a frame around its payload (sync, length, CRC) */
+constexpr std::size_t FRAME_OVERHEAD = 3;
+
+/** Largest payload a frame can carry */
+constexpr std::size_t MAX_FRAME_PAYLOAD = 255;
+
+/** Framing error counters */
+struct FrameErrors {
+    std::uint32_t dropped_bytes;    // bytes thrown away while looking for a sync byte
+    std::uint32_t bad_length;       // frames with a zero length
+    std::uint32_t bad_crc;          // frames whose CRC didn't match
+    std::uint32_t timeouts;         // partial frames that stopped arriving
+};
+
+/* Frame a payload and write it to the BLE UART in one go (one notification if it fits the MTU) */
+/* Note: returns false if the payload is too large or the central isn't accepting notifications */
+bool write_frame(BLEUart *uart, const std::uint8_t *payload, std::size_t length);
+
+class FrameParser {
+public:
+    /** A partial frame older than this is dropped, BLE delivers a frame's packets much faster than this */
+    static constexpr std::uint32_t FRAME_TIMEOUT_MS = 100;
+
+private:
+    std::uint8_t _buffer[FRAME_OVERHEAD + MAX_FRAME_PAYLOAD]; /*!< Frame being received, starting at its sync byte */
+    std::size_t _count;             /*!< Number of bytes in _buffer */
+    std::size_t _frame_length;      /*!< Length of the complete frame at the front of _buffer (0 if none) */
+    std::uint32_t _last_byte_ms;    /*!< Time the last byte was received in ms */
+    FrameErrors _errors;            /*!< Error counters */
+    std::uint32_t _bytes_received;  /*!< Bytes read from the BLE UART */
+
+    /* Number of bytes still needed to complete the current stage of the frame */
+    std::size_t needed() const;
+
+    /* Drop the first byte and everything up to the next sync byte */
+    void resync();
+
+public:
+    FrameParser();
+
+    /* Pull bytes from the BLE UART, returns true once a complete frame with a valid CRC is buffered */
+    bool poll(BLEUart *uart, std::uint32_t now_ms);
+
+    /* Payload of the complete frame (only valid while poll() returns true, may be modified in place) */
+    std::uint8_t *payload() { return _buffer + 2; }
+    std::size_t payload_length() const { return _frame_length - FRAME_OVERHEAD; }
+
+    /* Done with the complete frame, start on the next one */
+    void release();
+
+    const FrameErrors &errors() const { return _errors; }
+    std::uint32_t bytes_received() const { return _bytes_received; }
+
+    /* Zero the error and byte counters */
+    void reset_counters() {
+        _errors = FrameErrors{};
+        _bytes_received = 0;
+    }
+};
+
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,109 @@
+/* gpio_ports.h
+ * Whole-port GPIO access through the nRF52 GPIO registers.
+ * Functionality:
+ *      - Map Arduino pin numbers to nRF52 hardware port/pin numbers
+ *      - Set, clear and change direction of every pin in a mask with one register store per port
+ *      - Snapshot port registers
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <bluefruit.h>
+
+#include "bit_ops.h"
+
+namespace ble_uart_pin_ctrl {
+namespace gpio_ports {
+
+/** Number of nRF52 GPIO ports (P0 only on nRF52832, P0 and P1 on nRF52840) */
+#ifdef NRF_P1
+constexpr unsigned int NUM_PORTS = 2;
+#else
+constexpr unsigned int NUM_PORTS = 1;
+#endif
+
+/** Number of pins per GPIO port */
+constexpr unsigned int PINS_PER_PORT = 32;
+
+/** Pin masks for every port, bit n of bits[p] is pin n on port p */
+struct PortMasks {
+    std::uint32_t bits[NUM_PORTS];
+};
+
+/* Get the register block of a GPIO port (port must be < NUM_PORTS) */
+inline NRF_GPIO_Type *port_registers(unsigned int port) {
+#ifdef NRF_P1
+    return port ? NRF_P1 : NRF_P0;
+#else
+    (void) port;
+    return NRF_P0;
+#endif
+}
+
+/* Convert an Arduino pin number into an nRF52 hardware pin number (port * 32 + pin) */
+inline std::uint32_t arduino_to_hw_pin(unsigned int arduino_pin) {
+    return g_ADigitalPinMap[arduino_pin];
+}
+
+/* Snapshot the input levels, output latches and directions (1 = output) of a port */
+inline std::uint32_t read_input(unsigned int port) { return port_registers(port)->IN; }
+inline std::uint32_t read_output(unsigned int port) { return port_registers(port)->OUT; }
+inline std::uint32_t read_direction(unsigned int port) { return port_registers(port)->DIR; }
+
+/* Drive every masked pin high, all pins of a port switch in the same cycle */
+inline void set(const PortMasks &masks) {
+    for (unsigned int port = 0; port < NUM_PORTS; ++port) {
+        if (masks.bits[port]) {
+            port_registers(port)->OUTSET = masks.bits[port];
+        }
+    }
+}
+
+/* Drive every masked pin low, all pins of a port switch in the same cycle */
+inline void clear(const PortMasks &masks) {
+    for (unsigned int port = 0; port < NUM_PORTS; ++port) {
+        if (masks.bits[port]) {
+            port_registers(port)->OUTCLR = masks.bits[port];
+        }
+    }
+}
+
+/* Make every masked pin a low output (the output latch is cleared before the driver is enabled) */
+inline void make_output_low(const PortMasks &masks) {
+    for (unsigned int port = 0; port < NUM_PORTS; ++port) {
+        if (masks.bits[port]) {
+            NRF_GPIO_Type *const regs = port_registers(port);
+            regs->OUTCLR = masks.bits[port];
+            regs->DIRSET = masks.bits[port];
+        }
+    }
+}
+
+/* Make every masked pin an output, driving whatever its output latch holds */
+inline void make_output(const PortMasks &masks) {
+    for (unsigned int port = 0; port < NUM_PORTS; ++port) {
+        if (masks.bits[port]) {
+            port_registers(port)->DIRSET = masks.bits[port];
+        }
+    }
+}
+
+/* Make every masked pin a floating input */
+/* Note: the input buffer is per-pin configuration, so this writes PIN_CNF for each masked pin */
+inline void make_input(const PortMasks &masks) {
+    for (unsigned int port = 0; port < NUM_PORTS; ++port) {
+        NRF_GPIO_Type *const regs = port_registers(port);
+        for (unsigned int pin : bit_ops::set_bits(masks.bits[port])) {
+            regs->PIN_CNF[pin] = (GPIO_PIN_CNF_DIR_Input << GPIO_PIN_CNF_DIR_Pos)
+                               | (GPIO_PIN_CNF_INPUT_Connect << GPIO_PIN_CNF_INPUT_Pos)
+                               | (GPIO_PIN_CNF_PULL_Disabled << GPIO_PIN_CNF_PULL_Pos)
+                               | (GPIO_PIN_CNF_DRIVE_S0S1 << GPIO_PIN_CNF_DRIVE_Pos)
+                               | (GPIO_PIN_CNF_SENSE_Disabled << GPIO_PIN_CNF_SENSE_Pos);
+        }
+    }
+}
+
+}  // namespace gpio_ports
+}  // namespace ble_uart_pin_ctrl
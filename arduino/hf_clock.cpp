@@ -0,0 +1,22 @@
+/* hf_clock.cpp
+ * Shared request for the nRF52 HF crystal oscillator.
+ */
+
+#include "hf_clock.h"
+
+#include <bluefruit.h>
+
+/* Number of modules holding the crystal */
+static unsigned int hf_clock_owners = 0;
+
+void ble_uart_pin_ctrl::hf_clock::request() {
+    if (!hf_clock_owners++) {
+        sd_clock_hfclk_request();
+    }
+}
+
+void ble_uart_pin_ctrl::hf_clock::release() {
+    if (hf_clock_owners && !--hf_clock_owners) {
+        sd_clock_hfclk_release();
+    }
+}
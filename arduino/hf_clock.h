@@ -0,0 +1,21 @@
+/* hf_clock.h
+ * Shared request for the nRF52 HF crystal oscillator.
+ * Functionality:
+ *      - The SoftDevice's sd_clock_hfclk_request/release aren't counted, so every module that needs the crystal
+ *        goes through here, and the crystal only stops once the last of them lets it go
+ */
+
+#pragma once
+
+namespace ble_uart_pin_ctrl {
+namespace hf_clock {
+
+/* Keep the crystal running until the matching release() */
+/* Note: not interrupt safe, call from the context running service() (or setup()) only */
+void request();
+
+/* Let the crystal go, it stops once every request() has been released */
+void release();
+
+}  // namespace hf_clock
+}  // namespace ble_uart_pin_ctrl
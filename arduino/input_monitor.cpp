@@ -0,0 +1,175 @@
+/* input_monitor.cpp
+ * Interrupt-driven change detection on GPIO inputs.
+ *
+ * Every monitored pin has a GPIOTE event on any edge (through attachInterrupt()), all of them sharing one handler.
+ * The handler doesn't know which pin fired, so it compares the port input registers against the levels it saw
+ * last, which also catches edges on other pins that happened while it was pending.
+ */
+
+#include "input_monitor.h"
+
+#include "debug_log.h"
+
+using namespace ble_uart_pin_ctrl;
+
+/* Instance serviced by the GPIO interrupt */
+static InputMonitor *input_monitor_instance = nullptr;
+
+static void input_monitor_isr() {
+    if (input_monitor_instance) {
+        input_monitor_instance->on_interrupt();
+    }
+}
+
+InputMonitor::InputMonitor() : _changes{},
+                               _overflows{0},
+                               _arduino_pins{0},
+                               _monitored{},
+                               _raw_levels{},
+                               _levels{},
+                               _settling{},
+                               _debounce_us{0},
+                               _last_edge_us{},
+                               _wake_task{nullptr} {}
+
+std::uint32_t InputMonitor::monitor(std::uint32_t arduino_pins, std::uint32_t debounce_us) {
+    /* Stop the interrupt before touching anything it uses */
+    for (unsigned int pin : bit_ops::set_bits(_arduino_pins)) {
+        detachInterrupt(pin);
+    }
+    _arduino_pins = 0;
+    _monitored = gpio_ports::PortMasks{};
+    _settling = gpio_ports::PortMasks{};
+    _changes.clear();
+    _overflows = 0;
+    _debounce_us = debounce_us;
+
+    /* No pin has a recent edge, so the first change of each is reported right away */
+    const std::uint32_t now_us = micros();
+    for (unsigned int hw_pin = 0; hw_pin < NUM_HW_PINS; ++hw_pin) {
+        _last_edge_us[hw_pin] = now_us - debounce_us;
+    }
+
+    /* Keep to MAX_PINS so attachInterrupt() never takes a GPIOTE channel that pulses use */
+    unsigned int count = 0;
+    for (unsigned int pin : bit_ops::set_bits(arduino_pins)) {
+        if (pin >= PINS_COUNT || count == MAX_PINS) {
+            break;
+        }
+        const std::uint32_t hw_pin = gpio_ports::arduino_to_hw_pin(pin);
+        _monitored.bits[hw_pin / gpio_ports::PINS_PER_PORT] |= 1UL << (hw_pin % gpio_ports::PINS_PER_PORT);
+        _arduino_pins |= 1UL << pin;
+        ++count;
+    }
+
+    /* Start from the current levels, so only changes from here on are reported */
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        _raw_levels.bits[port] = gpio_ports::read_input(port);
+        _levels.bits[port] = _raw_levels.bits[port];
+    }
+
+    input_monitor_instance = this;
+    for (unsigned int pin : bit_ops::set_bits(_arduino_pins)) {
+        if (!attachInterrupt(pin, input_monitor_isr, CHANGE)) {
+            ERR_LOG_LINE("!!! No free GPIOTE channel, input not monitored");
+            const std::uint32_t hw_pin = gpio_ports::arduino_to_hw_pin(pin);
+            _monitored.bits[hw_pin / gpio_ports::PINS_PER_PORT] &= ~(1UL << (hw_pin % gpio_ports::PINS_PER_PORT));
+            _arduino_pins &= ~(1UL << pin);
+        }
+    }
+
+    return _arduino_pins;
+}
+
+bool InputMonitor::poll(std::uint32_t now_us, Event &event) {
+    /* Edges at least the debounce time after the pin's last reported edge are real, the rest are bounces */
+    while (_changes.pop(event)) {
+        const unsigned int port = event.pin / gpio_ports::PINS_PER_PORT;
+        const std::uint32_t bit = 1UL << (event.pin % gpio_ports::PINS_PER_PORT);
+
+        if (event.time_us - _last_edge_us[event.pin] < _debounce_us) {
+            _settling.bits[port] |= bit;
+            continue;
+        }
+        if (static_cast<bool>(_levels.bits[port] & bit) == event.level) {
+            continue; // bounced back before loop() saw it
+        }
+
+        _levels.bits[port] ^= bit;
+        _last_edge_us[event.pin] = event.time_us;
+        return true;
+    }
+
+    /* Pins that bounced can differ from their last report once they settle */
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        if (!_settling.bits[port]) {
+            continue;
+        }
+
+        const std::uint32_t input = gpio_ports::read_input(port);
+        for (unsigned int pin : bit_ops::set_bits(_settling.bits[port])) {
+            const std::uint32_t bit = 1UL << pin;
+            const unsigned int hw_pin = port * gpio_ports::PINS_PER_PORT + pin;
+            if (now_us - _last_edge_us[hw_pin] < _debounce_us) {
+                continue;
+            }
+
+            _settling.bits[port] &= ~bit;
+            if ((input ^ _levels.bits[port]) & bit) {
+                _levels.bits[port] ^= bit;
+                _last_edge_us[hw_pin] = now_us;
+                event = Event{now_us, static_cast<std::uint8_t>(hw_pin), static_cast<bool>(input & bit)};
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool InputMonitor::settling() const {
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        if (_settling.bits[port]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::uint32_t InputMonitor::take_overflows() {
+    /* Hold off the GPIOTE interrupt only, masking every interrupt would stall the SoftDevice */
+    NVIC_DisableIRQ(GPIOTE_IRQn);
+    const std::uint32_t overflows = _overflows;
+    _overflows = 0;
+    NVIC_EnableIRQ(GPIOTE_IRQn);
+    return overflows;
+}
+
+void InputMonitor::on_interrupt() {
+    const std::uint32_t now_us = micros();
+    bool recorded = false;
+
+    for (unsigned int port = 0; port < gpio_ports::NUM_PORTS; ++port) {
+        const std::uint32_t input = gpio_ports::read_input(port);
+        std::uint32_t changed = (input ^ _raw_levels.bits[port]) & _monitored.bits[port];
+        _raw_levels.bits[port] = input;
+
+        while (changed) {
+            const unsigned int pin = bit_ops::pop_lowest(changed);
+
+            const Event event{now_us, static_cast<std::uint8_t>(port * gpio_ports::PINS_PER_PORT + pin),
+                              static_cast<bool>(input & (1UL << pin))};
+            if (!_changes.push(event)) {
+                ++_overflows;
+            }
+            recorded = true;
+        }
+    }
+
+    /* The task reading the changes may be asleep */
+    if (recorded && _wake_task) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(_wake_task, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
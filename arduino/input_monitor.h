@@ -0,0 +1,78 @@
+/* input_monitor.h
+ * Interrupt-driven change detection on GPIO inputs.
+ * Functionality:
+ *      - Timestamp every level change of the monitored pins in the GPIO interrupt
+ *      - Hand the changes to loop() through a lock-free ring, counting any that don't fit
+ *      - Debounce in loop(): report the first edge right away, ignore bounces for the debounce time, then report
+ *        the settled level if the pin ended up somewhere else
+ *      - Optionally wake a FreeRTOS task whenever changes are recorded
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <bluefruit.h>
+
+#include "gpio_ports.h"
+#include "pulse_timer.h"
+#include "spsc_ring.h"
+
+namespace ble_uart_pin_ctrl {
+
+class InputMonitor {
+public:
+    /** Number of pins that can be monitored, each takes a GPIOTE channel below the ones used for pulses */
+    static constexpr unsigned int MAX_PINS = PULSE_GPIOTE_CHANNEL_BASE;
+
+    /** Level changes buffered between the interrupt and loop() */
+    static constexpr std::size_t RING_CAPACITY = 64;
+
+    /** Level change of a pin */
+    struct Event {
+        std::uint32_t time_us;  // time of the change
+        std::uint8_t pin;       // hardware pin number (port * 32 + pin)
+        bool level;             // level after the change
+    };
+
+private:
+    static constexpr unsigned int NUM_HW_PINS = gpio_ports::NUM_PORTS * gpio_ports::PINS_PER_PORT;
+
+    SpscRing<Event, RING_CAPACITY> _changes;    /*!< Raw changes, interrupt -> loop() */
+    volatile std::uint32_t _overflows;          /*!< Raw changes that didn't fit into the ring */
+    std::uint32_t _arduino_pins;                /*!< Monitored pins by Arduino pin number */
+    gpio_ports::PortMasks _monitored;           /*!< Monitored pins by hardware port */
+    gpio_ports::PortMasks _raw_levels;          /*!< Levels last seen by the interrupt */
+    gpio_ports::PortMasks _levels;              /*!< Debounced levels */
+    gpio_ports::PortMasks _settling;            /*!< Pins that bounced, re-checked once their debounce time ends */
+    std::uint32_t _debounce_us;                 /*!< Time after a reported edge during which changes are bounces */
+    std::uint32_t _last_edge_us[NUM_HW_PINS];   /*!< Time of each pin's last reported edge */
+    TaskHandle_t _wake_task;                    /*!< Task notified by the interrupt (nullptr if none) */
+
+public:
+    InputMonitor();
+
+    /* Monitor exactly these Arduino pins (0 stops monitoring), returns the pins actually monitored */
+    /* Note: pins beyond MAX_PINS, or that have no free GPIOTE channel, are left out */
+    std::uint32_t monitor(std::uint32_t arduino_pins, std::uint32_t debounce_us);
+
+    std::uint32_t pins() const { return _arduino_pins; }
+
+    /* Notify a task (with xTaskNotifyGive) every time the interrupt records changes, nullptr to stop */
+    void set_wake_task(TaskHandle_t task) { _wake_task = task; }
+
+    /* True while pins that bounced wait for their debounce time to end, poll() must be called again by then */
+    bool settling() const;
+    std::uint32_t debounce_us() const { return _debounce_us; }
+
+    /* Get the next debounced change, returns false if there is none yet */
+    bool poll(std::uint32_t now_us, Event &event);
+
+    /* Level changes lost because loop() fell behind, reset when read */
+    std::uint32_t take_overflows();
+
+    /* GPIO interrupt, records the changes of every monitored pin */
+    void on_interrupt();
+};
+
+}  // namespace ble_uart_pin_ctrl
@@ -15,13 +15,15 @@
 #include <Adafruit_LittleFS.h>
 #include <InternalFileSystem.h>
 
+#include "bit_benchmark.h"
 #include "bleuart_pin_ctrl.h"
 
 // BLE Service
-BLEUart bleuart; // uart over ble
+BLEUart bleuart(ble_uart_pin_ctrl::UART_RX_FIFO_DEPTH); // uart over ble, RX FIFO sized for streamed frames
 
 /* BLE UART pin controller */
 ble_uart_pin_ctrl::PinCtrl pin_controller(&bleuart);
+bool pin_controller_task = false; // true if pin_controller runs in its own task
 
 void setup() {
   Serial.begin(115200);
@@ -29,6 +31,12 @@ void setup() {
   Serial.println("Bluefruit52 BLEUART Example");
   Serial.println("---------------------------\n");
 
+  // Time set bit iteration when built with PIN_CTRL_BIT_BENCHMARK (compiles to nothing otherwise)
+  ble_uart_pin_ctrl::run_bit_benchmark();
+
+  // Restore the pin configuration and patterns saved by the last COMMIT, before anything else takes time
+  pin_controller.load_config();
+
   // Setup the BLE LED to be enabled on CONNECT
   // Note: This is actually the default behaviour, but provided
   // here in case you want to control this LED manually via PIN 19
@@ -41,13 +49,23 @@ void setup() {
 
   Bluefruit.begin();
   Bluefruit.setTxPower(4); // Check bluefruit.h for supported values
-  Bluefruit.setName("Bluefruit52");
-  //Bluefruit.setName(getMcuUniqueID()); // useful testing with multiple central connections
+  // Name each device after its MCU unique ID, so a central driving several of them can tell them apart
+  char name[32];
+  snprintf(name, sizeof(name), "Bluefruit52-%s", getMcuUniqueID() + 8);
+  Bluefruit.setName(name);
   Bluefruit.Periph.setConnectCallback(connect_callback);
   Bluefruit.Periph.setDisconnectCallback(disconnect_callback);
 
   // Configure and Start BLE Uart Service
   bleuart.begin();
+  // Not deferred, so frames are taken in straight from the BLE event
+  bleuart.setRxCallback(uart_rx_callback, false);
+
+  // Time pulse edges in hardware (needs the SoftDevice running, so after Bluefruit.begin())
+  pin_controller.set_hw_pulse_timing(true);
+
+  // Service pins from a task that sleeps between events, loop() isn't needed then (and would keep the CPU awake)
+  pin_controller_task = pin_controller.start_task();
 
   // Set up and start advertising
   startAdv();
@@ -84,10 +102,24 @@ void startAdv(void) {
 }
 
 void loop() {
-  // service pin control
+  // service pin control, unless its task does
+  if (pin_controller_task) {
+    suspendLoop();
+    return;
+  }
   pin_controller.service();
 }
 
+// callback invoked when the central writes to the BLE UART
+void uart_rx_callback(uint16_t conn_handle) {
+  (void) conn_handle;
+
+  // Take the frames in right away, they run in the pin controller's task (loop() reads them itself otherwise)
+  if (pin_controller_task) {
+    pin_controller.receive();
+  }
+}
+
 // callback invoked when central connects
 void connect_callback(uint16_t conn_handle) {
   // Get the reference to current connection
@@ -109,6 +141,9 @@ void disconnect_callback(uint16_t conn_handle, uint8_t reason) {
   (void) conn_handle;
   (void) reason;
 
+  // Outputs go to their safe state first, nothing should stay on without a central watching it
+  pin_controller.link_lost();
+
   Serial.println();
   Serial.print("Disconnected, reason = 0x");
   Serial.println(reason, HEX);
@@ -0,0 +1,242 @@
+/* pulse_timer.cpp
+ * Hardware-timed GPIO pulses using an nRF52 TIMER, GPIOTE and PPI.
+ *
+ * Each channel n owns TIMER compare n, GPIOTE channel PULSE_GPIOTE_CHANNEL_BASE + n and PPI channel
+ * PULSE_PPI_CHANNEL_BASE + n, wired so that compare n toggles the GPIOTE output. A pulse arms the compare for its
+ * rising edge, then the compare interrupt re-arms it for the falling edge relative to the previous compare value,
+ * so interrupt latency never moves an edge (unless it exceeds the pulse length, in which case the edge is late).
+ */
+
+#include "pulse_timer.h"
+
+#include "gpio_ports.h"
+#include "hf_clock.h"
+
+using namespace ble_uart_pin_ctrl;
+
+/* Instance serviced by the compare interrupt */
+static PulseTimer *pulse_timer_instance = nullptr;
+
+extern "C" void PULSE_TIMER_IRQHandler(void) {
+    if (pulse_timer_instance) {
+        pulse_timer_instance->on_interrupt();
+    }
+}
+
+PulseTimer::PulseTimer() : _enabled{false},
+                           _busy{0},
+                           _ending{0},
+                           _duration_us{},
+                           _pins{} {}
+
+void PulseTimer::begin() {
+    if (_enabled) {
+        return;
+    }
+
+    /* Keep the crystal running so edges are as accurate as the timer resolution */
+    hf_clock::request();
+
+    /* 1 MHz free running 32-bit counter */
+    PULSE_TIMER->TASKS_STOP = 1;
+    PULSE_TIMER->MODE = TIMER_MODE_MODE_Timer;
+    PULSE_TIMER->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    PULSE_TIMER->PRESCALER = 4; // 16 MHz / 2^4
+    PULSE_TIMER->SHORTS = 0;
+    PULSE_TIMER->INTENCLR = 0xFFFFFFFF;
+    PULSE_TIMER->TASKS_CLEAR = 1;
+
+    /* Compare n toggles GPIOTE channel n, the GPIOTE channel only drives its pin while a pulse owns it */
+    std::uint32_t ppi_mask = 0;
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        PULSE_TIMER->EVENTS_COMPARE[ch] = 0;
+        sd_ppi_channel_assign(PULSE_PPI_CHANNEL_BASE + ch, &PULSE_TIMER->EVENTS_COMPARE[ch],
+                              &NRF_GPIOTE->TASKS_OUT[PULSE_GPIOTE_CHANNEL_BASE + ch]);
+        ppi_mask |= 1UL << (PULSE_PPI_CHANNEL_BASE + ch);
+    }
+    sd_ppi_channel_enable_set(ppi_mask);
+
+    pulse_timer_instance = this;
+    NVIC_SetPriority(PULSE_TIMER_IRQn, PULSE_TIMER_IRQ_PRIORITY);
+    NVIC_ClearPendingIRQ(PULSE_TIMER_IRQn);
+    NVIC_EnableIRQ(PULSE_TIMER_IRQn);
+
+    PULSE_TIMER->TASKS_START = 1;
+    _enabled = true;
+}
+
+void PulseTimer::end() {
+    if (!_enabled) {
+        return;
+    }
+
+    NVIC_DisableIRQ(PULSE_TIMER_IRQn);
+    PULSE_TIMER->TASKS_STOP = 1;
+
+    /* Cut any pulse short, the pins drop to their (cleared) output latch */
+    std::uint32_t ppi_mask = 0;
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        release(ch);
+        ppi_mask |= 1UL << (PULSE_PPI_CHANNEL_BASE + ch);
+    }
+    sd_ppi_channel_enable_clr(ppi_mask);
+
+    hf_clock::release();
+
+    pulse_timer_instance = nullptr;
+    _enabled = false;
+}
+
+std::uint32_t PulseTimer::now() {
+    PULSE_TIMER->TASKS_CAPTURE[CAPTURE_CC] = 1;
+    return PULSE_TIMER->CC[CAPTURE_CC];
+}
+
+bool PulseTimer::start(unsigned int hw_pin, std::uint32_t start_tick, std::uint32_t duration_us) {
+    if (!_enabled) {
+        return false;
+    }
+
+    /* The compare interrupt updates the channel masks too, hold it off (masking every interrupt would stall the
+     * SoftDevice) */
+    NVIC_DisableIRQ(PULSE_TIMER_IRQn);
+
+    /* Claim a free channel */
+    unsigned int ch = 0;
+    while (ch < NUM_CHANNELS && (_busy & (1U << ch))) {
+        ++ch;
+    }
+    if (ch >= NUM_CHANNELS) {
+        NVIC_EnableIRQ(PULSE_TIMER_IRQn);
+        return false;
+    }
+
+    const unsigned int port = hw_pin / gpio_ports::PINS_PER_PORT;
+    const unsigned int pin = hw_pin % gpio_ports::PINS_PER_PORT;
+
+    /* Idle low once the GPIOTE channel lets the pin go again */
+    gpio_ports::port_registers(port)->OUTCLR = 1UL << pin;
+
+    _duration_us[ch] = duration_us;
+    _pins[ch] = static_cast<std::uint8_t>(hw_pin);
+    _ending &= ~(1U << ch);
+    _busy |= (1U << ch);
+
+    /* Hand the pin to GPIOTE, starting low so the first compare toggles it high */
+    NRF_GPIOTE->CONFIG[PULSE_GPIOTE_CHANNEL_BASE + ch] =
+        (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos)
+        | (pin << GPIOTE_CONFIG_PSEL_Pos)
+        | (port << GPIOTE_CONFIG_PORT_Pos)
+        | (GPIOTE_CONFIG_POLARITY_Toggle << GPIOTE_CONFIG_POLARITY_Pos)
+        | (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
+
+    PULSE_TIMER->EVENTS_COMPARE[ch] = 0;
+    PULSE_TIMER->INTENSET = 1UL << (TIMER_INTENSET_COMPARE0_Pos + ch);
+
+    if (!arm(ch, start_tick, CAPTURE_CC)) {
+        /* Too late for the hardware edge, raise the pin now and let the interrupt time the falling edge */
+        NRF_GPIOTE->TASKS_OUT[PULSE_GPIOTE_CHANNEL_BASE + ch] = 1;
+        _ending |= (1U << ch);
+        if (!arm(ch, now() + duration_us, CAPTURE_CC)) {
+            NRF_GPIOTE->TASKS_OUT[PULSE_GPIOTE_CHANNEL_BASE + ch] = 1;
+            release(ch);
+        }
+    }
+
+    NVIC_EnableIRQ(PULSE_TIMER_IRQn);
+    return true;
+}
+
+void PulseTimer::limit(unsigned int hw_pin, std::uint32_t max_us) {
+    if (!_enabled) {
+        return;
+    }
+
+    NVIC_DisableIRQ(PULSE_TIMER_IRQn);
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (!(_busy & (1U << ch)) || _pins[ch] != hw_pin) {
+            continue;
+        }
+
+        /* Not high yet (or its interrupt is pending): the interrupt times the falling edge from _duration_us */
+        if (_duration_us[ch] > max_us) {
+            _duration_us[ch] = max_us;
+        }
+        if (!(_ending & (1U << ch)) || PULSE_TIMER->EVENTS_COMPARE[ch]) {
+            continue;
+        }
+
+        /* High: bring the falling edge forward, unless it's too close to move safely */
+        const std::uint32_t now_tick = now();
+        if (PULSE_TIMER->CC[ch] - now_tick > max_us + START_LEAD_US && !arm(ch, now_tick + max_us, CAPTURE_CC)) {
+            NRF_GPIOTE->TASKS_OUT[PULSE_GPIOTE_CHANNEL_BASE + ch] = 1; // late, drop the pin now
+            release(ch);
+        }
+    }
+    NVIC_EnableIRQ(PULSE_TIMER_IRQn);
+}
+
+bool PulseTimer::owns(unsigned int hw_pin) const {
+    const std::uint8_t busy = _busy;
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if ((busy & (1U << ch)) && _pins[ch] == hw_pin) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void PulseTimer::release_pin(unsigned int hw_pin) {
+    if (!_enabled) {
+        return;
+    }
+
+    NVIC_DisableIRQ(PULSE_TIMER_IRQn);
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if ((_busy & (1U << ch)) && _pins[ch] == hw_pin) {
+            release(ch);
+        }
+    }
+    NVIC_EnableIRQ(PULSE_TIMER_IRQn);
+}
+
+void PulseTimer::on_interrupt() {
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (!PULSE_TIMER->EVENTS_COMPARE[ch]) {
+            continue;
+        }
+        PULSE_TIMER->EVENTS_COMPARE[ch] = 0;
+
+        if (!(_busy & (1U << ch))) {
+            continue;
+        }
+
+        if (_ending & (1U << ch)) {
+            /* Falling edge already happened in hardware */
+            release(ch);
+            continue;
+        }
+
+        /* Rising edge happened, time the falling edge from it */
+        _ending |= (1U << ch);
+        if (!arm(ch, PULSE_TIMER->CC[ch] + _duration_us[ch], ISR_CAPTURE_CC)) {
+            NRF_GPIOTE->TASKS_OUT[PULSE_GPIOTE_CHANNEL_BASE + ch] = 1; // late, drop the pin now
+            release(ch);
+        }
+    }
+}
+
+bool PulseTimer::arm(unsigned int ch, std::uint32_t tick, unsigned int capture_cc) {
+    PULSE_TIMER->CC[ch] = tick;
+
+    /* A compare only fires when the counter reaches it, check that it's still ahead */
+    PULSE_TIMER->TASKS_CAPTURE[capture_cc] = 1;
+    return static_cast<std::int32_t>(tick - PULSE_TIMER->CC[capture_cc]) > 0;
+}
+
+void PulseTimer::release(unsigned int ch) {
+    PULSE_TIMER->INTENCLR = 1UL << (TIMER_INTENSET_COMPARE0_Pos + ch);
+    NRF_GPIOTE->CONFIG[PULSE_GPIOTE_CHANNEL_BASE + ch] = GPIOTE_CONFIG_MODE_Disabled << GPIOTE_CONFIG_MODE_Pos;
+    _ending &= ~(1U << ch);
+    _busy &= ~(1U << ch);
+}
@@ -0,0 +1,86 @@
+/* pulse_timer.h
+ * Hardware-timed GPIO pulses using an nRF52 TIMER, GPIOTE and PPI.
+ * Functionality:
+ *      - Both edges of a pulse are toggled through PPI by TIMER compare events, so they land on the requested
+ *        microsecond no matter how busy loop() or the BLE stack is
+ *      - A small fixed number of channels, callers fall back to software (polled) timing when all are in use
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <bluefruit.h>
+
+/* Peripherals used for hardware pulses, must not be used by anything else in the sketch */
+#define PULSE_TIMER                 NRF_TIMER4
+#define PULSE_TIMER_IRQn            TIMER4_IRQn
+#define PULSE_TIMER_IRQHandler      TIMER4_IRQHandler
+#define PULSE_TIMER_IRQ_PRIORITY    3   // highest application priority that may not call SoftDevice APIs
+#define PULSE_GPIOTE_CHANNEL_BASE   4   // attachInterrupt() allocates GPIOTE channels from 0 upwards
+#define PULSE_PPI_CHANNEL_BASE      8   // clear of the channels reserved by the SoftDevice
+
+namespace ble_uart_pin_ctrl {
+
+class PulseTimer {
+public:
+    /** Number of pulses that can be timed in hardware at once */
+    static constexpr unsigned int NUM_CHANNELS = 4;
+
+    /** Minimum delay before a hardware pulse starts, leaves time to arm every channel of a command */
+    static constexpr std::uint32_t START_LEAD_US = 50;
+
+private:
+    /** TIMER capture registers reserved for reading the counter (main context and interrupt context) */
+    static constexpr unsigned int CAPTURE_CC = 5;
+    static constexpr unsigned int ISR_CAPTURE_CC = 4;
+
+    bool _enabled;                                  /*!< True once the timer is running */
+    volatile std::uint8_t _busy;                    /*!< Bit n is set while channel n is timing a pulse */
+    volatile std::uint8_t _ending;                  /*!< Bit n is set once channel n's rising edge happened */
+    std::uint32_t _duration_us[NUM_CHANNELS];       /*!< Pulse length of each channel in us */
+    std::uint8_t _pins[NUM_CHANNELS];               /*!< Hardware pin of each channel (valid while busy) */
+
+    /* Set a compare for channel ch, returns false if the counter already passed it */
+    bool arm(unsigned int ch, std::uint32_t tick, unsigned int capture_cc);
+
+    /* Hand the pin of channel ch back to the GPIO output latch */
+    void release(unsigned int ch);
+
+public:
+    PulseTimer();
+
+    /* Start/stop the timer and claim the PPI channels (call after Bluefruit.begin()) */
+    void begin();
+    void end();
+
+    bool enabled() const { return _enabled; }
+
+    // true if no channel is free
+    bool full() const { return _busy == (1U << NUM_CHANNELS) - 1; }
+
+    // number of pulses being timed in hardware right now
+    unsigned int active() const { return __builtin_popcount(_busy); }
+
+    /* True while a channel drives the hardware pin, the timer's clock isn't micros()' so only this says it's done */
+    bool owns(unsigned int hw_pin) const;
+
+    /* Read the counter, in us */
+    std::uint32_t now();
+
+    /* Pulse a hardware pin (port * 32 + pin) high at start_tick for duration_us, returns false if no channel is free */
+    /* Note: the pin's output latch is cleared, so the pin idles low once the pulse ends */
+    bool start(unsigned int hw_pin, std::uint32_t start_tick, std::uint32_t duration_us);
+
+    /* Cut the hardware pulses of a pin to max_us, a pulse already high ends at most max_us from now */
+    /* Note: a falling edge due within START_LEAD_US of the limit is left where it is, moving it could race it */
+    void limit(unsigned int hw_pin, std::uint32_t max_us);
+
+    /* Hand a pin back to its output latch now, ending its hardware pulse */
+    void release_pin(unsigned int hw_pin);
+
+    /* Compare interrupt, moves channels from their rising edge to their falling edge and frees finished ones */
+    void on_interrupt();
+};
+
+}  // namespace ble_uart_pin_ctrl
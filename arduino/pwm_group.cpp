@@ -0,0 +1,248 @@
+/* pwm_group.cpp
+ * Per-channel PWM duty cycles on one nRF52 PWM peripheral, loaded through its sequence DMA.
+ *
+ * The peripheral counts up to COUNTERTOP and plays sequence 0 in individual mode: one 16-bit value per channel,
+ * all four read by DMA in one go when the sequence starts. With LOOP and REFRESH at 0 the sequence has a single
+ * step, and the peripheral keeps the last values it loaded until the next SEQSTART. An update fills the buffer the
+ * peripheral isn't playing, points SEQ[0] at it and restarts the sequence, so every channel changes at the same
+ * period boundary and the DMA never reads a half written buffer.
+ *
+ * A ramp is a longer sequence 0: one row of four values per step, each played for REFRESH + 1 periods, built once
+ * when the ramp is asked for so the CPU does nothing while it plays. The table is only rewritten once the
+ * peripheral has been moved off it onto a static sequence.
+ */
+
+#include "pwm_group.h"
+
+#include <cmath>
+
+#include "gpio_ports.h"
+
+using namespace ble_uart_pin_ctrl;
+
+/* Bit 15 of a sequence value picks the edge, set for high from the counter start until the duty value */
+static constexpr std::uint16_t ACTIVE_HIGH = 0x8000;
+
+PwmGroup::PwmGroup() : _enabled{false},
+                       _top{DEFAULT_TOP},
+                       _prescaler{0},
+                       _pins{-1, -1, -1, -1},
+                       _duty{},
+                       _sequences{},
+                       _next_sequence{0},
+                       _ramp{},
+                       _ramping{false} {}
+
+bool PwmGroup::begin() {
+    if (_enabled) {
+        return true;
+    }
+
+    /* analogWrite() picks peripherals it can take ownership of, so owning this one keeps it away */
+    if (!PWM_GROUP_HWPWM.takeOwnership(PWM_GROUP_OWNER_TOKEN)) {
+        return false;
+    }
+
+    PWM_GROUP_PWM->ENABLE = PWM_ENABLE_ENABLE_Disabled;
+    PWM_GROUP_PWM->MODE = PWM_MODE_UPDOWN_Up;
+    PWM_GROUP_PWM->PRESCALER = _prescaler;
+    PWM_GROUP_PWM->COUNTERTOP = _top;
+    PWM_GROUP_PWM->LOOP = 0;
+    PWM_GROUP_PWM->DECODER = (PWM_DECODER_LOAD_Individual << PWM_DECODER_LOAD_Pos)
+                           | (PWM_DECODER_MODE_RefreshCount << PWM_DECODER_MODE_Pos);
+    PWM_GROUP_PWM->SEQ[0].CNT = NUM_CHANNELS;
+    PWM_GROUP_PWM->SEQ[0].REFRESH = 0;
+    PWM_GROUP_PWM->SEQ[0].ENDDELAY = 0;
+    PWM_GROUP_PWM->SHORTS = 0;
+    PWM_GROUP_PWM->INTENCLR = 0xFFFFFFFF;
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        PWM_GROUP_PWM->PSEL.OUT[ch] = PWM_PSEL_OUT_CONNECT_Disconnected << PWM_PSEL_OUT_CONNECT_Pos;
+    }
+
+    _enabled = true;
+    return true;
+}
+
+void PwmGroup::set_timing(std::uint32_t frequency_hz, std::uint16_t top) {
+    if (top) {
+        _top = top < MIN_TOP ? MIN_TOP : (top > MAX_TOP ? MAX_TOP : top);
+    }
+    if (frequency_hz) {
+        /* Each prescaler step halves the frequency, stop at the one closest to the request */
+        std::uint8_t best = 0;
+        std::uint32_t best_error = UINT32_MAX;
+        for (std::uint8_t prescaler = 0; prescaler <= MAX_PRESCALER; ++prescaler) {
+            const std::uint32_t frequency = (BASE_CLOCK_HZ >> prescaler) / _top;
+            const std::uint32_t error = frequency > frequency_hz ? frequency - frequency_hz : frequency_hz - frequency;
+            if (error < best_error) {
+                best = prescaler;
+                best_error = error;
+            }
+        }
+        _prescaler = best;
+    }
+}
+
+bool PwmGroup::set(const std::uint8_t *hw_pins, const std::uint16_t *duties, unsigned int count) {
+    if (count > NUM_CHANNELS || !begin()) {
+        return false;
+    }
+
+    /* Free the channels of pins that were left out */
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        bool kept = false;
+        for (unsigned int i = 0; i < count; ++i) {
+            kept |= _pins[ch] == hw_pins[i];
+        }
+        if (_pins[ch] >= 0 && !kept) {
+            release(_pins[ch]);
+        }
+    }
+
+    /* New pins take free channels, they are made low outputs first so they idle low once released */
+    for (unsigned int i = 0; i < count; ++i) {
+        int ch = channel_of(hw_pins[i]);
+        if (ch < 0) {
+            ch = free_channel();
+            gpio_ports::PortMasks mask{};
+            mask.bits[hw_pins[i] / gpio_ports::PINS_PER_PORT] = 1UL << (hw_pins[i] % gpio_ports::PINS_PER_PORT);
+            gpio_ports::make_output_low(mask);
+            _pins[ch] = hw_pins[i];
+            PWM_GROUP_PWM->PSEL.OUT[ch] = hw_pins[i];
+        }
+        _duty[ch] = duties[i] < _top ? duties[i] : _top;
+    }
+
+    if (!count) {
+        /* Nothing left to drive, stop the peripheral to save power */
+        PWM_GROUP_PWM->TASKS_STOP = 1;
+        PWM_GROUP_PWM->ENABLE = PWM_ENABLE_ENABLE_Disabled;
+        _ramping = false;
+        return true;
+    }
+
+    play_duties(false);
+    return true;
+}
+
+bool PwmGroup::ramp(std::uint8_t channels, std::uint16_t start, std::uint16_t end, std::uint32_t duration_us,
+                    PwmCurve curve) {
+    channels &= (1U << NUM_CHANNELS) - 1;
+    if (!_enabled || !channels) {
+        return false;
+    }
+    start = start < _top ? start : _top;
+    end = end < _top ? end : _top;
+
+    /* As many steps as fit, but never shorter than a PWM period: each step plays for refresh + 1 periods */
+    const std::uint32_t period_ticks = static_cast<std::uint32_t>(_top) << _prescaler;
+    const std::uint64_t duration_ticks = static_cast<std::uint64_t>(duration_us) * (BASE_CLOCK_HZ / 1000000);
+    const std::uint64_t periods = duration_ticks / period_ticks;
+    const std::uint32_t steps = periods < 1 ? 1 : (periods > MAX_RAMP_STEPS ? MAX_RAMP_STEPS : periods);
+    std::uint64_t refresh = periods / steps;
+    refresh = refresh ? refresh - 1 : 0;
+    refresh = refresh > MAX_REFRESH ? MAX_REFRESH : refresh;
+
+    /* Ramping channels jump to the start value, and get off the ramp table before it's rewritten */
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (channels & (1U << ch)) {
+            _duty[ch] = start;
+        }
+    }
+    play_duties(ramping());
+
+    /* Exponential ramps change by the same ratio every step (offset by one so they can start or end at 0) */
+    const float ratio = curve == PwmCurve::EXPONENTIAL
+                      ? std::pow((end + 1.0f) / (start + 1.0f), 1.0f / static_cast<float>(steps)) : 1.0f;
+    float level = start + 1.0f;
+    for (std::uint32_t step = 0; step < steps; ++step) {
+        std::uint16_t value;
+        if (step + 1 == steps) {
+            value = end; // land exactly, whatever rounding did on the way
+        } else if (curve == PwmCurve::EXPONENTIAL) {
+            level *= ratio;
+            value = static_cast<std::uint16_t>(level - 0.5f);
+        } else {
+            value = static_cast<std::uint16_t>(start + (static_cast<std::int32_t>(end) - start)
+                                                       * static_cast<std::int32_t>(step + 1)
+                                                       / static_cast<std::int32_t>(steps));
+        }
+        for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+            _ramp[step][ch] = ((channels & (1U << ch)) ? value : _duty[ch]) | ACTIVE_HIGH;
+        }
+    }
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (channels & (1U << ch)) {
+            _duty[ch] = end;
+        }
+    }
+
+    /* The peripheral plays the table by itself and holds the last step once it's done */
+    PWM_GROUP_PWM->SEQ[0].PTR = static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(_ramp));
+    PWM_GROUP_PWM->SEQ[0].CNT = steps * NUM_CHANNELS;
+    PWM_GROUP_PWM->SEQ[0].REFRESH = refresh;
+    PWM_GROUP_PWM->EVENTS_SEQEND[0] = 0;
+    PWM_GROUP_PWM->TASKS_SEQSTART[0] = 1;
+    _ramping = true;
+    return true;
+}
+
+bool PwmGroup::ramping() const {
+    return _ramping && !PWM_GROUP_PWM->EVENTS_SEQEND[0];
+}
+
+void PwmGroup::play_duties(bool wait) {
+    std::uint16_t *const sequence = _sequences[_next_sequence];
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        sequence[ch] = _duty[ch] | ACTIVE_HIGH;
+    }
+
+    PWM_GROUP_PWM->PRESCALER = _prescaler;
+    PWM_GROUP_PWM->COUNTERTOP = _top;
+    PWM_GROUP_PWM->SEQ[0].PTR = static_cast<std::uint32_t>(reinterpret_cast<std::uintptr_t>(sequence));
+    PWM_GROUP_PWM->SEQ[0].CNT = NUM_CHANNELS;
+    PWM_GROUP_PWM->SEQ[0].REFRESH = 0;
+    PWM_GROUP_PWM->EVENTS_SEQSTARTED[0] = 0;
+    PWM_GROUP_PWM->ENABLE = PWM_ENABLE_ENABLE_Enabled;
+    PWM_GROUP_PWM->TASKS_SEQSTART[0] = 1;
+    _next_sequence ^= 1;
+    _ramping = false;
+
+    /* The new sequence starts at the next period, DMA has read it (and left any ramp table) once it has */
+    if (wait) {
+        const std::uint32_t start_us = micros();
+        const std::uint32_t timeout_us = 2 * ((static_cast<std::uint32_t>(_top) << _prescaler) / 16) + 10;
+        while (!PWM_GROUP_PWM->EVENTS_SEQSTARTED[0] && micros() - start_us < timeout_us) {
+        }
+    }
+}
+
+void PwmGroup::release(unsigned int hw_pin) {
+    const int ch = channel_of(hw_pin);
+    if (ch < 0) {
+        return;
+    }
+
+    /* The pin falls back to its output latch, which was cleared when it joined */
+    PWM_GROUP_PWM->PSEL.OUT[ch] = PWM_PSEL_OUT_CONNECT_Disconnected << PWM_PSEL_OUT_CONNECT_Pos;
+    _pins[ch] = -1;
+    _duty[ch] = 0;
+}
+
+int PwmGroup::channel_of(unsigned int hw_pin) const {
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (_pins[ch] == static_cast<int>(hw_pin)) {
+            return static_cast<int>(ch);
+        }
+    }
+    return -1;
+}
+
+int PwmGroup::free_channel() const {
+    for (unsigned int ch = 0; ch < NUM_CHANNELS; ++ch) {
+        if (_pins[ch] < 0) {
+            return static_cast<int>(ch);
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,114 @@
+/* pwm_group.h
+ * Per-channel PWM duty cycles on one nRF52 PWM peripheral, loaded through its sequence DMA.
+ * Functionality:
+ *      - Drive up to 4 pins, each with its own duty cycle, updating every channel in the same PWM period
+ *      - Choose the resolution (counter top, up to 15 bits) and the frequency the prescaler gets closest to
+ *      - Ramp channels between two duties from a table played by the peripheral, with no CPU work per step
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <bluefruit.h>
+
+/* PWM peripheral used for the group, taken from analogWrite() (nRF52832 only has 3 of them) */
+#ifdef NRF_PWM3
+#   define PWM_GROUP_PWM        NRF_PWM3
+#   define PWM_GROUP_HWPWM      HwPWM3
+#else
+#   define PWM_GROUP_PWM        NRF_PWM2
+#   define PWM_GROUP_HWPWM      HwPWM2
+#endif
+#define PWM_GROUP_OWNER_TOKEN   0x50574D47 // "PWMG", see HardwarePWM::takeOwnership()
+
+namespace ble_uart_pin_ctrl {
+
+/** Ramp shapes */
+enum class PwmCurve : std::uint8_t {
+    LINEAR = 0,         // same duty change every step
+    EXPONENTIAL = 1     // same duty ratio every step, looks even to the eye (and to skin)
+};
+
+class PwmGroup {
+public:
+    /** Number of pins the group can drive */
+    static constexpr unsigned int NUM_CHANNELS = 4;
+
+    /** Counter top range, a duty of top (or more) is always high */
+    static constexpr std::uint16_t MIN_TOP = 3;
+    static constexpr std::uint16_t MAX_TOP = 32767;
+
+    /** Same timing as analogWrite(): 8-bit duty at 16 MHz / 255 (~62.7 kHz) */
+    static constexpr std::uint16_t DEFAULT_TOP = 255;
+
+    /** PWM clock before the prescaler */
+    static constexpr std::uint32_t BASE_CLOCK_HZ = 16000000;
+
+    /** Most steps in a ramp, shorter ramps get one step per PWM period */
+    static constexpr std::uint32_t MAX_RAMP_STEPS = 256;
+
+private:
+    /** Most prescaler steps (16 MHz / 2^7 = 125 kHz) */
+    static constexpr std::uint8_t MAX_PRESCALER = 7;
+
+    /** Most extra periods a sequence step can be held for (24-bit SEQ[n].REFRESH) */
+    static constexpr std::uint32_t MAX_REFRESH = 0xFFFFFF;
+
+    bool _enabled;                                  /*!< True once the peripheral is claimed and set up */
+    std::uint16_t _top;                             /*!< Counter top, duty range is 0 to _top */
+    std::uint8_t _prescaler;                        /*!< Clock is BASE_CLOCK_HZ / 2^_prescaler */
+    std::int16_t _pins[NUM_CHANNELS];               /*!< Hardware pin of each channel (-1 if free) */
+    std::uint16_t _duty[NUM_CHANNELS];              /*!< Duty of each channel (where a ramp ends, while ramping) */
+    std::uint16_t _sequences[2][NUM_CHANNELS];      /*!< DMA buffers, one is played while the other is filled */
+    std::uint8_t _next_sequence;                    /*!< Index of the buffer to fill next */
+    std::uint16_t _ramp[MAX_RAMP_STEPS][NUM_CHANNELS]; /*!< DMA table of the last ramp */
+    bool _ramping;                                  /*!< True from the start of a ramp until something replaces it */
+
+    /* First channel without a pin (-1 if none) */
+    int free_channel() const;
+
+    /* Play _duty on every channel, waiting until the peripheral has loaded it if wait is set */
+    void play_duties(bool wait);
+
+public:
+    PwmGroup();
+
+    /* Set up the peripheral, returns false if analogWrite() (or anything else) already owns it */
+    /* Note: set() calls it, call it first to know set() can't fail on a count of at most NUM_CHANNELS */
+    bool begin();
+
+    /* Change the resolution and/or frequency (0 keeps the current one), applies from the next set() */
+    /* Note: the frequency lands on BASE_CLOCK_HZ / (2^n * top), the closest of those to frequency_hz is used */
+    void set_timing(std::uint32_t frequency_hz, std::uint16_t top);
+
+    /* Drive exactly the listed hardware pins (port * 32 + pin) with their duties, pins left out are released */
+    /* Returns false if there are more than NUM_CHANNELS pins or the peripheral can't be claimed, nothing is changed */
+    /* Note: pins keep their channel across calls, so only pins that join the group can glitch */
+    bool set(const std::uint8_t *hw_pins, const std::uint16_t *duties, unsigned int count);
+
+    /* Ramp the channels in the mask (bit n = channel n) from start to end over duration_us, others hold */
+    /* Returns false if the group isn't running or no channel is given. set() replaces a ramp. */
+    bool ramp(std::uint8_t channels, std::uint16_t start, std::uint16_t end, std::uint32_t duration_us,
+              PwmCurve curve);
+
+    /* True while a ramp is playing */
+    bool ramping() const;
+
+    /* Stop driving a hardware pin (leaves it a low output), nothing happens if it isn't in the group */
+    void release(unsigned int hw_pin);
+
+    /* Hardware pin of channel ch (-1 if free) */
+    int pin(unsigned int ch) const { return _pins[ch]; }
+
+    /* Channel driving a hardware pin (-1 if none) */
+    int channel_of(unsigned int hw_pin) const;
+
+    /* Duty of channel ch (where it ends up, while ramping) */
+    std::uint16_t duty(unsigned int ch) const { return _duty[ch]; }
+
+    std::uint16_t top() const { return _top; }
+    std::uint32_t frequency_hz() const { return (BASE_CLOCK_HZ >> _prescaler) / _top; }
+};
+
+}  // namespace ble_uart_pin_ctrl
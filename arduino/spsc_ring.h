@@ -0,0 +1,62 @@
+/* spsc_ring.h
+ * Fixed-capacity ring buffer shared by one producer and one consumer running in different contexts.
+ * Functionality:
+ *      - Lock-free, each side only writes its own index so neither has to disable interrupts
+ *      - A side used from more than one context must be serialized by its callers (see PinCtrl::receive())
+ *      - Free running indices, so a full ring holds all CAPACITY items
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ble_uart_pin_ctrl {
+
+template <typename T, std::size_t CAPACITY>
+class SpscRing {
+    static_assert(CAPACITY && !(CAPACITY & (CAPACITY - 1)), "SpscRing capacity must be a power of two");
+
+    T _items[CAPACITY];
+    volatile std::uint32_t _head;   /*!< Items pushed so far, only written by the producer */
+    volatile std::uint32_t _tail;   /*!< Items popped so far, only written by the consumer */
+
+public:
+    SpscRing() : _items{}, _head{0}, _tail{0} {}
+
+    /* Producer: add an item, returns false if the ring is full */
+    bool push(const T &item) {
+        const std::uint32_t head = _head;
+        if (head - _tail == CAPACITY) {
+            return false;
+        }
+
+        _items[head % CAPACITY] = item;
+        __sync_synchronize(); // the item must be visible before the index that publishes it
+        _head = head + 1;
+        return true;
+    }
+
+    /* Consumer: take the oldest item, returns false if the ring is empty */
+    bool pop(T &item) {
+        const std::uint32_t tail = _tail;
+        if (_head == tail) {
+            return false;
+        }
+
+        __sync_synchronize(); // read the item only after seeing the index that published it
+        item = _items[tail % CAPACITY];
+        __sync_synchronize(); // and finish reading it before handing the slot back
+        _tail = tail + 1;
+        return true;
+    }
+
+    /* Consumer: drop everything (the producer must not be running) */
+    void clear() { _tail = _head; }
+
+    std::size_t size() const { return _head - _tail; }
+    bool empty() const { return _head == _tail; }
+    static constexpr std::size_t capacity() { return CAPACITY; }
+};
+
+}  // namespace ble_uart_pin_ctrl
@@ -0,0 +1,86 @@
+/* wire_format.h
+ * Byte order conversion for the packed structs sent over BLE UART.
+ * Functionality:
+ *      - Describe the multi-byte fields of a struct once, at compile time
+ *      - Convert a whole struct between network (big-endian) and host byte order in one generic call
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Describe a big-endian field (or array of fields) of a packed wire struct as (offset, element size, count) */
+#define WIRE_FIELD(type, field) offsetof(type, field), sizeof(type::field), 1
+#define WIRE_ARRAY(type, field) offsetof(type, field), sizeof(type::field[0]), sizeof(type::field) / sizeof(type::field[0])
+
+namespace ble_uart_pin_ctrl {
+namespace wire_format {
+
+/* Reverse the bytes of one field in place (single bytes have no order) */
+template <std::size_t SIZE>
+struct SwapBytes;
+
+template <>
+struct SwapBytes<1> {
+    static void apply(std::uint8_t *) {}
+};
+
+template <>
+struct SwapBytes<2> {
+    static void apply(std::uint8_t *bytes) {
+        std::uint16_t value;
+        memcpy(&value, bytes, sizeof(value));
+        value = __builtin_bswap16(value);
+        memcpy(bytes, &value, sizeof(value));
+    }
+};
+
+template <>
+struct SwapBytes<4> {
+    static void apply(std::uint8_t *bytes) {
+        std::uint32_t value;
+        memcpy(&value, bytes, sizeof(value));
+        value = __builtin_bswap32(value);
+        memcpy(bytes, &value, sizeof(value));
+    }
+};
+
+/* Swap every listed field, FIELDS is a flat list of (offset, element size, count) triples */
+template <std::size_t... FIELDS>
+struct Fields;
+
+template <>
+struct Fields<> {
+    static void apply(std::uint8_t *) {}
+};
+
+template <std::size_t OFFSET, std::size_t SIZE, std::size_t COUNT, std::size_t... REST>
+struct Fields<OFFSET, SIZE, COUNT, REST...> {
+    static void apply(std::uint8_t *bytes) {
+        for (std::size_t i = 0; i < COUNT; ++i) {
+            SwapBytes<SIZE>::apply(bytes + OFFSET + i * SIZE);
+        }
+        Fields<REST...>::apply(bytes);
+    }
+};
+
+/* Multi-byte fields of each wire struct, specialised next to the struct: struct Layout<T> : Fields<...> {} */
+template <typename T>
+struct Layout;
+
+/* Convert a wire struct from network to host byte order, in place */
+template <typename T>
+void to_host(T &frame) {
+    Layout<T>::apply(reinterpret_cast<std::uint8_t *>(&frame));
+}
+
+/* Convert a wire struct from host to network byte order, in place */
+template <typename T>
+void to_network(T &frame) {
+    Layout<T>::apply(reinterpret_cast<std::uint8_t *>(&frame));
+}
+
+}  // namespace wire_format
+}  // namespace ble_uart_pin_ctrl
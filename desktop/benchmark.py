@@ -0,0 +1,142 @@
+# -*- coding: utf-8 -*-
+"""
+Measures command round trip latency, sustained command rate and drop rate of a device running BleUartPinCtrl, using
+its ECHO command. Run it once per firmware build or BLE adapter to qualify them, e.g.
+    python benchmark.py --device Bluefruit52-0123ABCD --count 500 --window 4
+"""
+
+import argparse
+import asyncio
+import itertools
+import time
+from typing import List, NamedTuple, Optional
+
+from ble_uart_pin_ctrl import BleUartPinCtrl, BleUartPinCtrlBatch
+
+
+class BenchmarkResult(NamedTuple):
+    name: str
+    sent: int               # commands sent
+    dropped: int            # replies that never came
+    elapsed: float          # wall time of the run in s
+    latencies: List[float]  # round trip of every reply in s
+    device_us: List[int]    # time between frame complete and command run on the device, per reply
+
+    def commands_per_second(self, commands_per_reply: int) -> float:
+        return (self.sent - self.dropped) * commands_per_reply / self.elapsed if self.elapsed > 0 else 0.0
+
+
+def percentile(values: List[float], fraction: float) -> float:
+    """
+    Nearest-rank percentile, good enough for a few hundred samples
+    """
+    if len(values) == 0:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(round(fraction * (len(ordered) - 1))))]
+
+
+async def run_echoes(pin_ctrl: BleUartPinCtrl, name: str, count: int, window: int, timeout: float,
+                     filler_length: int = 0, batch_size: int = 1) -> BenchmarkResult:
+    """
+    Sends count echoes (or batches of echoes) keeping up to window of them in flight
+    :param filler_length: filler bytes per echo, sets the frame payload size
+    :param batch_size: echoes per batch frame, all but the last are silent, so each batch gets one reply
+    """
+    sequences = itertools.count()
+    in_flight = asyncio.Semaphore(window)
+    latencies = list()
+    device_us = list()
+    dropped = 0
+
+    async def one():
+        nonlocal dropped
+        async with in_flight:
+            sequence = next(sequences)
+            start = time.perf_counter()
+            try:
+                if batch_size == 1:
+                    reply = await pin_ctrl.echo(sequence, filler_length, timeout=timeout)
+                else:
+                    batch = BleUartPinCtrlBatch()
+                    for _ in range(batch_size - 1):
+                        batch.echo(sequence, filler_length, BleUartPinCtrl.ECHO_SILENT)
+                    batch.echo(sequence, filler_length)
+                    future = pin_ctrl.expect_echo(sequence)
+                    for payload in batch.to_payloads():
+                        await pin_ctrl.write_frame(payload)
+                    reply = await asyncio.wait_for(future, timeout)
+            except asyncio.TimeoutError:
+                dropped += 1
+                pin_ctrl.pending_echoes.pop(sequence, None)
+                return
+            latencies.append(time.perf_counter() - start)
+            device_us.append((reply.dispatched_us - reply.received_us) & 0xFFFFFFFF)
+
+    start = time.perf_counter()
+    await asyncio.gather(*(one() for _ in range(count)))
+    return BenchmarkResult(name=name, sent=count, dropped=dropped, elapsed=time.perf_counter() - start,
+                           latencies=latencies, device_us=device_us)
+
+
+def print_result(result: BenchmarkResult, commands_per_reply: int = 1):
+    print("{:<22} {:>8.2f} {:>8.2f} {:>10.1f} {:>7.2f}% {:>9.0f}".format(
+        result.name,
+        percentile(result.latencies, 0.50) * 1000, percentile(result.latencies, 0.99) * 1000,
+        result.commands_per_second(commands_per_reply),
+        100.0 * result.dropped / result.sent if result.sent else 0.0,
+        sum(result.device_us) / len(result.device_us) if result.device_us else float("nan")))
+
+
+def parse_sizes(text: str) -> List[int]:
+    return [int(size) for size in text.split(",") if size.strip()]
+
+
+async def run(args: argparse.Namespace):
+    pin_ctrl = await BleUartPinCtrl.new(args.device)
+    print("Connected to", pin_ctrl.get_mac())
+
+    if args.low_latency:
+        print(await pin_ctrl.request_low_latency())
+    if args.streaming:
+        await pin_ctrl.enable_streaming()
+
+    print("{:<22} {:>8} {:>8} {:>10} {:>8} {:>9}".format("test", "p50 ms", "p99 ms", "cmds/s", "dropped",
+                                                          "device us"))
+
+    # Round trip across frame payload sizes (echo header is 7 bytes, the rest is filler)
+    for size in args.payload_sizes:
+        filler_length = max(0, min(size, BleUartPinCtrl.MAX_FRAME_PAYLOAD) - 7)
+        result = await run_echoes(pin_ctrl, "payload {} B".format(filler_length + 7), args.count, args.window,
+                                  args.timeout, filler_length=filler_length)
+        print_result(result)
+
+    # Command rate across batch sizes (one reply per batch)
+    for batch_size in args.batch_sizes:
+        result = await run_echoes(pin_ctrl, "batch x{}".format(batch_size), args.count, args.window, args.timeout,
+                                  batch_size=batch_size)
+        print_result(result, commands_per_reply=batch_size)
+
+    await pin_ctrl.client.disconnect()
+
+
+def main(argv: Optional[List[str]] = None):
+    parser = argparse.ArgumentParser(description="Benchmark a BleUartPinCtrl device with ECHO commands")
+    parser.add_argument("--device", default=None, help="device name (default: first with the Nordic UART service)")
+    parser.add_argument("--count", type=int, default=200, help="echoes (or batches) per test")
+    parser.add_argument("--window", type=int, default=1, help="echoes kept in flight at once")
+    parser.add_argument("--timeout", type=float, default=2.0, help="time before a reply counts as dropped, in s")
+    parser.add_argument("--payload-sizes", type=parse_sizes, default=parse_sizes("7,32,64,128,200,255"),
+                        help="comma separated frame payload sizes in bytes")
+    parser.add_argument("--batch-sizes", type=parse_sizes, default=parse_sizes("1,4,16,32"),
+                        help="comma separated echoes per batch")
+    parser.add_argument("--low-latency", action="store_true", help="ask for the fastest connection parameters first")
+    parser.add_argument("--streaming", action="store_true", help="write without response, paced by FIFO credits")
+    args = parser.parse_args(argv)
+
+    loop = asyncio.get_event_loop()
+    loop.run_until_complete(run(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,18 +1,44 @@
+import array
+import asyncio
 import struct
+import time
 from enum import IntEnum
 
 from bleak import BleakScanner, BleakClient
-from typing import List, Optional, Callable
+from typing import Deque, Dict, List, NamedTuple, Optional, Callable, Set, TextIO, Tuple
+from collections import deque
 
 from bleak.backends.client import BaseBleakClient
 
+import ble_uart_pin_ctrl_schema as schema
 
-def _rx_callback(sender, data):
+
+def _make_crc8_table() -> List[int]:
+    """
+    Builds the lookup table for CRC-8 with polynomial 0x07 (see crc8.h)
+    """
+    table = list()
+    for i in range(256):
+        crc = i
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+        table.append(crc)
+    return table
+
+
+_CRC8_TABLE = _make_crc8_table()
+
+
+def crc8(data: bytes, crc: int = 0) -> int:
     """
-    Private callback to handle receiving data
+    Computes the CRC-8 used to check frames (polynomial 0x07, initial value 0x00)
+    :param data: bytes to check
+    :param crc: CRC to continue from
+    :return: CRC of the bytes
     """
-    # TODO implement (???)
-    print("Rx {0}: {1}".format(sender, data))
+    for byte in data:
+        crc = _CRC8_TABLE[crc ^ byte]
+    return crc
 
 
 class BleUartPinCtrlCommands(IntEnum):
@@ -22,6 +48,33 @@ class BleUartPinCtrlCommands(IntEnum):
     GPIO_QUERY = 0x04
     PWM_SET = 0x05
     QUERY_STATE = 0x06
+    BATCH = 0x07
+    GPIO_PULSE_SCHEDULE = 0x08
+    INPUT_SUBSCRIBE = 0x09
+    INPUT_EVENTS = 0x0A
+    CONN_PARAMS = 0x0B
+    ECHO = 0x0C
+    STATS = 0x0D
+    LOG_READ = 0x0E
+    PATTERN_UPLOAD = 0x0F
+    PATTERN_PLAY = 0x10
+    PATTERN_STOP = 0x11
+    COMMIT = 0x12
+    PWM_SET_MULTI = 0x13
+    PWM_RAMP = 0x14
+    SCHEDULE = 0x15
+    FLOW_CONTROL = 0x16
+    CREDITS = 0x17
+    PROTOCOL_VERSION = 0x18
+    COMPACT_GPIO_CONFIGURE = 0x19
+    COMPACT_GPIO_WRITE = 0x1A
+    COMPACT_GPIO_PULSE = 0x1B
+    COMPACT_GPIO_PULSE_SCHEDULE = 0x1C
+    COMPACT_PWM_SET = 0x1D
+    STATE_SYNC = 0x1E
+    ADC_STREAM = 0x1F
+    ADC_SAMPLES = 0x20
+    SAFETY = 0x21
 
 
 class BleUartPinCtrlGpioDirections(IntEnum):
@@ -34,16 +87,657 @@ class BleUartPinCtrlGpioOutputs(IntEnum):
     OUT_HIGH = 0x01
 
 
+class BleUartPinCtrlPulseModes(IntEnum):
+    SIMULTANEOUS = 0x00,
+    SEQUENTIAL = 0x01
+
+
+class BleUartPinCtrlPwmCurves(IntEnum):
+    LINEAR = 0x00,
+    EXPONENTIAL = 0x01
+
+
+class BleUartPinCtrlConnPhys(IntEnum):
+    PHY_KEEP = 0x00,
+    PHY_1M = 0x01,
+    PHY_2M = 0x02
+
+
+class BleUartPinCtrlLinkLoss(IntEnum):
+    LINK_LOSS_KEEP = 0x00,
+    LINK_LOSS_OFF = 0x01,
+    LINK_LOSS_HOLD = 0x02
+
+
+class BleUartPinCtrlKeyframe(NamedTuple):
+    """
+    One step of a pattern (see BleUartPinCtrl.upload_pattern): sets the pins, then holds for duration_us
+    """
+    port: int
+    pins: List[int]
+    level: int          # 0 = low, 1 = high, or the PWM intensity (0-255) if pwm is set
+    duration_us: int
+    pwm: bool = False
+
+
+class BleUartPinCtrlConnParams(NamedTuple):
+    """
+    Connection parameters in effect, as reported by BleUartPinCtrl.set_connection_parameters
+    """
+    interval_ms: float          # connection interval (0 if the device isn't connected)
+    slave_latency: int          # connection events the device may skip
+    supervision_timeout_ms: int
+    phy: BleUartPinCtrlConnPhys
+    data_length: int            # link layer payload size in bytes
+    mtu: int                    # ATT MTU in bytes
+
+
+class BleUartPinCtrlEchoReply(NamedTuple):
+    """
+    Reply to BleUartPinCtrl.echo, times are device micros()
+    """
+    sequence: int
+    received_us: int    # when the frame holding the echo (or the schedule it was queued by) was complete
+    dispatched_us: int  # when the echo was run
+    filler: bytes       # the filler, if it was asked back
+
+
+class BleUartPinCtrlClockSync(NamedTuple):
+    """
+    Estimated device clock, as measured by BleUartPinCtrl.sync_clock
+    """
+    offset_us: int      # device micros() minus host time.perf_counter() in us (modulo 2^32)
+    round_trip: float   # round trip of the echo the estimate came from in s, the offset is good to about half of it
+
+
+class BleUartPinCtrlStats(NamedTuple):
+    """
+    Performance counters of the device, as reported by BleUartPinCtrl.get_stats (all since the last reset)
+    """
+    elapsed_ms: int             # time since the counters were reset
+    service_calls: int          # PinCtrl::service() calls
+    max_service_us: int         # longest PinCtrl::service() call
+    max_pulse_late_us: int      # latest a software-timed pulse edge was applied
+    rx_fifo_high_water: int     # most bytes seen waiting in the BLE UART RX FIFO
+    bytes_received: int
+    dropped_bytes: int          # framing errors, see FrameErrors in framing.h
+    bad_length: int
+    bad_crc: int
+    timeouts: int
+    bad_commands: int           # frames with an unknown or malformed command
+    commands: Dict[int, int]    # runs per command id (BleUartPinCtrlCommands), batched sub-commands included
+
+    @property
+    def service_rate_hz(self) -> float:
+        return 1000.0 * self.service_calls / self.elapsed_ms if self.elapsed_ms else 0.0
+
+
+class BleUartPinCtrlLogRecord(NamedTuple):
+    """
+    Command recorded by the device's binary log, as returned by BleUartPinCtrl.read_log
+    """
+    time_us: int        # device micros() when the command ran
+    command: int        # command id (BleUartPinCtrlCommands)
+    length: int         # bytes of the command and its data
+    args: bytes         # first 8 bytes of the command's data, as sent (zero padded)
+
+
+class BleUartPinCtrlPinState(NamedTuple):
+    """
+    State of one GPIO, as reported by BleUartPinCtrl.query_gpio
+    """
+    input: bool         # input level
+    output: bool        # output latch
+    is_output: bool     # direction
+    pulsing: bool       # a pulse is active or queued
+    duty_cycle: int     # last PWM duty set (0 if none)
+
+
+class BleUartPinCtrlDeviceState(NamedTuple):
+    """
+    State of the whole device, as reported by BleUartPinCtrl.query_state. Port registers are listed per nRF52
+    hardware port (P0, P1) and PWM duty cycles are keyed by hardware pin number (port * 32 + pin).
+    """
+    uptime_ms: int
+    inputs: List[int]
+    outputs: List[int]
+    directions: List[int]
+    pulsing: List[int]
+    queued_pulse_edges: int
+    hw_pulses_active: int
+    duty_cycles: Dict[int, int]
+
+
+class BleUartPinCtrlSafety(NamedTuple):
+    """
+    Safety settings of the device, as reported by BleUartPinCtrl.set_safety. Limited pins are listed per nRF52
+    hardware port (P0, P1).
+    """
+    limited: List[int]          # pins with an on-time limit
+    link_loss: BleUartPinCtrlLinkLoss  # what a dropped link does, LINK_LOSS_OFF or LINK_LOSS_HOLD
+    failsafes: int              # times a link loss drove the outputs off since boot
+    auto_offs: int              # times a pin was switched off for staying on too long since boot
+
+
+class BleUartPinCtrlInputEvent(NamedTuple):
+    """
+    Debounced level change of a subscribed input, as reported to the BleUartPinCtrl.subscribe_inputs callback
+    """
+    pin: int            # pin number, numbered like the subscription
+    level: bool         # level after the change
+    time_us: int        # device micros() at the change (wraps every ~71 minutes)
+
+
+class BleUartPinCtrlFrameReceiver:
+    """
+    Reassembles frames (see BleUartPinCtrl.frame) from notification data. A frame may be split across
+    notifications or share one with other frames, bad bytes and frames are dropped up to the next sync byte.
+    """
+    def __init__(self, sync: int, max_payload: int):
+        self.sync = sync
+        self.max_payload = max_payload
+        # Bytes received but not yet part of a complete frame
+        self.buffer = bytearray()
+        # Number of bytes thrown away while resynchronizing
+        self.dropped_bytes = 0
+
+    def feed(self, data: bytes) -> List[bytes]:
+        """
+        Adds received bytes
+        :param data: notification data
+        :return: payloads of every frame completed by the data, in order
+        """
+        self.buffer += data
+        payloads = list()
+        while len(self.buffer) > 0:
+            if self.buffer[0] != self.sync:
+                self._resync()
+                continue
+            if len(self.buffer) < 2:
+                break  # missing length
+            length = self.buffer[1]
+            if length == 0:
+                self._resync()
+                continue
+            if len(self.buffer) < length + 3:
+                break  # missing payload or CRC
+            if crc8(self.buffer[1:length + 2]) != self.buffer[length + 2]:
+                self._resync()
+                continue
+            payloads.append(bytes(self.buffer[2:length + 2]))
+            del self.buffer[:length + 3]
+        return payloads
+
+    def _resync(self):
+        """
+        Drops the first byte and everything up to the next sync byte
+        """
+        next_sync = self.buffer.find(bytes([self.sync]), 1)
+        if next_sync < 0:
+            next_sync = len(self.buffer)
+        self.dropped_bytes += next_sync
+        del self.buffer[:next_sync]
+
+
+class BleUartPinCtrlShadow:
+    """
+    Shadow of the pin levels synced with STATE_SYNC (see StateSync in bleuart_pin_ctrl.h): the levels wanted, and the
+    last state the device acknowledged, which deltas are against. Pins are hardware pin numbers (port * 32 + pin),
+    levels are 0 = low, 255 = high and anything between a PWM duty. Keep it across a reconnect to resume with a delta.
+    """
+    # Sequences are 16-bit and wrap
+    SEQUENCE_MASK = 0xFFFF
+    # Unacknowledged frames after which a full snapshot goes instead (the device may not know STATE_SYNC)
+    MAX_UNACKED = 64
+
+    def __init__(self, full_interval: float = 5.0):
+        """
+        :param full_interval: longest time between full snapshots in s, they bring back a device that lost track
+        """
+        self.full_interval = full_interval
+        # Levels wanted, per hardware pin
+        self.levels: Dict[int, int] = dict()
+        # Sequence of the last frame made
+        self.sequence = 0
+        # State deltas are against and its levels, None until the first full snapshot
+        self.base: Optional[int] = None
+        self.base_levels: Dict[int, int] = dict()
+        # Frames made after base, oldest first: sequence, levels it brings the pins to, pins it lists
+        self.unacked: Deque[Tuple[int, Dict[int, int], Set[int]]] = deque()
+        # Sequence and time of the last full snapshot
+        self.full_sequence: Optional[int] = None
+        self.full_time = 0.0
+        # Set when the device refused a delta made after the last full snapshot
+        self.need_full = False
+
+    def set_levels(self, pins: List[int], level: int):
+        """
+        Sets the level wanted on hardware pins, sent by the next frame
+        """
+        if level < 0 or level > 255:
+            raise ValueError("Levels are 0 to 255", level)
+        for pin in pins:
+            self.levels[pin] = level
+
+    def make_frame(self, full: bool = False, now: Optional[float] = None) -> Optional[Tuple[int, int, int,
+                                                                                          List[Tuple[int, int]]]]:
+        """
+        Makes the next frame: a full snapshot if asked for, due or needed, else the pins changed since base
+        :param full: list every pin
+        :param now: time.monotonic() now
+        :return: sequence, base, flags and (pin, level) entries of the frame, None if there's nothing to send
+        """
+        now = time.monotonic() if now is None else now
+        full = (full or self.need_full or self.base is None or len(self.unacked) >= self.MAX_UNACKED
+                or now - self.full_time >= self.full_interval)
+        if full:
+            entries = sorted(self.levels.items())
+        else:
+            sent = self.unacked[-1][1] if self.unacked else self.base_levels
+            if self.levels == sent:
+                return None
+
+            # Pins sent since base go again, the device may have any of the frames since then
+            touched = set().union(*(pins for _, _, pins in self.unacked))
+            changed = {pin for pin, level in self.levels.items() if self.base_levels.get(pin) != level}
+            entries = sorted((pin, self.levels[pin]) for pin in changed | (touched & self.levels.keys()))
+        if len(entries) > BleUartPinCtrl.MAX_STATE_SYNC_PINS:
+            raise ValueError("Too many pins for one state sync", len(entries))
+
+        self.sequence = (self.sequence + 1) & self.SEQUENCE_MASK
+        if full:
+            # Later deltas go against the snapshot, a device that missed it refuses them
+            self.base, self.base_levels = self.sequence, dict(self.levels)
+            self.unacked.clear()
+            self.full_sequence, self.full_time = self.sequence, now
+            self.need_full = False
+            return self.sequence, self.sequence, BleUartPinCtrl.STATE_SYNC_FULL, entries
+
+        self.unacked.append((self.sequence, dict(self.levels), {pin for pin, _ in entries}))
+        return self.sequence, self.base, 0, entries
+
+    def acknowledge(self, sequence: int, status: int):
+        """
+        Takes in the device's reply to a frame
+        :param sequence: sequence of the frame replied to
+        :param status: 0 if it was applied, STATE_SYNC_NEED_FULL if the device wants a full snapshot
+        """
+        if status == BleUartPinCtrl.STATE_SYNC_NEED_FULL:
+            # Refusals of frames made before the last full snapshot are answered by it already
+            if self.full_sequence is None or self.sequence_before(self.full_sequence, sequence):
+                self.need_full = True
+            return
+
+        # Frames up to this one are in, so deltas can go against it
+        while self.unacked and not self.sequence_before(sequence, self.unacked[0][0]):
+            unacked_sequence, levels, _ = self.unacked.popleft()
+            if unacked_sequence == sequence:
+                self.base, self.base_levels = sequence, levels
+
+    @classmethod
+    def sequence_before(cls, a: int, b: int) -> bool:
+        """
+        True if sequence a comes before b (see PinCtrl::state_before)
+        """
+        return 0 < ((b - a) & cls.SEQUENCE_MASK) < 0x8000
+
+
+class BleUartPinCtrlAdcStream:
+    """
+    Reassembles the samples of an ADC stream (see AdcStream and AdcSamples in bleuart_pin_ctrl.h) into one flat
+    buffer of unsigned 16-bit samples, scan after scan with one sample per input (lowest input first), e.g.
+        first_scan, samples = stream.take()
+        scans = numpy.frombuffer(samples, dtype=numpy.uint16).reshape(-1, len(stream.inputs))
+    Scan i of the buffer is scan first_scan + i of the stream, taken (first_scan + i) / rate_hz s after its start.
+    Scans lost on the way are filled with LOST_SAMPLE, so the buffer stays evenly spaced in time.
+    """
+    # Fills the samples of lost scans, no 12-bit sample reads this
+    LOST_SAMPLE = 0xFFFF
+    # Scan numbers are 32-bit and wrap
+    SCAN_MASK = 0xFFFFFFFF
+
+    def __init__(self, callback: Optional[Callable[["BleUartPinCtrlAdcStream"], None]] = None):
+        """
+        :param callback: called with the stream after every notification's samples are added
+        """
+        self.callback = callback
+        # Streamed inputs (AIN numbers), scan period and scans per notification, as the device reported them
+        self.inputs: List[int] = list()
+        self.period_ticks = 0
+        self.scans_per_notification = 0
+        # Samples since the last take(), and the (unwrapped) number of the scan they start at
+        self.samples = array.array("H")
+        self.first_scan = 0
+        # Number of the next scan expected, None until the first notification
+        self.next_scan: Optional[int] = None
+        # Scans lost since the stream started
+        self.lost_scans = 0
+
+    @property
+    def rate_hz(self) -> float:
+        """
+        Scans per second, 0 if the stream is stopped
+        """
+        return BleUartPinCtrl.ADC_TIMER_HZ / self.period_ticks if self.period_ticks else 0.0
+
+    def start(self, inputs: List[int], period_ticks: int, scans_per_notification: int):
+        """
+        Starts over for a stream the device just started
+        """
+        self.inputs = inputs
+        self.period_ticks = period_ticks
+        self.scans_per_notification = scans_per_notification
+        self.samples = array.array("H")
+        self.first_scan = 0
+        self.next_scan = None
+        self.lost_scans = 0
+
+    def feed(self, payload: bytes):
+        """
+        Adds the samples of an ADC samples notification
+        """
+        size = struct.calcsize(BleUartPinCtrl.ADC_SAMPLES_FORMAT)
+        _, first_scan, scans = struct.unpack(BleUartPinCtrl.ADC_SAMPLES_FORMAT, payload[:size])
+        if not self.inputs:
+            return
+        samples = BleUartPinCtrl.unpack_adc_samples(payload[size:], scans * len(self.inputs))
+
+        if self.next_scan is None:
+            self.first_scan = self.next_scan = first_scan
+        else:
+            # Notifications arrive in order, only a forward gap is possible
+            gap = (first_scan - self.next_scan) & self.SCAN_MASK
+            if gap >= 0x80000000:
+                return
+            self.lost_scans += gap
+            self.samples.extend([self.LOST_SAMPLE] * (gap * len(self.inputs)))
+            self.next_scan += gap
+        self.samples.extend(samples)
+        self.next_scan += scans
+
+        if self.callback is not None:
+            self.callback(self)
+
+    def take(self) -> (int, array.array):
+        """
+        Takes every sample added since the last take()
+        :return: number of the first scan and the samples, scan after scan
+        """
+        first_scan, samples = self.first_scan, self.samples
+        self.samples = array.array("H")
+        if self.next_scan is not None:
+            self.first_scan = self.next_scan
+        return first_scan, samples
+
+
+class BleUartPinCtrlBatch:
+    """
+    Collects pin control commands so they can be sent to the device in BATCH frames, letting one BLE write carry
+    many commands. The byte format of a batch is:
+        <command 1-byte> <body length 2-bytes> <sub-command bytes ...>
+    """
+    # Must match MAX_BATCH_LENGTH in bleuart_pin_ctrl.h (largest frame payload minus the batch header)
+    MAX_BATCH_LENGTH = 252
+
+    def __init__(self, compact: bool = False):
+        # Packed sub-commands, in the order they were added
+        self.commands = list()
+        # Pack pin commands in their compact form, only for devices that picked protocol version 2
+        self.compact = compact
+
+    def __len__(self):
+        return len(self.commands)
+
+    def configure_gpio(self, port: int, pins: List[int], direction: BleUartPinCtrlGpioDirections):
+        """
+        Adds a GPIO configure command to the batch (see BleUartPinCtrl.configure_gpio)
+        """
+        self.commands.append(BleUartPinCtrl.pack_configure_gpio(port, pins, direction, self.compact))
+
+    def write_gpio(self, port: int, pins: List[int], output: BleUartPinCtrlGpioOutputs):
+        """
+        Adds a GPIO write command to the batch (see BleUartPinCtrl.write_gpio)
+        """
+        self.commands.append(BleUartPinCtrl.pack_write_gpio(port, pins, output, self.compact))
+
+    def pulse_gpio(self, port: int, pins: List[int], duration_ms: int):
+        """
+        Adds a GPIO pulse command to the batch (see BleUartPinCtrl.pulse_gpio)
+        """
+        self.commands.append(BleUartPinCtrl.pack_pulse_gpio(port, pins, duration_ms, self.compact))
+
+    def schedule_pulse_gpio(self, port: int, pins: List[int], duration_us: int, start_offset_us: int = 0,
+                            mode: BleUartPinCtrlPulseModes = BleUartPinCtrlPulseModes.SIMULTANEOUS):
+        """
+        Adds a GPIO pulse schedule command to the batch (see BleUartPinCtrl.schedule_pulse_gpio)
+        """
+        self.commands.append(BleUartPinCtrl.pack_schedule_pulse_gpio(port, pins, duration_us, start_offset_us, mode, self.compact))
+
+    def echo(self, sequence: int, filler_length: int = 0, flags: int = 0):
+        """
+        Adds an echo command to the batch (see BleUartPinCtrl.echo), ECHO_SILENT makes it a no-op of a given size
+        """
+        self.commands.append(BleUartPinCtrl.pack_echo(sequence, filler_length, flags))
+
+    def set_pwm(self, port: int, pins: List[int], duty_cycle: int):
+        """
+        Adds a PWM set command to the batch (see BleUartPinCtrl.set_pwm)
+        """
+        self.commands.append(BleUartPinCtrl.pack_set_pwm(port, pins, duty_cycle, self.compact))
+
+    def set_pwm_multi(self, port: int, duty_cycles: Dict[int, int], frequency_hz: int = 0, top: int = 0):
+        """
+        Adds a PWM set multi command to the batch (see BleUartPinCtrl.set_pwm_multi)
+        """
+        self.commands.append(BleUartPinCtrl.pack_set_pwm_multi(port, duty_cycles, frequency_hz, top))
+
+    def ramp_pwm(self, port: int, pins: List[int], start_duty: int, end_duty: int, duration_us: int,
+                 curve: BleUartPinCtrlPwmCurves = BleUartPinCtrlPwmCurves.LINEAR):
+        """
+        Adds a PWM ramp command to the batch (see BleUartPinCtrl.ramp_pwm)
+        """
+        self.commands.append(BleUartPinCtrl.pack_ramp_pwm(port, pins, start_duty, end_duty, duration_us, curve))
+
+    def upload_pattern(self, slot: int, keyframes: List[BleUartPinCtrlKeyframe]):
+        """
+        Adds the pattern upload commands to the batch (see BleUartPinCtrl.upload_pattern)
+        """
+        self.commands += BleUartPinCtrl.pack_upload_pattern(slot, keyframes)
+
+    def play_pattern(self, slot: int, repeat: int = 1):
+        """
+        Adds a pattern play command to the batch (see BleUartPinCtrl.play_pattern)
+        """
+        self.commands.append(BleUartPinCtrl.pack_play_pattern(slot, repeat))
+
+    def stop_pattern(self, slot: Optional[int] = None):
+        """
+        Adds a pattern stop command to the batch (see BleUartPinCtrl.stop_pattern)
+        """
+        self.commands.append(BleUartPinCtrl.pack_stop_pattern(slot))
+
+    def schedule(self, run_at_us: int, batch: "BleUartPinCtrlBatch"):
+        """
+        Adds commands that run at a device time to the batch (see BleUartPinCtrl.schedule)
+        """
+        self.commands += BleUartPinCtrl.pack_schedule(run_at_us, batch)
+
+    def to_payloads(self, max_batch_length: int = MAX_BATCH_LENGTH) -> List[bytes]:
+        """
+        Packs the collected commands into as few BATCH commands as possible. Commands are never split across batches.
+        :param max_batch_length: most sub-command bytes per BATCH command
+        :return: list of BATCH commands, each to be sent in its own frame
+        """
+        payloads = list()
+        body = b""
+        for command in self.commands:
+            if len(body) > 0 and len(body) + len(command) > max_batch_length:
+                payloads.append(struct.pack("!BH", BleUartPinCtrlCommands.BATCH, len(body)) + body)
+                body = b""
+            body += command
+        if len(body) > 0:
+            payloads.append(struct.pack("!BH", BleUartPinCtrlCommands.BATCH, len(body)) + body)
+        return payloads
+
+
+class _BleUartPinCtrlBatchContext:
+    """
+    Async context manager returned by BleUartPinCtrl.batch(), sends the batch when the block exits without an error
+    """
+    def __init__(self, pin_ctrl: "BleUartPinCtrl"):
+        self.pin_ctrl = pin_ctrl
+        self.batch = BleUartPinCtrlBatch(pin_ctrl.compact)
+
+    async def __aenter__(self) -> BleUartPinCtrlBatch:
+        return self.batch
+
+    async def __aexit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            await self.pin_ctrl.send_batch(self.batch)
+
+
 class BleUartPinCtrl:
     NORDIC_UART_SERVICE = "6e400001-b5a3-f393-e0a9-e50e24dcca9e"
     NUS_RX_CHAR = "6e400002-b5a3-f393-e0a9-e50e24dcca9e"
     NUS_TX_CHAR = "6e400003-b5a3-f393-e0a9-e50e24dcca9e"
 
+    # Frame format (see framing.h): <sync 1-byte> <payload length 1-byte> <payload> <CRC-8 of length and payload>
+    FRAME_SYNC = 0xA5
+    MAX_FRAME_PAYLOAD = 255
+
+    # Port flag (see GPIO_PORT_HW in bleuart_pin_ctrl.h): without it pins are Arduino pin numbers and the port is
+    # ignored, with it pins are numbered within the given nRF52 port and written through the port registers
+    GPIO_PORT_HW = 0x80000000
+    # Port value addressing both nRF52 ports at once (see GPIO_PORT_HW_ALL), pin n is hardware pin n (P1.n is 32 + n)
+    # Only compact commands carry pins above 31, so use it with protocol version 2
+    GPIO_PORT_HW_ALL = GPIO_PORT_HW | 0xFF
+
+    # Struct formats come from ble_uart_pin_ctrl_schema.py, generated from bleuart_pin_ctrl.h by gen_schema.py
+
+    # Query replies (see GpioQueryReply and QueryStateReply in bleuart_pin_ctrl.h), both are followed by PWM duties
+    GPIO_QUERY_REPLY_FORMAT = schema.STRUCTS["GpioQueryReply"].format
+    QUERY_STATE_REPLY_FORMAT = schema.STRUCTS["QueryStateReply"].format
+    QUERY_STATE_PORTS = 2
+    # How long to wait for a query reply in s
+    REPLY_TIMEOUT = 2.0
+    # How long to wait for connection parameters, the device waits up to CONN_PARAMS_TIMEOUT_MS for the central
+    CONN_PARAMS_TIMEOUT = 4.0
+
+    # Echo flags (see bleuart_pin_ctrl.h)
+    ECHO_RETURN_FILLER = 0x01
+    ECHO_SILENT = 0x02
+
+    # Stats reply (see StatsReply and StatsCommandCount in bleuart_pin_ctrl.h)
+    STATS_REPLY_FORMAT = schema.STRUCTS["StatsReply"].format
+    STATS_COMMAND_COUNT_FORMAT = schema.STRUCTS["StatsCommandCount"].format
+
+    # Log read reply (see LogReadReply and LogRecord in bleuart_pin_ctrl.h)
+    LOG_READ_REPLY_FORMAT = schema.STRUCTS["LogReadReply"].format
+    LOG_RECORD_FORMAT = schema.STRUCTS["LogRecord"].format
+
+    # Pattern commands (see PatternUpload, Keyframe, PatternPlay and PatternStop in bleuart_pin_ctrl.h)
+    PATTERN_UPLOAD_FORMAT = schema.STRUCTS["PatternUpload"].format
+    KEYFRAME_FORMAT = schema.STRUCTS["Keyframe"].format
+    PATTERN_SLOTS = 8
+    MAX_PATTERN_KEYFRAMES = 32
+    # Keyframes that fit one upload command, in a frame or in a batch
+    MAX_UPLOAD_KEYFRAMES = 17
+    PATTERN_ALL_SLOTS = 0xFF
+
+    # PWM set multi (see PwmSetMulti and PwmChannelDuty in bleuart_pin_ctrl.h)
+    PWM_SET_MULTI_FORMAT = schema.STRUCTS["PwmSetMulti"].format
+    PWM_CHANNEL_DUTY_FORMAT = schema.STRUCTS["PwmChannelDuty"].format
+    MAX_PWM_MULTI_CHANNELS = 4
+    PWM_MAX_TOP = 32767
+
+    # Scheduled commands (see Schedule in bleuart_pin_ctrl.h)
+    SCHEDULE_FORMAT = schema.STRUCTS["Schedule"].format
+    MAX_SCHEDULED_LENGTH = 128
+    SCHEDULE_QUEUE_CAPACITY = 16
+    # Echo sequence numbers used by sync_clock, clear of the ones benchmarks use
+    CLOCK_SYNC_SEQUENCE_BASE = 0xC0000000
+
+    # Commit (see Commit and CommitReply in bleuart_pin_ctrl.h), writing flash can take a while
+    COMMIT_ERASE = 0x01
+    COMMIT_REPLY_FORMAT = schema.STRUCTS["CommitReply"].format
+    COMMIT_TIMEOUT = 5.0
+
+    # Flow control (see FlowControl and Credits in bleuart_pin_ctrl.h)
+    FLOW_CONTROL_FORMAT = schema.STRUCTS["FlowControl"].format
+    CREDITS_FORMAT = schema.STRUCTS["Credits"].format
+    CREDIT_INTERVAL_MS = 10
+
+    # Protocol version (see ProtocolVersion and ProtocolVersionReply in bleuart_pin_ctrl.h)
+    PROTOCOL_VERSION_FORMAT = schema.STRUCTS["ProtocolVersion"].format
+    PROTOCOL_VERSION_REPLY_FORMAT = schema.STRUCTS["ProtocolVersionReply"].format
+    PROTOCOL_VERSION_MAX = 2
+    # Compact pin set header (see compact_format.h): <port 2-bits> <mask form 1-bit> <count 5-bits>
+    PIN_SET_PORT_SHIFT = 6
+    PIN_SET_FORM_MASK = 0x20
+    PIN_SET_PORT_HW_ALL = 3
+
+    # State sync (see StateSync, PinLevel and StateSyncReply in bleuart_pin_ctrl.h)
+    STATE_SYNC_FORMAT = schema.STRUCTS["StateSync"].format
+    PIN_LEVEL_FORMAT = schema.STRUCTS["PinLevel"].format
+    STATE_SYNC_REPLY_FORMAT = schema.STRUCTS["StateSyncReply"].format
+    STATE_SYNC_FULL = 0x01
+    STATE_SYNC_NEED_FULL = 1
+    MAX_STATE_SYNC_PINS = 124
+
+    # ADC stream (see AdcStream, AdcStreamReply and AdcSamples in bleuart_pin_ctrl.h)
+    ADC_STREAM_REPLY_FORMAT = schema.STRUCTS["AdcStreamReply"].format
+    ADC_SAMPLES_FORMAT = schema.STRUCTS["AdcSamples"].format
+    ADC_TIMER_HZ = 16000000
+    ADC_FULL_SCALE_MV = 3600
+    ADC_NUM_INPUTS = 8
+
+    # Safety (see Safety and SafetyReply in bleuart_pin_ctrl.h)
+    SAFETY_REPLY_FORMAT = schema.STRUCTS["SafetyReply"].format
+    MAX_SAFETY_ON_US = 1 << 30
+
+    # Input events notification (see InputEvents and InputEvent in bleuart_pin_ctrl.h)
+    INPUT_EVENTS_FORMAT = schema.STRUCTS["InputEvents"].format
+    INPUT_EVENT_FORMAT = schema.STRUCTS["InputEvent"].format
+
     def __init__(self):
         # The bleak client instance
         self.client = None
         # The BLEDevice representing the remote device
         self.device = None
+        # Reassembles frames from the NUS TX characteristic
+        self.receiver = BleUartPinCtrlFrameReceiver(self.FRAME_SYNC, self.MAX_FRAME_PAYLOAD)
+        # Futures waiting for a reply, per command, oldest first (the device replies in order)
+        self.pending_replies: Dict[int, Deque[asyncio.Future]] = dict()
+        # Futures waiting for an echo reply, per sequence number (replies may go missing, so they aren't FIFO)
+        self.pending_echoes: Dict[int, asyncio.Future] = dict()
+        # Latest device clock estimate, see sync_clock
+        self.clock_sync: Optional[BleUartPinCtrlClockSync] = None
+        # Streaming mode (see enable_streaming): writes go without response, within the device's RX FIFO credits
+        self.streaming = False
+        # Bytes written (from the device's count at the last credit sync) and bytes the device reported consumed
+        self.credit_sent = 0
+        self.credit_consumed = 0
+        # Device RX FIFO size, 0 until the first credit report
+        self.fifo_depth = 0
+        # True until the next credit report lines credit_sent up with the device's count
+        self.credit_syncing = False
+        # Shortest time between credit reports asked of the device
+        self.credit_interval_ms = self.CREDIT_INTERVAL_MS
+        # Set whenever a credit report arrives
+        self.credit_event = asyncio.Event()
+        # Protocol version picked with the device, see negotiate_protocol
+        self.protocol_version = 1
+        # Print every command as it's sent (console I/O takes about as long as a write, see BleUartPinCtrlSendQueue)
+        self.log_sends = True
+        # Called with (events, number of changes lost) for every input events notification
+        self.input_callback: Optional[Callable[[List[BleUartPinCtrlInputEvent], int], None]] = None
+        # Pin levels synced with sync_state
+        self.shadow = BleUartPinCtrlShadow()
+        # Samples of the ADC stream, see stream_adc
+        self.adc_stream: Optional[BleUartPinCtrlAdcStream] = None
+        # Every frame written goes here too while recording (see record_writes), and when the recording started
+        self.recording: Optional[TextIO] = None
+        self.recording_started = 0.0
 
     @classmethod
     async def list_devices(cls):
@@ -56,34 +750,48 @@ class BleUartPinCtrl:
             print(device)
 
     @classmethod
-    async def new(cls, device_name: str = None):
+    async def new(cls, device_name: str = None, shadow: Optional[BleUartPinCtrlShadow] = None):
         """
         Creates and initializes a BLE connection to a target device running the Nordic UART service.
         :param device_name: Name of the device to connect to.
+        :param shadow: synced pin levels of an earlier connection to resume from (see sync_state)
         """
-        self = BleUartPinCtrl()
-
         # Gather and look through devices for one that matches the target name
         devices = await BleakScanner.discover()
 
         # Scan through the devices to see if the desired device is available
+        target = None
         for device in devices:
             if device_name is not None:  # search by device name
                 if device.name == device_name:
-                    self.device = device
-                    if self.NORDIC_UART_SERVICE not in self.device.metadata['uuids']:
+                    target = device
+                    if cls.NORDIC_UART_SERVICE not in target.metadata['uuids']:
                         raise RuntimeError("Device with given name does not have the Nordic UART service",
-                                           self.device, self.NORDIC_UART_SERVICE)
+                                           target, cls.NORDIC_UART_SERVICE)
                     break
             else:  # just grab the first one with the Nordic UART service
-                if self.NORDIC_UART_SERVICE in device.metadata['uuids']:
-                    self.device = device
+                if cls.NORDIC_UART_SERVICE in device.metadata['uuids']:
+                    target = device
                     break
 
-        if self.device is None:
+        if target is None:
             raise RuntimeError("Could not find a device with the given name or with the Nordic UART service",
                                device_name)
 
+        return await cls.connect(target, shadow)
+
+    @classmethod
+    async def connect(cls, device, shadow: Optional[BleUartPinCtrlShadow] = None):
+        """
+        Creates and initializes a BLE connection to an already scanned device (see BleUartPinCtrlGroup)
+        :param device: the BLEDevice to connect to, it must have the Nordic UART service
+        :param shadow: synced pin levels of an earlier connection to resume from (see sync_state)
+        """
+        self = BleUartPinCtrl()
+        self.device = device
+        if shadow is not None:
+            self.shadow = shadow
+
         # Get the client and wait for a connection
         self.client = BleakClient(self.device)
         conn = await self.client.connect()
@@ -91,10 +799,50 @@ class BleUartPinCtrl:
             raise RuntimeError("Could not connect to device")
 
         # Start listening for notifications from NUS service
-        await self.client.start_notify(self.NUS_TX_CHAR, _rx_callback)
+        await self.client.start_notify(self.NUS_TX_CHAR, self._rx_callback)
+
+        # Pick the smallest encoding the firmware knows
+        await self.negotiate_protocol()
 
         return self
 
+    @property
+    def compact(self) -> bool:
+        """
+        True if pin commands go in their compact form (protocol version 2)
+        """
+        return self.protocol_version >= 2
+
+    async def negotiate_protocol(self, version: int = PROTOCOL_VERSION_MAX, timeout: float = REPLY_TIMEOUT) -> int:
+        """
+        Picks the protocol version to speak with the device, connect() does this already. Firmware older than the
+        handshake never replies, it stays on version 1. The byte format is:
+            <command 1-byte> <highest version wanted 1-byte>
+        The reply is:
+            <command 1-byte> <version in use 1-byte> <highest version of the device 1-byte>
+        :param version: highest version to use, 1 goes back to the packed commands only
+        :param timeout: how long to wait for the reply in s
+        :return: the version in use
+        """
+        byte_buffer = struct.pack(BleUartPinCtrl.PROTOCOL_VERSION_FORMAT, BleUartPinCtrlCommands.PROTOCOL_VERSION,
+                                  version)
+
+        self._log_send("negotiate_protocol", byte_buffer)
+
+        try:
+            reply = await self.request(byte_buffer, timeout)
+            _, self.protocol_version, _ = struct.unpack(BleUartPinCtrl.PROTOCOL_VERSION_REPLY_FORMAT, reply)
+        except asyncio.TimeoutError:
+            self.protocol_version = 1
+        return self.protocol_version
+
+    def _log_send(self, name: str, byte_buffer: bytes):
+        """
+        Prints a command about to be sent, unless log_sends is off
+        """
+        if self.log_sends:
+            print(name + " sending: ", byte_buffer)
+
     def get_mac(self) -> str:
         """
         Gets the MAC address of the connected BLE device
@@ -117,14 +865,12 @@ class BleUartPinCtrl:
         :param pins: list of pins to configure
         :param direction: which directon to configure the pins as
         """
-        # Pack it all into a byte buffer (LE byte, LE 4 bytes, LE 4 bytes, LE byte
-        byte_buffer = struct.pack("!BLLB", BleUartPinCtrlCommands.GPIO_CONFIGURE,
-                                  port, BleUartPinCtrl.pin_list_to_bitmask(pins), int(direction))
+        byte_buffer = BleUartPinCtrl.pack_configure_gpio(port, pins, direction, self.compact)
 
-        print("configure_gpio sending: ", byte_buffer)
+        self._log_send("configure_gpio", byte_buffer)
 
         # Transmit the byte buffer
-        await self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(byte_buffer))
+        await self.write_frame(byte_buffer)
 
     async def write_gpio(self, port: int, pins: List[int], output: BleUartPinCtrlGpioOutputs):
         """
@@ -134,32 +880,57 @@ class BleUartPinCtrl:
         :param pins: list of pins to configure
         :param output: what output level to set on the GPIO
         """
-        # Pack it all into a byte buffer (LE byte, LE 4 bytes, LE 4 bytes, LE byte
-        byte_buffer = struct.pack("!BLLB",
-                                  BleUartPinCtrlCommands.GPIO_WRITE,
-                                  port, BleUartPinCtrl.pin_list_to_bitmask(pins), int(output))
+        byte_buffer = BleUartPinCtrl.pack_write_gpio(port, pins, output, self.compact)
 
-        print("write_gpio sending: ", byte_buffer)
+        self._log_send("write_gpio", byte_buffer)
 
         # Transmit the byte buffer
-        await self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(byte_buffer))
+        await self.write_frame(byte_buffer)
 
     async def pulse_gpio(self, port: int, pins: List[int], duration_ms: int):
-        # Pack it all into a byte buffer (LE byte, LE 4 bytes, LE 4 bytes, LE byte
-        byte_buffer = struct.pack("!BLLL",
-                                  BleUartPinCtrlCommands.GPIO_PULSE,
-                                  port, BleUartPinCtrl.pin_list_to_bitmask(pins), duration_ms)
+        byte_buffer = BleUartPinCtrl.pack_pulse_gpio(port, pins, duration_ms, self.compact)
 
-        print("pulse_gpio sending: ", byte_buffer)
+        self._log_send("pulse_gpio", byte_buffer)
 
         # Transmit the byte buffer
-        await self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(byte_buffer))
+        await self.write_frame(byte_buffer)
 
-    async def query_gpio(self, port: int, pins: List[int]):
+    async def schedule_pulse_gpio(self, port: int, pins: List[int], duration_us: int, start_offset_us: int = 0,
+                                  mode: BleUartPinCtrlPulseModes = BleUartPinCtrlPulseModes.SIMULTANEOUS):
         """
-        TODO
+        Queues pulses on GPIO of the connected device. Pulses on a pin that is already pulsing start once the pulses
+        ahead of them end, so overlapping commands never cut each other short. The byte format is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes> <mode 1-byte> <duration 4-bytes> <start offset 4-bytes>
+        :param port: port number to configure
+        :param pins: list of pins to pulse
+        :param duration_us: how long each pin stays high in us
+        :param start_offset_us: delay before the first pulse starts in us
+        :param mode: pulse all pins at once, or one after another starting with the highest pin
+        """
+        byte_buffer = BleUartPinCtrl.pack_schedule_pulse_gpio(port, pins, duration_us, start_offset_us, mode, self.compact)
+
+        self._log_send("schedule_pulse_gpio", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    async def query_gpio(self, port: int, pins: List[int]) -> Dict[int, BleUartPinCtrlPinState]:
+        """
+        Reads the state of GPIO on the connected device in one round trip. The byte format is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes>
+        The reply is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes> <input mask 4-bytes> <output mask 4-bytes>
+            <direction mask 4-bytes> <pulsing mask 4-bytes> <PWM duty 1-byte per pin, lowest pin first>
+        :param port: port number to query
+        :param pins: list of pins to query
+        :return: state of each pin, keyed by pin number
         """
-        raise NotImplementedError("TODO CMK(11/15/20): Implement query_gpio")
+        byte_buffer = BleUartPinCtrl.pack_query_gpio(port, pins)
+
+        self._log_send("query_gpio", byte_buffer)
+
+        reply = await self.request(byte_buffer)
+        return BleUartPinCtrl.unpack_gpio_query_reply(reply)
 
     async def set_pwm(self, port: int, pins: List[int], duty_cycle: int):
         """
@@ -169,20 +940,1081 @@ class BleUartPinCtrl:
         :param pins: list of pins to configure
         :param duty_cycle: duty cycle of the PWM cycle (duty cycle is intensity / 255)
         """
-        # Pack it all into a byte buffer (LE byte, LE 4 bytes, LE 4 bytes, LE byte
-        byte_buffer = struct.pack("!BLLB", BleUartPinCtrlCommands.PWM_SET,
-                                  port, BleUartPinCtrl.pin_list_to_bitmask(pins), duty_cycle)
+        byte_buffer = BleUartPinCtrl.pack_set_pwm(port, pins, duty_cycle, self.compact)
+
+        self._log_send("set_pwm", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    async def set_pwm_multi(self, port: int, duty_cycles: Dict[int, int], frequency_hz: int = 0, top: int = 0):
+        """
+        Sets a PWM duty per pin on the connected device's PWM group, every pin changes in the same PWM period. The
+        listed pins replace the whole group (pins left out stop), an empty dict stops the group. The group is
+        separate from set_pwm, a pin moved from one to the other stops in the first. The byte format is:
+            <command 1-byte> <port 4-bytes> <frequency Hz 4-bytes> <top 2-bytes> <count 1-byte>
+            followed per pin by
+            <pin 1-byte> <duty 2-bytes>
+        :param port: port number the pins are numbered in
+        :param duty_cycles: duty (0 to top) per pin, up to MAX_PWM_MULTI_CHANNELS pins
+        :param frequency_hz: PWM frequency, the device picks the closest 16 MHz / (2^n * top) (0 keeps it)
+        :param top: resolution, duties range from 0 to top (up to PWM_MAX_TOP, 0 keeps it, 255 at boot)
+        """
+        byte_buffer = BleUartPinCtrl.pack_set_pwm_multi(port, duty_cycles, frequency_hz, top)
 
-        print("set_pwm sending: ", byte_buffer)
+        self._log_send("set_pwm_multi", byte_buffer)
 
         # Transmit the byte buffer
-        await self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(byte_buffer))
+        await self.write_frame(byte_buffer)
+
+    async def ramp_pwm(self, port: int, pins: List[int], start_duty: int, end_duty: int, duration_us: int,
+                       curve: BleUartPinCtrlPwmCurves = BleUartPinCtrlPwmCurves.LINEAR):
+        """
+        Ramps the duty of PWM group pins (see set_pwm_multi) on the connected device. The device's PWM peripheral
+        plays the ramp in up to 256 steps, one per PWM period at most, and holds the end duty. Other group pins keep
+        their duty. The byte format is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes> <start duty 2-bytes> <end duty 2-bytes>
+            <duration us 4-bytes> <curve 1-byte>
+        :param port: port number the pins are numbered in
+        :param pins: pins of the PWM group to ramp
+        :param start_duty: duty the pins jump to first (0 to the group's top)
+        :param end_duty: duty the pins end at
+        :param duration_us: length of the ramp
+        :param curve: LINEAR changes by the same amount every step, EXPONENTIAL by the same ratio
+        """
+        byte_buffer = BleUartPinCtrl.pack_ramp_pwm(port, pins, start_duty, end_duty, duration_us, curve)
+
+        self._log_send("ramp_pwm", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    def sync_gpio(self, port: int, pins: List[int], output: BleUartPinCtrlGpioOutputs):
+        """
+        Sets the output level wanted on GPIO pins in the shadow state, the next sync_state sends it. The pins become
+        outputs on the device.
+        :param port: hardware port of the pins (see hw_port), or GPIO_PORT_HW_ALL
+        :param pins: list of pins
+        :param output: level to drive them to
+        """
+        self.shadow.set_levels(BleUartPinCtrl.sync_pins(port, pins),
+                               255 if output == BleUartPinCtrlGpioOutputs.OUT_HIGH else 0)
+
+    def sync_pwm(self, port: int, pins: List[int], duty_cycle: int):
+        """
+        Sets the PWM duty wanted on pins in the shadow state, the next sync_state sends it. Duties 0 and 255 drive the
+        pins low and high without PWM.
+        :param port: hardware port of the pins (see hw_port), or GPIO_PORT_HW_ALL
+        :param pins: list of pins
+        :param duty_cycle: duty from 0 to 255
+        """
+        self.shadow.set_levels(BleUartPinCtrl.sync_pins(port, pins), duty_cycle)
+
+    async def sync_state(self, full: bool = False) -> bool:
+        """
+        Sends the pins whose level changed in the shadow state since the last state the device acknowledged. The byte
+        format is:
+            <command 1-byte> <sequence 2-bytes> <base sequence 2-bytes> <flags 1-byte> <count 1-byte>
+            <(hardware pin 1-byte, level 1-byte) per pin>
+        The device replies with the following, taken in as it arrives:
+            <command 1-byte> <sequence 2-bytes> <device state 2-bytes> <0 = applied, 1 = send a full snapshot>
+        A full snapshot goes instead on the first call, when asked for, every shadow.full_interval (so call this now
+        and then even if nothing changed) and right away once the device refused a delta. After a reconnect with the
+        old shadow (see connect), this resumes with a delta unless the device lost the state.
+        :param full: send every pin, not just the changed ones
+        :return: True if a frame was sent, False if nothing changed
+        """
+        frame = self.shadow.make_frame(full)
+        if frame is None:
+            return False
+
+        sequence, base, flags, entries = frame
+        byte_buffer = BleUartPinCtrl.pack_state_sync(sequence, base, flags, entries)
+
+        self._log_send("sync_state", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+        return True
+
+    async def query_state(self) -> BleUartPinCtrlDeviceState:
+        """
+        Reads the state of the connected device in one round trip. The byte format is:
+            <command 1-byte>
+        The reply is:
+            <command 1-byte> <uptime 4-bytes> <input registers 2x4-bytes> <output registers 2x4-bytes>
+            <direction registers 2x4-bytes> <pulsing masks 2x4-bytes> <queued pulse edges 2-bytes>
+            <hardware pulses 1-byte> <PWM count 1-byte> <(hardware pin 1-byte, PWM duty 1-byte) per PWM pin>
+        :return: the device state
+        """
+        byte_buffer = struct.pack("!B", BleUartPinCtrlCommands.QUERY_STATE)
+
+        self._log_send("query_state", byte_buffer)
+
+        reply = await self.request(byte_buffer)
+        return BleUartPinCtrl.unpack_query_state_reply(reply)
+
+    async def request(self, payload: bytes, timeout: float = REPLY_TIMEOUT) -> bytes:
+        """
+        Sends a command and waits for the device's reply to it
+        :param payload: the packed command
+        :param timeout: how long to wait for the reply in s
+        :return: payload of the reply
+        """
+        future = asyncio.get_event_loop().create_future()
+        waiting = self.pending_replies.setdefault(payload[0], deque())
+        waiting.append(future)
+        try:
+            await self.write_frame(payload)
+            return await asyncio.wait_for(future, timeout)
+        finally:
+            if future in waiting:
+                waiting.remove(future)
+
+    def _rx_callback(self, sender, data):
+        """
+        Private callback to handle receiving data, hands each reply to the oldest request waiting for it
+        """
+        for payload in self.receiver.feed(data):
+            if payload[0] == BleUartPinCtrlCommands.INPUT_EVENTS:
+                events, lost = BleUartPinCtrl.unpack_input_events(payload)
+                if self.input_callback is not None:
+                    self.input_callback(events, lost)
+                continue
+
+            if payload[0] == BleUartPinCtrlCommands.ADC_SAMPLES:
+                if self.adc_stream is not None:
+                    self.adc_stream.feed(payload)
+                continue
+
+            if payload[0] == BleUartPinCtrlCommands.CREDITS:
+                _, consumed, self.fifo_depth = struct.unpack(BleUartPinCtrl.CREDITS_FORMAT, payload)
+                self.credit_consumed = consumed
+                if self.credit_syncing:
+                    self.credit_sent = consumed
+                    self.credit_syncing = False
+                self.credit_event.set()
+                continue
+
+            if payload[0] == BleUartPinCtrlCommands.STATE_SYNC:
+                _, sequence, _, status = struct.unpack(BleUartPinCtrl.STATE_SYNC_REPLY_FORMAT, payload)
+                self.shadow.acknowledge(sequence, status)
+                if self.shadow.need_full:
+                    asyncio.ensure_future(self.sync_state())
+                continue
+
+            if payload[0] == BleUartPinCtrlCommands.ECHO:
+                reply = BleUartPinCtrl.unpack_echo_reply(payload)
+                future = self.pending_echoes.pop(reply.sequence, None)
+                if future is not None and not future.done():
+                    future.set_result(reply)
+                continue
+
+            waiting = self.pending_replies.get(payload[0])
+            while waiting and waiting[0].done():
+                waiting.popleft()  # timed out
+            if waiting:
+                waiting.popleft().set_result(payload)
+            else:
+                print("Rx {0}: {1}".format(sender, payload))
+
+    async def subscribe_inputs(self, port: int, pins: List[int],
+                               callback: Callable[[List[BleUartPinCtrlInputEvent], int], None],
+                               debounce_ms: int = 10, min_interval_ms: int = 20) -> List[int]:
+        """
+        Asks the connected device to report level changes of input pins, replacing any earlier subscription. Changes
+        are debounced on the device and sent in batches, at most one notification per min_interval_ms. The pins must
+        already be configured as inputs. The byte format is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes> <debounce 2-bytes> <minimum interval 2-bytes>
+        The reply is:
+            <command 1-byte> <port 4-bytes> <subscribed pin mask 4-bytes>
+        :param port: port number of the pins
+        :param pins: list of pins to report, an empty list unsubscribes
+        :param callback: called with the changes of each notification and the number of changes lost before them
+        :param debounce_ms: changes this soon after a reported change are treated as bounce
+        :param min_interval_ms: shortest time between two notifications
+        :return: pins actually subscribed to (the device can only watch a few pins at a time)
+        """
+        byte_buffer = BleUartPinCtrl.pack_subscribe_inputs(port, pins, debounce_ms, min_interval_ms)
+
+        self._log_send("subscribe_inputs", byte_buffer)
 
-    async def query_state(self, port: int, pins: List[int]):
+        self.input_callback = callback
+        reply = await self.request(byte_buffer)
+        _, _, pin_mask = struct.unpack("!BLL", reply)
+        return [pin for pin in range(32) if pin_mask & (1 << pin)]
+
+    async def unsubscribe_inputs(self):
+        """
+        Stops the connected device reporting input changes
+        """
+        await self.subscribe_inputs(0, [], None)
+
+    async def stream_adc(self, inputs: List[int], rate_hz: int,
+                         callback: Optional[Callable[[BleUartPinCtrlAdcStream], None]] = None
+                         ) -> BleUartPinCtrlAdcStream:
+        """
+        Asks the connected device to sample analog inputs at a fixed rate and stream the samples, replacing any
+        earlier stream. Each scan samples every input once, the device sends as many scans per notification as fit a
+        single packet (or 10 ms worth, whichever is less). The byte format is:
+            <command 1-byte> <input mask 1-byte> <scans per second 4-bytes>
+        The reply is:
+            <command 1-byte> <streamed input mask 1-byte> <scan period 4-bytes, 1/16 us units>
+            <scans per notification 1-byte>
+        Then every notification is:
+            <command 1-byte> <first scan number 4-bytes> <scans 1-byte> <12-bit samples, two per 3 bytes>
+        :param inputs: analog inputs to sample (AIN numbers 0-7, not Arduino pins), an empty list stops the stream
+        :param rate_hz: scans per second, the device lowers it to what its ADC can convert (200 kHz over all inputs)
+        :param callback: called with the stream after every notification
+        :return: the stream, its samples read 0 to ADC_FULL_SCALE_MV in 0-4095
+        """
+        byte_buffer = BleUartPinCtrl.pack_stream_adc(inputs, rate_hz)
+
+        self._log_send("stream_adc", byte_buffer)
+
+        # Samples may come in right behind the reply
+        stream = BleUartPinCtrlAdcStream(callback)
+        stream.start(sorted(inputs), 0, 0)
+        self.adc_stream = stream if inputs else None
+        reply = await self.request(byte_buffer)
+        _, input_mask, period_ticks, scans = struct.unpack(BleUartPinCtrl.ADC_STREAM_REPLY_FORMAT, reply)
+        streamed = [input for input in range(BleUartPinCtrl.ADC_NUM_INPUTS) if input_mask & (1 << input)]
+        stream.inputs, stream.period_ticks, stream.scans_per_notification = streamed, period_ticks, scans
+        if not streamed:
+            self.adc_stream = None
+        return stream
+
+    async def stop_adc_stream(self):
+        """
+        Stops the connected device streaming ADC samples
+        """
+        await self.stream_adc([], 0)
+
+    async def set_safety(self, port: int, pins: List[int], max_on_us: int,
+                         link_loss: BleUartPinCtrlLinkLoss = BleUartPinCtrlLinkLoss.LINK_LOSS_KEEP
+                         ) -> BleUartPinCtrlSafety:
+        """
+        Limits how long pins of the connected device may stay on (output high or PWM above 0), and picks what the
+        device does when the link drops. A pin left on for max_on_us after whatever last turned it on is switched off,
+        and its pulses are cut to max_on_us (queued ones included). By default a dropped link drives every output off
+        and stops PWM, patterns, pulses and scheduled commands, so the next sync_state() sends a full snapshot. The
+        byte format is:
+            <command 1-byte> <port 4-bytes> <pin mask 4-bytes> <max on-time 4-bytes, us> <link-loss action 1-byte>
+        The reply is:
+            <command 1-byte> <limited P0 pins 4-bytes> <limited P1 pins 4-bytes> <link-loss action 1-byte>
+            <failsafes 4-bytes> <auto-offs 4-bytes>
+        :param port: port number of the pins
+        :param pins: pins to limit, the limits aren't saved by commit()
+        :param max_on_us: longest the pins may stay on, at most MAX_SAFETY_ON_US (0 lifts their limit)
+        :param link_loss: what a dropped link does, LINK_LOSS_KEEP leaves it as it is
+        :return: the settings in effect
+        """
+        byte_buffer = BleUartPinCtrl.pack_safety(port, pins, max_on_us, link_loss)
+
+        self._log_send("set_safety", byte_buffer)
+
+        reply = await self.request(byte_buffer)
+        return BleUartPinCtrl.unpack_safety_reply(reply)
+
+    async def get_safety(self) -> BleUartPinCtrlSafety:
+        """
+        Reads the safety settings in effect (see set_safety)
+        """
+        return await self.set_safety(0, [], 0)
+
+    async def set_connection_parameters(self, interval_ms: float = 0, slave_latency: int = 0,
+                                        supervision_timeout_ms: int = 0,
+                                        phy: BleUartPinCtrlConnPhys = BleUartPinCtrlConnPhys.PHY_KEEP,
+                                        data_length: int = 0) -> BleUartPinCtrlConnParams:
+        """
+        Asks the connected device to renegotiate its connection, 0 leaves a parameter as it is (except slave_latency,
+        which is always used when interval_ms is given). The central may refuse or adjust any of them, so the
+        parameters actually in effect are returned. The byte format is:
+            <command 1-byte> <interval 2-bytes, 1.25 ms units> <slave latency 2-bytes>
+            <supervision timeout 2-bytes, 10 ms units> <PHY 1-byte> <data length 2-bytes>
+        The reply is:
+            <command 1-byte> <interval 2-bytes> <slave latency 2-bytes> <supervision timeout 2-bytes> <PHY 1-byte>
+            <data length 2-bytes> <MTU 2-bytes>
+        :param interval_ms: connection interval, 7.5 ms to 4 s in 1.25 ms steps
+        :param slave_latency: connection events the device may skip while it has nothing to send
+        :param supervision_timeout_ms: time without packets after which the link is dropped, must be more than
+            2 * (1 + slave_latency) * interval_ms
+        :param phy: radio PHY, 2M halves the air time of every packet
+        :param data_length: link layer payload size in bytes (27-251)
+        :return: the parameters in effect
+        """
+        byte_buffer = BleUartPinCtrl.pack_conn_params(interval_ms, slave_latency, supervision_timeout_ms, phy,
+                                                      data_length)
+
+        self._log_send("set_connection_parameters", byte_buffer)
+
+        reply = await self.request(byte_buffer, self.CONN_PARAMS_TIMEOUT)
+        return BleUartPinCtrl.unpack_conn_params_reply(reply)
+
+    async def get_connection_parameters(self) -> BleUartPinCtrlConnParams:
+        """
+        Reads the connection parameters in effect (see set_connection_parameters)
+        """
+        return await self.set_connection_parameters()
+
+    async def request_low_latency(self) -> BleUartPinCtrlConnParams:
+        """
+        Asks for the fastest connection: shortest interval, no slave latency, 2M PHY and the largest data length
+        """
+        return await self.set_connection_parameters(interval_ms=7.5, slave_latency=0, supervision_timeout_ms=2000,
+                                                    phy=BleUartPinCtrlConnPhys.PHY_2M, data_length=251)
+
+    async def request_low_power(self) -> BleUartPinCtrlConnParams:
+        """
+        Asks for an idle connection: long interval and slave latency, so the device's radio is mostly off
+        """
+        return await self.set_connection_parameters(interval_ms=100, slave_latency=4, supervision_timeout_ms=6000)
+
+    async def echo(self, sequence: int, filler_length: int = 0, return_filler: bool = False,
+                   timeout: float = REPLY_TIMEOUT) -> BleUartPinCtrlEchoReply:
+        """
+        Sends a timestamped echo, for measuring round trip times. Nothing is printed, so it doesn't skew them. The
+        byte format is:
+            <command 1-byte> <sequence 4-bytes> <flags 1-byte> <filler length 1-byte> <filler bytes>
+        The reply is:
+            <command 1-byte> <sequence 4-bytes> <received time 4-bytes> <dispatched time 4-bytes>
+            <filler length 1-byte> <filler bytes>
+        :param sequence: number to match the reply with, must not be in use by another echo
+        :param filler_length: bytes of filler to pad the command with (0-255)
+        :param return_filler: have the device send the filler back (capped so the reply fits in a frame)
+        :param timeout: how long to wait for the reply in s
+        :return: the reply
+        """
+        byte_buffer = BleUartPinCtrl.pack_echo(sequence, filler_length,
+                                               self.ECHO_RETURN_FILLER if return_filler else 0)
+
+        future = self.expect_echo(sequence)
+        try:
+            await self.write_frame(byte_buffer)
+            return await asyncio.wait_for(future, timeout)
+        finally:
+            self.pending_echoes.pop(sequence, None)
+
+    def expect_echo(self, sequence: int) -> asyncio.Future:
+        """
+        Registers interest in the echo reply with this sequence number, e.g. for echoes sent in a batch
+        :param sequence: sequence number of the echo
+        :return: future resolved with the BleUartPinCtrlEchoReply
+        """
+        future = asyncio.get_event_loop().create_future()
+        self.pending_echoes[sequence] = future
+        return future
+
+    async def sync_clock(self, samples: int = 8, timeout: float = REPLY_TIMEOUT) -> BleUartPinCtrlClockSync:
+        """
+        Estimates the device clock from a few echoes: the device's dispatch time is taken to be halfway through the
+        round trip, and the echo with the shortest round trip wins. Crystals drift by tens of ppm, so sync again
+        every few minutes when scheduling ahead.
+        :param samples: number of echoes to send
+        :param timeout: how long to wait for each echo in s
+        :return: the estimate, also kept for device_time_us
+        """
+        best = None
+        for sample in range(samples):
+            start = time.perf_counter()
+            try:
+                reply = await self.echo(self.CLOCK_SYNC_SEQUENCE_BASE + sample, timeout=timeout)
+            except asyncio.TimeoutError:
+                continue
+            end = time.perf_counter()
+            if best is None or end - start < best.round_trip:
+                host_us = int((start + end) / 2 * 1000000)
+                best = BleUartPinCtrlClockSync(offset_us=(reply.dispatched_us - host_us) & 0xFFFFFFFF,
+                                               round_trip=end - start)
+        if best is None:
+            raise asyncio.TimeoutError("No echo came back to sync the clock with")
+        self.clock_sync = best
+        return best
+
+    def device_time_us(self, delay: float = 0.0, host_time: Optional[float] = None) -> int:
+        """
+        Converts a host time into device micros(), for scheduling commands (needs sync_clock first)
+        :param delay: time to add in s, e.g. enough to cover BLE delivery
+        :param host_time: time.perf_counter() time, now if not given
+        :return: device time in us (wraps every ~71 minutes)
+        """
+        if self.clock_sync is None:
+            raise RuntimeError("Call sync_clock before converting times")
+        host_time = time.perf_counter() if host_time is None else host_time
+        return (int((host_time + delay) * 1000000) + self.clock_sync.offset_us) & 0xFFFFFFFF
+
+    async def schedule(self, run_at_us: int, batch: BleUartPinCtrlBatch):
+        """
+        Queues the commands of a batch on the device to run at a device time (see device_time_us), so they come out
+        on time however BLE delivers them. The commands are split across as many SCHEDULE commands as needed (each
+        holds up to MAX_SCHEDULED_LENGTH bytes, the device queues up to SCHEDULE_QUEUE_CAPACITY), all due at the same
+        time and run in order. The byte format is:
+            <command 1-byte> <run at us 4-bytes> <length 1-byte> <command bytes (a command or a batch)>
+        :param run_at_us: device time to run the commands at, at most 60 s ahead (passed times run right away)
+        :param batch: the commands to run
+        """
+        scheduled = BleUartPinCtrlBatch()
+        scheduled.commands = BleUartPinCtrl.pack_schedule(run_at_us, batch)
+        for byte_buffer in scheduled.to_payloads():
+            self._log_send("schedule", byte_buffer)
+
+            # Transmit the byte buffer
+            await self.write_frame(byte_buffer)
+
+    async def cancel_schedule(self):
+        """
+        Drops every command queued with schedule that hasn't run yet
+        """
+        byte_buffer = struct.pack(BleUartPinCtrl.SCHEDULE_FORMAT, BleUartPinCtrlCommands.SCHEDULE, 0, 0)
+
+        self._log_send("cancel_schedule", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    async def get_stats(self, reset: bool = False) -> BleUartPinCtrlStats:
+        """
+        Reads the performance counters of the connected device. The byte format is:
+            <command 1-byte> <reset 1-byte>
+        The reply is:
+            <command 1-byte> <elapsed 4-bytes> <service calls 4-bytes> <max service time 4-bytes>
+            <max pulse lateness 4-bytes> <RX FIFO high water 2-bytes> <bytes received 4-bytes> <dropped bytes 4-bytes>
+            <bad length 4-bytes> <bad CRC 4-bytes> <timeouts 4-bytes> <bad commands 4-bytes> <command types 1-byte>
+            <(command 1-byte, count 4-bytes) per command type run>
+        :param reset: zero the counters once they are read
+        :return: the counters
+        """
+        byte_buffer = struct.pack("!BB", BleUartPinCtrlCommands.STATS, 1 if reset else 0)
+
+        self._log_send("get_stats", byte_buffer)
+
+        reply = await self.request(byte_buffer)
+        return BleUartPinCtrl.unpack_stats_reply(reply)
+
+    async def read_log(self) -> (List[BleUartPinCtrlLogRecord], int):
+        """
+        Takes every record from the device's binary log, oldest first, using as many reads as it takes. The byte
+        format of one read is:
+            <command 1-byte> <max records 1-byte, 0 = as many as fit>
+        The reply is:
+            <command 1-byte> <records dropped 2-bytes> <records remaining 2-bytes> <count 1-byte>
+            <(time 4-bytes, command 1-byte, length 1-byte, args 8-bytes) per record>
+        :return: the records, and the number of records lost because the log was full
+        """
+        records = list()
+        dropped = 0
+        byte_buffer = struct.pack("!BB", BleUartPinCtrlCommands.LOG_READ, 0)
+        while True:
+            reply = await self.request(byte_buffer)
+            size = struct.calcsize(self.LOG_READ_REPLY_FORMAT)
+            _, read_dropped, remaining, count = struct.unpack(self.LOG_READ_REPLY_FORMAT, reply[:size])
+            read_records = [BleUartPinCtrlLogRecord(*fields)
+                            for fields in struct.iter_unpack(self.LOG_RECORD_FORMAT, reply[size:])]
+            if len(read_records) != count:
+                raise RuntimeError("Malformed log read reply", reply)
+            records += read_records
+            dropped += read_dropped
+            if remaining == 0:
+                return records, dropped
+
+    async def upload_pattern(self, slot: int, keyframes: List[BleUartPinCtrlKeyframe]):
+        """
+        Stores a pattern on the device, replacing the one in the slot (and stopping it if it's playing). Keyframes
+        are applied in order, each one holding for its duration before the next, so the pattern plays with device
+        timing no matter how the link behaves. The byte format is:
+            <command 1-byte> <slot 1-byte> <first keyframe 1-byte> <keyframe count 1-byte>
+            followed per keyframe by
+            <port 4-bytes> <pin mask 4-bytes> <mode 1-byte> <level 1-byte> <duration us 4-bytes>
+        Patterns longer than MAX_UPLOAD_KEYFRAMES are sent in several commands.
+        :param slot: pattern slot, 0 to PATTERN_SLOTS - 1
+        :param keyframes: up to MAX_PATTERN_KEYFRAMES keyframes
+        """
+        for byte_buffer in BleUartPinCtrl.pack_upload_pattern(slot, keyframes):
+            self._log_send("upload_pattern", byte_buffer)
+
+            # Transmit the byte buffer
+            await self.write_frame(byte_buffer)
+
+    async def play_pattern(self, slot: int, repeat: int = 1):
+        """
+        Plays a stored pattern, restarting it if it's already playing. Pins are left as the last keyframe set them.
+        The byte format is:
+            <command 1-byte> <slot 1-byte> <repeat 2-bytes>
+        :param slot: pattern slot
+        :param repeat: number of times to play the pattern, 0 plays it until stopped
+        """
+        byte_buffer = BleUartPinCtrl.pack_play_pattern(slot, repeat)
+
+        self._log_send("play_pattern", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    async def stop_pattern(self, slot: Optional[int] = None):
+        """
+        Stops playing a pattern, pins are left as they are. The byte format is:
+            <command 1-byte> <slot 1-byte>
+        :param slot: pattern slot, None stops every pattern
+        """
+        byte_buffer = BleUartPinCtrl.pack_stop_pattern(slot)
+
+        self._log_send("stop_pattern", byte_buffer)
+
+        # Transmit the byte buffer
+        await self.write_frame(byte_buffer)
+
+    async def commit(self, erase: bool = False) -> int:
+        """
+        Saves the pin configuration (GPIO_CONFIGURE directions and the current output levels) and the stored patterns
+        to the device's flash, so they are restored at boot before any central connects. The byte format is:
+            <command 1-byte> <flags 1-byte>
+        The reply is:
+            <command 1-byte> <saved 1-byte> <file size 2-bytes>
+        The device stalls while it writes flash, so don't commit while timing matters.
+        :param erase: remove the saved settings instead, the device then boots with defaults
+        :return: bytes saved (0 if erased)
+        """
+        byte_buffer = struct.pack("!BB", BleUartPinCtrlCommands.COMMIT, BleUartPinCtrl.COMMIT_ERASE if erase else 0)
+
+        self._log_send("commit", byte_buffer)
+
+        reply = await self.request(byte_buffer, timeout=BleUartPinCtrl.COMMIT_TIMEOUT)
+        _, saved, size = struct.unpack(BleUartPinCtrl.COMMIT_REPLY_FORMAT, reply)
+        if not saved:
+            raise RuntimeError("Device couldn't write its flash")
+        return size
+
+    def batch(self) -> _BleUartPinCtrlBatchContext:
+        """
+        Starts a batch of commands that is sent when the block exits, e.g.
+            async with pin_ctrl.batch() as batch:
+                batch.write_gpio(port=0, pins=[12], output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
+                batch.set_pwm(port=0, pins=[14, 15], duty_cycle=128)
+        :return: async context manager yielding a BleUartPinCtrlBatch
+        """
+        return _BleUartPinCtrlBatchContext(self)
+
+    async def send_batch(self, batch: BleUartPinCtrlBatch):
+        """
+        Sends all commands in a batch, using one BLE write per BATCH frame.
+        :param batch: the commands to send
+        """
+        for byte_buffer in batch.to_payloads():
+            self._log_send("send_batch", byte_buffer)
+
+            # Transmit the byte buffer
+            await self.write_frame(byte_buffer)
+
+    async def write_frame(self, payload: bytes):
+        """
+        Frames a command and writes it to the device's NUS RX characteristic. In streaming mode the write goes
+        without response once the device's RX FIFO has room for it.
+        :param payload: the packed command
+        """
+        await (await self.start_frame_write(payload))
+
+    async def start_frame_write(self, payload: bytes) -> asyncio.Future:
+        """
+        Frames a command and starts writing it, for callers keeping several writes in flight. Writes start in the
+        order they're asked for. In streaming mode this first waits for the device's RX FIFO to have room.
+        :param payload: the packed command
+        :return: future completing once the write is done
+        """
+        frame = BleUartPinCtrl.frame(payload)
+        self._record(frame)
+        if not self.streaming:
+            return asyncio.ensure_future(self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(frame)))
+
+        await self._take_credits(len(frame))
+        return asyncio.ensure_future(self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(frame), response=False))
+
+    def record_writes(self, path: str):
+        """
+        Records every frame written from now on, for replaying on the host (see host/replay.cpp). The file gets one
+        line per write:
+            <time since the recording started in us> <framed bytes in hex>
+        :param path: file to (over)write
+        """
+        self.stop_recording()
+        self.recording = open(path, "w")
+        self.recording.write("# BleUartPinCtrl writes, <time us> <frame hex>\n")
+        self.recording_started = time.monotonic()
+
+    def stop_recording(self):
+        """
+        Stops recording writes and closes the file
+        """
+        if self.recording is not None:
+            self.recording.close()
+            self.recording = None
+
+    def _record(self, frame: bytes):
+        """
+        Adds a frame to the recording, if one is on
+        """
+        if self.recording is not None:
+            elapsed_us = int((time.monotonic() - self.recording_started) * 1e6)
+            self.recording.write("{} {}\n".format(elapsed_us, frame.hex()))
+
+    async def enable_streaming(self, interval_ms: int = CREDIT_INTERVAL_MS, timeout: float = REPLY_TIMEOUT):
+        """
+        Switches to streaming mode: frames are written without response, as fast as the link takes them, and the
+        device reports how much of its RX FIFO it has drained so the frames never overrun it. Don't write anything
+        else while this runs. The byte format is:
+            <command 1-byte> <enable 1-byte> <report interval ms 2-bytes>
+        The device then notifies, right away and whenever it drained bytes and the interval passed:
+            <command 1-byte> <bytes consumed since boot 4-bytes> <RX FIFO size 2-bytes>
+        :param interval_ms: shortest time between credit reports
+        :param timeout: how long to wait for the first report in s
+        """
+        self.credit_interval_ms = interval_ms
+        await self._sync_credits(timeout)
+        self.streaming = True
+
+    async def disable_streaming(self):
+        """
+        Goes back to writing with the backend's default write type, and stops the device's credit reports
+        """
+        self.streaming = False
+        await self.write_frame(struct.pack(BleUartPinCtrl.FLOW_CONTROL_FORMAT, BleUartPinCtrlCommands.FLOW_CONTROL,
+                                           0, 0))
+
+    async def _sync_credits(self, timeout: float):
+        """
+        Asks for a credit report and waits for it, the report counts every byte up to the request as consumed
+        """
+        self.credit_syncing = True
+        self.credit_event.clear()
+        frame = BleUartPinCtrl.frame(struct.pack(BleUartPinCtrl.FLOW_CONTROL_FORMAT,
+                                                 BleUartPinCtrlCommands.FLOW_CONTROL, 1, self.credit_interval_ms))
+        self._record(frame)
+        await self.client.write_gatt_char(self.NUS_RX_CHAR, bytearray(frame))
+        await asyncio.wait_for(self.credit_event.wait(), timeout)
+
+    async def _take_credits(self, length: int):
+        """
+        Waits until the device's RX FIFO has room for length more bytes, then counts them as sent
+        """
+        while True:
+            in_flight = (self.credit_sent - self.credit_consumed) & 0xFFFFFFFF
+            if in_flight + length <= self.fifo_depth:
+                self.credit_sent = (self.credit_sent + length) & 0xFFFFFFFF
+                return
+            self.credit_event.clear()
+            try:
+                await asyncio.wait_for(self.credit_event.wait(), self.REPLY_TIMEOUT)
+            except asyncio.TimeoutError:
+                # The report that would have freed the window went missing, ask for a fresh one
+                await self._sync_credits(self.REPLY_TIMEOUT)
+
+    @staticmethod
+    def frame(payload: bytes) -> bytes:
+        """
+        Wraps a packed command in a frame, the byte format is:
+            <sync 1-byte> <payload length 1-byte> <payload bytes> <CRC-8 of length and payload 1-byte>
+        :param payload: the packed command
+        :return: the frame
+        """
+        if len(payload) == 0 or len(payload) > BleUartPinCtrl.MAX_FRAME_PAYLOAD:
+            raise ValueError("Frame payload must be 1 to {} bytes".format(BleUartPinCtrl.MAX_FRAME_PAYLOAD))
+        header = struct.pack("!BB", BleUartPinCtrl.FRAME_SYNC, len(payload))
+        return header + payload + struct.pack("!B", crc8(header[1:] + payload))
+
+    @staticmethod
+    def pack_configure_gpio(port: int, pins: List[int], direction: BleUartPinCtrlGpioDirections,
+                            compact: bool = False) -> bytes:
+        """
+        Packs a GPIO configure command (see configure_gpio), or its compact form: <command> <pin set> <direction>
+        """
+        if compact:
+            return (struct.pack("!B", BleUartPinCtrlCommands.COMPACT_GPIO_CONFIGURE)
+                    + BleUartPinCtrl.pack_pin_set(port, pins) + struct.pack("!B", int(direction)))
+
+        return schema.pack_gpio_configure(port, BleUartPinCtrl.pin_list_to_bitmask(pins), int(direction))
+
+    @staticmethod
+    def pack_write_gpio(port: int, pins: List[int], output: BleUartPinCtrlGpioOutputs,
+                        compact: bool = False) -> bytes:
+        """
+        Packs a GPIO write command (see write_gpio), or its compact form: <command> <pin set> <output>
+        """
+        if compact:
+            return (struct.pack("!B", BleUartPinCtrlCommands.COMPACT_GPIO_WRITE)
+                    + BleUartPinCtrl.pack_pin_set(port, pins) + struct.pack("!B", int(output)))
+
+        return schema.pack_gpio_write(port, BleUartPinCtrl.pin_list_to_bitmask(pins), int(output))
+
+    @staticmethod
+    def pack_pulse_gpio(port: int, pins: List[int], duration_ms: int, compact: bool = False) -> bytes:
+        """
+        Packs a GPIO pulse command (see pulse_gpio), or its compact form: <command> <pin set> <varint duration>
+        """
+        if compact:
+            return (struct.pack("!B", BleUartPinCtrlCommands.COMPACT_GPIO_PULSE)
+                    + BleUartPinCtrl.pack_pin_set(port, pins) + BleUartPinCtrl.pack_varint(duration_ms))
+
+        return schema.pack_gpio_pulse(port, BleUartPinCtrl.pin_list_to_bitmask(pins), duration_ms)
+
+    @staticmethod
+    def pack_schedule_pulse_gpio(port: int, pins: List[int], duration_us: int, start_offset_us: int,
+                                 mode: BleUartPinCtrlPulseModes, compact: bool = False) -> bytes:
+        """
+        Packs a GPIO pulse schedule command (see schedule_pulse_gpio), or its compact form:
+            <command> <pin set> <mode> <varint duration> <varint start offset>
+        """
+        if compact:
+            return (struct.pack("!B", BleUartPinCtrlCommands.COMPACT_GPIO_PULSE_SCHEDULE)
+                    + BleUartPinCtrl.pack_pin_set(port, pins) + struct.pack("!B", int(mode))
+                    + BleUartPinCtrl.pack_varint(duration_us) + BleUartPinCtrl.pack_varint(start_offset_us))
+
+        return schema.pack_gpio_pulse_schedule(port, BleUartPinCtrl.pin_list_to_bitmask(pins), int(mode), duration_us,
+                                               start_offset_us)
+
+    @staticmethod
+    def pack_query_gpio(port: int, pins: List[int]) -> bytes:
+        """
+        Packs a GPIO query command (see query_gpio)
+        """
+        return schema.pack_gpio_query(port, BleUartPinCtrl.pin_list_to_bitmask(pins))
+
+    @staticmethod
+    def unpack_gpio_query_reply(reply: bytes) -> Dict[int, BleUartPinCtrlPinState]:
+        """
+        Unpacks a GPIO query reply (see query_gpio)
+        """
+        size = struct.calcsize(BleUartPinCtrl.GPIO_QUERY_REPLY_FORMAT)
+        _, _, pin_mask, inputs, outputs, directions, pulsing = struct.unpack(
+            BleUartPinCtrl.GPIO_QUERY_REPLY_FORMAT, reply[:size])
+        pins = [pin for pin in range(32) if pin_mask & (1 << pin)]
+        duty_cycles = reply[size:]
+        if len(duty_cycles) != len(pins):
+            raise RuntimeError("Malformed GPIO query reply", reply)
+
+        return {pin: BleUartPinCtrlPinState(input=bool(inputs & (1 << pin)), output=bool(outputs & (1 << pin)),
+                                            is_output=bool(directions & (1 << pin)),
+                                            pulsing=bool(pulsing & (1 << pin)), duty_cycle=duty_cycle)
+                for pin, duty_cycle in zip(pins, duty_cycles)}
+
+    @staticmethod
+    def unpack_query_state_reply(reply: bytes) -> BleUartPinCtrlDeviceState:
+        """
+        Unpacks a query state reply (see query_state)
+        """
+        size = struct.calcsize(BleUartPinCtrl.QUERY_STATE_REPLY_FORMAT)
+        fields = struct.unpack(BleUartPinCtrl.QUERY_STATE_REPLY_FORMAT, reply[:size])
+        ports = BleUartPinCtrl.QUERY_STATE_PORTS
+        registers = [list(fields[2 + i * ports:2 + (i + 1) * ports]) for i in range(4)]
+        queued_pulse_edges, hw_pulses_active, pwm_count = fields[-3:]
+        entries = reply[size:]
+        if len(entries) != 2 * pwm_count:
+            raise RuntimeError("Malformed query state reply", reply)
+
+        return BleUartPinCtrlDeviceState(uptime_ms=fields[1], inputs=registers[0], outputs=registers[1],
+                                         directions=registers[2], pulsing=registers[3],
+                                         queued_pulse_edges=queued_pulse_edges, hw_pulses_active=hw_pulses_active,
+                                         duty_cycles={entries[i]: entries[i + 1] for i in range(0, len(entries), 2)})
+
+    @staticmethod
+    def pack_subscribe_inputs(port: int, pins: List[int], debounce_ms: int, min_interval_ms: int) -> bytes:
+        """
+        Packs an input subscribe command (see subscribe_inputs)
+        """
+        return schema.pack_input_subscribe(port, BleUartPinCtrl.pin_list_to_bitmask(pins), debounce_ms, min_interval_ms)
+
+    @staticmethod
+    def unpack_input_events(payload: bytes) -> (List[BleUartPinCtrlInputEvent], int):
+        """
+        Unpacks an input events notification, the byte format is:
+            <command 1-byte> <changes lost 2-bytes> <count 1-byte> <(time 4-bytes, pin 1-byte, level 1-byte) per change>
+        :return: the changes, oldest first, and the number of changes lost before them
+        """
+        size = struct.calcsize(BleUartPinCtrl.INPUT_EVENTS_FORMAT)
+        _, lost, count = struct.unpack(BleUartPinCtrl.INPUT_EVENTS_FORMAT, payload[:size])
+        events = [BleUartPinCtrlInputEvent(pin=pin, level=bool(level), time_us=time_us)
+                  for time_us, pin, level in struct.iter_unpack(BleUartPinCtrl.INPUT_EVENT_FORMAT, payload[size:])]
+        if len(events) != count:
+            raise RuntimeError("Malformed input events notification", payload)
+        return events, lost
+
+    @staticmethod
+    def pack_stream_adc(inputs: List[int], rate_hz: int) -> bytes:
+        """
+        Packs an ADC stream command (see stream_adc)
+        """
+        if any(input < 0 or input >= BleUartPinCtrl.ADC_NUM_INPUTS for input in inputs):
+            raise ValueError("Analog inputs are 0 to {}".format(BleUartPinCtrl.ADC_NUM_INPUTS - 1), inputs)
+        return schema.pack_adc_stream(BleUartPinCtrl.pin_list_to_bitmask(inputs), rate_hz)
+
+    @staticmethod
+    def unpack_adc_samples(data: bytes, count: int) -> array.array:
+        """
+        Unpacks 12-bit samples packed big-endian two per 3 bytes (see AdcSamples in bleuart_pin_ctrl.h)
+        :param data: the packed samples
+        :param count: number of samples
+        :return: the samples
+        """
+        if len(data) != (count * 3 + 1) // 2:
+            raise RuntimeError("Malformed ADC samples notification", data)
+        samples = array.array("H", bytes(2 * count))
+        for i in range(0, count - 1, 2):
+            packed = int.from_bytes(data[i // 2 * 3:i // 2 * 3 + 3], "big")
+            samples[i], samples[i + 1] = packed >> 12, packed & 0xFFF
+        if count % 2:
+            samples[count - 1] = (data[-2] << 4) | (data[-1] >> 4)
+        return samples
+
+    @staticmethod
+    def pack_safety(port: int, pins: List[int], max_on_us: int, link_loss: BleUartPinCtrlLinkLoss) -> bytes:
+        """
+        Packs a safety command (see set_safety)
+        """
+        if not 0 <= max_on_us <= BleUartPinCtrl.MAX_SAFETY_ON_US:
+            raise ValueError("On-time limits are 0 to {} us".format(BleUartPinCtrl.MAX_SAFETY_ON_US), max_on_us)
+        return schema.pack_safety(port, BleUartPinCtrl.pin_list_to_bitmask(pins), max_on_us, int(link_loss))
+
+    @staticmethod
+    def unpack_safety_reply(reply: bytes) -> BleUartPinCtrlSafety:
+        """
+        Unpacks a safety reply (see set_safety)
+        """
+        fields = struct.unpack(BleUartPinCtrl.SAFETY_REPLY_FORMAT, reply)
+        ports = BleUartPinCtrl.QUERY_STATE_PORTS
+        return BleUartPinCtrlSafety(limited=list(fields[1:1 + ports]),
+                                    link_loss=BleUartPinCtrlLinkLoss(fields[1 + ports]),
+                                    failsafes=fields[2 + ports], auto_offs=fields[3 + ports])
+
+    @staticmethod
+    def pack_conn_params(interval_ms: float, slave_latency: int, supervision_timeout_ms: int,
+                         phy: BleUartPinCtrlConnPhys, data_length: int) -> bytes:
+        """
+        Packs a connection parameters command (see set_connection_parameters)
+        """
+        return schema.pack_conn_params(round(interval_ms / 1.25), slave_latency, round(supervision_timeout_ms / 10),
+                                       int(phy), data_length)
+
+    @staticmethod
+    def unpack_conn_params_reply(reply: bytes) -> BleUartPinCtrlConnParams:
+        """
+        Unpacks a connection parameters reply (see set_connection_parameters)
+        """
+        _, interval, slave_latency, supervision_timeout, phy, data_length, mtu = struct.unpack(
+            schema.STRUCTS["ConnParamsReply"].format, reply)
+        return BleUartPinCtrlConnParams(interval_ms=interval * 1.25, slave_latency=slave_latency,
+                                        supervision_timeout_ms=supervision_timeout * 10,
+                                        phy=BleUartPinCtrlConnPhys(phy), data_length=data_length, mtu=mtu)
+
+    @staticmethod
+    def pack_echo(sequence: int, filler_length: int, flags: int) -> bytes:
+        """
+        Packs an echo command (see echo)
+        """
+        return schema.pack_echo(sequence & 0xFFFFFFFF, flags, filler_length) \
+            + bytes(i & 0xFF for i in range(filler_length))
+
+    @staticmethod
+    def unpack_echo_reply(reply: bytes) -> BleUartPinCtrlEchoReply:
+        """
+        Unpacks an echo reply (see echo)
+        """
+        size = struct.calcsize("!BLLLB")
+        _, sequence, received_us, dispatched_us, filler_length = struct.unpack("!BLLLB", reply[:size])
+        if len(reply) != size + filler_length:
+            raise RuntimeError("Malformed echo reply", reply)
+        return BleUartPinCtrlEchoReply(sequence=sequence, received_us=received_us, dispatched_us=dispatched_us,
+                                       filler=reply[size:])
+
+    @staticmethod
+    def unpack_stats_reply(reply: bytes) -> BleUartPinCtrlStats:
+        """
+        Unpacks a stats reply (see get_stats)
+        """
+        size = struct.calcsize(BleUartPinCtrl.STATS_REPLY_FORMAT)
+        fields = struct.unpack(BleUartPinCtrl.STATS_REPLY_FORMAT, reply[:size])
+        commands = {command: count for command, count
+                    in struct.iter_unpack(BleUartPinCtrl.STATS_COMMAND_COUNT_FORMAT, reply[size:])}
+        if len(commands) != fields[-1]:
+            raise RuntimeError("Malformed stats reply", reply)
+        return BleUartPinCtrlStats(*fields[1:-1], commands=commands)
+
+    @staticmethod
+    def pack_set_pwm(port: int, pins: List[int], duty_cycle: int, compact: bool = False) -> bytes:
+        """
+        Packs a PWM set command (see set_pwm), or its compact form: <command> <pin set> <intensity>
+        """
+        if compact:
+            return (struct.pack("!B", BleUartPinCtrlCommands.COMPACT_PWM_SET)
+                    + BleUartPinCtrl.pack_pin_set(port, pins) + struct.pack("!B", duty_cycle))
+
+        return schema.pack_pwm_set(port, BleUartPinCtrl.pin_list_to_bitmask(pins), duty_cycle)
+
+    @staticmethod
+    def pack_upload_pattern(slot: int, keyframes: List[BleUartPinCtrlKeyframe]) -> List[bytes]:
+        """
+        Packs the pattern upload commands (see upload_pattern), one per MAX_UPLOAD_KEYFRAMES keyframes
+        """
+        if len(keyframes) == 0 or len(keyframes) > BleUartPinCtrl.MAX_PATTERN_KEYFRAMES:
+            raise ValueError("Patterns must have 1 to {} keyframes".format(BleUartPinCtrl.MAX_PATTERN_KEYFRAMES))
+        if sum(keyframe.duration_us for keyframe in keyframes) == 0:
+            raise ValueError("Patterns must take some time")
+        commands = list()
+        for first in range(0, len(keyframes), BleUartPinCtrl.MAX_UPLOAD_KEYFRAMES):
+            chunk = keyframes[first:first + BleUartPinCtrl.MAX_UPLOAD_KEYFRAMES]
+            command = struct.pack(BleUartPinCtrl.PATTERN_UPLOAD_FORMAT, BleUartPinCtrlCommands.PATTERN_UPLOAD,
+                                  slot, first, len(chunk))
+            for keyframe in chunk:
+                command += struct.pack(BleUartPinCtrl.KEYFRAME_FORMAT, keyframe.port,
+                                       BleUartPinCtrl.pin_list_to_bitmask(keyframe.pins), 1 if keyframe.pwm else 0,
+                                       keyframe.level, keyframe.duration_us)
+            commands.append(command)
+        return commands
+
+    @staticmethod
+    def pack_play_pattern(slot: int, repeat: int) -> bytes:
+        """
+        Packs a pattern play command (see play_pattern)
+        """
+        return schema.pack_pattern_play(slot, repeat)
+
+    @staticmethod
+    def pack_stop_pattern(slot: Optional[int]) -> bytes:
+        """
+        Packs a pattern stop command (see stop_pattern)
+        """
+        return schema.pack_pattern_stop(BleUartPinCtrl.PATTERN_ALL_SLOTS if slot is None else slot)
+
+    @staticmethod
+    def pack_set_pwm_multi(port: int, duty_cycles: Dict[int, int], frequency_hz: int, top: int) -> bytes:
+        """
+        Packs a PWM set multi command (see set_pwm_multi)
+        """
+        if len(duty_cycles) > BleUartPinCtrl.MAX_PWM_MULTI_CHANNELS:
+            raise ValueError("At most {} PWM pins".format(BleUartPinCtrl.MAX_PWM_MULTI_CHANNELS))
+        if top > BleUartPinCtrl.PWM_MAX_TOP:
+            raise ValueError("PWM top must be at most {}".format(BleUartPinCtrl.PWM_MAX_TOP))
+        command = struct.pack(BleUartPinCtrl.PWM_SET_MULTI_FORMAT, BleUartPinCtrlCommands.PWM_SET_MULTI,
+                              port, frequency_hz, top, len(duty_cycles))
+        for pin, duty in duty_cycles.items():
+            command += struct.pack(BleUartPinCtrl.PWM_CHANNEL_DUTY_FORMAT, pin, duty)
+        return command
+
+    @staticmethod
+    def pack_ramp_pwm(port: int, pins: List[int], start_duty: int, end_duty: int, duration_us: int,
+                      curve: BleUartPinCtrlPwmCurves) -> bytes:
+        """
+        Packs a PWM ramp command (see ramp_pwm)
+        """
+        return schema.pack_pwm_ramp(port, BleUartPinCtrl.pin_list_to_bitmask(pins), start_duty, end_duty, duration_us,
+                                    int(curve))
+
+    @staticmethod
+    def pack_schedule(run_at_us: int, batch: BleUartPinCtrlBatch) -> List[bytes]:
+        """
+        Packs the SCHEDULE commands for a batch (see schedule), single commands are queued as they are
+        """
+        if len(batch.commands) == 1:
+            bodies = batch.commands
+        else:
+            bodies = batch.to_payloads(BleUartPinCtrl.MAX_SCHEDULED_LENGTH - struct.calcsize("!BH"))
+        commands = list()
+        for body in bodies:
+            if len(body) > BleUartPinCtrl.MAX_SCHEDULED_LENGTH:
+                raise ValueError("Commands of over {} bytes can't be scheduled".format(
+                    BleUartPinCtrl.MAX_SCHEDULED_LENGTH))
+            commands.append(struct.pack(BleUartPinCtrl.SCHEDULE_FORMAT, BleUartPinCtrlCommands.SCHEDULE,
+                                        run_at_us & 0xFFFFFFFF, len(body)) + body)
+        if len(commands) > BleUartPinCtrl.SCHEDULE_QUEUE_CAPACITY:
+            raise ValueError("Batch needs {} queue entries, the device has {}".format(
+                len(commands), BleUartPinCtrl.SCHEDULE_QUEUE_CAPACITY))
+        return commands
+
+    @staticmethod
+    def pack_state_sync(sequence: int, base: int, flags: int, entries: List[Tuple[int, int]]) -> bytes:
+        """
+        Packs a state sync frame (see sync_state) from its (hardware pin, level) entries
+        """
+        byte_buffer = schema.pack_state_sync(sequence, base, flags, len(entries))
+        for pin, level in entries:
+            byte_buffer += struct.pack(BleUartPinCtrl.PIN_LEVEL_FORMAT, pin, level)
+        return byte_buffer
+
+    @staticmethod
+    def sync_pins(port: int, pins: List[int]) -> List[int]:
+        """
+        Numbers pins of a port as hardware pins, state sync addresses pins by their hardware number
+        :param port: hardware port of the pins (see hw_port), or GPIO_PORT_HW_ALL
+        :param pins: list of pins
+        :return: hardware pin numbers
+        """
+        if port == BleUartPinCtrl.GPIO_PORT_HW_ALL:
+            hw_pins = list(pins)
+        elif port & BleUartPinCtrl.GPIO_PORT_HW:
+            hw_pins = [BleUartPinCtrl.hw_pin(port & ~BleUartPinCtrl.GPIO_PORT_HW, pin) for pin in pins]
+        else:
+            raise ValueError("State sync takes hardware ports, see hw_port", port)
+        if any(pin < 0 or pin > 63 for pin in hw_pins):
+            raise ValueError("Hardware pins must be 0 to 63", hw_pins)
+        return hw_pins
+
+    @staticmethod
+    def hw_port(port: int) -> int:
+        """
+        Marks a port number as an nRF52 hardware port, so pin numbers are taken relative to that port
+        :param port: hardware port number (0 = P0, 1 = P1)
+        :return: port value to pass to the command methods
+        """
+        return port | BleUartPinCtrl.GPIO_PORT_HW
+
+    @staticmethod
+    def hw_pin(port: int, pin: int) -> int:
+        """
+        Numbers a hardware pin for GPIO_PORT_HW_ALL, which addresses pins of both ports in one command
+        :param port: hardware port number (0 = P0, 1 = P1)
+        :param pin: pin number within the port
+        :return: pin number to pass to the command methods along with GPIO_PORT_HW_ALL
+        """
+        return port * 32 + pin
+
+    @staticmethod
+    def pack_pin_set(port: int, pins: List[int]) -> bytes:
+        """
+        Packs pins in the compact form (see compact_format.h), whichever of a pin list or a mask is shorter:
+            <port 2-bits (0 = Arduino pins, 1 = P0, 2 = P1, 3 = both)> <1 = mask 1-bit> <count 5-bits> <pins or mask>
+        :param port: port number, as for the packed commands (see GPIO_PORT_HW and GPIO_PORT_HW_ALL)
+        :param pins: list of pins
+        :return: the pin set
+        """
+        if port == BleUartPinCtrl.GPIO_PORT_HW_ALL:
+            port_select, max_pin = BleUartPinCtrl.PIN_SET_PORT_HW_ALL, 63
+        else:
+            port_select = 1 + (port & ~BleUartPinCtrl.GPIO_PORT_HW) if port & BleUartPinCtrl.GPIO_PORT_HW else 0
+            max_pin = 31
+            if port_select > 2:
+                raise ValueError("Compact pin sets only address ports P0 and P1", port)
+
+        pins = sorted(set(pins))
+        if pins and (pins[0] < 0 or pins[-1] > max_pin):
+            raise ValueError("Pins must be 0 to {}".format(max_pin), pins)
+        pin_mask = BleUartPinCtrl.pin_list_to_bitmask(pins)
+        mask_length = max(1, (pin_mask.bit_length() + 7) // 8)
+        header = port_select << BleUartPinCtrl.PIN_SET_PORT_SHIFT
+        if len(pins) <= mask_length:
+            return struct.pack("!B", header | len(pins)) + bytes(pins)
+        return (struct.pack("!B", header | BleUartPinCtrl.PIN_SET_FORM_MASK | mask_length)
+                + pin_mask.to_bytes(mask_length, "big"))
+
+    @staticmethod
+    def pack_varint(value: int) -> bytes:
         """
-        TODO
+        Packs a 32-bit value as an unsigned LEB128 varint (7 bits per byte, least significant first)
         """
-        raise NotImplementedError("TODO CMK(11/15/20): Implement query_state")
+        if value < 0 or value > 0xFFFFFFFF:
+            raise ValueError("Varints hold 32-bit unsigned values", value)
+        packed = bytearray()
+        while value > 0x7F:
+            packed.append(0x80 | (value & 0x7F))
+            value >>= 7
+        packed.append(value)
+        return bytes(packed)
 
     @staticmethod
     def pin_list_to_bitmask(pins: List[int]) -> int:
@@ -0,0 +1,144 @@
+# -*- coding: utf-8 -*-
+"""
+Drives several devices running BleUartPinCtrl at once. Devices are found with one scan, connected concurrently and
+sent commands in parallel, so a step across N devices takes about as long as it does on one, e.g.
+    group = await BleUartPinCtrlGroup.new(count=4)
+    batch = BleUartPinCtrlBatch()
+    batch.write_gpio(port=0, pins=[12], output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
+    print(await group.send_batch(batch))
+"""
+
+import asyncio
+import time
+from typing import Awaitable, Callable, Dict, List, Optional, TypeVar
+
+from bleak import BleakScanner
+
+from ble_uart_pin_ctrl import BleUartPinCtrl, BleUartPinCtrlBatch
+
+T = TypeVar("T")
+
+
+class BleUartPinCtrlGroup:
+    # Devices name themselves "<prefix>-<last 8 hex digits of the MCU unique ID>" (see my_bleuart.ino)
+    NAME_PREFIX = "Bluefruit52"
+    SCAN_TIMEOUT = 5.0
+
+    def __init__(self, members: List[BleUartPinCtrl]):
+        # Connected devices, by name in name order
+        self.members: Dict[str, BleUartPinCtrl] = {member.device.name: member for member in members}
+
+    def __len__(self):
+        return len(self.members)
+
+    def __getitem__(self, name: str) -> BleUartPinCtrl:
+        return self.members[name]
+
+    @classmethod
+    async def new(cls, count: Optional[int] = None, names: Optional[List[str]] = None,
+                  name_prefix: str = NAME_PREFIX, scan_timeout: float = SCAN_TIMEOUT) -> "BleUartPinCtrlGroup":
+        """
+        Scans once and connects to every matching device concurrently
+        :param count: number of devices to connect to, raises if fewer are found (all found ones if None)
+        :param names: exact device names to connect to, instead of everything starting with name_prefix
+        :param name_prefix: start of the device names to pick
+        :param scan_timeout: how long to scan in s
+        :return: the connected group
+        """
+        devices = await BleakScanner.discover(timeout=scan_timeout)
+        found = sorted((device for device in devices
+                        if device.name is not None
+                        and BleUartPinCtrl.NORDIC_UART_SERVICE in device.metadata['uuids']
+                        and (device.name in names if names is not None else device.name.startswith(name_prefix))),
+                       key=lambda device: device.name)
+
+        wanted = len(names) if names is not None else count
+        if wanted is not None:
+            if len(found) < wanted:
+                raise RuntimeError("Found {} of {} devices".format(len(found), wanted),
+                                   [device.name for device in found])
+            found = found[:wanted]
+
+        members = await asyncio.gather(*(BleUartPinCtrl.connect(device) for device in found), return_exceptions=True)
+        failed = [member for member in members if isinstance(member, BaseException)]
+        if failed:
+            # Don't leave the ones that made it connected
+            await asyncio.gather(*(member.client.disconnect() for member in members
+                                   if isinstance(member, BleUartPinCtrl)), return_exceptions=True)
+            raise RuntimeError("Could not connect to every device", failed)
+        return cls(members)
+
+    async def disconnect(self):
+        """
+        Disconnects every device
+        """
+        await asyncio.gather(*(member.client.disconnect() for member in self.members.values()),
+                             return_exceptions=True)
+
+    async def for_each(self, action: Callable[[BleUartPinCtrl], Awaitable[T]]) -> Dict[str, T]:
+        """
+        Runs a coroutine on every device in parallel, e.g. group.for_each(lambda pin_ctrl: pin_ctrl.query_state())
+        :param action: called with each device, returns the coroutine to run
+        :return: result per device name
+        """
+        names = list(self.members)
+        results = await asyncio.gather(*(action(self.members[name]) for name in names))
+        return dict(zip(names, results))
+
+    async def send_batch(self, batch: BleUartPinCtrlBatch,
+                         per_device: Optional[Dict[str, BleUartPinCtrlBatch]] = None) -> Dict[str, float]:
+        """
+        Sends a batch to every device in parallel
+        :param batch: commands for every device
+        :param per_device: commands for single devices by name, sent instead of batch to those devices
+        :return: time each device took to accept its writes in s
+        """
+        per_device = per_device or dict()
+
+        async def send(pin_ctrl: BleUartPinCtrl) -> float:
+            start = time.perf_counter()
+            for payload in per_device.get(pin_ctrl.device.name, batch).to_payloads():
+                await pin_ctrl.write_frame(payload)
+            return time.perf_counter() - start
+
+        return await self.for_each(send)
+
+    async def measure_latency(self, samples: int = 8, timeout: float = BleUartPinCtrl.REPLY_TIMEOUT) \
+            -> Dict[str, float]:
+        """
+        Measures the median echo round trip of every device, in parallel
+        :param samples: echoes per device
+        :param timeout: how long to wait for each echo in s
+        :return: median round trip per device in s (inf if no echo came back)
+        """
+        async def measure(pin_ctrl: BleUartPinCtrl) -> float:
+            round_trips = list()
+            for sequence in range(samples):
+                start = time.perf_counter()
+                try:
+                    await pin_ctrl.echo(sequence, timeout=timeout)
+                except asyncio.TimeoutError:
+                    continue
+                round_trips.append(time.perf_counter() - start)
+            return sorted(round_trips)[len(round_trips) // 2] if round_trips else float("inf")
+
+        return await self.for_each(measure)
+
+    async def sync_clocks(self, samples: int = 8):
+        """
+        Estimates every device's clock (see BleUartPinCtrl.sync_clock), needed by schedule
+        """
+        await self.for_each(lambda pin_ctrl: pin_ctrl.sync_clock(samples))
+
+    async def schedule(self, delay: float, batch: BleUartPinCtrlBatch,
+                       per_device: Optional[Dict[str, BleUartPinCtrlBatch]] = None):
+        """
+        Queues commands on every device to run at the same moment, delay from now, however BLE delivers them
+        :param delay: time from now in s, long enough to cover delivery to every device
+        :param batch: commands for every device
+        :param per_device: commands for single devices by name, sent instead of batch to those devices
+        """
+        per_device = per_device or dict()
+        host_time = time.perf_counter() + delay
+        await self.for_each(lambda pin_ctrl: pin_ctrl.schedule(pin_ctrl.device_time_us(host_time=host_time),
+                                                               per_device.get(pin_ctrl.device.name, batch)))
@@ -0,0 +1,298 @@
+# -*- coding: utf-8 -*-
+"""
+Non-blocking pin commands for a device running BleUartPinCtrl. Commands issued within one connection interval are
+coalesced into BATCH frames, a bounded number of frame writes is kept in flight, and every command returns a future
+that completes once the frame carrying it is written, e.g.
+    send_queue = BleUartPinCtrlSendQueue(pin_ctrl)
+    await send_queue.start()
+    done = send_queue.write_gpio(port=0, pins=[12], output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
+    send_queue.set_pwm(port=0, pins=[14, 15], duty_cycle=128)   # same window, same frame and future
+    await done
+Callers producing commands faster than the link takes them await drain() now and then, which holds them back once
+too many bytes are queued. Commands with replies (queries, echoes, stats, ...) still go through BleUartPinCtrl, don't
+mix them with queued commands that must run first.
+"""
+
+import asyncio
+from typing import Dict, List, Optional, Set
+
+from ble_uart_pin_ctrl import (BleUartPinCtrl, BleUartPinCtrlBatch, BleUartPinCtrlGpioDirections,
+                               BleUartPinCtrlGpioOutputs, BleUartPinCtrlKeyframe, BleUartPinCtrlPulseModes,
+                               BleUartPinCtrlPwmCurves)
+
+
+class BleUartPinCtrlSendQueue:
+    # Coalescing window when the connection interval can't be read, in s (the shortest BLE connection interval)
+    DEFAULT_INTERVAL = 0.0075
+    # Frame writes in flight at once
+    DEFAULT_MAX_IN_FLIGHT = 4
+    # Queued command bytes past which drain() waits, about 16 full frames
+    DEFAULT_MAX_QUEUED_BYTES = 4096
+    # BATCH command bytes ahead of its sub-commands (see BatchHeader in bleuart_pin_ctrl.h)
+    BATCH_HEADER_LENGTH = 3
+
+    def __init__(self, pin_ctrl: BleUartPinCtrl, interval: Optional[float] = None,
+                 max_in_flight: int = DEFAULT_MAX_IN_FLIGHT, max_queued_bytes: int = DEFAULT_MAX_QUEUED_BYTES):
+        """
+        :param pin_ctrl: connected device
+        :param interval: how long commands are collected before they're sent in s, None for the connection interval
+        :param max_in_flight: most frame writes started but not done
+        :param max_queued_bytes: command bytes not yet written past which drain() waits
+        """
+        self.pin_ctrl = pin_ctrl
+        self.interval = interval
+        self.max_queued_bytes = max_queued_bytes
+        # Writes started but not done, and a slot per write that may be in flight
+        self.writes: Set[asyncio.Future] = set()
+        self.in_flight = asyncio.Semaphore(max_in_flight)
+        # Commands of the window being collected, and the future they share
+        self.batch = BleUartPinCtrlBatch(pin_ctrl.compact)
+        self.window_done: Optional[asyncio.Future] = None
+        self.window_opened = 0.0
+        # Future of the window whose writes are being started, it's off the batch but not all in self.writes yet
+        self.sending: Optional[asyncio.Future] = None
+        # Send the window without waiting for the interval to pass (see flush)
+        self.urgent = False
+        # Command bytes not yet handed to a write
+        self.queued_bytes = 0
+        # Totals, to see how well commands coalesce
+        self.commands_sent = 0
+        self.frames_sent = 0
+        # Set when a window opens or should go now, and when queued bytes go down
+        self.wakeup = asyncio.Event()
+        self.room = asyncio.Event()
+        self.sender: Optional[asyncio.Task] = None
+
+    async def start(self):
+        """
+        Reads the connection interval (unless one was given) and starts sending
+        """
+        if self.interval is None:
+            try:
+                params = await self.pin_ctrl.get_connection_parameters()
+                self.interval = params.interval_ms / 1000 if params.interval_ms else self.DEFAULT_INTERVAL
+            except asyncio.TimeoutError:
+                self.interval = self.DEFAULT_INTERVAL
+        self.sender = asyncio.ensure_future(self._send_loop())
+
+    async def stop(self):
+        """
+        Sends whatever is queued, waits for every write, then stops sending
+        """
+        await self.flush()
+        if self.sender is not None:
+            # No new commands from here, the sender returns once it's sent what's left rather than being cut off
+            sender, self.sender = self.sender, None
+            self.wakeup.set()
+            await sender
+            await self.flush()
+
+    async def flush(self):
+        """
+        Sends the current window right away and waits until every command queued so far is written
+        """
+        windows = [window for window in (self.sending, self.window_done) if window is not None]
+        if self.window_done is not None:
+            self.urgent = True
+            self.wakeup.set()
+        for window in windows:
+            await asyncio.shield(window)
+        if self.writes:
+            await asyncio.gather(*self.writes)
+
+    async def drain(self):
+        """
+        Waits until queued bytes are back under max_queued_bytes, this is the queue's backpressure
+        """
+        while self.queued_bytes > self.max_queued_bytes:
+            self.room.clear()
+            await self.room.wait()
+
+    def configure_gpio(self, port: int, pins: List[int], direction: BleUartPinCtrlGpioDirections) -> asyncio.Future:
+        """
+        Queues a GPIO configure command (see BleUartPinCtrl.configure_gpio)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.configure_gpio(port, pins, direction))
+
+    def write_gpio(self, port: int, pins: List[int], output: BleUartPinCtrlGpioOutputs) -> asyncio.Future:
+        """
+        Queues a GPIO write command (see BleUartPinCtrl.write_gpio)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.write_gpio(port, pins, output))
+
+    def pulse_gpio(self, port: int, pins: List[int], duration_ms: int) -> asyncio.Future:
+        """
+        Queues a GPIO pulse command (see BleUartPinCtrl.pulse_gpio)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.pulse_gpio(port, pins, duration_ms))
+
+    def schedule_pulse_gpio(self, port: int, pins: List[int], duration_us: int, start_offset_us: int = 0,
+                            mode: BleUartPinCtrlPulseModes = BleUartPinCtrlPulseModes.SIMULTANEOUS) -> asyncio.Future:
+        """
+        Queues a GPIO pulse schedule command (see BleUartPinCtrl.schedule_pulse_gpio)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.schedule_pulse_gpio(port, pins, duration_us, start_offset_us, mode))
+
+    def set_pwm(self, port: int, pins: List[int], duty_cycle: int) -> asyncio.Future:
+        """
+        Queues a PWM set command (see BleUartPinCtrl.set_pwm)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.set_pwm(port, pins, duty_cycle))
+
+    def set_pwm_multi(self, port: int, duty_cycles: Dict[int, int], frequency_hz: int = 0,
+                      top: int = 0) -> asyncio.Future:
+        """
+        Queues a PWM set multi command (see BleUartPinCtrl.set_pwm_multi)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.set_pwm_multi(port, duty_cycles, frequency_hz, top))
+
+    def ramp_pwm(self, port: int, pins: List[int], start_duty: int, end_duty: int, duration_us: int,
+                 curve: BleUartPinCtrlPwmCurves = BleUartPinCtrlPwmCurves.LINEAR) -> asyncio.Future:
+        """
+        Queues a PWM ramp command (see BleUartPinCtrl.ramp_pwm)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.ramp_pwm(port, pins, start_duty, end_duty, duration_us, curve))
+
+    def upload_pattern(self, slot: int, keyframes: List[BleUartPinCtrlKeyframe]) -> asyncio.Future:
+        """
+        Queues the pattern upload commands (see BleUartPinCtrl.upload_pattern)
+        :return: future completing once the commands are written
+        """
+        return self._queue(lambda batch: batch.upload_pattern(slot, keyframes))
+
+    def play_pattern(self, slot: int, repeat: int = 1) -> asyncio.Future:
+        """
+        Queues a pattern play command (see BleUartPinCtrl.play_pattern)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.play_pattern(slot, repeat))
+
+    def stop_pattern(self, slot: Optional[int] = None) -> asyncio.Future:
+        """
+        Queues a pattern stop command (see BleUartPinCtrl.stop_pattern)
+        :return: future completing once the command is written
+        """
+        return self._queue(lambda batch: batch.stop_pattern(slot))
+
+    def schedule(self, run_at_us: int, batch: BleUartPinCtrlBatch) -> asyncio.Future:
+        """
+        Queues commands that run at a device time (see BleUartPinCtrl.schedule)
+        :return: future completing once the commands are written
+        """
+        return self._queue(lambda window: window.schedule(run_at_us, batch))
+
+    def _queue(self, add) -> asyncio.Future:
+        """
+        Adds commands to the current window, opening one if there's none
+        :param add: adds the commands to the window's batch
+        :return: the window's future
+        """
+        if self.sender is None:
+            raise RuntimeError("Send queue isn't started")
+
+        added = len(self.batch.commands)
+        add(self.batch)
+        self.queued_bytes += sum(len(command) for command in self.batch.commands[added:])
+
+        if self.window_done is None:
+            loop = asyncio.get_event_loop()
+            self.window_done = loop.create_future()
+            self.window_opened = loop.time()
+            self.wakeup.set()
+        return self.window_done
+
+    async def _send_loop(self):
+        """
+        Sends each window once its interval has passed, a bounded number of writes at a time
+        """
+        loop = asyncio.get_event_loop()
+        while True:
+            if self.window_done is None:
+                if self.sender is None:
+                    return  # stopped, and nothing left to send
+                await self.wakeup.wait()
+                self.wakeup.clear()
+                continue
+
+            # Let the rest of this connection interval's commands join the window (unless stopping)
+            delay = self.window_opened + self.interval - loop.time()
+            while delay > 0 and not self.urgent and self.sender is not None:
+                try:
+                    await asyncio.wait_for(self.wakeup.wait(), delay)
+                    self.wakeup.clear()
+                except asyncio.TimeoutError:
+                    pass
+                delay = self.window_opened + self.interval - loop.time()
+            self.urgent = False
+
+            batch, done = self.batch, self.window_done
+            self.batch, self.window_done = BleUartPinCtrlBatch(self.pin_ctrl.compact), None
+
+            # A lone command goes as it is, more go in as few BATCH frames as they fit
+            lone = len(batch) == 1
+            payloads = batch.commands if lone else batch.to_payloads()
+            unsent = sum(len(command) for command in batch.commands)
+            writes = list()
+            self.sending = done
+            try:
+                for payload in payloads:
+                    await self.in_flight.acquire()
+                    try:
+                        write = await self.pin_ctrl.start_frame_write(payload)
+                    except BaseException:
+                        self.in_flight.release()
+                        raise
+                    write.add_done_callback(self._write_done)
+                    self.writes.add(write)
+                    writes.append(write)
+                    self.frames_sent += 1
+
+                    sent = len(payload) if lone else len(payload) - self.BATCH_HEADER_LENGTH
+                    unsent -= sent
+                    self.queued_bytes -= sent
+                    self.room.set()
+            except asyncio.CancelledError:
+                # Cancelled from outside mid-window, the rest of the window is never written
+                self.queued_bytes -= unsent
+                self.room.set()
+                done.cancel()
+                raise
+            except Exception as err:
+                # The rest of the window is lost, tell whoever waits on it
+                self.queued_bytes -= unsent
+                self.room.set()
+                done.set_exception(err)
+                continue
+            else:
+                self.commands_sent += len(batch)
+                asyncio.ensure_future(self._complete(done, writes))
+            finally:
+                self.sending = None
+
+    def _write_done(self, write: asyncio.Future):
+        """
+        Frees a write's in-flight slot
+        """
+        self.writes.discard(write)
+        self.in_flight.release()
+
+    @staticmethod
+    async def _complete(done: asyncio.Future, writes: List[asyncio.Future]):
+        """
+        Completes a window's future once all its writes are done (with the first error, if any failed)
+        """
+        try:
+            await asyncio.gather(*writes)
+        except Exception as err:
+            if not done.done():
+                done.set_exception(err)
+            return
+        if not done.done():
+            done.set_result(None)
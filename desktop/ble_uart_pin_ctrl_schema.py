@@ -0,0 +1,308 @@
+# -*- coding: utf-8 -*-
+# Generated by gen_schema.py from arduino/bleuart_pin_ctrl.h and arduino/bleuart_pin_ctrl.cpp, do not edit.
+"""
+Wire format of every BleUartPinCtrl struct, and a packer for the data of every command in the firmware's
+dispatch table (the fixed part, for variable-length commands)
+"""
+
+import struct
+from typing import Dict, NamedTuple, Tuple
+
+
+class StructSchema(NamedTuple):
+    format: str             # struct module format, network byte order
+    fields: Tuple[str, ...]  # name of each value the format packs, in order
+
+
+# Command ids
+COMMANDS: Dict[str, int] = {
+    "GPIO_CONFIGURE": 0x01,
+    "GPIO_WRITE": 0x02,
+    "GPIO_PULSE": 0x03,
+    "GPIO_QUERY": 0x04,
+    "PWM_SET": 0x05,
+    "QUERY_STATE": 0x06,
+    "BATCH": 0x07,
+    "GPIO_PULSE_SCHEDULE": 0x08,
+    "INPUT_SUBSCRIBE": 0x09,
+    "INPUT_EVENTS": 0x0A,
+    "CONN_PARAMS": 0x0B,
+    "ECHO": 0x0C,
+    "STATS": 0x0D,
+    "LOG_READ": 0x0E,
+    "PATTERN_UPLOAD": 0x0F,
+    "PATTERN_PLAY": 0x10,
+    "PATTERN_STOP": 0x11,
+    "COMMIT": 0x12,
+    "PWM_SET_MULTI": 0x13,
+    "PWM_RAMP": 0x14,
+    "SCHEDULE": 0x15,
+    "FLOW_CONTROL": 0x16,
+    "CREDITS": 0x17,
+    "PROTOCOL_VERSION": 0x18,
+    "COMPACT_GPIO_CONFIGURE": 0x19,
+    "COMPACT_GPIO_WRITE": 0x1A,
+    "COMPACT_GPIO_PULSE": 0x1B,
+    "COMPACT_GPIO_PULSE_SCHEDULE": 0x1C,
+    "COMPACT_PWM_SET": 0x1D,
+    "STATE_SYNC": 0x1E,
+    "ADC_STREAM": 0x1F,
+    "ADC_SAMPLES": 0x20,
+    "SAFETY": 0x21,
+}
+
+# Packed structs
+STRUCTS: Dict[str, StructSchema] = {
+    "GpioConfigure": StructSchema("!BLLB", ("command", "gpio_port", "gpio_bitset", "gpio_direction",)),
+    "GpioWrite": StructSchema("!BLLB", ("command", "gpio_port", "gpio_bitset", "output",)),
+    "GpioToggle": StructSchema("!BLL", ("command", "gpio_port", "gpio_bitset",)),
+    "GpioPulse": StructSchema("!BLLL", ("command", "gpio_port", "gpio_bitset", "duration_ms",)),
+    "GpioPulseSchedule": StructSchema("!BLLBLL", ("command", "gpio_port", "gpio_bitset", "mode", "duration_us", "start_offset_us",)),
+    "GpioQuery": StructSchema("!BLL", ("command", "gpio_port", "gpio_bitset",)),
+    "GpioQueryReply": StructSchema("!BLLLLLL", ("command", "gpio_port", "gpio_bitset", "input", "output", "direction", "pulsing",)),
+    "PwmSet": StructSchema("!BLLB", ("command", "gpio_port", "gpio_bitset", "intensity",)),
+    "QueryState": StructSchema("!B", ("command",)),
+    "QueryStateReply": StructSchema("!BL2L2L2L2LHBB", ("command", "uptime_ms", "input_0", "input_1", "output_0", "output_1", "direction_0", "direction_1", "pulsing_0", "pulsing_1", "queued_pulse_edges", "hw_pulses_active", "pwm_count",)),
+    "PwmDuty": StructSchema("!BB", ("pin", "duty",)),
+    "PwmSetMulti": StructSchema("!BLLHB", ("command", "gpio_port", "frequency_hz", "top", "count",)),
+    "PwmChannelDuty": StructSchema("!BH", ("pin", "duty",)),
+    "PwmRamp": StructSchema("!BLLHHLB", ("command", "gpio_port", "gpio_bitset", "start_duty", "end_duty", "duration_us", "curve",)),
+    "InputSubscribe": StructSchema("!BLLHH", ("command", "gpio_port", "gpio_bitset", "debounce_ms", "min_interval_ms",)),
+    "InputSubscribeReply": StructSchema("!BLL", ("command", "gpio_port", "gpio_bitset",)),
+    "InputEvents": StructSchema("!BHB", ("command", "lost", "count",)),
+    "InputEvent": StructSchema("!LBB", ("time_us", "pin", "level",)),
+    "ConnParams": StructSchema("!BHHHBH", ("command", "interval", "slave_latency", "supervision_timeout", "phy", "data_length",)),
+    "ConnParamsReply": StructSchema("!BHHHBHH", ("command", "interval", "slave_latency", "supervision_timeout", "phy", "data_length", "mtu",)),
+    "Echo": StructSchema("!BLBB", ("command", "sequence", "flags", "filler_length",)),
+    "EchoReply": StructSchema("!BLLLB", ("command", "sequence", "received_us", "dispatched_us", "filler_length",)),
+    "Stats": StructSchema("!BB", ("command", "reset",)),
+    "StatsReply": StructSchema("!BLLLLHLLLLLLB", ("command", "elapsed_ms", "service_calls", "max_service_us", "max_pulse_late_us", "rx_fifo_high_water", "bytes_received", "dropped_bytes", "bad_length", "bad_crc", "timeouts", "bad_commands", "command_types",)),
+    "StatsCommandCount": StructSchema("!BL", ("command", "count",)),
+    "LogRecord": StructSchema("!LBB8s", ("time_us", "command", "length", "args",)),
+    "LogRead": StructSchema("!BB", ("command", "max_records",)),
+    "LogReadReply": StructSchema("!BHHB", ("command", "dropped", "remaining", "count",)),
+    "Keyframe": StructSchema("!LLBBL", ("gpio_port", "gpio_bitset", "mode", "level", "duration_us",)),
+    "PatternUpload": StructSchema("!BBBB", ("command", "slot", "first_keyframe", "count",)),
+    "PatternPlay": StructSchema("!BBH", ("command", "slot", "repeat",)),
+    "PatternStop": StructSchema("!BB", ("command", "slot",)),
+    "Commit": StructSchema("!BB", ("command", "flags",)),
+    "CommitReply": StructSchema("!BBH", ("command", "saved", "size",)),
+    "Schedule": StructSchema("!BLB", ("command", "run_at_us", "length",)),
+    "FlowControl": StructSchema("!BBH", ("command", "enable", "interval_ms",)),
+    "Credits": StructSchema("!BLH", ("command", "consumed", "fifo_depth",)),
+    "ProtocolVersion": StructSchema("!BB", ("command", "version",)),
+    "ProtocolVersionReply": StructSchema("!BBB", ("command", "version", "max_version",)),
+    "BatchHeader": StructSchema("!BH", ("command", "batch_length",)),
+    "StateSync": StructSchema("!BHHBB", ("command", "sequence", "base", "flags", "count",)),
+    "PinLevel": StructSchema("!BB", ("pin", "level",)),
+    "StateSyncReply": StructSchema("!BHHB", ("command", "sequence", "state", "status",)),
+    "AdcStream": StructSchema("!BBL", ("command", "inputs", "rate_hz",)),
+    "AdcStreamReply": StructSchema("!BBLB", ("command", "inputs", "period_ticks", "scans_per_notification",)),
+    "AdcSamples": StructSchema("!BLB", ("command", "first_scan", "scans",)),
+    "Safety": StructSchema("!BLLLB", ("command", "gpio_port", "gpio_bitset", "max_on_us", "link_loss",)),
+    "SafetyReply": StructSchema("!B2LBLL", ("command", "limited_0", "limited_1", "link_loss", "failsafes", "auto_offs",)),
+}
+
+# Struct of each command's data
+COMMAND_STRUCTS: Dict[str, str] = {
+    "GPIO_CONFIGURE": "GpioConfigure",
+    "GPIO_WRITE": "GpioWrite",
+    "GPIO_PULSE": "GpioPulse",
+    "GPIO_QUERY": "GpioQuery",
+    "PWM_SET": "PwmSet",
+    "QUERY_STATE": "QueryState",
+    "BATCH": "BatchHeader",
+    "GPIO_PULSE_SCHEDULE": "GpioPulseSchedule",
+    "INPUT_SUBSCRIBE": "InputSubscribe",
+    "CONN_PARAMS": "ConnParams",
+    "ECHO": "Echo",
+    "STATS": "Stats",
+    "LOG_READ": "LogRead",
+    "PATTERN_UPLOAD": "PatternUpload",
+    "PATTERN_PLAY": "PatternPlay",
+    "PATTERN_STOP": "PatternStop",
+    "COMMIT": "Commit",
+    "PWM_SET_MULTI": "PwmSetMulti",
+    "PWM_RAMP": "PwmRamp",
+    "SCHEDULE": "Schedule",
+    "FLOW_CONTROL": "FlowControl",
+    "PROTOCOL_VERSION": "ProtocolVersion",
+    "STATE_SYNC": "StateSync",
+    "ADC_STREAM": "AdcStream",
+    "SAFETY": "Safety",
+}
+
+
+def pack_gpio_configure(gpio_port, gpio_bitset, gpio_direction) -> bytes:
+    """
+    Packs GPIO_CONFIGURE (GpioConfigure)
+    """
+    return struct.pack("!BLLB", 0x01, gpio_port, gpio_bitset, gpio_direction)
+
+
+def pack_gpio_write(gpio_port, gpio_bitset, output) -> bytes:
+    """
+    Packs GPIO_WRITE (GpioWrite)
+    """
+    return struct.pack("!BLLB", 0x02, gpio_port, gpio_bitset, output)
+
+
+def pack_gpio_pulse(gpio_port, gpio_bitset, duration_ms) -> bytes:
+    """
+    Packs GPIO_PULSE (GpioPulse)
+    """
+    return struct.pack("!BLLL", 0x03, gpio_port, gpio_bitset, duration_ms)
+
+
+def pack_gpio_query(gpio_port, gpio_bitset) -> bytes:
+    """
+    Packs GPIO_QUERY (GpioQuery)
+    """
+    return struct.pack("!BLL", 0x04, gpio_port, gpio_bitset)
+
+
+def pack_pwm_set(gpio_port, gpio_bitset, intensity) -> bytes:
+    """
+    Packs PWM_SET (PwmSet)
+    """
+    return struct.pack("!BLLB", 0x05, gpio_port, gpio_bitset, intensity)
+
+
+def pack_query_state() -> bytes:
+    """
+    Packs QUERY_STATE (QueryState)
+    """
+    return struct.pack("!B", 0x06)
+
+
+def pack_batch(batch_length) -> bytes:
+    """
+    Packs BATCH (BatchHeader)
+    """
+    return struct.pack("!BH", 0x07, batch_length)
+
+
+def pack_gpio_pulse_schedule(gpio_port, gpio_bitset, mode, duration_us, start_offset_us) -> bytes:
+    """
+    Packs GPIO_PULSE_SCHEDULE (GpioPulseSchedule)
+    """
+    return struct.pack("!BLLBLL", 0x08, gpio_port, gpio_bitset, mode, duration_us, start_offset_us)
+
+
+def pack_input_subscribe(gpio_port, gpio_bitset, debounce_ms, min_interval_ms) -> bytes:
+    """
+    Packs INPUT_SUBSCRIBE (InputSubscribe)
+    """
+    return struct.pack("!BLLHH", 0x09, gpio_port, gpio_bitset, debounce_ms, min_interval_ms)
+
+
+def pack_conn_params(interval, slave_latency, supervision_timeout, phy, data_length) -> bytes:
+    """
+    Packs CONN_PARAMS (ConnParams)
+    """
+    return struct.pack("!BHHHBH", 0x0B, interval, slave_latency, supervision_timeout, phy, data_length)
+
+
+def pack_echo(sequence, flags, filler_length) -> bytes:
+    """
+    Packs ECHO (Echo)
+    """
+    return struct.pack("!BLBB", 0x0C, sequence, flags, filler_length)
+
+
+def pack_stats(reset) -> bytes:
+    """
+    Packs STATS (Stats)
+    """
+    return struct.pack("!BB", 0x0D, reset)
+
+
+def pack_log_read(max_records) -> bytes:
+    """
+    Packs LOG_READ (LogRead)
+    """
+    return struct.pack("!BB", 0x0E, max_records)
+
+
+def pack_pattern_upload(slot, first_keyframe, count) -> bytes:
+    """
+    Packs PATTERN_UPLOAD (PatternUpload)
+    """
+    return struct.pack("!BBBB", 0x0F, slot, first_keyframe, count)
+
+
+def pack_pattern_play(slot, repeat) -> bytes:
+    """
+    Packs PATTERN_PLAY (PatternPlay)
+    """
+    return struct.pack("!BBH", 0x10, slot, repeat)
+
+
+def pack_pattern_stop(slot) -> bytes:
+    """
+    Packs PATTERN_STOP (PatternStop)
+    """
+    return struct.pack("!BB", 0x11, slot)
+
+
+def pack_commit(flags) -> bytes:
+    """
+    Packs COMMIT (Commit)
+    """
+    return struct.pack("!BB", 0x12, flags)
+
+
+def pack_pwm_set_multi(gpio_port, frequency_hz, top, count) -> bytes:
+    """
+    Packs PWM_SET_MULTI (PwmSetMulti)
+    """
+    return struct.pack("!BLLHB", 0x13, gpio_port, frequency_hz, top, count)
+
+
+def pack_pwm_ramp(gpio_port, gpio_bitset, start_duty, end_duty, duration_us, curve) -> bytes:
+    """
+    Packs PWM_RAMP (PwmRamp)
+    """
+    return struct.pack("!BLLHHLB", 0x14, gpio_port, gpio_bitset, start_duty, end_duty, duration_us, curve)
+
+
+def pack_schedule(run_at_us, length) -> bytes:
+    """
+    Packs SCHEDULE (Schedule)
+    """
+    return struct.pack("!BLB", 0x15, run_at_us, length)
+
+
+def pack_flow_control(enable, interval_ms) -> bytes:
+    """
+    Packs FLOW_CONTROL (FlowControl)
+    """
+    return struct.pack("!BBH", 0x16, enable, interval_ms)
+
+
+def pack_protocol_version(version) -> bytes:
+    """
+    Packs PROTOCOL_VERSION (ProtocolVersion)
+    """
+    return struct.pack("!BB", 0x18, version)
+
+
+def pack_state_sync(sequence, base, flags, count) -> bytes:
+    """
+    Packs STATE_SYNC (StateSync)
+    """
+    return struct.pack("!BHHBB", 0x1E, sequence, base, flags, count)
+
+
+def pack_adc_stream(inputs, rate_hz) -> bytes:
+    """
+    Packs ADC_STREAM (AdcStream)
+    """
+    return struct.pack("!BBL", 0x1F, inputs, rate_hz)
+
+
+def pack_safety(gpio_port, gpio_bitset, max_on_us, link_loss) -> bytes:
+    """
+    Packs SAFETY (Safety)
+    """
+    return struct.pack("!BLLLB", 0x21, gpio_port, gpio_bitset, max_on_us, link_loss)
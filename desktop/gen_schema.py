@@ -0,0 +1,167 @@
+# -*- coding: utf-8 -*-
+"""
+Generates ble_uart_pin_ctrl_schema.py from the firmware's wire structs (arduino/bleuart_pin_ctrl.h) and dispatch
+table (arduino/bleuart_pin_ctrl.cpp), so the desktop packs exactly what the firmware decodes. Run it after changing
+a command struct, and commit the result:
+    python gen_schema.py
+    python gen_schema.py --check    # fails if the generated module is out of date
+"""
+
+import argparse
+import os
+import re
+import sys
+from typing import Dict, List, NamedTuple, Tuple
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ARDUINO = os.path.join(HERE, "..", "arduino")
+HEADER = os.path.join(ARDUINO, "bleuart_pin_ctrl.h")
+SOURCE = os.path.join(ARDUINO, "bleuart_pin_ctrl.cpp")
+# headers declaring enums the wire structs use
+ENUM_HEADERS = [HEADER, os.path.join(ARDUINO, "pwm_group.h")]
+OUTPUT = os.path.join(HERE, "ble_uart_pin_ctrl_schema.py")
+
+# struct module codes of the integer types used in wire structs
+TYPE_CODES = {
+    "std::uint8_t": "B", "std::int8_t": "b",
+    "std::uint16_t": "H", "std::int16_t": "h",
+    "std::uint32_t": "L", "std::int32_t": "l",
+}
+
+ENUM_RE = re.compile(r"^enum class (\w+) : (std::\w+) \{", re.MULTILINE)
+COMMAND_RE = re.compile(r"^enum class Command : std::uint8_t \{(.*?)^\};", re.MULTILINE | re.DOTALL)
+COMMAND_VALUE_RE = re.compile(r"^\s*(\w+) = (0x[0-9A-Fa-f]+|\d+),", re.MULTILINE)
+CONSTANT_RE = re.compile(r"^constexpr [\w:]+(?: [\w:]+)? (\w+) = (0x[0-9A-Fa-f]+|\d+)\w*;", re.MULTILINE)
+STRUCT_RE = re.compile(r"^struct __attribute__\(\(packed\)\) (\w+) \{(.*?)^\};", re.MULTILINE | re.DOTALL)
+FIELD_RE = re.compile(r"^\s*([\w:]+) (\w+)(?:\[(\w+)\])?;", re.MULTILINE)
+TABLE_RE = re.compile(r"\{Command::(\w+), sizeof\((\w+)\),")
+
+
+class Field(NamedTuple):
+    name: str
+    code: str   # struct module code
+    count: int  # array length, 1 for plain fields
+
+
+def parse(header: str, source: str, enum_headers: List[str]) -> Tuple[Dict[str, int], Dict[str, List[Field]],
+                                                                     Dict[str, str]]:
+    """
+    Reads the commands, the wire structs and the struct of each command
+    :return: command ids by name, fields of each struct by name, struct name of each command
+    """
+    types = dict(TYPE_CODES)
+    for enum_header in enum_headers:
+        for name, underlying in ENUM_RE.findall(enum_header):
+            types[name] = TYPE_CODES[underlying]
+    constants = {name: int(value, 0) for name, value in CONSTANT_RE.findall(header)}
+
+    commands = {name: int(value, 0) for name, value in COMMAND_VALUE_RE.findall(COMMAND_RE.search(header).group(1))}
+
+    structs = dict()
+    for name, body in STRUCT_RE.findall(header):
+        fields = list()
+        for type_name, field_name, count in FIELD_RE.findall(body):
+            if type_name not in types:
+                raise RuntimeError("Unknown type {} of {}.{}".format(type_name, name, field_name))
+            count = 1 if not count else int(count) if count.isdigit() else constants[count]
+            fields.append(Field(field_name, types[type_name], count))
+        structs[name] = fields
+
+    command_structs = {command: struct_name for command, struct_name in TABLE_RE.findall(source)}
+    for command, struct_name in command_structs.items():
+        if command not in commands or struct_name not in structs:
+            raise RuntimeError("Dispatch table names unknown command {} or struct {}".format(command, struct_name))
+    return commands, structs, command_structs
+
+
+def struct_format(fields: List[Field]) -> str:
+    """
+    Network byte order struct module format of a packed struct, uint8_t arrays are bytes
+    """
+    codes = "".join(field.code if field.count == 1 else
+                    "{}s".format(field.count) if field.code == "B" else
+                    "{}{}".format(field.count, field.code) for field in fields)
+    return "!" + codes
+
+
+def field_names(fields: List[Field]) -> List[str]:
+    """
+    One name per value the struct module packs, arrays other than bytes take one per element
+    """
+    names = list()
+    for field in fields:
+        if field.count == 1 or field.code == "B":
+            names.append(field.name)
+        else:
+            names += ["{}_{}".format(field.name, i) for i in range(field.count)]
+    return names
+
+
+def generate(commands: Dict[str, int], structs: Dict[str, List[Field]], command_structs: Dict[str, str]) -> str:
+    lines = [
+        "# -*- coding: utf-8 -*-",
+        "# Generated by gen_schema.py from arduino/bleuart_pin_ctrl.h and arduino/bleuart_pin_ctrl.cpp, do not edit.",
+        '"""',
+        "Wire format of every BleUartPinCtrl struct, and a packer for the data of every command in the firmware's",
+        "dispatch table (the fixed part, for variable-length commands)",
+        '"""',
+        "",
+        "import struct",
+        "from typing import Dict, NamedTuple, Tuple",
+        "",
+        "",
+        "class StructSchema(NamedTuple):",
+        "    format: str             # struct module format, network byte order",
+        "    fields: Tuple[str, ...]  # name of each value the format packs, in order",
+        "",
+        "",
+        "# Command ids",
+        "COMMANDS: Dict[str, int] = {",
+    ]
+    lines += ["    \"{}\": 0x{:02X},".format(name, value) for name, value in commands.items()]
+    lines += ["}", "", "# Packed structs", "STRUCTS: Dict[str, StructSchema] = {"]
+    for name, fields in structs.items():
+        lines.append("    \"{}\": StructSchema(\"{}\", ({})),".format(
+            name, struct_format(fields), "".join("\"{}\", ".format(field) for field in field_names(fields)).strip()))
+    lines += ["}", "", "# Struct of each command's data", "COMMAND_STRUCTS: Dict[str, str] = {"]
+    lines += ["    \"{}\": \"{}\",".format(command, struct_name) for command, struct_name in command_structs.items()]
+    lines.append("}")
+
+    for command, struct_name in command_structs.items():
+        names = field_names(structs[struct_name])[1:]  # the command byte is filled in
+        lines += [
+            "",
+            "",
+            "def pack_{}({}) -> bytes:".format(command.lower(), ", ".join(names)),
+            "    \"\"\"",
+            "    Packs {} ({})".format(command, struct_name),
+            "    \"\"\"",
+            "    return struct.pack(\"{}\", 0x{:02X}{})".format(struct_format(structs[struct_name]), commands[command],
+                                                           "".join(", " + name for name in names)),
+        ]
+    return "\n".join(lines) + "\n"
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description="Generate the desktop wire schema from the firmware sources")
+    parser.add_argument("--check", action="store_true", help="fail if the generated module is out of date")
+    args = parser.parse_args(argv)
+
+    sources = dict()
+    for path in set(ENUM_HEADERS + [HEADER, SOURCE]):
+        with open(path) as source:
+            sources[path] = source.read()
+    generated = generate(*parse(sources[HEADER], sources[SOURCE], [sources[path] for path in ENUM_HEADERS]))
+
+    if args.check:
+        with open(OUTPUT) as output:
+            if output.read() != generated:
+                sys.exit("{} is out of date, run gen_schema.py".format(os.path.basename(OUTPUT)))
+        return
+
+    with open(OUTPUT, "w", newline="\n") as output:
+        output.write(generated)
+
+
+if __name__ == "__main__":
+    main()
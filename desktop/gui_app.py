@@ -1,7 +1,6 @@
 import asyncio
 import queue
 import threading
-import time
 from typing import List, Tuple
 
 import tkinter as tk
@@ -9,6 +8,7 @@ from tkinter import ttk
 
 
 from ble_uart_pin_ctrl import BleUartPinCtrl, BleUartPinCtrlGpioOutputs, BleUartPinCtrlGpioDirections
+from ble_uart_pin_ctrl_queue import BleUartPinCtrlSendQueue
 
 
 class Solenoids:
@@ -414,6 +414,7 @@ class BLEApp:
 
         # BLE UART pin control variables
         self.pin_ctrl = None
+        self.send_queue = None
 
         # asyncio thread variables
         self.loop = None
@@ -503,6 +504,10 @@ class BLEApp:
             self.status_label_var.set("Connected!")
             self.pin_ctrl.set_disconnect_callback(self.on_disconnect)
             self.conn_state_var.set("Connected: {}".format(self.pin_ctrl.get_mac()))
+            # Pin commands go through a send queue, without printing each one
+            self.pin_ctrl.log_sends = False
+            self.send_queue = BleUartPinCtrlSendQueue(self.pin_ctrl)
+            await self.send_queue.start()
 
     def on_connect(self):
         # Disable buttons no longer used
@@ -546,6 +551,7 @@ class BLEApp:
                                pulse_solenoids: List[Tuple[int, int]], pulse_duration: int,
                                erm_motors: List[Tuple[int, int]], erm_duty_cycle: int):
         try:
+            # Queue everything, commands issued within one connection interval go out in one BATCH frame
             # Are there solenoids to set high?
             if len(high_solenoids) > 0:  # Send a GPIO high command
                 temp_str = self.status_label_var.get()
@@ -555,16 +561,12 @@ class BLEApp:
                 port_zero_pins, port_one_pins = self.separate_pins_by_port(high_solenoids)
 
                 if len(port_zero_pins) > 0:
-                    await self.pin_ctrl.write_gpio(port=0, pins=port_zero_pins,
-                                                   output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
+                    self.send_queue.write_gpio(port=0, pins=port_zero_pins, output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
                 if len(port_one_pins) > 0:
-                    await self.pin_ctrl.write_gpio(port=1, pins=port_one_pins,
-                                                   output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
-
-                time.sleep(0.1)  # sleep for a little bit so things don't get flooded
+                    self.send_queue.write_gpio(port=1, pins=port_one_pins, output=BleUartPinCtrlGpioOutputs.OUT_HIGH)
 
             # Are there solenoids to set low?
-            if len(low_solenoids) > 0:  # Send a GPIO high command
+            if len(low_solenoids) > 0:  # Send a GPIO low command
                 temp_str = self.status_label_var.get()
                 temp_str += "\nSetting low: {}...".format(low_solenoids)
                 self.status_label_var.set(temp_str)
@@ -572,15 +574,12 @@ class BLEApp:
                 port_zero_pins, port_one_pins = self.separate_pins_by_port(low_solenoids)
 
                 if len(port_zero_pins) > 0:
-                    await self.pin_ctrl.write_gpio(port=0, pins=port_zero_pins,
-                                                   output=BleUartPinCtrlGpioOutputs.OUT_LOW)
+                    self.send_queue.write_gpio(port=0, pins=port_zero_pins, output=BleUartPinCtrlGpioOutputs.OUT_LOW)
                 if len(port_one_pins) > 0:
-                    await self.pin_ctrl.write_gpio(port=1, pins=port_one_pins, output=BleUartPinCtrlGpioOutputs.OUT_LOW)
-
-                time.sleep(0.1)  # sleep for a little bit so things don't get flooded
+                    self.send_queue.write_gpio(port=1, pins=port_one_pins, output=BleUartPinCtrlGpioOutputs.OUT_LOW)
 
             # Are there solenoids to pulse?
-            if len(pulse_solenoids) > 0:  # Send a GPIO high command
+            if len(pulse_solenoids) > 0:  # Send a GPIO pulse command
                 temp_str = self.status_label_var.get()
                 temp_str += "\nPulsing for {} ms: {}...".format(pulse_duration, pulse_solenoids)
                 self.status_label_var.set(temp_str)
@@ -588,13 +587,12 @@ class BLEApp:
                 port_zero_pins, port_one_pins = self.separate_pins_by_port(pulse_solenoids)
 
                 if len(port_zero_pins) > 0:
-                    await self.pin_ctrl.pulse_gpio(port=0, pins=port_zero_pins, duration_ms=pulse_duration)
+                    self.send_queue.pulse_gpio(port=0, pins=port_zero_pins, duration_ms=pulse_duration)
                 if len(port_one_pins) > 0:
-                    await self.pin_ctrl.pulse_gpio(port=1, pins=port_one_pins, duration_ms=pulse_duration)
-                time.sleep(0.1)  # sleep for a little bit so things don't get flooded
+                    self.send_queue.pulse_gpio(port=1, pins=port_one_pins, duration_ms=pulse_duration)
 
             # Are there ERMs to PWM?
-            if len(erm_motors) > 0:  # Send a GPIO high command
+            if len(erm_motors) > 0:  # Send a PWM set command
                 temp_str = self.status_label_var.get()
                 temp_str += "\nPWMing duty cycle {}/255: {}...".format(erm_duty_cycle, erm_motors)
                 self.status_label_var.set(temp_str)
@@ -602,11 +600,10 @@ class BLEApp:
                 port_zero_pins, port_one_pins = self.separate_pins_by_port(erm_motors)
 
                 if len(port_zero_pins) > 0:
-                    await self.pin_ctrl.set_pwm(port=0, pins=port_zero_pins, duty_cycle=erm_duty_cycle)
+                    self.send_queue.set_pwm(port=0, pins=port_zero_pins, duty_cycle=erm_duty_cycle)
                 if len(port_one_pins) > 0:
-                    await self.pin_ctrl.set_pwm(port=1, pins=port_one_pins, duty_cycle=erm_duty_cycle)
-
-                time.sleep(0.1)  # sleep for a little bit so things don't get flooded
+                    self.send_queue.set_pwm(port=1, pins=port_one_pins, duty_cycle=erm_duty_cycle)
+            await self.send_queue.flush()
         except RuntimeError as err:  # Couldn't execute, update GUI state
             self.execute_button["state"] = "normal"
             self.gpio_conf_button["state"] = "normal"
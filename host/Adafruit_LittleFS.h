@@ -0,0 +1,58 @@
+/* Adafruit_LittleFS.h
+ * Host stand-in for the Adafruit LittleFS wrapper: an in-memory file system (see InternalFileSystem.h).
+ * Functionality:
+ *      - Open files to read or to append, read/write/available/close
+ *      - exists/remove/rename by path, no directories
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#define FILE_O_READ 0
+#define FILE_O_WRITE 1
+
+namespace Adafruit_LittleFS_Namespace {
+
+class File;
+
+}  // namespace Adafruit_LittleFS_Namespace
+
+class Adafruit_LittleFS {
+    friend class Adafruit_LittleFS_Namespace::File;
+
+    std::map<std::string, std::vector<std::uint8_t>> _files;
+
+public:
+    bool begin() { return true; }
+    bool exists(const char *path) const { return _files.count(path) != 0; }
+    bool remove(const char *path) { return _files.erase(path) != 0; }
+    bool rename(const char *from, const char *to);
+
+    /* Remove every file (host only) */
+    void format() { _files.clear(); }
+};
+
+namespace Adafruit_LittleFS_Namespace {
+
+class File {
+    Adafruit_LittleFS *_fs;
+    std::string _path;
+    std::size_t _position;
+    bool _open;
+
+public:
+    explicit File(Adafruit_LittleFS &fs) : _fs{&fs}, _path{}, _position{0}, _open{false} {}
+
+    bool open(const char *path, std::uint8_t mode);
+    std::size_t write(const std::uint8_t *data, std::size_t length);
+    int read(void *data, std::size_t length);
+    int available();
+    void close() { _open = false; }
+};
+
+}  // namespace Adafruit_LittleFS_Namespace
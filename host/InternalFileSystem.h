@@ -0,0 +1,9 @@
+/* InternalFileSystem.h
+ * Host stand-in for the nRF52 internal flash file system, kept in memory until host_hal::reset().
+ */
+
+#pragma once
+
+#include "Adafruit_LittleFS.h"
+
+extern Adafruit_LittleFS InternalFS;
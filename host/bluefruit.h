@@ -0,0 +1,353 @@
+/* bluefruit.h
+ * Host stand-in for the Adafruit nRF52 core, so the firmware sources build and run natively (see host_hal.h).
+ * Functionality:
+ *      - Arduino calls the firmware makes (micros/millis on the virtual clock, analogWrite, attachInterrupt, Serial)
+ *      - BLEUart with an RX FIFO fed by the harness and a buffer of everything the firmware sent
+ *      - nRF52840 GPIO port registers in memory, recording every output edge with its time
+ *      - Inert TIMER, GPIOTE, PPI, PWM, SAADC, NVIC, SoftDevice and FreeRTOS calls (hardware pulse timing, ADC
+ *        sampling and the service task aren't simulated, keep to polled pulses and service() from the harness)
+ *
+ * Only what the firmware in arduino/ uses is declared, with the core's names and signatures.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+/** Arduino constants */
+#define HEX 16
+#define DEC 10
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+#define CHANGE 2
+
+/** Feather nRF52840 Express pin count, see g_ADigitalPinMap */
+#define PINS_COUNT 34
+extern const std::uint32_t g_ADigitalPinMap[PINS_COUNT];
+
+/** Arduino time and pin calls */
+std::uint32_t micros();
+std::uint32_t millis();
+void delay(std::uint32_t ms);
+void pinMode(std::uint32_t pin, std::uint32_t mode);
+void digitalWrite(std::uint32_t pin, std::uint32_t value);
+int digitalRead(std::uint32_t pin);
+void analogWrite(std::uint32_t pin, std::uint32_t value);
+
+typedef void (*voidFuncPtr)(void);
+int attachInterrupt(std::uint32_t pin, voidFuncPtr callback, std::uint32_t mode);
+void detachInterrupt(std::uint32_t pin);
+
+/** Serial, printed to stdout only while host_hal::echo_serial() is on */
+class HostSerial {
+public:
+    void begin(unsigned long) {}
+    void print(const char *text);
+    void print(char c);
+    void print(long value, int base = DEC);
+    void print(unsigned long value, int base = DEC);
+    void print(int value, int base = DEC) { print(static_cast<long>(value), base); }
+    void print(unsigned int value, int base = DEC) { print(static_cast<unsigned long>(value), base); }
+    void print(double value);
+    template <typename T> void println(T value) { print(value); print('\n'); }
+    template <typename T> void println(T value, int base) { print(value, base); print('\n'); }
+    void println() { print('\n'); }
+    operator bool() const { return true; }
+};
+extern HostSerial Serial;
+
+/** BLE UART: the firmware reads the RX FIFO and writes notifications, the harness does the opposite */
+#define BLE_UART_DEFAULT_FIFO_DEPTH 256
+class BLEUart {
+    std::uint16_t _fifo_depth;
+    std::deque<std::uint8_t> _rx;   /*!< Bytes written by the central, not read yet */
+    std::vector<std::uint8_t> _tx;  /*!< Bytes the firmware sent, not taken yet */
+    bool _notify;
+
+public:
+    explicit BLEUart(std::uint16_t fifo_depth = BLE_UART_DEFAULT_FIFO_DEPTH)
+        : _fifo_depth{fifo_depth}, _rx{}, _tx{}, _notify{true} {}
+
+    /* Core API the firmware uses */
+    void begin() {}
+    int available() { return static_cast<int>(_rx.size()); }
+    int peek() { return _rx.empty() ? -1 : _rx.front(); }
+    int read();
+    int read(std::uint8_t *buffer, std::size_t size);
+    std::size_t write(std::uint8_t b) { return write(&b, 1); }
+    std::size_t write(const std::uint8_t *content, std::size_t len);
+    bool notifyEnabled() { return _notify; }
+
+    /* Harness side: write bytes as the central would, returns how many fit the RX FIFO (the rest are lost) */
+    std::size_t host_write(const std::uint8_t *data, std::size_t length);
+
+    /* Harness side: take every byte the firmware sent so far */
+    std::vector<std::uint8_t> host_take_sent();
+
+    /* Harness side: whether the central has notifications enabled (writes are dropped while it hasn't) */
+    void host_set_notify(bool enable) { _notify = enable; }
+};
+
+/** GPIO port registers */
+/* Note: OUTSET/OUTCLR/DIRSET/DIRCLR and PIN_CNF are write-only views that update OUT and DIR like the hardware
+ * does, so the firmware's register writes work unchanged. IN reads back OUT for outputs, host_hal sets inputs. */
+struct NRF_GPIO_Type;
+namespace host_hal {
+void gpio_write_out(NRF_GPIO_Type *regs, std::uint32_t value);
+}
+
+struct NRF_GPIO_Type {
+    /** Write-only register updating OUT or DIR */
+    class Strobe {
+        NRF_GPIO_Type *_regs;
+        std::uint32_t NRF_GPIO_Type::*_target;
+        bool _set;
+
+    public:
+        Strobe(NRF_GPIO_Type *regs, std::uint32_t NRF_GPIO_Type::*target, bool set)
+            : _regs{regs}, _target{target}, _set{set} {}
+        Strobe &operator=(std::uint32_t mask);
+    };
+
+    /** PIN_CNF[n], only its DIR bit is simulated */
+    class PinConfig {
+        NRF_GPIO_Type *_regs;
+        unsigned int _pin;
+
+    public:
+        PinConfig(NRF_GPIO_Type *regs, unsigned int pin) : _regs{regs}, _pin{pin} {}
+        PinConfig &operator=(std::uint32_t value);
+    };
+
+    class PinConfigs {
+        NRF_GPIO_Type *_regs;
+
+    public:
+        explicit PinConfigs(NRF_GPIO_Type *regs) : _regs{regs} {}
+        PinConfig operator[](unsigned int pin) { return PinConfig{_regs, pin}; }
+    };
+
+    unsigned int port;  // 0 = P0, 1 = P1 (host only)
+    std::uint32_t OUT;
+    std::uint32_t IN;
+    std::uint32_t DIR;
+    Strobe OUTSET;
+    Strobe OUTCLR;
+    Strobe DIRSET;
+    Strobe DIRCLR;
+    PinConfigs PIN_CNF;
+
+    explicit NRF_GPIO_Type(unsigned int port_number)
+        : port{port_number}, OUT{0}, IN{0}, DIR{0},
+          OUTSET{this, &NRF_GPIO_Type::OUT, true}, OUTCLR{this, &NRF_GPIO_Type::OUT, false},
+          DIRSET{this, &NRF_GPIO_Type::DIR, true}, DIRCLR{this, &NRF_GPIO_Type::DIR, false}, PIN_CNF{this} {}
+    NRF_GPIO_Type(const NRF_GPIO_Type &) = delete;
+    NRF_GPIO_Type &operator=(const NRF_GPIO_Type &) = delete;
+};
+extern NRF_GPIO_Type *const NRF_P0;
+extern NRF_GPIO_Type *const NRF_P1;
+#define NRF_P0 NRF_P0
+#define NRF_P1 NRF_P1
+
+#define GPIO_PIN_CNF_DIR_Pos 0
+#define GPIO_PIN_CNF_DIR_Input 0
+#define GPIO_PIN_CNF_DIR_Output 1
+#define GPIO_PIN_CNF_INPUT_Pos 1
+#define GPIO_PIN_CNF_INPUT_Connect 0
+#define GPIO_PIN_CNF_INPUT_Disconnect 1
+#define GPIO_PIN_CNF_PULL_Pos 2
+#define GPIO_PIN_CNF_PULL_Disabled 0
+#define GPIO_PIN_CNF_PULL_Pulldown 1
+#define GPIO_PIN_CNF_PULL_Pullup 3
+#define GPIO_PIN_CNF_DRIVE_Pos 8
+#define GPIO_PIN_CNF_DRIVE_S0S1 0
+#define GPIO_PIN_CNF_SENSE_Pos 16
+#define GPIO_PIN_CNF_SENSE_Disabled 0
+
+/** TIMER, GPIOTE and PPI (registers only, nothing counts or fires) */
+struct NRF_TIMER_Type {
+    volatile std::uint32_t TASKS_START, TASKS_STOP, TASKS_COUNT, TASKS_CLEAR, TASKS_SHUTDOWN, TASKS_CAPTURE[6];
+    volatile std::uint32_t EVENTS_COMPARE[6];
+    volatile std::uint32_t SHORTS, INTENSET, INTENCLR, MODE, BITMODE, PRESCALER, CC[6];
+};
+struct NRF_GPIOTE_Type {
+    volatile std::uint32_t TASKS_OUT[8], TASKS_SET[8], TASKS_CLR[8], EVENTS_IN[8], EVENTS_PORT;
+    volatile std::uint32_t INTENSET, INTENCLR, CONFIG[8];
+};
+extern NRF_TIMER_Type *const NRF_TIMER3;
+extern NRF_TIMER_Type *const NRF_TIMER4;
+extern NRF_GPIOTE_Type *const NRF_GPIOTE;
+
+#define TIMER_MODE_MODE_Timer 0
+#define TIMER_BITMODE_BITMODE_32Bit 3
+#define TIMER_INTENSET_COMPARE0_Pos 16
+#define TIMER_SHORTS_COMPARE0_CLEAR_Msk 1
+#define GPIOTE_CONFIG_MODE_Pos 0
+#define GPIOTE_CONFIG_MODE_Disabled 0
+#define GPIOTE_CONFIG_MODE_Event 1
+#define GPIOTE_CONFIG_MODE_Task 3
+#define GPIOTE_CONFIG_PSEL_Pos 8
+#define GPIOTE_CONFIG_PORT_Pos 13
+#define GPIOTE_CONFIG_POLARITY_Pos 16
+#define GPIOTE_CONFIG_POLARITY_Toggle 3
+#define GPIOTE_CONFIG_OUTINIT_Pos 20
+#define GPIOTE_CONFIG_OUTINIT_Low 0
+#define GPIOTE_CONFIG_OUTINIT_High 1
+
+enum IRQn_Type { GPIOTE_IRQn = 6, SAADC_IRQn = 7, TIMER4_IRQn = 42 };
+inline void NVIC_SetPriority(IRQn_Type, std::uint32_t) {}
+inline void NVIC_EnableIRQ(IRQn_Type) {}
+inline void NVIC_DisableIRQ(IRQn_Type) {}
+inline void NVIC_ClearPendingIRQ(IRQn_Type) {}
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+
+inline std::uint32_t sd_ppi_channel_assign(std::uint8_t, const volatile void *, const volatile void *) { return 0; }
+inline std::uint32_t sd_ppi_channel_enable_set(std::uint32_t) { return 0; }
+inline std::uint32_t sd_ppi_channel_enable_clr(std::uint32_t) { return 0; }
+inline std::uint32_t sd_clock_hfclk_request() { return 0; }
+inline std::uint32_t sd_clock_hfclk_release() { return 0; }
+
+/** SAADC (registers only, no buffer is ever filled) */
+struct NRF_SAADC_Type {
+    volatile std::uint32_t TASKS_START, TASKS_SAMPLE, TASKS_STOP, EVENTS_STARTED, EVENTS_END, EVENTS_STOPPED;
+    volatile std::uint32_t INTENSET, INTENCLR, ENABLE, RESOLUTION, OVERSAMPLE, SAMPLERATE;
+    struct { volatile std::uint32_t PSELP, PSELN, CONFIG; } CH[8];
+    struct { volatile std::uint32_t PTR, MAXCNT, AMOUNT; } RESULT;
+};
+extern NRF_SAADC_Type *const NRF_SAADC;
+
+#define SAADC_CH_PSELP_PSELP_NC 0
+#define SAADC_CH_PSELP_PSELP_AnalogInput0 1
+#define SAADC_CH_PSELN_PSELN_NC 0
+#define SAADC_CH_CONFIG_RESP_Pos 0
+#define SAADC_CH_CONFIG_RESP_Bypass 0
+#define SAADC_CH_CONFIG_RESN_Pos 4
+#define SAADC_CH_CONFIG_RESN_Bypass 0
+#define SAADC_CH_CONFIG_GAIN_Pos 8
+#define SAADC_CH_CONFIG_GAIN_Gain1_6 0
+#define SAADC_CH_CONFIG_REFSEL_Pos 12
+#define SAADC_CH_CONFIG_REFSEL_Internal 0
+#define SAADC_CH_CONFIG_TACQ_Pos 16
+#define SAADC_CH_CONFIG_TACQ_3us 0
+#define SAADC_CH_CONFIG_MODE_Pos 20
+#define SAADC_CH_CONFIG_MODE_SE 0
+#define SAADC_CH_CONFIG_BURST_Pos 24
+#define SAADC_CH_CONFIG_BURST_Disabled 0
+#define SAADC_RESOLUTION_VAL_12bit 2
+#define SAADC_OVERSAMPLE_OVERSAMPLE_Bypass 0
+#define SAADC_SAMPLERATE_MODE_Pos 12
+#define SAADC_SAMPLERATE_MODE_Task 0
+#define SAADC_ENABLE_ENABLE_Disabled 0
+#define SAADC_ENABLE_ENABLE_Enabled 1
+#define SAADC_INTENSET_STARTED_Msk 0x01
+#define SAADC_INTENSET_END_Msk 0x02
+
+/** PWM peripheral (registers only, see analogWrite() for the duties the firmware sets) */
+struct NRF_PWM_Type {
+    volatile std::uint32_t TASKS_STOP, TASKS_SEQSTART[2], EVENTS_SEQSTARTED[2], EVENTS_SEQEND[2];
+    volatile std::uint32_t ENABLE, MODE, PRESCALER, COUNTERTOP, LOOP, DECODER, SHORTS, INTENCLR;
+    struct { volatile std::uint32_t PTR, CNT, REFRESH, ENDDELAY; } SEQ[2];
+    struct { volatile std::uint32_t OUT[4]; } PSEL;
+};
+extern NRF_PWM_Type *const NRF_PWM3;
+#define NRF_PWM3 NRF_PWM3
+
+#define PWM_ENABLE_ENABLE_Disabled 0
+#define PWM_ENABLE_ENABLE_Enabled 1
+#define PWM_MODE_UPDOWN_Up 0
+#define PWM_DECODER_LOAD_Individual 2
+#define PWM_DECODER_LOAD_Pos 0
+#define PWM_DECODER_MODE_RefreshCount 0
+#define PWM_DECODER_MODE_Pos 8
+#define PWM_PSEL_OUT_CONNECT_Disconnected 1
+#define PWM_PSEL_OUT_CONNECT_Pos 31
+
+class HardwarePWM {
+    std::uint32_t _owner;
+
+public:
+    HardwarePWM() : _owner{0} {}
+    bool takeOwnership(std::uint32_t token);
+    bool releaseOwnership(std::uint32_t token);
+    bool removePin(std::uint32_t pin);
+};
+#define HWPWM_MODULE_NUM 4
+extern HardwarePWM HwPWM0, HwPWM1, HwPWM2, HwPWM3;
+extern HardwarePWM *HwPWMx[HWPWM_MODULE_NUM];
+
+/** BLE connection, reports fixed parameters that take whatever is requested */
+#define BLE_GAP_PHY_1MBPS 1
+#define BLE_GAP_PHY_2MBPS 2
+#define BLE_GAP_DATA_LENGTH_AUTO 0
+struct ble_gap_data_length_params_t {
+    std::uint16_t max_tx_octets, max_rx_octets, max_tx_time_us, max_rx_time_us;
+};
+
+class BLEConnection {
+    std::uint16_t _interval = 24; // 1.25 ms units
+    std::uint16_t _slave_latency = 0;
+    std::uint16_t _supervision_timeout = 400; // 10 ms units
+    std::uint16_t _data_length = 27;
+    std::uint8_t _phy = BLE_GAP_PHY_1MBPS;
+
+public:
+    bool connected() const { return true; }
+    bool requestConnectionParameter(std::uint16_t interval, std::uint16_t latency, std::uint16_t timeout);
+    bool requestPHY(std::uint8_t phy);
+    bool requestDataLengthUpdate(const ble_gap_data_length_params_t *params);
+    std::uint16_t getConnectionInterval() const { return _interval; }
+    std::uint16_t getSlaveLatency() const { return _slave_latency; }
+    std::uint16_t getSupervisionTimeout() const { return _supervision_timeout; }
+    std::uint8_t getPHY() const { return _phy; }
+    std::uint16_t getDataLength() const { return _data_length; }
+    std::uint16_t getMtu() const { return 247; }
+};
+
+class AdafruitBluefruit {
+    BLEConnection _connection;
+
+public:
+    void begin() {}
+    std::uint16_t connHandle() const { return 0; }
+    BLEConnection *Connection(std::uint16_t) { return &_connection; }
+};
+extern AdafruitBluefruit Bluefruit;
+
+/** FreeRTOS, the service task isn't simulated (start_task() "succeeds" but nothing runs it) */
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef std::uint32_t TickType_t;
+#define pdPASS 1
+#define pdFALSE 0
+#define pdTRUE 1
+#define portMAX_DELAY 0xFFFFFFFFUL
+#define configTICK_RATE_HZ 1024
+#define TASK_PRIO_NORMAL 2
+#define portYIELD_FROM_ISR(x) (void) (x)
+
+inline BaseType_t xTaskCreate(void (*)(void *), const char *, std::uint32_t, void *, UBaseType_t,
+                              TaskHandle_t *handle) {
+    static int task;
+    *handle = &task;
+    return pdPASS;
+}
+inline void xTaskNotifyGive(TaskHandle_t) {}
+inline void vTaskNotifyGiveFromISR(TaskHandle_t, BaseType_t *) {}
+inline std::uint32_t ulTaskNotifyTake(BaseType_t, TickType_t) { return 0; }
+inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+    static int mutex;
+    return &mutex;
+}
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t) { return pdTRUE; }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t) { return pdTRUE; }
+inline void vSemaphoreDelete(SemaphoreHandle_t) {}
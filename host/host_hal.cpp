@@ -0,0 +1,393 @@
+/* host_hal.cpp
+ * Host implementation of bluefruit.h, Adafruit_LittleFS.h and the harness controls of host_hal.h.
+ */
+
+#include "host_hal.h"
+
+#include <map>
+
+#include "Adafruit_LittleFS.h"
+#include "InternalFileSystem.h"
+
+/* Arduino pin -> nRF52 pin of the Feather nRF52840 Express, as in the core's variant.cpp */
+const std::uint32_t g_ADigitalPinMap[PINS_COUNT] = {
+    25, 24, 10, 47, 42, 40, 7, 34, 16, 26, 27, 6, 8, 41,    // D0-D13
+    4, 5, 30, 28, 2, 3, 29, 31,                             // D14-D21 (A0-A7)
+    12, 11, 15, 13, 14,                                     // D22-D26 (I2C, SPI)
+    19, 20, 17, 22, 23, 21,                                 // D27-D32 (QSPI)
+    9,                                                      // D33 (NFC1)
+};
+
+HostSerial Serial;
+AdafruitBluefruit Bluefruit;
+Adafruit_LittleFS InternalFS;
+
+static NRF_GPIO_Type p0{0};
+static NRF_GPIO_Type p1{1};
+NRF_GPIO_Type *const NRF_P0 = &p0;
+NRF_GPIO_Type *const NRF_P1 = &p1;
+
+static NRF_TIMER_Type timer3;
+static NRF_TIMER_Type timer4;
+static NRF_GPIOTE_Type gpiote;
+static NRF_SAADC_Type saadc;
+static NRF_PWM_Type pwm3;
+NRF_TIMER_Type *const NRF_TIMER3 = &timer3;
+NRF_TIMER_Type *const NRF_TIMER4 = &timer4;
+NRF_GPIOTE_Type *const NRF_GPIOTE = &gpiote;
+NRF_SAADC_Type *const NRF_SAADC = &saadc;
+NRF_PWM_Type *const NRF_PWM3 = &pwm3;
+
+HardwarePWM HwPWM0, HwPWM1, HwPWM2, HwPWM3;
+HardwarePWM *HwPWMx[HWPWM_MODULE_NUM] = {&HwPWM0, &HwPWM1, &HwPWM2, &HwPWM3};
+
+namespace {
+
+std::uint64_t time_us = 0;      // virtual clock, micros() is its low 32 bits
+std::uint32_t auto_advance_us = 0;
+bool recording = false;
+std::vector<host_hal::Edge> edges;
+std::uint32_t analog_values[PINS_COUNT];
+std::uint32_t input_levels[2];  // levels outside the chip, IN shows them on pins that aren't outputs
+std::map<std::uint32_t, voidFuncPtr> interrupts; // attached callback per Arduino pin
+bool echo = false;
+
+NRF_GPIO_Type *port_of(unsigned int hw_pin) {
+    return hw_pin < 32 ? NRF_P0 : NRF_P1;
+}
+
+/* Outputs read back their latch, other pins the level driven on them */
+void update_input(NRF_GPIO_Type *regs) {
+    const std::uint32_t old_in = regs->IN;
+    regs->IN = (input_levels[regs->port] & ~regs->DIR) | (regs->OUT & regs->DIR);
+
+    std::uint32_t changed = old_in ^ regs->IN;
+    while (changed) {
+        const unsigned int pin = __builtin_ctz(changed);
+        changed &= changed - 1;
+        for (const auto &attached : interrupts) {
+            if (g_ADigitalPinMap[attached.first] == regs->port * 32 + pin) {
+                attached.second();
+            }
+        }
+    }
+}
+
+}  // namespace
+
+void host_hal::gpio_write_out(NRF_GPIO_Type *regs, std::uint32_t value) {
+    if (recording) {
+        std::uint32_t changed = regs->OUT ^ value;
+        while (changed) {
+            const unsigned int pin = __builtin_ctz(changed);
+            changed &= changed - 1;
+            ::edges.push_back(Edge{static_cast<std::uint32_t>(::time_us),
+                                   static_cast<std::uint8_t>(regs->port * 32 + pin), ((value >> pin) & 1U) != 0});
+        }
+    }
+    regs->OUT = value;
+    update_input(regs);
+}
+
+NRF_GPIO_Type::Strobe &NRF_GPIO_Type::Strobe::operator=(std::uint32_t mask) {
+    const std::uint32_t value = _set ? _regs->*_target | mask : _regs->*_target & ~mask;
+    if (_target == &NRF_GPIO_Type::OUT) {
+        host_hal::gpio_write_out(_regs, value);
+    } else {
+        _regs->*_target = value;
+        update_input(_regs);
+    }
+    return *this;
+}
+
+NRF_GPIO_Type::PinConfig &NRF_GPIO_Type::PinConfig::operator=(std::uint32_t value) {
+    if ((value >> GPIO_PIN_CNF_DIR_Pos) & 1U) {
+        _regs->DIRSET = 1UL << _pin;
+    } else {
+        _regs->DIRCLR = 1UL << _pin;
+    }
+    return *this;
+}
+
+/* Arduino calls */
+
+std::uint32_t micros() {
+    time_us += auto_advance_us;
+    return static_cast<std::uint32_t>(time_us);
+}
+
+std::uint32_t millis() {
+    return static_cast<std::uint32_t>(time_us / 1000);
+}
+
+void delay(std::uint32_t ms) {
+    time_us += static_cast<std::uint64_t>(ms) * 1000;
+}
+
+void pinMode(std::uint32_t pin, std::uint32_t mode) {
+    const std::uint32_t hw_pin = g_ADigitalPinMap[pin];
+    if (mode == OUTPUT) {
+        port_of(hw_pin)->DIRSET = 1UL << (hw_pin % 32);
+    } else {
+        port_of(hw_pin)->DIRCLR = 1UL << (hw_pin % 32);
+    }
+}
+
+void digitalWrite(std::uint32_t pin, std::uint32_t value) {
+    const std::uint32_t hw_pin = g_ADigitalPinMap[pin];
+    if (value) {
+        port_of(hw_pin)->OUTSET = 1UL << (hw_pin % 32);
+    } else {
+        port_of(hw_pin)->OUTCLR = 1UL << (hw_pin % 32);
+    }
+}
+
+int digitalRead(std::uint32_t pin) {
+    const std::uint32_t hw_pin = g_ADigitalPinMap[pin];
+    return (port_of(hw_pin)->IN >> (hw_pin % 32)) & 1U;
+}
+
+void analogWrite(std::uint32_t pin, std::uint32_t value) {
+    if (pin < PINS_COUNT) {
+        analog_values[pin] = value;
+    }
+}
+
+int attachInterrupt(std::uint32_t pin, voidFuncPtr callback, std::uint32_t) {
+    interrupts[pin] = callback;
+    return 1;
+}
+
+void detachInterrupt(std::uint32_t pin) {
+    interrupts.erase(pin);
+}
+
+/* Serial */
+
+void HostSerial::print(const char *text) {
+    if (echo) {
+        fputs(text, stdout);
+    }
+}
+
+void HostSerial::print(char c) {
+    if (echo) {
+        fputc(c, stdout);
+    }
+}
+
+void HostSerial::print(long value, int base) {
+    if (echo) {
+        printf(base == HEX ? "%lX" : "%ld", value);
+    }
+}
+
+void HostSerial::print(unsigned long value, int base) {
+    if (echo) {
+        printf(base == HEX ? "%lX" : "%lu", value);
+    }
+}
+
+void HostSerial::print(double value) {
+    if (echo) {
+        printf("%.2f", value);
+    }
+}
+
+/* BLE */
+
+int BLEUart::read() {
+    if (_rx.empty()) {
+        return -1;
+    }
+    const int b = _rx.front();
+    _rx.pop_front();
+    return b;
+}
+
+int BLEUart::read(std::uint8_t *buffer, std::size_t size) {
+    std::size_t count = 0;
+    for (; count < size && !_rx.empty(); ++count) {
+        buffer[count] = _rx.front();
+        _rx.pop_front();
+    }
+    return static_cast<int>(count);
+}
+
+std::size_t BLEUart::write(const std::uint8_t *content, std::size_t len) {
+    if (!_notify) {
+        return 0;
+    }
+    _tx.insert(_tx.end(), content, content + len);
+    return len;
+}
+
+std::size_t BLEUart::host_write(const std::uint8_t *data, std::size_t length) {
+    const std::size_t room = _fifo_depth - _rx.size();
+    const std::size_t count = length < room ? length : room;
+    _rx.insert(_rx.end(), data, data + count);
+    return count;
+}
+
+std::vector<std::uint8_t> BLEUart::host_take_sent() {
+    std::vector<std::uint8_t> sent;
+    sent.swap(_tx);
+    return sent;
+}
+
+bool BLEConnection::requestConnectionParameter(std::uint16_t interval, std::uint16_t latency,
+                                               std::uint16_t timeout) {
+    _interval = interval;
+    _slave_latency = latency;
+    _supervision_timeout = timeout;
+    return true;
+}
+
+bool BLEConnection::requestPHY(std::uint8_t phy) {
+    _phy = phy;
+    return true;
+}
+
+bool BLEConnection::requestDataLengthUpdate(const ble_gap_data_length_params_t *params) {
+    _data_length = params ? params->max_tx_octets : 251;
+    return true;
+}
+
+/* PWM */
+
+bool HardwarePWM::takeOwnership(std::uint32_t token) {
+    if (_owner) {
+        return false;
+    }
+    _owner = token;
+    return true;
+}
+
+bool HardwarePWM::releaseOwnership(std::uint32_t token) {
+    if (_owner != token) {
+        return false;
+    }
+    _owner = 0;
+    return true;
+}
+
+bool HardwarePWM::removePin(std::uint32_t) {
+    return true;
+}
+
+/* File system */
+
+bool Adafruit_LittleFS::rename(const char *from, const char *to) {
+    const auto file = _files.find(from);
+    if (file == _files.end()) {
+        return false;
+    }
+    _files[to] = file->second;
+    _files.erase(from);
+    return true;
+}
+
+bool Adafruit_LittleFS_Namespace::File::open(const char *path, std::uint8_t mode) {
+    if (mode == FILE_O_READ && !_fs->exists(path)) {
+        return false;
+    }
+    _path = path;
+    _position = 0;
+    _fs->_files[_path];
+    _open = true;
+    return true;
+}
+
+std::size_t Adafruit_LittleFS_Namespace::File::write(const std::uint8_t *data, std::size_t length) {
+    if (!_open) {
+        return 0;
+    }
+    auto &bytes = _fs->_files[_path];
+    bytes.insert(bytes.end(), data, data + length);
+    return length;
+}
+
+int Adafruit_LittleFS_Namespace::File::read(void *data, std::size_t length) {
+    if (!_open) {
+        return -1;
+    }
+    const auto &bytes = _fs->_files[_path];
+    std::size_t count = 0;
+    for (; count < length && _position < bytes.size(); ++count) {
+        static_cast<std::uint8_t *>(data)[count] = bytes[_position++];
+    }
+    return static_cast<int>(count);
+}
+
+int Adafruit_LittleFS_Namespace::File::available() {
+    return _open ? static_cast<int>(_fs->_files[_path].size() - _position) : 0;
+}
+
+/* Harness controls */
+
+void host_hal::set_time_us(std::uint32_t now_us) {
+    ::time_us = now_us;
+}
+
+void host_hal::advance_us(std::uint32_t delta_us) {
+    ::time_us += delta_us;
+}
+
+std::uint32_t host_hal::time_us() {
+    return static_cast<std::uint32_t>(::time_us);
+}
+
+void host_hal::set_auto_advance_us(std::uint32_t step_us) {
+    auto_advance_us = step_us;
+}
+
+void host_hal::record_edges(bool enable) {
+    recording = enable;
+}
+
+const std::vector<host_hal::Edge> &host_hal::edges() {
+    return ::edges;
+}
+
+void host_hal::clear_edges() {
+    ::edges.clear();
+}
+
+std::uint32_t host_hal::analog_value(std::uint32_t pin) {
+    return pin < PINS_COUNT ? analog_values[pin] : 0;
+}
+
+void host_hal::set_input(unsigned int hw_pin, bool level) {
+    const unsigned int port = hw_pin / 32;
+    const std::uint32_t bit = 1UL << (hw_pin % 32);
+    input_levels[port] = level ? input_levels[port] | bit : input_levels[port] & ~bit;
+    update_input(port_of(hw_pin));
+}
+
+void host_hal::echo_serial(bool enable) {
+    echo = enable;
+}
+
+void host_hal::reset() {
+    for (NRF_GPIO_Type *regs : {NRF_P0, NRF_P1}) {
+        regs->OUT = 0;
+        regs->IN = 0;
+        regs->DIR = 0;
+    }
+    timer3 = NRF_TIMER_Type{};
+    timer4 = NRF_TIMER_Type{};
+    gpiote = NRF_GPIOTE_Type{};
+    saadc = NRF_SAADC_Type{};
+    pwm3 = NRF_PWM_Type{};
+    for (HardwarePWM *pwm : HwPWMx) {
+        *pwm = HardwarePWM{};
+    }
+    ::time_us = 0;
+    auto_advance_us = 0;
+    recording = false;
+    ::edges.clear();
+    memset(analog_values, 0, sizeof(analog_values));
+    memset(input_levels, 0, sizeof(input_levels));
+    interrupts.clear();
+    InternalFS.format();
+}
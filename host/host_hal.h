@@ -0,0 +1,55 @@
+/* host_hal.h
+ * Harness controls of the host build, which runs the firmware in arduino/ natively against bluefruit.h.
+ * Functionality:
+ *      - Virtual clock: micros()/millis() only move when the harness moves them (optionally on every read)
+ *      - Trace of GPIO output edges with their virtual time, to check pulse timing
+ *      - Last analogWrite() value per Arduino pin
+ *      - Input levels for pins the firmware reads
+ *      - Reset every simulated peripheral between runs
+ *
+ * Build a harness with the firmware sources, this directory first on the include path, e.g. (from arduino/):
+ *      g++ -std=gnu++11 -O2 -I../host -I. ../host/replay.cpp ../host/host_hal.cpp *.cpp -o replay
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "bluefruit.h"
+
+namespace host_hal {
+
+/** GPIO output edge */
+struct Edge {
+    std::uint32_t time_us;  // virtual time of the register write
+    std::uint8_t pin;       // hardware pin number (port * 32 + pin)
+    bool level;             // level after the edge
+};
+
+/* Set or move the virtual clock */
+void set_time_us(std::uint32_t time_us);
+void advance_us(std::uint32_t delta_us);
+std::uint32_t time_us();
+
+/* Advance the clock by step_us on every micros() call, so code timing itself sees time pass (0 turns it off) */
+void set_auto_advance_us(std::uint32_t step_us);
+
+/* Record output edges from now on (off by default, the trace grows with every edge) */
+void record_edges(bool enable);
+const std::vector<Edge> &edges();
+void clear_edges();
+
+/* Last analogWrite() value of an Arduino pin */
+std::uint32_t analog_value(std::uint32_t pin);
+
+/* Drive the input level of a hardware pin (see NRF_GPIO_Type::IN), firing attached interrupts on a change */
+void set_input(unsigned int hw_pin, bool level);
+
+/* Print Serial output to stdout (off by default, error logging would swamp a benchmark) */
+void echo_serial(bool enable);
+
+/* Put every register, the clock, the trace and the file system back to their power-on state */
+void reset();
+
+}  // namespace host_hal
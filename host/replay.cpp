@@ -0,0 +1,314 @@
+/* replay.cpp
+ * Replay benchmark of PinCtrl on the host: feeds recorded BLE UART writes through the firmware's parser and
+ * dispatch, then replays them in virtual time to check pulse timing.
+ * Functionality:
+ *      - Throughput: the recording (repeated) is pushed through the RX FIFO as fast as service() takes it, timed on
+ *        the host clock, giving ns per command and MB/s of the parse/dispatch hot path
+ *      - Timing: the recording is replayed at its own pace on the virtual clock, with service() called every
+ *        -p us, and the firmware's STATS counters give the worst pulse edge lateness (which should stay within
+ *        the service period) and the number of edges driven
+ *      - No recording given runs a built-in mix of pulse, write, batch, compact, PWM, state sync and query commands
+ *
+ * Recordings are text, one BLE write per line (see BleUartPinCtrl.record_writes on the desktop):
+ *      <time since the recording started in us> <framed bytes in hex>
+ * with blank lines and lines starting with # ignored.
+ *
+ * Build (from arduino/) and run:
+ *      g++ -std=gnu++11 -O2 -I../host -I. ../host/replay.cpp ../host/host_hal.cpp *.cpp -o replay
+ *      ./replay [-n repeats] [-p service period us] [-t tail ms] [-w dump.txt] [recording.txt]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "bleuart_pin_ctrl.h"
+#include "crc8.h"
+#include "host_hal.h"
+
+using namespace ble_uart_pin_ctrl;
+
+namespace {
+
+/** BLE write of a recording */
+struct Write {
+    std::uint32_t time_us;
+    std::vector<std::uint8_t> bytes;
+};
+
+/** Counters read back with STATS */
+struct Counters {
+    StatsReply reply;
+    std::uint32_t commands; // commands run, sub-commands of batches included
+};
+
+std::vector<std::uint8_t> frame(const std::vector<std::uint8_t> &payload) {
+    std::vector<std::uint8_t> bytes{FRAME_SYNC, static_cast<std::uint8_t>(payload.size())};
+    bytes.insert(bytes.end(), payload.begin(), payload.end());
+    bytes.push_back(crc8(bytes.data() + 1, bytes.size() - 1));
+    return bytes;
+}
+
+template <typename T>
+std::vector<std::uint8_t> pack(T command) {
+    wire_format::to_network(command);
+    const auto bytes = reinterpret_cast<const std::uint8_t *>(&command);
+    return std::vector<std::uint8_t>(bytes, bytes + sizeof(command));
+}
+
+std::vector<std::uint8_t> &append(std::vector<std::uint8_t> &bytes, const std::vector<std::uint8_t> &more) {
+    bytes.insert(bytes.end(), more.begin(), more.end());
+    return bytes;
+}
+
+/* A haptics-like session: pulse trains, digital and PWM levels, batches of compact writes and a state sync, one
+ * write per 7.5 ms connection interval */
+std::vector<Write> builtin_recording() {
+    constexpr std::uint32_t INTERVAL_US = 7500;
+    constexpr std::uint32_t P0 = GPIO_PORT_HW;
+    constexpr std::uint32_t P1 = GPIO_PORT_HW | 1;
+
+    std::vector<std::vector<std::uint8_t>> payloads;
+    payloads.push_back(pack(ProtocolVersion{Command::PROTOCOL_VERSION, PROTOCOL_VERSION_2}));
+    payloads.push_back(pack(GpioConfigure{Command::GPIO_CONFIGURE, P0, 0x0000FFFF, GpioDirection::DIR_OUTPUT}));
+    payloads.push_back(pack(GpioConfigure{Command::GPIO_CONFIGURE, P1, 0x0000FFFF, GpioDirection::DIR_OUTPUT}));
+
+    for (std::uint8_t cycle = 0; cycle < 16; ++cycle) {
+        const std::uint32_t pins = 0x0FUL << (cycle % 4 * 4);
+        payloads.push_back(pack(GpioPulseSchedule{Command::GPIO_PULSE_SCHEDULE, P0, pins, PulseMode::SIMULTANEOUS,
+                                                  2000, 500}));
+        payloads.push_back({static_cast<std::uint8_t>(Command::COMPACT_GPIO_PULSE_SCHEDULE),
+                            compact_format::PORT_HW_ALL << compact_format::HEADER_PORT_SHIFT | 2,
+                            static_cast<std::uint8_t>(16 + cycle % 8), static_cast<std::uint8_t>(40 + cycle % 8),
+                            static_cast<std::uint8_t>(PulseMode::SEQUENTIAL), 0xE8, 0x07, 0x00}); // 1000 us, now
+        payloads.push_back(pack(GpioWrite{Command::GPIO_WRITE, P1, 0x00000F00, GpioOutput::OUT_HIGH}));
+
+        std::vector<std::uint8_t> batch = pack(BatchHeader{Command::BATCH, 0});
+        for (std::uint8_t pin = 8; pin < 12; ++pin) {
+            append(batch, {static_cast<std::uint8_t>(Command::COMPACT_GPIO_WRITE),
+                           compact_format::PORT_HW_P1 << compact_format::HEADER_PORT_SHIFT | 1, pin,
+                           static_cast<std::uint8_t>(GpioOutput::OUT_LOW)});
+        }
+        const std::uint16_t batch_length = static_cast<std::uint16_t>(batch.size() - sizeof(BatchHeader));
+        batch[1] = batch_length >> 8;
+        batch[2] = batch_length & 0xFF;
+        payloads.push_back(batch);
+
+        payloads.push_back(pack(PwmSet{Command::PWM_SET, 0, 0x00000060, static_cast<std::uint8_t>(cycle * 16)}));
+
+        std::vector<std::uint8_t> sync = pack(StateSync{Command::STATE_SYNC, static_cast<std::uint16_t>(cycle + 1), 0,
+                                                        STATE_SYNC_FULL, 8});
+        for (std::uint8_t pin = 32 + 12; pin < 32 + 16; ++pin) {
+            append(sync, pack(PinLevel{pin, static_cast<std::uint8_t>(cycle & 1 ? 255 : 0)}));
+            append(sync, pack(PinLevel{static_cast<std::uint8_t>(pin - 32), static_cast<std::uint8_t>(cycle * 8)}));
+        }
+        payloads.push_back(sync);
+
+        payloads.push_back(pack(GpioQuery{Command::GPIO_QUERY, P0, 0x000000FF}));
+    }
+
+    std::vector<Write> writes;
+    for (std::size_t i = 0; i < payloads.size(); ++i) {
+        writes.push_back(Write{static_cast<std::uint32_t>(i * INTERVAL_US), frame(payloads[i])});
+    }
+    return writes;
+}
+
+bool load_recording(const char *path, std::vector<Write> &writes) {
+    FILE *const file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+
+    char line[2 * (FRAME_OVERHEAD + MAX_FRAME_PAYLOAD) * 4 + 32];
+    while (fgets(line, sizeof(line), file)) {
+        char *cursor = line;
+        while (*cursor == ' ' || *cursor == '\t') {
+            ++cursor;
+        }
+        if (*cursor == '#' || *cursor == '\n' || *cursor == '\r' || !*cursor) {
+            continue;
+        }
+
+        Write write{static_cast<std::uint32_t>(strtoul(cursor, &cursor, 10)), {}};
+        while (*cursor == ' ' || *cursor == '\t') {
+            ++cursor;
+        }
+        unsigned int value;
+        int used;
+        while (sscanf(cursor, "%2x%n", &value, &used) == 1) {
+            write.bytes.push_back(static_cast<std::uint8_t>(value));
+            cursor += used;
+        }
+        writes.push_back(write);
+    }
+    fclose(file);
+    return true;
+}
+
+bool save_recording(const char *path, const std::vector<Write> &writes) {
+    FILE *const file = fopen(path, "w");
+    if (!file) {
+        return false;
+    }
+    for (const Write &write : writes) {
+        fprintf(file, "%lu ", static_cast<unsigned long>(write.time_us));
+        for (std::uint8_t b : write.bytes) {
+            fprintf(file, "%02x", b);
+        }
+        fputc('\n', file);
+    }
+    fclose(file);
+    return true;
+}
+
+/* Ask for the counters and read the reply out of everything the device sent */
+Counters read_stats(PinCtrl &pin_ctrl, BLEUart &uart) {
+    uart.host_take_sent();
+    const std::vector<std::uint8_t> request = frame(pack(Stats{Command::STATS, 0}));
+    uart.host_write(request.data(), request.size());
+    pin_ctrl.service();
+
+    /* The firmware's own parser splits the replies back into frames */
+    const std::vector<std::uint8_t> sent = uart.host_take_sent();
+    BLEUart replies{static_cast<std::uint16_t>(sent.size())};
+    replies.host_write(sent.data(), sent.size());
+    FrameParser parser;
+
+    Counters stats{};
+    while (parser.poll(&replies, millis())) {
+        std::uint8_t *const payload = parser.payload();
+        if (payload[0] == static_cast<std::uint8_t>(Command::STATS) && parser.payload_length() >= sizeof(StatsReply)) {
+            memcpy(&stats.reply, payload, sizeof(StatsReply));
+            wire_format::to_host(stats.reply);
+            for (std::size_t i = 0; i < stats.reply.command_types; ++i) {
+                StatsCommandCount count;
+                memcpy(&count, payload + sizeof(StatsReply) + i * sizeof(count), sizeof(count));
+                wire_format::to_host(count);
+                stats.commands += count.count;
+            }
+        }
+        parser.release();
+    }
+    stats.commands -= 1; // the STATS request itself
+    return stats;
+}
+
+/* Push the recording through as fast as service() takes it */
+void run_throughput(const std::vector<Write> &writes, unsigned int repeats) {
+    host_hal::reset();
+    BLEUart uart{UART_RX_FIFO_DEPTH};
+    PinCtrl *const pin_ctrl = new PinCtrl{&uart};
+    host_hal::set_time_us(1000000);
+
+    const std::uint32_t recording_us = writes.empty() ? 0 : writes.back().time_us + 1;
+    std::uint32_t services = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (unsigned int repeat = 0; repeat < repeats; ++repeat) {
+        const std::uint32_t base_us = 1000000 + repeat * recording_us;
+        for (const Write &write : writes) {
+            /* Fill the RX FIFO, then let service() drain it in one pass */
+            if (uart.available() + write.bytes.size() > UART_RX_FIFO_DEPTH) {
+                pin_ctrl->service();
+                ++services;
+                uart.host_take_sent();
+            }
+            host_hal::set_time_us(base_us + write.time_us);
+            uart.host_write(write.bytes.data(), write.bytes.size());
+        }
+    }
+    pin_ctrl->service();
+    ++services;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const Counters stats = read_stats(*pin_ctrl, uart);
+    const double elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    printf("Throughput: %u repeats, %lu bytes, %lu commands, %lu bad commands, %lu service() calls\n", repeats,
+           static_cast<unsigned long>(stats.reply.bytes_received), static_cast<unsigned long>(stats.commands),
+           static_cast<unsigned long>(stats.reply.bad_commands), static_cast<unsigned long>(services));
+    printf("    %.1f ms, %.1f ns per command, %.2f MB/s\n", elapsed_ns / 1e6,
+           stats.commands ? elapsed_ns / stats.commands : 0.0, stats.reply.bytes_received * 1e3 / elapsed_ns);
+    delete pin_ctrl;
+}
+
+/* Replay the recording at its own pace, service() running every period_us of virtual time */
+void run_timing(const std::vector<Write> &writes, std::uint32_t period_us, std::uint32_t tail_ms) {
+    host_hal::reset();
+    BLEUart uart{UART_RX_FIFO_DEPTH};
+    PinCtrl *const pin_ctrl = new PinCtrl{&uart};
+    host_hal::set_time_us(1000000);
+    host_hal::record_edges(true);
+
+    std::size_t next = 0;
+    std::size_t lost_bytes = 0;
+    const std::uint32_t start_us = host_hal::time_us();
+    const std::uint32_t end_us = start_us + (writes.empty() ? 0 : writes.back().time_us) + tail_ms * 1000;
+    while (static_cast<std::int32_t>(host_hal::time_us() - end_us) < 0) {
+        for (; next < writes.size() && host_hal::time_us() - start_us >= writes[next].time_us; ++next) {
+            lost_bytes += writes[next].bytes.size()
+                        - uart.host_write(writes[next].bytes.data(), writes[next].bytes.size());
+        }
+        pin_ctrl->service();
+        uart.host_take_sent();
+        host_hal::advance_us(period_us);
+    }
+
+    const Counters stats = read_stats(*pin_ctrl, uart);
+    printf("Timing: service() every %lu us, %lu commands, %lu bad commands, %lu bytes lost to a full RX FIFO\n",
+           static_cast<unsigned long>(period_us), static_cast<unsigned long>(stats.commands),
+           static_cast<unsigned long>(stats.reply.bad_commands), static_cast<unsigned long>(lost_bytes));
+    printf("    %lu edges, worst pulse edge %lu us late%s\n", static_cast<unsigned long>(host_hal::edges().size()),
+           static_cast<unsigned long>(stats.reply.max_pulse_late_us),
+           stats.reply.max_pulse_late_us > period_us ? " (more than the service period)" : "");
+    delete pin_ctrl;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    unsigned int repeats = 1000;
+    std::uint32_t period_us = 100;
+    std::uint32_t tail_ms = 1000;
+    const char *dump_path = nullptr;
+    const char *recording_path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            repeats = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            period_us = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            tail_ms = strtoul(argv[++i], nullptr, 10);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            dump_path = argv[++i];
+        } else if (argv[i][0] != '-' && !recording_path) {
+            recording_path = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-n repeats] [-p service period us] [-t tail ms] [-w dump.txt] "
+                            "[recording.txt]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (!period_us) {
+        period_us = 1;
+    }
+
+    std::vector<Write> writes;
+    if (!recording_path) {
+        writes = builtin_recording();
+    } else if (!load_recording(recording_path, writes)) {
+        fprintf(stderr, "Can't read %s\n", recording_path);
+        return 1;
+    }
+    if (dump_path && !save_recording(dump_path, writes)) {
+        fprintf(stderr, "Can't write %s\n", dump_path);
+        return 1;
+    }
+    printf("%s: %lu writes\n", recording_path ? recording_path : "built-in recording",
+           static_cast<unsigned long>(writes.size()));
+
+    run_throughput(writes, repeats);
+    run_timing(writes, period_us, tail_ms);
+    return 0;
+}